@@ -167,6 +167,11 @@ HEADERS += src/qt/bitcoingui.h \
     src/script.h \
     src/init.h \
     src/bloom.h \
+    src/muhash.h \
+    src/lzcompress.h \
+    src/feeestimator.h \
+    src/jsonwriter.h \
+    src/walletlog.h \
     src/mruset.h \
     src/checkqueue.h \
     src/json/json_spirit_writer_template.h \
@@ -264,6 +269,11 @@ SOURCES += src/qt/bitcoin.cpp \
     src/init.cpp \
     src/net.cpp \
     src/bloom.cpp \
+    src/muhash.cpp \
+    src/lzcompress.cpp \
+    src/feeestimator.cpp \
+    src/jsonwriter.cpp \
+    src/walletlog.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
     src/db.cpp \
@@ -23,6 +23,10 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 #include <list>
 
 using namespace std;
@@ -32,6 +36,9 @@ using namespace json_spirit;
 
 static std::string strRPCUserColonPass;
 
+// How long a wallet call waits for the wallet to catch up with validation (milliseconds)
+static const int64 RPC_WALLET_WAIT_TIMEOUT = 10000;
+
 // These are created by StartRPCThreads, destroyed in StopRPCThreads
 static asio::io_service* rpc_io_service = NULL;
 static ssl::context* rpc_ssl_context = NULL;
@@ -106,6 +113,18 @@ Value ValueFromAmount(int64 amount)
     return (double)amount / (double)COIN;
 }
 
+// For callers that need a Value from a command that writes its result
+Value ValueFromWriter(rpcfn_write_type writer, const Array& params, bool fHelp)
+{
+    string strJSON;
+    CJSONWriter result(strJSON);
+    writer(params, fHelp, result);
+    Value value;
+    if (!ParseJSON(strJSON, value))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Invalid result");
+    return value;
+}
+
 std::string HexBits(unsigned int nBits)
 {
     union {
@@ -200,20 +219,20 @@ static const CRPCCommand vRPCCommands[] =
   //  ------------------------  -----------------------  ---------- ---------- ---------
     { "help",                   &help,                   true,      true,       false },
     { "stop",                   &stop,                   true,      true,       false },
-    { "getblockcount",          &getblockcount,          true,      false,      false },
-    { "getbestblockhash",       &getbestblockhash,       true,      false,      false },
-    { "getconnectioncount",     &getconnectioncount,     true,      false,      false },
+    { "getblockcount",          &getblockcount,          true,      true,       false },
+    { "getbestblockhash",       &getbestblockhash,       true,      true,       false },
+    { "getconnectioncount",     &getconnectioncount,     true,      true,       false },
     { "getpeerinfo",            &getpeerinfo,            true,      false,      false },
     { "addnode",                &addnode,                true,      true,       false },
     { "masternode",             &masternode,             false,     false,      true },
     { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false },
-    { "getdifficulty",          &getdifficulty,          true,      false,      false },
+    { "getdifficulty",          &getdifficulty,          true,      true,       false },
     { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
     { "getgenerate",            &getgenerate,            true,      false,      false },
     { "setgenerate",            &setgenerate,            true,      false,      true },
-    { "gethashespersec",        &gethashespersec,        true,      false,      false },
-    { "getinfo",                &getinfo,                true,      false,      false },
-    { "getmininginfo",          &getmininginfo,          true,      false,      false },
+    { "gethashespersec",        &gethashespersec,        true,      true,       false },
+    { "getinfo",                &getinfo,                true,      true,       false },
+    { "getmininginfo",          &getmininginfo,          true,      true,       false },
     { "getnewaddress",          &getnewaddress,          true,      false,      true },
     { "getaccountaddress",      &getaccountaddress,      true,      false,      true },
     { "setaccount",             &setaccount,             true,      false,      true },
@@ -235,9 +254,14 @@ static const CRPCCommand vRPCCommands[] =
     { "move",                   &movecmd,                false,     false,      true },
     { "sendfrom",               &sendfrom,               false,     false,      true },
     { "sendmany",               &sendmany,               false,     false,      true },
+    { "sendmanybatch",          &sendmanybatch,          false,     false,      true },
     { "addmultisigaddress",     &addmultisigaddress,     false,     false,      true },
-    { "createmultisig",         &createmultisig,         true,      true ,      false },
+    { "createmultisig",         &createmultisig,         true,      true,      false },
     { "getrawmempool",          &getrawmempool,          true,      false,      false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,      false,      false },
+    { "savemempool",            &savemempool,            true,      false,      false },
+    { "estimatefee",            &estimatefee,            true,      true,       false },
+    { "estimatepriority",       &estimatepriority,       true,      true,       false },
     { "getblock",               &getblock,               false,     false,      false },
     { "getblockhash",           &getblockhash,           false,     false,      false },
     { "gettransaction",         &gettransaction,         false,     false,      true },
@@ -258,7 +282,9 @@ static const CRPCCommand vRPCCommands[] =
     { "sendcheckpoint",         &sendcheckpoint,         true,      false,		false },
     { "enforcecheckpoint",      &enforcecheckpoint,      true,      false,		false },
     { "dumpprivkey",            &dumpprivkey,            true,      false,      true },
-    { "importprivkey",          &importprivkey,          false,     false,      true },
+    { "importprivkey",          &importprivkey,          false,     true,       true },
+    { "importprivkeys",         &importprivkeys,         false,     true,       true },
+    { "abortrescan",            &abortrescan,            true,      true,       true },
     { "listunspent",            &listunspent,            false,     false,      true },
     { "getrawtransaction",      &getrawtransaction,      false,     false,      false },
     { "createrawtransaction",   &createrawtransaction,   false,     false,      false },
@@ -270,6 +296,24 @@ static const CRPCCommand vRPCCommands[] =
     { "lockunspent",            &lockunspent,            false,     false,      true },
     { "listlockunspent",        &listlockunspent,        false,     false,      true },
     { "verifychain",            &verifychain,            true,      false,      false },
+    { "getaddressbalance",      &getaddressbalance,      true,      false,      false },
+    { "getaddressutxos",        &getaddressutxos,        true,      false,      false },
+    { "getaddresstxids",        &getaddresstxids,        true,      false,      false },
+    { "getspentinfo",           &getspentinfo,           true,      false,      false },
+};
+
+/** Commands above that can also write their result directly into the reply */
+static const struct
+{
+    const char *name;
+    rpcfn_write_type writer;
+} vRPCWriters[] =
+{
+    { "getblock",               &getblock },
+    { "getrawtransaction",      &getrawtransaction },
+    { "decoderawtransaction",   &decoderawtransaction },
+    { "getrawmempool",          &getrawmempool },
+    { "listtransactions",       &listtransactions },
 };
 
 CRPCTable::CRPCTable()
@@ -282,6 +326,8 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < (sizeof(vRPCWriters) / sizeof(vRPCWriters[0])); vcidx++)
+        mapWriters[vRPCWriters[vcidx].name] = vRPCWriters[vcidx].writer;
 }
 
 const CRPCCommand *CRPCTable::operator[](string name) const
@@ -329,31 +375,15 @@ string rfc1123Time()
     return string(buffer);
 }
 
-static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+static string HTTPReplyHeader(int nStatus, size_t nContentLength, bool keepalive)
 {
-    if (nStatus == HTTP_UNAUTHORIZED)
-        return strprintf("HTTP/1.0 401 Authorization Required\r\n"
-            "Date: %s\r\n"
-            "Server: cryptobit-json-rpc/%s\r\n"
-            "WWW-Authenticate: Basic realm=\"jsonrpc\"\r\n"
-            "Content-Type: text/html\r\n"
-            "Content-Length: 296\r\n"
-            "\r\n"
-            "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\"\r\n"
-            "\"http://www.w3.org/TR/1999/REC-html401-19991224/loose.dtd\">\r\n"
-            "<HTML>\r\n"
-            "<HEAD>\r\n"
-            "<TITLE>Error</TITLE>\r\n"
-            "<META HTTP-EQUIV='Content-Type' CONTENT='text/html; charset=ISO-8859-1'>\r\n"
-            "</HEAD>\r\n"
-            "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
-            "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
     const char *cStatus;
          if (nStatus == HTTP_OK) cStatus = "OK";
     else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
@@ -362,15 +392,35 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "Content-Length: %"PRIszu"\r\n"
             "Content-Type: application/json\r\n"
             "Server: cryptobit-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
+            "\r\n",
         nStatus,
         cStatus,
         rfc1123Time().c_str(),
         keepalive ? "keep-alive" : "close",
-        strMsg.size(),
-        FormatFullVersion().c_str(),
-        strMsg.c_str());
+        nContentLength,
+        FormatFullVersion().c_str());
+}
+
+static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+{
+    if (nStatus == HTTP_UNAUTHORIZED)
+        return strprintf("HTTP/1.0 401 Authorization Required\r\n"
+            "Date: %s\r\n"
+            "Server: cryptobit-json-rpc/%s\r\n"
+            "WWW-Authenticate: Basic realm=\"jsonrpc\"\r\n"
+            "Content-Type: text/html\r\n"
+            "Content-Length: 296\r\n"
+            "\r\n"
+            "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\"\r\n"
+            "\"http://www.w3.org/TR/1999/REC-html401-19991224/loose.dtd\">\r\n"
+            "<HTML>\r\n"
+            "<HEAD>\r\n"
+            "<TITLE>Error</TITLE>\r\n"
+            "<META HTTP-EQUIV='Content-Type' CONTENT='text/html; charset=ISO-8859-1'>\r\n"
+            "</HEAD>\r\n"
+            "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
+            "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
+    return HTTPReplyHeader(nStatus, strMsg.size(), keepalive) + strMsg;
 }
 
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
@@ -503,40 +553,37 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
 
 string JSONRPCRequest(const string& strMethod, const Array& params, const Value& id)
 {
-    Object request;
-    request.push_back(Pair("method", strMethod));
-    request.push_back(Pair("params", params));
-    request.push_back(Pair("id", id));
-    return write_string(Value(request), false) + "\n";
+    string strRequest;
+    CJSONWriter writer(strRequest);
+    writer.BeginObject();
+    writer.Key("method").String(strMethod);
+    writer.Key("params").BeginArray();
+    BOOST_FOREACH(const Value& param, params)
+        writer.Write(param);
+    writer.EndArray();
+    writer.Key("id").Write(id);
+    writer.EndObject();
+    return strRequest + "\n";
 }
 
-Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
+static void JSONRPCWriteReply(CJSONWriter& writer, const Value& result, const Value& error, const Value& id)
 {
-    Object reply;
+    writer.BeginObject();
     if (error.type() != null_type)
-        reply.push_back(Pair("result", Value::null));
+        writer.Key("result").Null();
     else
-        reply.push_back(Pair("result", result));
-    reply.push_back(Pair("error", error));
-    reply.push_back(Pair("id", id));
-    return reply;
+        writer.Key("result").Write(result);
+    writer.Key("error").Write(error);
+    writer.Key("id").Write(id);
+    writer.EndObject();
 }
 
 string JSONRPCReply(const Value& result, const Value& error, const Value& id)
 {
-    Object reply = JSONRPCReplyObj(result, error, id);
-    return write_string(Value(reply), false) + "\n";
-}
-
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
-{
-    // Send error reply from json-rpc error object
-    int nStatus = HTTP_INTERNAL_SERVER_ERROR;
-    int code = find_value(objError, "code").get_int();
-    if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
-    else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
-    string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    string strReply;
+    CJSONWriter writer(strReply);
+    JSONRPCWriteReply(writer, result, error, id);
+    return strReply + "\n";
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -615,61 +662,393 @@ private:
     asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
-class AcceptedConnection
+class JSONRequest
+{
+public:
+    Value id;
+    string strMethod;
+    Array params;
+
+    JSONRequest() { id = Value::null; }
+    void parse(const Value& valRequest);
+};
+
+void JSONRequest::parse(const Value& valRequest)
+{
+    // Parse request
+    if (valRequest.type() != obj_type)
+        throw JSONRPCError(RPC_INVALID_REQUEST, "Invalid Request object");
+    const Object& request = valRequest.get_obj();
+
+    // Parse id now so errors from here on will have the id
+    id = find_value(request, "id");
+
+    // Parse method
+    Value valMethod = find_value(request, "method");
+    if (valMethod.type() == null_type)
+        throw JSONRPCError(RPC_INVALID_REQUEST, "Missing method");
+    if (valMethod.type() != str_type)
+        throw JSONRPCError(RPC_INVALID_REQUEST, "Method must be a string");
+    strMethod = valMethod.get_str();
+    if (strMethod != "getwork" && strMethod != "getworkex" && strMethod != "getblocktemplate")
+        printf("ThreadRPCServer method=%s\n", strMethod.c_str());
+
+    // Parse params
+    Value valParams = find_value(request, "params");
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+    else if (valParams.type() == null_type)
+        params = Array();
+    else
+        throw JSONRPCError(RPC_INVALID_REQUEST, "Params must be an array");
+}
+
+// Execute a request, writing the reply object; throws on error
+static void JSONRPCExec(const JSONRequest& jreq, CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Key("result");
+    tableRPC.execute(jreq.strMethod, jreq.params, writer);
+    writer.Key("error").Null();
+    writer.Key("id").Write(jreq.id);
+    writer.EndObject();
+}
+
+static void JSONRPCExecOne(const Value& req, CJSONWriter& writer)
+{
+    JSONRequest jreq;
+    // a failing call replaces whatever it wrote with the error reply
+    CJSONWriter::Mark mark = writer.GetMark();
+    try {
+        jreq.parse(req);
+        JSONRPCExec(jreq, writer);
+    }
+    catch (Object& objError)
+    {
+        writer.Rewind(mark);
+        JSONRPCWriteReply(writer, Value::null, objError, jreq.id);
+    }
+    catch (std::exception& e)
+    {
+        writer.Rewind(mark);
+        JSONRPCWriteReply(writer, Value::null,
+                          JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+    }
+}
+
+static void JSONRPCExecBatch(const Array& vReq, string& strReply)
+{
+    CJSONWriter writer(strReply);
+    writer.BeginArray();
+    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
+        JSONRPCExecOne(vReq[reqIdx], writer);
+    writer.EndArray();
+    strReply += "\n";
+}
+
+/** Calls waiting for an RPC worker thread. The queue is bounded, so that a flood of
+ *  requests is turned away with "503 Service Unavailable" rather than piling up behind slow calls. */
+class CRPCWorkQueue
 {
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque< boost::function<void()> > queue;
+    size_t nMaxDepth;
+    bool fRunning;
+
 public:
-    virtual ~AcceptedConnection() {}
+    CRPCWorkQueue(size_t nMaxDepthIn) : nMaxDepth(nMaxDepthIn), fRunning(true) {}
+
+    bool Enqueue(const boost::function<void()> &func)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fRunning || queue.size() >= nMaxDepth)
+            return false;
+        queue.push_back(func);
+        cond.notify_one();
+        return true;
+    }
 
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
+    void Run()
+    {
+        RenameThread("bitcoin-rpcworker");
+        loop
+        {
+            boost::function<void()> func;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (fRunning && queue.empty())
+                    cond.wait(lock);
+                if (!fRunning)
+                    return;
+                func = queue.front();
+                queue.pop_front();
+            }
+            func();
+        }
+    }
+
+    void Interrupt()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = false;
+        cond.notify_all();
+    }
 };
 
+static CRPCWorkQueue* rpc_work_queue = NULL;
+
+/**
+ * An RPC client connection, served asynchronously. The io_service thread reads the
+ * HTTP requests and writes the replies; the calls themselves run on the worker threads.
+ * Connections are kept alive, and pipelined requests are answered in order. At most
+ * one operation is pending on the socket at any time, so the thread executing a call
+ * may start writing its reply directly.
+ */
 template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+class AcceptedConnectionImpl : public boost::enable_shared_from_this< AcceptedConnectionImpl<Protocol> >
 {
 public:
     AcceptedConnectionImpl(
             asio::io_service& io_service,
             ssl::context &context,
-            bool fUseSSL) :
+            bool fUseSSLIn) :
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+        fUseSSL(fUseSSLIn),
+        timerAuth(io_service),
+        nProto(0),
+        fKeepAlive(false)
     {
     }
 
-    virtual std::iostream& stream()
+    std::string peer_address_to_string() const
     {
-        return _stream;
+        return peer.address().to_string();
     }
 
-    virtual std::string peer_address_to_string() const
+    void Start()
     {
-        return peer.address().to_string();
+        if (fUseSSL)
+            sslStream.async_handshake(ssl::stream_base::server,
+                boost::bind(&AcceptedConnectionImpl::HandleHandshake, this->shared_from_this(), asio::placeholders::error));
+        else
+            ReadRequest();
     }
 
-    virtual void close()
+    // Send nStatus with strReplyBody, then read the next request or close
+    void Reply(int nStatus, bool fKeepAliveIn)
     {
-        _stream.close();
+        fKeepAlive = fKeepAliveIn;
+        if (nStatus == HTTP_UNAUTHORIZED)
+            strReplyHeader = HTTPReply(nStatus, "", false);
+        else
+            strReplyHeader = HTTPReplyHeader(nStatus, strReplyBody.size(), fKeepAlive);
+
+        // header and body go out as they are, without first being joined into one string
+        std::vector<asio::const_buffer> vBuffers;
+        vBuffers.push_back(asio::buffer(strReplyHeader));
+        if (nStatus != HTTP_UNAUTHORIZED)
+            vBuffers.push_back(asio::buffer(strReplyBody));
+        if (fUseSSL)
+            asio::async_write(sslStream, vBuffers,
+                boost::bind(&AcceptedConnectionImpl::HandleWrite, this->shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_write(sslStream.next_layer(), vBuffers,
+                boost::bind(&AcceptedConnectionImpl::HandleWrite, this->shared_from_this(), asio::placeholders::error));
     }
 
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
 private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
-};
+    bool fUseSSL;
+    asio::deadline_timer timerAuth;
+    asio::streambuf buf;
+    int nProto;
+    bool fKeepAlive;
+    string strMethod, strURI;
+    map<string, string> mapHeaders;
+    string strReplyHeader, strReplyBody;
+
+    // Errors below mean the client went away or broke the protocol: no further operation
+    // is started, and the connection is freed with the last handler referring to it.
+
+    void HandleHandshake(const boost::system::error_code& error)
+    {
+        if (!error)
+            ReadRequest();
+    }
+
+    void ReadRequest()
+    {
+        // completes at once if a pipelined request is already buffered
+        if (fUseSSL)
+            asio::async_read_until(sslStream, buf, "\r\n\r\n",
+                boost::bind(&AcceptedConnectionImpl::HandleHeaders, this->shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_read_until(sslStream.next_layer(), buf, "\r\n\r\n",
+                boost::bind(&AcceptedConnectionImpl::HandleHeaders, this->shared_from_this(), asio::placeholders::error));
+    }
+
+    void HandleHeaders(const boost::system::error_code& error)
+    {
+        if (error)
+            return;
+
+        std::istream stream(&buf);
+        mapHeaders.clear();
+        if (!ReadHTTPRequestLine(stream, nProto, strMethod, strURI))
+            return;
+        int nLen = ReadHTTPHeaders(stream, mapHeaders);
+        if (nLen < 0 || nLen > (int)MAX_SIZE)
+        {
+            strReplyBody.clear();
+            Reply(HTTP_BAD_REQUEST, false);
+            return;
+        }
+
+        string sConHdr = mapHeaders["connection"];
+        fKeepAlive = (sConHdr == "keep-alive") || (sConHdr != "close" && nProto >= 1);
+
+        // the body may have arrived along with the headers already
+        if (buf.size() >= (size_t)nLen)
+            HandleBody(nLen, boost::system::error_code());
+        else if (fUseSSL)
+            asio::async_read(sslStream, buf, asio::transfer_at_least(nLen - buf.size()),
+                boost::bind(&AcceptedConnectionImpl::HandleBody, this->shared_from_this(), nLen, asio::placeholders::error));
+        else
+            asio::async_read(sslStream.next_layer(), buf, asio::transfer_at_least(nLen - buf.size()),
+                boost::bind(&AcceptedConnectionImpl::HandleBody, this->shared_from_this(), nLen, asio::placeholders::error));
+    }
+
+    void HandleBody(int nLen, const boost::system::error_code& error)
+    {
+        if (error)
+            return;
+
+        string strRequest(nLen, '\0');
+        if (nLen > 0)
+        {
+            std::istream stream(&buf);
+            stream.read(&strRequest[0], nLen);
+        }
+
+        // Requests that will not run are answered here on the io thread, so clients
+        // without the password can never take up the work queue
+        strReplyBody.clear();
+        if (strURI != "/")
+        {
+            Reply(HTTP_NOT_FOUND, false);
+            return;
+        }
+        if (mapHeaders.count("authorization") == 0)
+        {
+            Reply(HTTP_UNAUTHORIZED, false);
+            return;
+        }
+        if (!HTTPAuthorized(mapHeaders))
+        {
+            printf("ThreadRPCServer incorrect password attempt from %s\n", peer_address_to_string().c_str());
+            /* Deter brute-forcing short passwords.
+               If this results in a DOS the user really
+               shouldn't have their RPC port exposed.
+               A timer rather than a sleep, which would hold up the io thread. */
+            if (mapArgs["-rpcpassword"].size() < 20)
+            {
+                timerAuth.expires_from_now(boost::posix_time::milliseconds(250));
+                timerAuth.async_wait(boost::bind(&AcceptedConnectionImpl::HandleUnauthorized, this->shared_from_this(), asio::placeholders::error));
+                return;
+            }
+            Reply(HTTP_UNAUTHORIZED, false);
+            return;
+        }
+
+        if (!rpc_work_queue->Enqueue(boost::bind(&AcceptedConnectionImpl::Execute, this->shared_from_this(), strRequest)))
+        {
+            printf("ThreadRPCServer work queue full, rejecting request from %s\n", peer_address_to_string().c_str());
+            strReplyBody.clear();
+            Reply(HTTP_SERVICE_UNAVAILABLE, false);
+        }
+    }
+
+    void HandleUnauthorized(const boost::system::error_code& error)
+    {
+        if (!error)
+            Reply(HTTP_UNAUTHORIZED, false);
+    }
+
+    void HandleWrite(const boost::system::error_code& error)
+    {
+        string().swap(strReplyBody);
+        if (error)
+            return;
+        if (fKeepAlive)
+        {
+            ReadRequest();
+            return;
+        }
+        boost::system::error_code ec;
+        sslStream.lowest_layer().shutdown(socket_base::shutdown_both, ec);
+        sslStream.lowest_layer().close(ec);
+    }
+
+    void ReplyError(const Object& objError, const Value& id)
+    {
+        // Send error reply from json-rpc error object
+        int nStatus = HTTP_INTERNAL_SERVER_ERROR;
+        int code = find_value(objError, "code").get_int();
+        if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
+        else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
+        strReplyBody = JSONRPCReply(Value::null, objError, id);
+        Reply(nStatus, false);
+    }
+
+    // Runs on an RPC worker thread, for authorized requests only
+    void Execute(const string& strRequest)
+    {
+        JSONRequest jreq;
+        try
+        {
+            // Parse request
+            Value valRequest;
+            if (!ParseJSON(strRequest, valRequest))
+                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+            // singleton request
+            if (valRequest.type() == obj_type) {
+                jreq.parse(valRequest);
+
+                // the result is written straight into the reply
+                CJSONWriter writer(strReplyBody);
+                JSONRPCExec(jreq, writer);
+                strReplyBody += "\n";
 
-void ServiceConnection(AcceptedConnection *conn);
+            // array of requests
+            } else if (valRequest.type() == array_type)
+                JSONRPCExecBatch(valRequest.get_array(), strReplyBody);
+            else
+                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+
+            Reply(HTTP_OK, fKeepAlive);
+        }
+        catch (Object& objError)
+        {
+            ReplyError(objError, jreq.id);
+        }
+        catch (std::exception& e)
+        {
+            ReplyError(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        }
+    }
+};
 
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
                              const boost::system::error_code& error);
 
 /**
@@ -681,7 +1060,7 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
                    const bool fUseSSL)
 {
     // Accept connection
-    AcceptedConnectionImpl<Protocol>* conn = new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL);
+    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
@@ -701,36 +1080,29 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn,
                              const boost::system::error_code& error)
 {
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
-
     // TODO: Actually handle errors
     if (error)
-    {
-        delete conn;
-    }
+        return;
 
     // Restrict callers by IP.  It is important to
     // do this before starting client thread, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    if (!ClientAllowed(conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        delete conn;
-    }
-    else {
-        ServiceConnection(conn);
-        conn->close();
-        delete conn;
+            conn->Reply(HTTP_FORBIDDEN, false);
+        return;
     }
+
+    conn->Start();
 }
 
 void StartRPCThreads()
@@ -847,9 +1219,12 @@ void StartRPCThreads()
         return;
     }
 
+    // One thread does all the socket I/O; the calls run on the -rpcthreads workers
+    rpc_work_queue = new CRPCWorkQueue(std::max((int)GetArg("-rpcworkqueue", 16), 1));
     rpc_worker_group = new boost::thread_group();
+    rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
     for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+        rpc_worker_group->create_thread(boost::bind(&CRPCWorkQueue::Run, rpc_work_queue));
 }
 
 void StopRPCThreads()
@@ -857,169 +1232,16 @@ void StopRPCThreads()
     if (rpc_io_service == NULL) return;
 
     rpc_io_service->stop();
+    rpc_work_queue->Interrupt();
     rpc_worker_group->join_all();
     delete rpc_worker_group; rpc_worker_group = NULL;
-    delete rpc_ssl_context; rpc_ssl_context = NULL;
+    // connections still queued or waiting on the io_service go first, as they use the SSL context
+    delete rpc_work_queue; rpc_work_queue = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
+    delete rpc_ssl_context; rpc_ssl_context = NULL;
 }
 
-class JSONRequest
-{
-public:
-    Value id;
-    string strMethod;
-    Array params;
-
-    JSONRequest() { id = Value::null; }
-    void parse(const Value& valRequest);
-};
-
-void JSONRequest::parse(const Value& valRequest)
-{
-    // Parse request
-    if (valRequest.type() != obj_type)
-        throw JSONRPCError(RPC_INVALID_REQUEST, "Invalid Request object");
-    const Object& request = valRequest.get_obj();
-
-    // Parse id now so errors from here on will have the id
-    id = find_value(request, "id");
-
-    // Parse method
-    Value valMethod = find_value(request, "method");
-    if (valMethod.type() == null_type)
-        throw JSONRPCError(RPC_INVALID_REQUEST, "Missing method");
-    if (valMethod.type() != str_type)
-        throw JSONRPCError(RPC_INVALID_REQUEST, "Method must be a string");
-    strMethod = valMethod.get_str();
-    if (strMethod != "getwork" && strMethod != "getworkex" && strMethod != "getblocktemplate")
-        printf("ThreadRPCServer method=%s\n", strMethod.c_str());
-
-    // Parse params
-    Value valParams = find_value(request, "params");
-    if (valParams.type() == array_type)
-        params = valParams.get_array();
-    else if (valParams.type() == null_type)
-        params = Array();
-    else
-        throw JSONRPCError(RPC_INVALID_REQUEST, "Params must be an array");
-}
-
-static Object JSONRPCExecOne(const Value& req)
-{
-    Object rpc_result;
-
-    JSONRequest jreq;
-    try {
-        jreq.parse(req);
-
-        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-        rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
-    }
-    catch (Object& objError)
-    {
-        rpc_result = JSONRPCReplyObj(Value::null, objError, jreq.id);
-    }
-    catch (std::exception& e)
-    {
-        rpc_result = JSONRPCReplyObj(Value::null,
-                                     JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-    }
-
-    return rpc_result;
-}
-
-static string JSONRPCExecBatch(const Array& vReq)
-{
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
-
-    return write_string(Value(ret), false) + "\n";
-}
-
-void ServiceConnection(AcceptedConnection *conn)
-{
-    bool fRun = true;
-    while (fRun)
-    {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
-
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
-
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
-
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
-        }
-
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
-
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
-
-            string strReply;
-
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
-
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
-
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
-
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
-        }
-        catch (std::exception& e)
-        {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
-        }
-    }
-}
-
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+const CRPCCommand* CRPCTable::prepare(const std::string &strMethod) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -1028,11 +1250,21 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     if (pcmd->reqWallet && !pwalletMain)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
 
+    // Let the wallet catch up with the blocks and transactions validated before this call
+    if (pcmd->reqWallet && !WaitForWallets(RPC_WALLET_WAIT_TIMEOUT))
+        printf("%s : wallet still catching up with the chain\n", strMethod.c_str());
+
     // Observe safe mode
     string strWarning = GetWarnings("rpc");
     if (strWarning != "" && !GetBoolArg("-disablesafemode") &&
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
+    return pcmd;
+}
+
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    const CRPCCommand *pcmd = prepare(strMethod);
 
     try
     {
@@ -1057,6 +1289,35 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     }
 }
 
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter &result) const
+{
+    map<string, rpcfn_write_type>::const_iterator it = mapWriters.find(strMethod);
+    if (it == mapWriters.end())
+    {
+        result.Write(execute(strMethod, params));
+        return;
+    }
+
+    const CRPCCommand *pcmd = prepare(strMethod);
+    rpcfn_write_type writer = it->second;
+    try
+    {
+        if (pcmd->threadSafe)
+            writer(params, false, result);
+        else if (!pwalletMain) {
+            LOCK(cs_main);
+            writer(params, false, result);
+        } else {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            writer(params, false, result);
+        }
+    }
+    catch (std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+}
+
 
 Object CallRPC(const string& strMethod, const Array& params)
 {
@@ -1105,7 +1366,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ParseJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -1127,7 +1388,7 @@ void ConvertTo(Value& value, bool fAllowNull=false)
         // reinterpret string as unquoted json value
         Value value2;
         string strJSON = value.get_str();
-        if (!read_string(strJSON, value2))
+        if (!ParseJSON(strJSON, value2))
             throw runtime_error(string("Error parsing JSON:")+strJSON);
         ConvertTo<T>(value2, fAllowNull);
         value = value2;
@@ -1167,6 +1428,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listreceivedbyaccount"  && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getbalance"             && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getblockhash"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "estimatefee"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "estimatepriority"       && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "move"                   && n > 2) ConvertTo<double>(params[2]);
     if (strMethod == "move"                   && n > 3) ConvertTo<boost::int64_t>(params[3]);
     if (strMethod == "sendfrom"               && n > 2) ConvertTo<double>(params[2]);
@@ -1179,6 +1442,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listsinceblock"         && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "sendmany"               && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "sendmany"               && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "sendmanybatch"          && n > 1) ConvertTo<Object>(params[1]);
+    if (strMethod == "sendmanybatch"          && n > 2) ConvertTo<boost::int64_t>(params[2]);
     if (strMethod == "addmultisigaddress"     && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "addmultisigaddress"     && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "createmultisig"         && n > 0) ConvertTo<boost::int64_t>(params[0]);
@@ -1187,6 +1452,7 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listunspent"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "listunspent"            && n > 2) ConvertTo<Array>(params[2]);
     if (strMethod == "getblock"               && n > 1) ConvertTo<bool>(params[1]);
+    if (strMethod == "getrawmempool"          && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "getrawtransaction"      && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "createrawtransaction"   && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<Object>(params[1]);
@@ -1197,8 +1463,16 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "lockunspent"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "lockunspent"            && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "importprivkey"          && n > 2) ConvertTo<bool>(params[2]);
+    if (strMethod == "importprivkeys"         && n > 0) ConvertTo<Array>(params[0]);
+    if (strMethod == "importprivkeys"         && n > 2) ConvertTo<bool>(params[2]);
     if (strMethod == "verifychain"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "verifychain"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddressbalance"      && n > 0 && params[0].get_str().size() > 0 && params[0].get_str()[0] == '[') ConvertTo<Array>(params[0]);
+    if (strMethod == "getaddressutxos"        && n > 0 && params[0].get_str().size() > 0 && params[0].get_str()[0] == '[') ConvertTo<Array>(params[0]);
+    if (strMethod == "getaddresstxids"        && n > 0 && params[0].get_str().size() > 0 && params[0].get_str()[0] == '[') ConvertTo<Array>(params[0]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "getspentinfo"           && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getpoolinfo"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "enforcecheckpoint"      && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "enforcecheckpoint"      && n > 1) ConvertTo<boost::int64_t>(params[1]);
@@ -100,6 +100,41 @@ bool CCrypter::Decrypt(const std::vector<unsigned char>& vchCiphertext, CKeyingM
 }
 
 
+CSecretDecrypter::CSecretDecrypter(const CKeyingMaterial& vMasterKey)
+{
+    pctx = EVP_CIPHER_CTX_new();
+    fKeySet = (pctx && vMasterKey.size() == WALLET_CRYPTO_KEY_SIZE &&
+               EVP_DecryptInit_ex(pctx, EVP_aes_256_cbc(), NULL, &vMasterKey[0], NULL));
+}
+
+CSecretDecrypter::~CSecretDecrypter()
+{
+    // also cleanses the key schedule
+    if (pctx)
+        EVP_CIPHER_CTX_free(pctx);
+}
+
+bool CSecretDecrypter::Decrypt(const std::vector<unsigned char>& vchCiphertext, const uint256& nIV, CKeyingMaterial& vchPlaintext)
+{
+    if (!fKeySet || vchCiphertext.empty())
+        return false;
+
+    int nLen = vchCiphertext.size();
+    int nPLen = nLen, nFLen = 0;
+    vchPlaintext = CKeyingMaterial(nPLen);
+
+    // a new IV restarts the context without touching the key
+    bool fOk = true;
+    if (fOk) fOk = EVP_DecryptInit_ex(pctx, NULL, NULL, NULL, (const unsigned char*)&nIV);
+    if (fOk) fOk = EVP_DecryptUpdate(pctx, &vchPlaintext[0], &nPLen, &vchCiphertext[0], nLen);
+    if (fOk) fOk = EVP_DecryptFinal_ex(pctx, (&vchPlaintext[0])+nPLen, &nFLen);
+
+    if (!fOk) return false;
+
+    vchPlaintext.resize(nPLen + nFLen);
+    return true;
+}
+
 bool EncryptSecret(const CKeyingMaterial& vMasterKey, const CKeyingMaterial &vchPlaintext, const uint256& nIV, std::vector<unsigned char> &vchCiphertext)
 {
     CCrypter cKeyCrypter;
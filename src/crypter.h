@@ -101,6 +101,27 @@ public:
     }
 };
 
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+/** Decrypts any number of secrets under the same master key. The AES key schedule is
+ *  expanded once and the cipher context, with whatever hardware AES support OpenSSL
+ *  picked for it, is reused for each secret; only the IV changes. */
+class CSecretDecrypter
+{
+private:
+    EVP_CIPHER_CTX* pctx;
+    bool fKeySet;
+
+    // owns pctx
+    CSecretDecrypter(const CSecretDecrypter&);
+    CSecretDecrypter& operator=(const CSecretDecrypter&);
+
+public:
+    CSecretDecrypter(const CKeyingMaterial& vMasterKey);
+    ~CSecretDecrypter();
+    bool Decrypt(const std::vector<unsigned char>& vchCiphertext, const uint256& nIV, CKeyingMaterial& vchPlaintext);
+};
+
 bool EncryptSecret(const CKeyingMaterial& vMasterKey, const CKeyingMaterial &vchPlaintext, const uint256& nIV, std::vector<unsigned char> &vchCiphertext);
 bool DecryptSecret(const CKeyingMaterial& vMasterKey, const std::vector<unsigned char>& vchCiphertext, const uint256& nIV, CKeyingMaterial& vchPlaintext);
 
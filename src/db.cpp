@@ -49,6 +49,8 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 CDBEnv::~CDBEnv()
 {
     EnvShutdown();
+    for (map<string, CWalletLog*>::iterator mi = mapLog.begin(); mi != mapLog.end(); mi++)
+        delete (*mi).second;
 }
 
 void CDBEnv::Close()
@@ -215,7 +217,7 @@ void CDBEnv::CheckpointLSN(std::string strFile)
 
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), activeTxn(NULL), plog(NULL), fLogTxn(false), fLogWritten(false)
 {
     int ret;
     if (pszFile == NULL)
@@ -229,6 +231,16 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
 
     {
         LOCK(bitdb.cs_db);
+        plog = bitdb.GetLog(pszFile);
+        if (plog)
+        {
+            strFile = pszFile;
+            ++bitdb.mapFileUseCount[strFile];
+            if (fCreate && !fReadOnly && !Exists(string("version")))
+                WriteVersion(CLIENT_VERSION);
+            return;
+        }
+
         if (!bitdb.Open(GetDataDir()))
             throw runtime_error("env open failed");
 
@@ -279,8 +291,17 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    if (activeTxn || fLogTxn)
+        return;
+
+    // Everything appended to a wallet log before this sync (from any handle) shares its fsync
+    if (plog)
+    {
+        if (fLogWritten)
+            plog->Sync();
+        fLogWritten = false;
         return;
+    }
 
     // Flush database activity from memory pool to disk log
     unsigned int nMinutes = 0;
@@ -292,14 +313,17 @@ void CDB::Flush()
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pdb && !plog)
         return;
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
+    fLogTxn = false;
+    vLogTxn.clear();
     pdb = NULL;
 
     Flush();
+    plog = NULL;
 
     {
         LOCK(bitdb.cs_db);
@@ -331,8 +355,327 @@ bool CDBEnv::RemoveDb(const string& strFile)
     return (rc == 0);
 }
 
+bool CDB::LogRead(const CDataStream& ssKey, CSerializeData& vchValue)
+{
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    if (fLogTxn)
+    {
+        // the open transaction's own writes come first
+        for (vector<CWalletLogOp>::reverse_iterator it = vLogTxn.rbegin(); it != vLogTxn.rend(); ++it)
+        {
+            if (it->vchKey != vchKey)
+                continue;
+            if (it->nOp == CWalletLogOp::ERASE)
+                return false;
+            vchValue = it->vchValue;
+            return true;
+        }
+    }
+    return plog->Read(vchKey, vchValue);
+}
+
+bool CDB::LogExists(const CDataStream& ssKey)
+{
+    CSerializeData vchValue;
+    return LogRead(ssKey, vchValue);
+}
+
+bool CDB::LogWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && LogExists(ssKey))
+        return false;
+    fLogWritten = true;
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    CSerializeData vchValue(ssValue.begin(), ssValue.end());
+    if (fLogTxn)
+    {
+        vLogTxn.push_back(CWalletLogOp(vchKey, vchValue));
+        return true;
+    }
+    return plog->Write(vchKey, vchValue, fOverwrite);
+}
+
+bool CDB::LogErase(const CDataStream& ssKey)
+{
+    fLogWritten = true;
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    if (fLogTxn)
+    {
+        vLogTxn.push_back(CWalletLogOp(vchKey));
+        return true;
+    }
+    return plog->Erase(vchKey);
+}
+
+int CDB::ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    CSerializeData vchKey;
+    bool fInclusive;
+    if (fFlags == DB_SET_RANGE)
+    {
+        vchKey.assign(ssKey.begin(), ssKey.end());
+        fInclusive = true;
+    }
+    else if (fFlags == DB_NEXT)
+    {
+        if (pcursor->fStarted)
+            vchKey = pcursor->vchLastKey;
+        fInclusive = !pcursor->fStarted;
+    }
+    else
+        return EINVAL;
+
+    // Positioning by key rather than by iterator keeps the cursor valid while records change
+    CSerializeData vchValue;
+    if (!plog->Seek(vchKey, vchValue, fInclusive))
+        return DB_NOTFOUND;
+    pcursor->vchLastKey = vchKey;
+    pcursor->fStarted = true;
+
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write(&vchKey[0], vchKey.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    if (!vchValue.empty())
+        ssValue.write(&vchValue[0], vchValue.size());
+    return 0;
+}
+
+bool CDBEnv::OpenLog(const string& strFile)
+{
+    LOCK(cs_db);
+    if (mapLog.count(strFile))
+        return mapLog[strFile]->IsOpen();
+    CWalletLog* plog = new CWalletLog();
+    if (!plog->Open(CDB::GetLogPath(strFile)))
+    {
+        delete plog;
+        return false;
+    }
+    mapLog[strFile] = plog;
+    return true;
+}
+
+CWalletLog* CDBEnv::GetLog(const string& strFile)
+{
+    LOCK(cs_db);
+    map<string, CWalletLog*>::iterator mi = mapLog.find(strFile);
+    if (mi == mapLog.end())
+        return NULL;
+    return mi->second;
+}
+
+boost::filesystem::path CDB::GetLogPath(const string& strFile)
+{
+    return GetDataDir() / (strFile + ".log");
+}
+
+bool CDB::MigrateToLog(const string& strFile)
+{
+    filesystem::path pathLog = GetLogPath(strFile);
+    filesystem::path pathTmp = pathLog.string() + ".new";
+    printf("Copying %s to %s...\n", strFile.c_str(), pathLog.string().c_str());
+    int64 nStart = GetTimeMillis();
+    bool fSuccess = true;
+    {
+        try {
+            filesystem::remove(pathTmp);
+        } catch(const filesystem::filesystem_error &e) {
+        }
+        CWalletLog log;
+        if (!log.Open(pathTmp))
+            return false;
+
+        CDB db(strFile.c_str(), "r");
+        CDBCursor* pcursor = db.GetCursor();
+        if (!pcursor)
+            return error("CDB::MigrateToLog() : cannot create cursor on %s", strFile.c_str());
+        vector<CWalletLogOp> vOps;
+        loop
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                fSuccess = false;
+                break;
+            }
+            vOps.push_back(CWalletLogOp(CSerializeData(ssKey.begin(), ssKey.end()), CSerializeData(ssValue.begin(), ssValue.end())));
+            if (vOps.size() >= 1000)
+            {
+                fSuccess = log.WriteBatch(vOps);
+                vOps.clear();
+                if (!fSuccess)
+                    break;
+            }
+        }
+        delete pcursor;
+        if (fSuccess)
+            fSuccess = log.WriteBatch(vOps) && log.Sync();
+        log.Close();
+    }
+    if (!fSuccess || !RenameOver(pathTmp, pathLog))
+        return error("CDB::MigrateToLog() : copying %s FAILED", strFile.c_str());
+
+    // Set the Berkeley database aside so it is not converted a second time
+    LOCK(bitdb.cs_db);
+    bitdb.CloseDb(strFile);
+    bitdb.CheckpointLSN(strFile);
+    bitdb.mapFileUseCount.erase(strFile);
+    string strFileBak = strprintf("%s.%"PRI64d".bak", strFile.c_str(), GetTime());
+    if (bitdb.dbenv.dbrename(NULL, strFile.c_str(), NULL, strFileBak.c_str(), DB_AUTO_COMMIT) != 0)
+        printf("CDB::MigrateToLog() : failed to rename %s to %s\n", strFile.c_str(), strFileBak.c_str());
+    printf("Copied %s to %s in %"PRI64d"ms\n", strFile.c_str(), pathLog.string().c_str(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CDB::MigrateFromLog(const string& strFile)
+{
+    filesystem::path pathLog = GetLogPath(strFile);
+    printf("Copying %s to %s...\n", pathLog.string().c_str(), strFile.c_str());
+    bool fSuccess = true;
+    {
+        CWalletLog log;
+        if (!log.Open(pathLog))
+            return false;
+
+        CDB db(strFile.c_str(), "cr+");
+        CSerializeData vchKey, vchValue;
+        bool fInclusive = true;
+        while (fSuccess && log.Seek(vchKey, vchValue, fInclusive))
+        {
+            fInclusive = false;
+            Dbt datKey(&vchKey[0], vchKey.size());
+            Dbt datValue(vchValue.empty() ? NULL : &vchValue[0], vchValue.size());
+            if (db.pdb->put(NULL, &datKey, &datValue, 0) != 0)
+                fSuccess = false;
+        }
+        db.Close();
+        log.Close();
+    }
+    {
+        LOCK(bitdb.cs_db);
+        bitdb.CloseDb(strFile);
+        bitdb.CheckpointLSN(strFile);
+        bitdb.mapFileUseCount.erase(strFile);
+    }
+    if (!fSuccess)
+        return error("CDB::MigrateFromLog() : copying %s FAILED", pathLog.string().c_str());
+
+    filesystem::path pathBak = pathLog.string() + strprintf(".%"PRI64d".bak", GetTime());
+    if (!RenameOver(pathLog, pathBak))
+        printf("CDB::MigrateFromLog() : failed to rename %s to %s\n", pathLog.string().c_str(), pathBak.string().c_str());
+    return true;
+}
+
+// whether strName is strFile or its log with a timestamp and ".bak" appended
+static bool IsBackupName(const string& strName, const string& strFile)
+{
+    string strStem = strFile + ".";
+    if (strName.size() <= strStem.size() + 4 || strName.compare(0, strStem.size(), strStem) != 0 ||
+        strName.compare(strName.size() - 4, 4, ".bak") != 0)
+        return false;
+    string strTime = strName.substr(strStem.size(), strName.size() - strStem.size() - 4);
+    if (strTime.compare(0, 4, "log.") == 0)
+        strTime.erase(0, 4);
+    return !strTime.empty() && strTime.find_first_not_of("0123456789") == string::npos;
+}
+
+void CDB::ScrubBackups(const string& strFile)
+{
+    CWalletLog* plog = bitdb.GetLog(strFile);
+    // the copy of a damaged log is kept: it may hold the only copy of a key
+    if (plog && filesystem::exists(plog->GetQuarantinePath()))
+        printf("WARNING: %s may still hold unencrypted keys\n", plog->GetQuarantinePath().string().c_str());
+    vector<filesystem::path> vBackups;
+    try {
+        for (filesystem::directory_iterator it(GetDataDir()); it != filesystem::directory_iterator(); ++it)
+            if (IsBackupName(filesystem::path(it->path().filename()).string(), strFile))
+                vBackups.push_back(it->path());
+    } catch(const filesystem::filesystem_error &e) {
+        printf("CDB::ScrubBackups() : %s\n", e.what());
+    }
+    if (vBackups.empty())
+        return;
+    // the copies of a damaged log may hold the only copy of a key
+    if (plog && plog->IsDamaged())
+    {
+        BOOST_FOREACH(const filesystem::path& path, vBackups)
+            printf("WARNING: %s may still hold unencrypted keys\n", path.string().c_str());
+        return;
+    }
+
+    // overwrite before removing, so the unencrypted keys don't linger in the freed blocks
+    static const char pchZero[4096] = {};
+    BOOST_FOREACH(const filesystem::path& path, vBackups)
+    {
+        bool fScrubbed = false;
+        FILE* file = fopen(path.string().c_str(), "r+b");
+        if (file)
+        {
+            uint64 nLeft = filesystem::file_size(path);
+            fScrubbed = true;
+            while (fScrubbed && nLeft > 0)
+            {
+                size_t n = std::min(nLeft, (uint64)sizeof(pchZero));
+                fScrubbed = (fwrite(pchZero, 1, n, file) == n);
+                nLeft -= n;
+            }
+            if (fScrubbed && fflush(file) == 0)
+                FileCommit(file);
+            else
+                fScrubbed = false;
+            fclose(file);
+        }
+        try {
+            filesystem::remove(path);
+        } catch(const filesystem::filesystem_error &e) {
+            fScrubbed = false;
+        }
+        if (fScrubbed)
+            printf("Removed %s\n", path.string().c_str());
+        else
+            printf("WARNING: failed to remove %s, which may still hold unencrypted keys\n", path.string().c_str());
+    }
+}
+
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
+    CWalletLog* plog = bitdb.GetLog(strFile);
+    if (plog)
+    {
+        // Writers need not stop: drop the skipped records, then compact
+        vector<CWalletLogOp> vOps;
+        if (pszSkip)
+        {
+            CSerializeData vchKey(pszSkip, pszSkip + strlen(pszSkip)), vchValue;
+            CSerializeData vchPrefix = vchKey;
+            bool fInclusive = true;
+            while (plog->Seek(vchKey, vchValue, fInclusive) && vchKey.size() >= vchPrefix.size() &&
+                   std::equal(vchPrefix.begin(), vchPrefix.end(), vchKey.begin()))
+            {
+                vOps.push_back(CWalletLogOp(vchKey));
+                fInclusive = false;
+            }
+        }
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << string("version");
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << CLIENT_VERSION;
+        vOps.push_back(CWalletLogOp(CSerializeData(ssKey.begin(), ssKey.end()), CSerializeData(ssValue.begin(), ssValue.end())));
+        printf("Rewriting %s...\n", plog->GetPath().string().c_str());
+        if (!plog->WriteBatch(vOps) || !plog->Compact())
+        {
+            printf("Rewriting of %s FAILED!\n", plog->GetPath().string().c_str());
+            return false;
+        }
+        return true;
+    }
+
     while (true)
     {
         {
@@ -363,7 +706,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess)
                         {
@@ -372,12 +715,12 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                             int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
                             if (ret == DB_NOTFOUND)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 break;
                             }
                             else if (ret != 0)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 fSuccess = false;
                                 break;
                             }
@@ -431,6 +774,17 @@ void CDBEnv::Flush(bool fShutdown)
     // Flush log data to the actual data file
     //  on all files that are not in use
     printf("Flush(%s)%s\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " db not started");
+    {
+        // Wallet logs stay registered after closing, so late access fails instead of opening a database
+        LOCK(cs_db);
+        for (map<string, CWalletLog*>::iterator mi = mapLog.begin(); mi != mapLog.end(); mi++)
+        {
+            if (fShutdown)
+                (*mi).second->Close();
+            else
+                (*mi).second->Sync();
+        }
+    }
     if (!fDbEnvInit)
         return;
     {
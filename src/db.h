@@ -6,6 +6,7 @@
 #define BITCOIN_DB_H
 
 #include "main.h"
+#include "walletlog.h"
 
 #include <map>
 #include <string>
@@ -42,6 +43,8 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    // files kept in a wallet log instead of a Berkeley database
+    std::map<std::string, CWalletLog*> mapLog;
 
     CDBEnv();
     ~CDBEnv();
@@ -74,6 +77,10 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    /** Serve CDB access to strFile from its wallet log from now on */
+    bool OpenLog(const std::string& strFile);
+    CWalletLog* GetLog(const std::string& strFile);
+
     DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -87,6 +94,24 @@ public:
 extern CDBEnv bitdb;
 
 
+/** A cursor returned by CDB::GetCursor: a Berkeley DB cursor, or for a
+ *  wallet log the key of the last record read. Free it with delete. */
+class CDBCursor
+{
+public:
+    Dbc* pcursor;
+    CSerializeData vchLastKey;
+    bool fStarted;
+
+    explicit CDBCursor(Dbc* pcursorIn) : pcursor(pcursorIn), fStarted(false) {}
+    ~CDBCursor()
+    {
+        if (pcursor)
+            pcursor->close();
+    }
+};
+
+
 /** RAII class that provides access to a Berkeley database */
 class CDB
 {
@@ -95,6 +120,18 @@ protected:
     std::string strFile;
     DbTxn *activeTxn;
     bool fReadOnly;
+    // set instead of pdb when strFile is kept in a wallet log
+    CWalletLog* plog;
+    // writes of the open transaction, appended as one record on commit
+    std::vector<CWalletLogOp> vLogTxn;
+    bool fLogTxn;
+    bool fLogWritten;
+
+    bool LogRead(const CDataStream& ssKey, CSerializeData& vchValue);
+    bool LogWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool LogErase(const CDataStream& ssKey);
+    bool LogExists(const CDataStream& ssKey);
+    int ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
@@ -109,6 +146,22 @@ protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
+        if (plog)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << key;
+            CSerializeData vchValue;
+            if (!LogRead(ssKey, vchValue))
+                return false;
+            try {
+                CDataStream ssValue(vchValue, SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+            }
+            catch (std::exception &e) {
+                return false;
+            }
+            return true;
+        }
         if (!pdb)
             return false;
 
@@ -144,6 +197,16 @@ protected:
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
+        if (plog)
+        {
+            if (fReadOnly)
+                assert(!"Write called on database in read-only mode");
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << key;
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue << value;
+            return LogWrite(ssKey, ssValue, fOverwrite);
+        }
         if (!pdb)
             return false;
         if (fReadOnly)
@@ -173,6 +236,14 @@ protected:
     template<typename K>
     bool Erase(const K& key)
     {
+        if (plog)
+        {
+            if (fReadOnly)
+                assert(!"Erase called on database in read-only mode");
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << key;
+            return LogErase(ssKey);
+        }
         if (!pdb)
             return false;
         if (fReadOnly)
@@ -195,6 +266,12 @@ protected:
     template<typename K>
     bool Exists(const K& key)
     {
+        if (plog)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << key;
+            return LogExists(ssKey);
+        }
         if (!pdb)
             return false;
 
@@ -212,19 +289,24 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
+        if (plog)
+            return new CDBCursor(NULL);
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
-        return pcursor;
+        return new CDBCursor(pcursor);
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
+        if (!pcursor->pcursor)
+            return ReadAtLogCursor(pcursor, ssKey, ssValue, fFlags);
+
         // Read at cursor
         Dbt datKey;
         if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
@@ -240,7 +322,7 @@ protected:
         }
         datKey.set_flags(DB_DBT_MALLOC);
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        int ret = pcursor->pcursor->get(&datKey, &datValue, fFlags);
         if (ret != 0)
             return ret;
         else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
@@ -265,6 +347,14 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (plog)
+        {
+            if (fLogTxn)
+                return false;
+            vLogTxn.clear();
+            fLogTxn = true;
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -276,6 +366,15 @@ public:
 
     bool TxnCommit()
     {
+        if (plog)
+        {
+            if (!fLogTxn)
+                return false;
+            fLogTxn = false;
+            bool fOk = plog->WriteBatch(vLogTxn) && plog->Sync();
+            vLogTxn.clear();
+            return fOk;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -285,6 +384,14 @@ public:
 
     bool TxnAbort()
     {
+        if (plog)
+        {
+            if (!fLogTxn)
+                return false;
+            fLogTxn = false;
+            vLogTxn.clear();
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -304,6 +411,14 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+
+    static boost::filesystem::path GetLogPath(const std::string& strFile);
+    /** Copy the Berkeley database strFile into its wallet log and set strFile aside */
+    bool static MigrateToLog(const std::string& strFile);
+    /** Copy the wallet log of strFile back into a Berkeley database strFile and set the log aside */
+    bool static MigrateFromLog(const std::string& strFile);
+    /** Overwrite and remove the copies of strFile and its log set aside above or by CWalletLog::Open */
+    void static ScrubBackups(const std::string& strFile);
 };
 
 
@@ -0,0 +1,205 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "feeestimator.h"
+
+#include <algorithm>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+// weight kept by past data at each block, so the history spans roughly the last 500 blocks
+static const double ESTIMATE_DECAY = 0.998;
+// part of the transactions in a bucket range that must have confirmed within the target
+static const double ESTIMATE_SUCCESS = 0.85;
+// decayed number of transactions a bucket range needs before it is trusted
+static const double ESTIMATE_SUFFICIENT_TXS = 5;
+
+// fee rate buckets, in satoshis per 1000 bytes, and priority buckets
+static const double MIN_FEERATE_BUCKET = 1000;
+static const double MAX_FEERATE_BUCKET = 1e8;
+static const double FEERATE_SPACING = 1.1;
+static const double MIN_PRIORITY_BUCKET = 1e5;
+static const double MAX_PRIORITY_BUCKET = 1e13;
+static const double PRIORITY_SPACING = 2;
+
+void CConfirmStats::Init(double dMin, double dMax, double dSpacing, unsigned int nMaxConfirms)
+{
+    vBucketBounds.clear();
+    vBucketBounds.push_back(0);
+    for (double dBound = dMin; dBound <= dMax; dBound *= dSpacing)
+        vBucketBounds.push_back(dBound);
+    vTxCount.assign(vBucketBounds.size(), 0);
+    vValueSum.assign(vBucketBounds.size(), 0);
+    vConfirmed.assign(nMaxConfirms, vector<double>(vBucketBounds.size(), 0));
+}
+
+unsigned int CConfirmStats::FindBucket(double dValue) const
+{
+    vector<double>::const_iterator it = upper_bound(vBucketBounds.begin(), vBucketBounds.end(), dValue);
+    return it == vBucketBounds.begin() ? 0 : (it - vBucketBounds.begin()) - 1;
+}
+
+void CConfirmStats::Record(unsigned int nBucket, double dValue, unsigned int nBlocks)
+{
+    vTxCount[nBucket] += 1;
+    vValueSum[nBucket] += dValue;
+    if (nBlocks == 0)
+        return;
+    for (unsigned int i = nBlocks - 1; i < vConfirmed.size(); i++)
+        vConfirmed[i][nBucket] += 1;
+}
+
+void CConfirmStats::Decay(double dDecay)
+{
+    for (unsigned int i = 0; i < vTxCount.size(); i++) {
+        vTxCount[i] *= dDecay;
+        vValueSum[i] *= dDecay;
+    }
+    BOOST_FOREACH(vector<double> &vConf, vConfirmed)
+        for (unsigned int i = 0; i < vConf.size(); i++)
+            vConf[i] *= dDecay;
+}
+
+double CConfirmStats::Estimate(unsigned int nBlocks, double dSufficientTxs, double dSuccess) const
+{
+    if (nBlocks < 1 || nBlocks > vConfirmed.size())
+        return -1;
+    const vector<double> &vConf = vConfirmed[nBlocks - 1];
+
+    // Walk down from the most expensive bucket, grouping buckets until there is enough data
+    // to judge them, for as long as the groups keep confirming in time
+    double dEstimate = -1;
+    double dConf = 0, dTotal = 0, dValue = 0;
+    for (int i = (int)vTxCount.size() - 1; i >= 0; i--) {
+        dConf += vConf[i];
+        dTotal += vTxCount[i];
+        dValue += vValueSum[i];
+        if (dTotal >= dSufficientTxs) {
+            if (dConf / dTotal < dSuccess)
+                break;
+            dEstimate = dValue / dTotal;
+            dConf = dTotal = dValue = 0;
+        }
+    }
+    return dEstimate;
+}
+
+bool CConfirmStats::IsCompatible(const CConfirmStats &other) const
+{
+    if (vBucketBounds != other.vBucketBounds || vConfirmed.size() != other.vConfirmed.size())
+        return false;
+    if (vTxCount.size() != vBucketBounds.size() || vValueSum.size() != vBucketBounds.size())
+        return false;
+    BOOST_FOREACH(const vector<double> &vConf, vConfirmed)
+        if (vConf.size() != vBucketBounds.size())
+            return false;
+    return true;
+}
+
+CFeeEstimator::CFeeEstimator()
+{
+    feeStats.Init(MIN_FEERATE_BUCKET, MAX_FEERATE_BUCKET, FEERATE_SPACING, MAX_CONFIRMS);
+    priStats.Init(MIN_PRIORITY_BUCKET, MAX_PRIORITY_BUCKET, PRIORITY_SPACING, MAX_CONFIRMS);
+    UpdateEstimates();
+}
+
+void CFeeEstimator::UpdateEstimates()
+{
+    // A longer target never needs more than a shorter one, and takes its answer if it has none
+    vFeeEstimates.assign(MAX_CONFIRMS + 1, -1);
+    vPriorityEstimates.assign(MAX_CONFIRMS + 1, -1);
+    for (unsigned int nBlocks = 1; nBlocks <= MAX_CONFIRMS; nBlocks++) {
+        double dFee = feeStats.Estimate(nBlocks, ESTIMATE_SUFFICIENT_TXS, ESTIMATE_SUCCESS);
+        double dPrevFee = vFeeEstimates[nBlocks - 1];
+        vFeeEstimates[nBlocks] = (dFee >= 0 && (dPrevFee < 0 || dFee < dPrevFee)) ? dFee : dPrevFee;
+
+        double dPriority = priStats.Estimate(nBlocks, ESTIMATE_SUFFICIENT_TXS, ESTIMATE_SUCCESS);
+        double dPrevPriority = vPriorityEstimates[nBlocks - 1];
+        vPriorityEstimates[nBlocks] = (dPriority >= 0 && (dPrevPriority < 0 || dPriority < dPrevPriority)) ? dPriority : dPrevPriority;
+    }
+}
+
+void CFeeEstimator::ProcessTransaction(const uint256 &hash, int nHeight, double dFeeRate, double dPriority)
+{
+    if (dFeeRate < 0 && dPriority < 0)
+        return;
+    CTrackedTx &tracked = mapTracked[hash];
+    tracked.nHeight = nHeight;
+    tracked.dFeeRate = dFeeRate;
+    tracked.dPriority = dPriority;
+    tracked.fResolved = false;
+}
+
+void CFeeEstimator::RemoveTransaction(const uint256 &hash)
+{
+    mapTracked.erase(hash);
+}
+
+void CFeeEstimator::ProcessBlock(int nHeight, const vector<uint256> &vTxHashes)
+{
+    feeStats.Decay(ESTIMATE_DECAY);
+    priStats.Decay(ESTIMATE_DECAY);
+
+    BOOST_FOREACH(const uint256 &hash, vTxHashes) {
+        map<uint256, CTrackedTx>::iterator it = mapTracked.find(hash);
+        if (it == mapTracked.end())
+            continue;
+        const CTrackedTx &tracked = it->second;
+        int nBlocks = nHeight - tracked.nHeight;
+        if (!tracked.fResolved && nBlocks > 0) {
+            if (tracked.dFeeRate >= 0)
+                feeStats.Record(feeStats.FindBucket(tracked.dFeeRate), tracked.dFeeRate, nBlocks);
+            if (tracked.dPriority >= 0)
+                priStats.Record(priStats.FindBucket(tracked.dPriority), tracked.dPriority, nBlocks);
+        }
+        mapTracked.erase(it);
+    }
+
+    // Transactions waiting longer than any target we answer for count as failures right away,
+    // rather than when (or if) they finally leave the pool
+    for (map<uint256, CTrackedTx>::iterator it = mapTracked.begin(); it != mapTracked.end(); ++it) {
+        CTrackedTx &tracked = it->second;
+        if (tracked.fResolved || nHeight - tracked.nHeight < (int)MAX_CONFIRMS)
+            continue;
+        if (tracked.dFeeRate >= 0)
+            feeStats.Record(feeStats.FindBucket(tracked.dFeeRate), tracked.dFeeRate, 0);
+        if (tracked.dPriority >= 0)
+            priStats.Record(priStats.FindBucket(tracked.dPriority), tracked.dPriority, 0);
+        tracked.fResolved = true;
+    }
+
+    UpdateEstimates();
+}
+
+void CFeeEstimator::Write(CAutoFile &fileout) const
+{
+    fileout << feeStats << priStats;
+}
+
+bool CFeeEstimator::Read(CAutoFile &filein)
+{
+    CConfirmStats feeStatsRead, priStatsRead;
+    filein >> feeStatsRead >> priStatsRead;
+    if (!feeStatsRead.IsCompatible(feeStats) || !priStatsRead.IsCompatible(priStats))
+        return false;
+    feeStats = feeStatsRead;
+    priStats = priStatsRead;
+    UpdateEstimates();
+    return true;
+}
+
+double CFeeEstimator::EstimateFee(int nBlocks) const
+{
+    if (nBlocks < 1)
+        return -1;
+    return vFeeEstimates[min(nBlocks, (int)MAX_CONFIRMS)];
+}
+
+double CFeeEstimator::EstimatePriority(int nBlocks) const
+{
+    if (nBlocks < 1)
+        return -1;
+    return vPriorityEstimates[min(nBlocks, (int)MAX_CONFIRMS)];
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_FEEESTIMATOR_H
+#define BITCOIN_FEEESTIMATOR_H
+
+#include <map>
+#include <vector>
+
+#include "serialize.h"
+#include "uint256.h"
+
+/** Confirmation statistics of transactions grouped into buckets by a value (fee rate or priority).
+ *
+ * Each bucket keeps exponentially decayed counts of the transactions that were
+ * resolved (confirmed, or stuck for longer than the longest target tracked) and
+ * of how many of those confirmed within 1, 2, ... nMaxConfirms blocks.
+ */
+class CConfirmStats
+{
+public:
+    // lower bound of every bucket, ascending
+    std::vector<double> vBucketBounds;
+    // per bucket: resolved transactions, and the sum of their values
+    std::vector<double> vTxCount;
+    std::vector<double> vValueSum;
+    // [nBlocks - 1][bucket]: transactions confirmed within nBlocks
+    std::vector<std::vector<double> > vConfirmed;
+
+    void Init(double dMin, double dMax, double dSpacing, unsigned int nMaxConfirms);
+    unsigned int FindBucket(double dValue) const;
+    unsigned int GetMaxConfirms() const { return vConfirmed.size(); }
+    // a transaction in nBucket confirmed after nBlocks, or (nBlocks == 0) did not in time
+    void Record(unsigned int nBucket, double dValue, unsigned int nBlocks);
+    void Decay(double dDecay);
+    // the average value of the cheapest buckets in which at least dSuccess of the transactions
+    // confirmed within nBlocks, or -1 if there is not enough data
+    double Estimate(unsigned int nBlocks, double dSufficientTxs, double dSuccess) const;
+    // whether both have the same buckets and targets
+    bool IsCompatible(const CConfirmStats &other) const;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vBucketBounds);
+        READWRITE(vTxCount);
+        READWRITE(vValueSum);
+        READWRITE(vConfirmed);
+    )
+};
+
+/** Estimates the fee rate and the priority a transaction needs to confirm within a number of blocks,
+ *  from how long the transactions that went through our memory pool took. */
+class CFeeEstimator
+{
+private:
+    struct CTrackedTx
+    {
+        int nHeight;
+        double dFeeRate;
+        double dPriority;
+        bool fResolved;
+    };
+
+    CConfirmStats feeStats;
+    CConfirmStats priStats;
+    std::map<uint256, CTrackedTx> mapTracked;
+    // answers for every target, refreshed with each block
+    std::vector<double> vFeeEstimates;
+    std::vector<double> vPriorityEstimates;
+
+    void UpdateEstimates();
+
+public:
+    static const unsigned int MAX_CONFIRMS = 25;
+
+    CFeeEstimator();
+
+    /** Start tracking a transaction entering the memory pool at nHeight; dFeeRate is in satoshis per 1000 bytes */
+    void ProcessTransaction(const uint256 &hash, int nHeight, double dFeeRate, double dPriority);
+    /** Stop tracking a transaction that left the memory pool without being mined */
+    void RemoveTransaction(const uint256 &hash);
+    /** Record the confirmation of the tracked transactions in a block connected at nHeight */
+    void ProcessBlock(int nHeight, const std::vector<uint256> &vTxHashes);
+
+    /** Fee rate (satoshis per 1000 bytes) needed to confirm within nBlocks, or -1 if unknown */
+    double EstimateFee(int nBlocks) const;
+    /** Priority needed to confirm within nBlocks without fee, or -1 if unknown */
+    double EstimatePriority(int nBlocks) const;
+
+    /** Save the statistics (not the transactions being tracked) */
+    void Write(CAutoFile &fileout) const;
+    /** Load saved statistics; fails, keeping the current ones, if they use another bucket layout */
+    bool Read(CAutoFile &filein);
+};
+
+#endif
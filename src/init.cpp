@@ -87,6 +87,8 @@ bool ShutdownRequested()
 }
 
 static CCoinsViewDB *pcoinsdbview;
+// whether startup got as far as reading fee_estimates.dat, so writing it back keeps what it held
+static bool fFeeEstimatesInitialized = false;
 
 void Shutdown()
 {
@@ -103,6 +105,19 @@ void Shutdown()
         bitdb.Flush(false);
     GenerateBitcoins(false, NULL);
     StopNode();
+    // what validation left queued for the wallet, before its best chain is recorded
+    FlushWalletNotifications();
+    if (GetBoolArg("-persistmempool", true) && IsMempoolLoaded())
+        DumpMempool();
+    if (fFeeEstimatesInitialized)
+    {
+        boost::filesystem::path pathFeeEstimates = GetDataDir() / "fee_estimates.dat";
+        CAutoFile fileout = CAutoFile(fopen(pathFeeEstimates.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileout)
+            mempool.WriteFeeEstimates(fileout);
+        else
+            printf("Failed to write fee estimates to %s\n", pathFeeEstimates.string().c_str());
+    }
     {
         LOCK(cs_main);
         if (pwalletMain)
@@ -111,6 +126,9 @@ void Shutdown()
             pblocktree->Flush();
         if (pcoinsTip)
             pcoinsTip->Flush();
+        // a snapshot taken in the middle of reindexing would not describe a usable index
+        if (pblocktree && pcoinsTip && !fReindex)
+            WriteBlockIndexSnapshot();
         delete pcoinsTip; pcoinsTip = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
@@ -335,6 +353,7 @@ std::string HelpMessage()
 #endif
 #endif
         "  -paytxfee=<amt>        " + _("Fee per KB to add to transactions you send") + "\n" +
+        "  -txconfirmtarget=<n>   " + _("Without -paytxfee, pay the fee estimated to confirm within n blocks (default: 2)") + "\n" +
         "  -mininput=<amt>        " + _("When creating transactions, ignore inputs with value less than this (default: 0.0001)") + "\n" +
 #ifdef QT_GUI
         "  -server                " + _("Accept command line and JSON-RPC commands") + "\n" +
@@ -359,22 +378,36 @@ std::string HelpMessage()
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
 #endif
         "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Set the number of RPC calls that may wait for a thread before new ones are refused (default: 16)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
+        "  -usehd                 " + _("Derive the keys of a new wallet from a seed (default: 1)") + "\n" +
+        "  -keypoolmin=<n>        " + _("Top up the key pool in the background when it has <n> keys left (default: half of -keypool)") + "\n" +
+        "  -walletkdftime=<n>     " + _("Make deriving the key from a new wallet passphrase take about <n> milliseconds (default: 100)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
-        "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
-        "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
+        "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat, or rewrite a damaged wallet.dat.log without its damaged records") + "\n" +
+        "  -walletlog             " + _("Keep the wallet in the append-only file wallet.dat.log, converting wallet.dat on first use; older versions cannot read it. 0 converts it back (default: 0)") + "\n" +
+        "  -checkblocks=<n>       " + _("How many blocks to check in the background after startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
+        "  -addressindex          " + _("Maintain an index of outputs and inputs by address, for the getaddress* calls (default: 0)") + "\n" +
+        "  -spentindex            " + _("Maintain an index of the inputs spending each output, for getspentinfo (default: 0)") + "\n" +
+        "  -prune=<n>             " + strprintf(_("Reduce storage requirements by deleting old block and undo files, keeping their total size around <n> MiB (minimum: %u, default: 0 = disabled). Incompatible with -txindex"), (unsigned int)(MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024)) + "\n" +
+        "  -compressblocks        " + _("Store new blocks compressed in the block files (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
-        "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -par=<n>               " + _("Set the number of script verification, -reindex block file scanning and wallet rescan threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
+        "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes of transactions, evicting the lowest fee rates first (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n" +
+        "  -persistmempool        " + _("Save the memory pool on shutdown and load it on startup (default: 1)") + "\n" +
+        "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the memory pool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n" +
+        "  -limitancestorcount=<n> " + strprintf(_("Do not accept transactions with more than <n> unconfirmed ancestors, itself included (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n" +
+        "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions that would give an unconfirmed ancestor more than <n> descendants, itself included (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n" +
         "  -blockmaxsize=<n>      "   + _("Set maximum block size in bytes (default: 250000)") + "\n" +
         "  -blockprioritysize=<n> "   + _("Set maximum size of high-priority/low-fee transactions in bytes (default: 27000)") + "\n" +
 
@@ -400,6 +433,29 @@ struct CImportingNow
     }
 };
 
+// Checks that used to hold up startup: they run once the node is up, and shut it down on failure
+void ThreadVerifyDB(int nCheckLevel, int nCheckDepth)
+{
+    RenameThread("bitcoin-verifydb");
+
+    if (!CheckBlockIndexSnapshot()) {
+        uiInterface.ThreadSafeMessageBox(_("The block index snapshot does not match the block database. Please restart to reload the block index."),
+                                         "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+    } else if (!VerifyDB(nCheckLevel, nCheckDepth)) {
+        // as when the check ran during startup, offer a rebuild; it can only start with the next run
+        bool fRet = uiInterface.ThreadSafeMessageBox(
+            _("Corrupted block database detected") + ".\n\n" + _("Do you want to rebuild the block database at the next start?"),
+            "", CClientUIInterface::MSG_ERROR | CClientUIInterface::BTN_ABORT);
+        if (fRet) {
+            LOCK(cs_main);
+            pblocktree->WriteFlag("rebuild", true);
+        } else
+            printf("ThreadVerifyDB() : restart with -reindex to rebuild the block database\n");
+        StartShutdown();
+    }
+}
+
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("bitcoin-loadblk");
@@ -407,16 +463,9 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break;
-            printf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
-        }
+        // leave the reindexing flag set on failure, so the next start resumes
+        if (!ReindexBlockFiles(std::max(nScriptCheckThreads, 1)))
+            return;
         pblocktree->WriteReindexing(false);
         fReindex = false;
         printf("Reindexing finished\n");
@@ -446,6 +495,12 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LoadExternalBlockFile(file);
         }
     }
+
+    // mempool.dat, once the chain it was saved against is in place
+    if (GetBoolArg("-persistmempool", true))
+        LoadMempool();
+    else
+        SetMempoolLoaded();
 }
 
 /** Initialize bitcoin.
@@ -510,6 +565,24 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fBloomFilters)
         nLocalServices |= NODE_BLOOM;
 
+    int64 nPruneArg = GetArg("-prune", 0);
+    if (nPruneArg < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    nPruneTarget = (uint64)nPruneArg * 1024 * 1024;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %u MiB. Please use a higher number."), (unsigned int)(MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024)));
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+        fPruneMode = true;
+        // a pruned node can only serve recent blocks
+        nLocalServices &= ~(uint64)NODE_NETWORK;
+        nLocalServices |= NODE_NETWORK_LIMITED;
+        printf("Prune mode enabled, keeping block files under %"PRI64u" MiB\n", nPruneTarget / 1024 / 1024);
+    }
+
+    fCompressBlocks = GetBoolArg("-compressblocks", false);
+
     if (mapArgs.count("-bind")) {
         // when specifying an explicit binding address, you want to listen on it
         // even when -connect or -proxy is specified
@@ -630,6 +703,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         if (nTransactionFee > 0.25 * COIN)
             InitWarning(_("Warning: -paytxfee is set very high! This is the transaction fee you will pay if you send a transaction."));
     }
+    nTxConfirmTarget = GetArg("-txconfirmtarget", DEFAULT_TX_CONFIRM_TARGET);
 
     if (mapArgs.count("-mininput"))
     {
@@ -672,8 +746,10 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     if (nScriptCheckThreads) {
         printf("Using %u threads for script verification\n", nScriptCheckThreads);
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadMempoolScriptCheck);
+        }
     }
 
     int64 nStart;
@@ -707,7 +783,7 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
         }
 
-        if (GetBoolArg("-salvagewallet"))
+        if (GetBoolArg("-salvagewallet") && filesystem::exists(GetDataDir() / "wallet.dat"))
         {
             // Recover readable keypairs:
             if (!CWalletDB::Recover(bitdb, "wallet.dat", true))
@@ -728,6 +804,37 @@ bool AppInit2(boost::thread_group& threadGroup)
             if (r == CDBEnv::RECOVER_FAIL)
                 return InitError(_("wallet.dat corrupt, salvage failed"));
         }
+
+        bool fWalletLogExists = filesystem::exists(CDB::GetLogPath("wallet.dat"));
+        if (GetBoolArg("-walletlog"))
+        {
+            if (!fWalletLogExists && filesystem::exists(GetDataDir() / "wallet.dat") && !CDB::MigrateToLog("wallet.dat"))
+                return InitError(_("Error converting wallet.dat to wallet.dat.log"));
+            if (!bitdb.OpenLog("wallet.dat"))
+                return InitError(_("Error loading wallet.dat.log"));
+            CWalletLog* plog = bitdb.GetLog("wallet.dat");
+            if (plog->IsDamaged())
+            {
+                // the damaged records may hold keys, so they are only dropped when asked to
+                if (GetBoolArg("-salvagewallet"))
+                {
+                    if (!plog->Compact(true))
+                        return InitError(_("wallet.dat.log has damaged records, salvage failed"));
+                    InitWarning(strprintf(_("Warning: wallet.dat.log had damaged records and was rewritten without them."
+                                            " The damaged file was saved as %s; if your balance or transactions are"
+                                            " incorrect you should restore from a backup."), plog->GetQuarantinePath().string().c_str()));
+                }
+                else
+                    InitWarning(strprintf(_("Warning: wallet.dat.log has damaged records, a copy was saved as %s."
+                                            " The wallet cannot be compacted or encrypted until you restart with"
+                                            " -salvagewallet, which rewrites it without them."), plog->GetQuarantinePath().string().c_str()));
+            }
+        }
+        else if (fWalletLogExists && !filesystem::exists(GetDataDir() / "wallet.dat"))
+        {
+            if (!CDB::MigrateFromLog("wallet.dat"))
+                return InitError(_("Error converting wallet.dat.log to wallet.dat"));
+        }
     } // (!fDisableWallet)
 
     // ********************************************************* Step 6: network initialization
@@ -881,7 +988,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nTotalCache < (1 << 22))
         nTotalCache = (1 << 22); // total cache cannot be less than 4 MiB
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false) && !GetBoolArg("-addressindex", false) && !GetBoolArg("-spentindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
@@ -904,6 +1011,15 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+
+                // a rebuild accepted after the background check found the database corrupted
+                bool fRebuild = false;
+                if (!fReindex && pblocktree->ReadFlag("rebuild", fRebuild) && fRebuild) {
+                    printf("Rebuilding the block database as requested\n");
+                    fReindex = true;
+                    delete pblocktree;
+                    pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, true);
+                }
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
 
@@ -932,12 +1048,22 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
-                uiInterface.InitMessage(_("Verifying blocks..."));
-                if (!VerifyDB(GetArg("-checklevel", 3),
-                              GetArg( "-checkblocks", 288))) {
-                    strLoadError = _("Corrupted block database detected");
+                // Check for changed -addressindex or -spentindex state
+                if (fAddressIndex != GetBoolArg("-addressindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addressindex");
                     break;
                 }
+                if (fSpentIndex != GetBoolArg("-spentindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -spentindex");
+                    break;
+                }
+
+                // A pruned block store cannot serve the full chain again without downloading it
+                if (fHavePruned && !fPruneMode) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode. This will redownload the entire blockchain");
+                    break;
+                }
+
             } catch(std::exception &e) {
                 strLoadError = _("Error opening block database");
                 break;
@@ -974,6 +1100,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     printf(" block index %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    boost::filesystem::path pathFeeEstimates = GetDataDir() / "fee_estimates.dat";
+    CAutoFile filein = CAutoFile(fopen(pathFeeEstimates.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    // Allowed to fail as this file IS missing on first startup.
+    if (filein)
+        mempool.ReadFeeEstimates(filein);
+    fFeeEstimatesInitialized = true;
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -1055,6 +1188,10 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         if (fFirstRun)
         {
+            // New wallets derive their keys from a seed, so a backup covers all of them
+            if (GetBoolArg("-usehd", true) && !pwalletMain->SetHDMasterKey(pwalletMain->GenerateNewHDMasterKey()))
+                strErrors << _("Cannot write HD seed") << "\n";
+
             // Create new keyUser and set as default key
             RandAddSeedPerfmon();
 
@@ -1072,6 +1209,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         printf(" wallet      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
         RegisterWallet(pwalletMain);
+        threadGroup.create_thread(&ThreadSyncWithWallets);
 
         CBlockIndex *pindexRescan = pindexBest;
         if (GetBoolArg("-rescan"))
@@ -1085,15 +1223,37 @@ bool AppInit2(boost::thread_group& threadGroup)
             else
                 pindexRescan = pindexGenesisBlock;
         }
+        if (pindexBest && pindexBest != pindexRescan && fHavePruned)
+        {
+            // the rescan needs every block from pindexRescan on to be available
+            CBlockIndex *pindexOldest = pindexBest;
+            while (pindexOldest != pindexRescan && pindexOldest->pprev && (pindexOldest->pprev->nStatus & BLOCK_HAVE_DATA))
+                pindexOldest = pindexOldest->pprev;
+            if (pindexOldest != pindexRescan)
+            {
+                // an explicit -rescan makes do with what is left; a wallet behind the pruned
+                // blocks would miss its own transactions
+                if (!GetBoolArg("-rescan"))
+                    return InitError(strprintf(_("Prune: the wallet was last synchronised at block %d, but blocks before %d are pruned. Restart with -reindex to download the block chain again and rescan it."),
+                                               pindexRescan->nHeight, pindexOldest->nHeight));
+                InitWarning(strprintf(_("Warning: blocks before %d are pruned, so the rescan starts there and may miss older wallet transactions. Use -reindex for a full rescan."),
+                                      pindexOldest->nHeight));
+                pindexRescan = pindexOldest;
+            }
+        }
         if (pindexBest && pindexBest != pindexRescan)
         {
             uiInterface.InitMessage(_("Rescanning..."));
             printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
-            pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+            int nFound = pwalletMain->ScanForWalletTransactions(pindexRescan, true);
             printf(" rescan      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
-            pwalletMain->SetBestChain(CBlockLocator(pindexBest));
-            nWalletDBUpdated++;
+            // an interrupted rescan has to be done again on the next start
+            if (nFound >= 0)
+            {
+                pwalletMain->SetBestChain(CBlockLocator(pindexBest));
+                nWalletDBUpdated++;
+            }
         }
     } // (!fDisableWallet)
 
@@ -1111,6 +1271,7 @@ bool AppInit2(boost::thread_group& threadGroup)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    threadGroup.create_thread(boost::bind(&ThreadVerifyDB, GetArg("-checklevel", 3), GetArg("-checkblocks", 288)));
 
     // ********************************************************* Step 10: load peers
 
@@ -1160,11 +1321,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     uiInterface.InitMessage(_("Done loading"));
 
     if (pwalletMain) {
-        // Add wallet transactions that aren't already in a block to mapTransactions
-        pwalletMain->ReacceptWalletTransactions();
+        // Add wallet transactions that aren't already in a block to mapTransactions,
+        // in the background so a large wallet doesn't hold up startup
+        threadGroup.create_thread(boost::bind(&ThreadReacceptWalletTransactions, pwalletMain));
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Run a thread to keep the key pool filled
+        threadGroup.create_thread(boost::bind(&ThreadTopUpKeyPool, pwalletMain));
     }
 
     return !fRequestShutdown;
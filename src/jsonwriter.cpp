@@ -0,0 +1,487 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonwriter.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+using namespace json_spirit;
+
+static const char *pszHexDigits = "0123456789ABCDEF";
+
+void CJSONWriter::Separate()
+{
+    if (fAfterKey)
+        fAfterKey = false;
+    else if (!vFirst.empty())
+    {
+        if (!vFirst.back())
+            strOut += ',';
+        vFirst.back() = false;
+    }
+}
+
+void CJSONWriter::Quote(const char *psz, size_t nLen)
+{
+    strOut += '"';
+    const char *pend = psz + nLen;
+    while (psz < pend)
+    {
+        // copy runs of plain characters at once
+        const char *pRun = psz;
+        while (psz < pend && *psz >= 0x20 && *psz < 0x7f && *psz != '"' && *psz != '\\')
+            psz++;
+        strOut.append(pRun, psz - pRun);
+        if (psz == pend)
+            break;
+
+        unsigned char c = *psz++;
+        switch (c)
+        {
+        case '"':  strOut += "\\\""; break;
+        case '\\': strOut += "\\\\"; break;
+        case '\b': strOut += "\\b"; break;
+        case '\f': strOut += "\\f"; break;
+        case '\n': strOut += "\\n"; break;
+        case '\r': strOut += "\\r"; break;
+        case '\t': strOut += "\\t"; break;
+        default:
+            // as json_spirit does, bytes outside printable ASCII are escaped one by one
+            strOut += "\\u00";
+            strOut += pszHexDigits[c >> 4];
+            strOut += pszHexDigits[c & 15];
+        }
+    }
+    strOut += '"';
+}
+
+void CJSONWriter::BeginObject()
+{
+    Separate();
+    strOut += '{';
+    vFirst.push_back(true);
+}
+
+void CJSONWriter::EndObject()
+{
+    strOut += '}';
+    vFirst.pop_back();
+}
+
+void CJSONWriter::BeginArray()
+{
+    Separate();
+    strOut += '[';
+    vFirst.push_back(true);
+}
+
+void CJSONWriter::EndArray()
+{
+    strOut += ']';
+    vFirst.pop_back();
+}
+
+CJSONWriter& CJSONWriter::Key(const char *pszKey)
+{
+    Separate();
+    Quote(pszKey, strlen(pszKey));
+    strOut += ':';
+    fAfterKey = true;
+    return *this;
+}
+
+CJSONWriter& CJSONWriter::Key(const string &strKey)
+{
+    Separate();
+    Quote(strKey.data(), strKey.size());
+    strOut += ':';
+    fAfterKey = true;
+    return *this;
+}
+
+void CJSONWriter::String(const string &str)
+{
+    Separate();
+    Quote(str.data(), str.size());
+}
+
+void CJSONWriter::Int(int64_t n)
+{
+    Separate();
+    char buf[24];
+    strOut.append(buf, snprintf(buf, sizeof(buf), "%lld", (long long)n));
+}
+
+void CJSONWriter::UInt(uint64_t n)
+{
+    Separate();
+    char buf[24];
+    strOut.append(buf, snprintf(buf, sizeof(buf), "%llu", (unsigned long long)n));
+}
+
+void CJSONWriter::Real(double d)
+{
+    Separate();
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "%.8f", d);
+    strOut.append(buf, min(n, (int)sizeof(buf) - 1));
+}
+
+void CJSONWriter::Bool(bool f)
+{
+    Separate();
+    strOut += f ? "true" : "false";
+}
+
+void CJSONWriter::Null()
+{
+    Separate();
+    strOut += "null";
+}
+
+void CJSONWriter::Amount(int64_t nAmount)
+{
+    Separate();
+    uint64_t nAbs = nAmount < 0 ? -(uint64_t)nAmount : nAmount;
+    char buf[32];
+    strOut.append(buf, snprintf(buf, sizeof(buf), "%s%llu.%08llu", nAmount < 0 ? "-" : "",
+                                (unsigned long long)(nAbs / 100000000), (unsigned long long)(nAbs % 100000000)));
+}
+
+void CJSONWriter::Write(const Value &value)
+{
+    switch (value.type())
+    {
+    case obj_type:
+    {
+        BeginObject();
+        const Object &obj = value.get_obj();
+        for (Object::const_iterator it = obj.begin(); it != obj.end(); ++it)
+        {
+            Key(it->name_);
+            Write(it->value_);
+        }
+        EndObject();
+        break;
+    }
+    case array_type:
+    {
+        BeginArray();
+        const Array &arr = value.get_array();
+        for (Array::const_iterator it = arr.begin(); it != arr.end(); ++it)
+            Write(*it);
+        EndArray();
+        break;
+    }
+    case str_type:
+        String(value.get_str());
+        break;
+    case bool_type:
+        Bool(value.get_bool());
+        break;
+    case int_type:
+        if (value.is_uint64())
+            UInt(value.get_uint64());
+        else
+            Int(value.get_int64());
+        break;
+    case real_type:
+        Real(value.get_real());
+        break;
+    case null_type:
+        Null();
+        break;
+    }
+}
+
+CJSONWriter::Mark CJSONWriter::GetMark() const
+{
+    Mark mark;
+    mark.nSize = strOut.size();
+    mark.vFirst = vFirst;
+    mark.fAfterKey = fAfterKey;
+    return mark;
+}
+
+void CJSONWriter::Rewind(const Mark &mark)
+{
+    strOut.resize(mark.nSize);
+    vFirst = mark.vFirst;
+    fAfterKey = mark.fAfterKey;
+}
+
+
+// nesting deeper than this is refused, rather than risking the stack
+static const unsigned int MAX_JSON_DEPTH = 512;
+
+class CJSONParser
+{
+public:
+    CJSONParser(const char *pbeginIn, const char *pendIn) : p(pbeginIn), pend(pendIn), nDepth(0) {}
+
+    bool ParseDocument(Value &value)
+    {
+        if (!ParseValue(value))
+            return false;
+        SkipSpace();
+        return p == pend;
+    }
+
+private:
+    const char *p;
+    const char *pend;
+    unsigned int nDepth;
+
+    void SkipSpace()
+    {
+        while (p < pend && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            p++;
+    }
+
+    bool Literal(const char *psz)
+    {
+        size_t nLen = strlen(psz);
+        if ((size_t)(pend - p) < nLen || memcmp(p, psz, nLen) != 0)
+            return false;
+        p += nLen;
+        return true;
+    }
+
+    static int HexValue(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool ParseHex(int nDigits, unsigned int &n)
+    {
+        if (pend - p < nDigits)
+            return false;
+        n = 0;
+        for (int i = 0; i < nDigits; i++)
+        {
+            int nDigit = HexValue(*p++);
+            if (nDigit < 0)
+                return false;
+            n = (n << 4) | nDigit;
+        }
+        return true;
+    }
+
+    bool ParseString(string &str)
+    {
+        // the opening quote has been consumed
+        while (true)
+        {
+            const char *pRun = p;
+            while (p < pend && *p != '"' && *p != '\\')
+                p++;
+            str.append(pRun, p - pRun);
+            if (p == pend)
+                return false;
+            if (*p++ == '"')
+                return true;
+
+            if (p == pend)
+                return false;
+            unsigned int n;
+            switch (*p++)
+            {
+            case '"':  str += '"'; break;
+            case '\\': str += '\\'; break;
+            case '/':  str += '/'; break;
+            case 'b':  str += '\b'; break;
+            case 'f':  str += '\f'; break;
+            case 'n':  str += '\n'; break;
+            case 'r':  str += '\r'; break;
+            case 't':  str += '\t'; break;
+            // as with json_spirit, escapes stand for single bytes, mirroring the writer
+            case 'x':
+                if (!ParseHex(2, n))
+                    return false;
+                str += (char)n;
+                break;
+            case 'u':
+                if (!ParseHex(4, n))
+                    return false;
+                str += (char)n;
+                break;
+            default:
+                return false;
+            }
+        }
+    }
+
+    bool ParseNumber(Value &value)
+    {
+        const char *pbegin = p;
+        bool fReal = false;
+        if (p < pend && *p == '-')
+            p++;
+        if (p == pend || *p < '0' || *p > '9')
+            return false;
+        while (p < pend && *p >= '0' && *p <= '9')
+            p++;
+        if (p < pend && *p == '.')
+        {
+            fReal = true;
+            p++;
+            if (p == pend || *p < '0' || *p > '9')
+                return false;
+            while (p < pend && *p >= '0' && *p <= '9')
+                p++;
+        }
+        if (p < pend && (*p == 'e' || *p == 'E'))
+        {
+            fReal = true;
+            p++;
+            if (p < pend && (*p == '+' || *p == '-'))
+                p++;
+            if (p == pend || *p < '0' || *p > '9')
+                return false;
+            while (p < pend && *p >= '0' && *p <= '9')
+                p++;
+        }
+
+        // strtoll and friends need a terminated string; numbers are short
+        string strNum(pbegin, p);
+        if (!fReal)
+        {
+            errno = 0;
+            long long n = strtoll(strNum.c_str(), NULL, 10);
+            if (errno == 0)
+            {
+                value = Value((boost::int64_t)n);
+                return true;
+            }
+            if (*pbegin != '-')
+            {
+                errno = 0;
+                unsigned long long un = strtoull(strNum.c_str(), NULL, 10);
+                if (errno == 0)
+                {
+                    value = Value((boost::uint64_t)un);
+                    return true;
+                }
+            }
+        }
+        value = Value(strtod(strNum.c_str(), NULL));
+        return true;
+    }
+
+    bool ParseValue(Value &value)
+    {
+        SkipSpace();
+        if (p == pend)
+            return false;
+        switch (*p)
+        {
+        case '{':
+        {
+            if (++nDepth > MAX_JSON_DEPTH)
+                return false;
+            p++;
+            Object obj;
+            SkipSpace();
+            if (p < pend && *p == '}')
+                p++;
+            else while (true)
+            {
+                SkipSpace();
+                if (p == pend || *p++ != '"')
+                    return false;
+                obj.push_back(Pair(string(), Value()));
+                if (!ParseString(obj.back().name_))
+                    return false;
+                SkipSpace();
+                if (p == pend || *p++ != ':')
+                    return false;
+                if (!ParseValue(obj.back().value_))
+                    return false;
+                SkipSpace();
+                if (p == pend)
+                    return false;
+                if (*p == '}')
+                {
+                    p++;
+                    break;
+                }
+                if (*p++ != ',')
+                    return false;
+            }
+            nDepth--;
+            value = obj;
+            return true;
+        }
+        case '[':
+        {
+            if (++nDepth > MAX_JSON_DEPTH)
+                return false;
+            p++;
+            Array arr;
+            SkipSpace();
+            if (p < pend && *p == ']')
+                p++;
+            else while (true)
+            {
+                arr.push_back(Value());
+                if (!ParseValue(arr.back()))
+                    return false;
+                SkipSpace();
+                if (p == pend)
+                    return false;
+                if (*p == ']')
+                {
+                    p++;
+                    break;
+                }
+                if (*p++ != ',')
+                    return false;
+            }
+            nDepth--;
+            value = arr;
+            return true;
+        }
+        case '"':
+        {
+            p++;
+            string str;
+            if (!ParseString(str))
+                return false;
+            value = str;
+            return true;
+        }
+        case 't':
+            if (!Literal("true"))
+                return false;
+            value = true;
+            return true;
+        case 'f':
+            if (!Literal("false"))
+                return false;
+            value = false;
+            return true;
+        case 'n':
+            if (!Literal("null"))
+                return false;
+            value = Value::null;
+            return true;
+        default:
+            return ParseNumber(value);
+        }
+    }
+};
+
+bool ParseJSON(const string &str, Value &value)
+{
+    CJSONParser parser(str.data(), str.data() + str.size());
+    return parser.ParseDocument(value);
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_JSONWRITER_H
+#define BITCOIN_JSONWRITER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "json/json_spirit_value.h"
+
+/** Writes JSON text straight into a string, one event at a time.
+ *
+ * Where building a json_spirit tree allocates a node for every value and
+ * then serializes it through an ostream, the writer appends to the output
+ * buffer as it goes. Separators are inserted automatically: inside an
+ * object, every value must be preceded by Key(). Output matches that of
+ * json_spirit::write_string (compact), except that Amount() writes exact
+ * fixed point numbers.
+ */
+class CJSONWriter
+{
+public:
+    /** Position in the output, to undo everything written after it */
+    class Mark
+    {
+    private:
+        friend class CJSONWriter;
+        size_t nSize;
+        std::vector<bool> vFirst;
+        bool fAfterKey;
+    };
+
+    explicit CJSONWriter(std::string &strOutIn) : strOut(strOutIn), fAfterKey(false) {}
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    CJSONWriter& Key(const char *pszKey);
+    CJSONWriter& Key(const std::string &strKey);
+
+    void String(const std::string &str);
+    void Int(int64_t n);
+    void UInt(uint64_t n);
+    void Real(double d);
+    void Bool(bool f);
+    void Null();
+    /** A number of satoshis, in coins */
+    void Amount(int64_t nAmount);
+    /** Any json_spirit value */
+    void Write(const json_spirit::Value &value);
+
+    Mark GetMark() const;
+    void Rewind(const Mark &mark);
+
+private:
+    std::string &strOut;
+    // per open object or array: whether nothing has been written into it yet
+    std::vector<bool> vFirst;
+    bool fAfterKey;
+
+    void Separate();
+    void Quote(const char *psz, size_t nLen);
+};
+
+/** Parse JSON text into a json_spirit value. Like json_spirit::read_string, any value
+ *  may stand at the top level. Returns false if str is not valid JSON. */
+bool ParseJSON(const std::string &str, json_spirit::Value &value);
+
+#endif
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <openssl/ecdsa.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/obj_mac.h>
 
@@ -256,6 +257,50 @@ public:
     }
 };
 
+// vchSecretOut = vchSecretIn + vchTweak modulo the curve order. Fails if the tweak isn't
+// below the order or the result is zero.
+bool TweakSecret(unsigned char vchSecretOut[32], const unsigned char vchSecretIn[32], const unsigned char vchTweak[32])
+{
+    bool ret = true;
+    BN_CTX *ctx = BN_CTX_new();
+    BN_CTX_start(ctx);
+    BIGNUM *bnSecret = BN_CTX_get(ctx);
+    BIGNUM *bnTweak = BN_CTX_get(ctx);
+    BIGNUM *bnOrder = BN_CTX_get(ctx);
+    EC_GROUP *group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    EC_GROUP_get_order(group, bnOrder, ctx);
+    BN_bin2bn(vchTweak, 32, bnTweak);
+    if (BN_cmp(bnTweak, bnOrder) >= 0)
+        ret = false;
+    BN_bin2bn(vchSecretIn, 32, bnSecret);
+    BN_add(bnSecret, bnSecret, bnTweak);
+    BN_nnmod(bnSecret, bnSecret, bnOrder, ctx);
+    if (BN_is_zero(bnSecret))
+        ret = false;
+    int nBytes = BN_num_bytes(bnSecret);
+    memset(vchSecretOut, 0, 32 - nBytes);
+    BN_bn2bin(bnSecret, &vchSecretOut[32 - nBytes]);
+    EC_GROUP_free(group);
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+    return ret;
+}
+
+// HMAC-SHA512 of (header || data || nChild) keyed with the chain code, as BIP32 defines
+void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64])
+{
+    unsigned char vchData[37];
+    vchData[0] = header;
+    memcpy(&vchData[1], data, 32);
+    vchData[33] = (nChild >> 24) & 0xFF;
+    vchData[34] = (nChild >> 16) & 0xFF;
+    vchData[35] = (nChild >>  8) & 0xFF;
+    vchData[36] = (nChild >>  0) & 0xFF;
+    unsigned int nLen = 64;
+    HMAC(EVP_sha512(), chainCode, 32, vchData, sizeof(vchData), output, &nLen);
+    OPENSSL_cleanse(vchData, sizeof(vchData));
+}
+
 }; // end of anonymous namespace
 
 bool CKey::Check(const unsigned char *vch) {
@@ -340,6 +385,45 @@ bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig)
     return true;
 }
 
+bool CKey::Derive(CKey& keyChild, unsigned char ccChild[32], unsigned int nChild, const unsigned char cc[32]) const {
+    assert(fValid);
+    unsigned char out[64];
+    LockObject(out);
+    if (nChild < BIP32_HARDENED_KEY_LIMIT) {
+        // normal children hash the compressed public key
+        CECKey key;
+        key.SetSecretBytes(vch);
+        CPubKey pubkey;
+        key.GetPubKey(pubkey, true);
+        assert(pubkey.size() == 33);
+        BIP32Hash(cc, nChild, *pubkey.begin(), pubkey.begin()+1, out);
+    } else {
+        BIP32Hash(cc, nChild, 0, vch, out);
+    }
+    memcpy(ccChild, out+32, 32);
+    keyChild.fValid = TweakSecret(keyChild.vch, vch, out);
+    keyChild.fCompressed = true;
+    OPENSSL_cleanse(out, sizeof(out));
+    UnlockObject(out);
+    return keyChild.fValid;
+}
+
+void CExtKey::SetMaster(const unsigned char *seed, unsigned int nSeedLen) {
+    static const char hashkey[] = {'B','i','t','c','o','i','n',' ','s','e','e','d'};
+    unsigned char out[64];
+    LockObject(out);
+    unsigned int nLen = 64;
+    HMAC(EVP_sha512(), hashkey, sizeof(hashkey), seed, nSeedLen, out, &nLen);
+    key.Set(&out[0], &out[32], true);
+    memcpy(vchChainCode, &out[32], 32);
+    OPENSSL_cleanse(out, sizeof(out));
+    UnlockObject(out);
+}
+
+bool CExtKey::Derive(CExtKey &out, unsigned int nChild) const {
+    return key.Derive(out.key, out.vchChainCode, nChild, vchChainCode);
+}
+
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
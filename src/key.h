@@ -251,6 +251,23 @@ public:
     //                  0x1D = second key with even y, 0x1E = second key with odd y,
     //                  add 0x04 for compressed keys.
     bool SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig) const;
+
+    // Derive the BIP32 child key nChild, given this key's chain code cc.
+    bool Derive(CKey& keyChild, unsigned char ccChild[32], unsigned int nChild, const unsigned char cc[32]) const;
+};
+
+// BIP32 child numbers from here on are hardened: derived from the private key
+static const unsigned int BIP32_HARDENED_KEY_LIMIT = 0x80000000;
+
+/** A BIP32 extended private key: a private key with its chain code. */
+struct CExtKey {
+    unsigned char vchChainCode[32];
+    CKey key;
+
+    // Make the master key of the chain generated from a seed.
+    void SetMaster(const unsigned char *seed, unsigned int nSeedLen);
+
+    bool Derive(CExtKey &out, unsigned int nChild) const;
 };
 
 #endif
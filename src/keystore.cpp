@@ -51,6 +51,14 @@ bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut)
     return false;
 }
 
+void CBasicKeyStore::GetCScriptIDs(std::set<CScriptID> &setScriptIDs) const
+{
+    setScriptIDs.clear();
+    LOCK(cs_KeyStore);
+    for (ScriptMap::const_iterator mi = mapScripts.begin(); mi != mapScripts.end(); ++mi)
+        setScriptIDs.insert((*mi).first);
+}
+
 bool CCryptoKeyStore::SetCrypted()
 {
     LOCK(cs_KeyStore);
@@ -70,6 +78,7 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        mapKeyCache.clear();
     }
 
     NotifyStatusChanged(this);
@@ -100,6 +109,7 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
             return false;
         }
         vMasterKey = vMasterKeyIn;
+        mapKeyCache.clear();
     }
     NotifyStatusChanged(this);
     return true;
@@ -146,6 +156,15 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
         if (!IsCrypted())
             return CBasicKeyStore::GetKey(address, keyOut);
 
+        if (IsLocked())
+            return false;
+        std::map<CKeyID, CKey>::const_iterator it = mapKeyCache.find(address);
+        if (it != mapKeyCache.end())
+        {
+            keyOut = (*it).second;
+            return true;
+        }
+
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
         {
@@ -157,12 +176,38 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
             if (vchSecret.size() != 32)
                 return false;
             keyOut.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+            mapKeyCache[address] = keyOut;
             return true;
         }
     }
     return false;
 }
 
+bool CCryptoKeyStore::CacheKeys(const std::set<CKeyID> &setAddress) const
+{
+    LOCK(cs_KeyStore);
+    if (!IsCrypted())
+        return true;
+    if (IsLocked())
+        return false;
+
+    CSecretDecrypter decrypter(vMasterKey);
+    BOOST_FOREACH(const CKeyID &address, setAddress)
+    {
+        if (mapKeyCache.count(address))
+            continue;
+        CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
+        if (mi == mapCryptedKeys.end())
+            continue;
+        const CPubKey &vchPubKey = (*mi).second.first;
+        CKeyingMaterial vchSecret;
+        if (!decrypter.Decrypt((*mi).second.second, vchPubKey.GetHash(), vchSecret) || vchSecret.size() != 32)
+            return false;
+        mapKeyCache[address].Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+    }
+    return true;
+}
+
 bool CCryptoKeyStore::GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const
 {
     {
@@ -70,6 +70,7 @@ public:
             }
         }
     }
+    void GetCScriptIDs(std::set<CScriptID> &setScriptIDs) const;
     bool GetKey(const CKeyID &address, CKey &keyOut) const
     {
         {
@@ -100,6 +101,10 @@ private:
 
     CKeyingMaterial vMasterKey;
 
+    // keys decrypted since the wallet was unlocked, dropped by Lock(); CKey keeps
+    // its secret in locked memory
+    mutable std::map<CKeyID, CKey> mapKeyCache;
+
     // if fUseCrypto is true, mapKeys must be empty
     // if fUseCrypto is false, vMasterKey must be empty
     bool fUseCrypto;
@@ -149,6 +154,8 @@ public:
         return false;
     }
     bool GetKey(const CKeyID &address, CKey& keyOut) const;
+    // decrypt the keys of setAddress that GetKey would have to, all under one cipher context
+    bool CacheKeys(const std::set<CKeyID> &setAddress) const;
     bool GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const;
     void GetKeys(std::set<CKeyID> &setAddress) const
     {
@@ -0,0 +1,140 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lzcompress.h"
+
+#include <string.h>
+#include <stdint.h>
+
+using namespace std;
+
+static const int HASH_LOG = 12;
+static const unsigned int NO_POS = (unsigned int)(-1);
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+// the format requires the last 5 bytes to be literals, and the last match to start 12 bytes before the end
+static const size_t LAST_LITERALS = 5;
+static const size_t MATCH_FIND_LIMIT = 12;
+
+static inline uint32_t Read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned int HashPrefix(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static void PutLength(vector<unsigned char> &vOut, size_t n)
+{
+    while (n >= 255) {
+        vOut.push_back(255);
+        n -= 255;
+    }
+    vOut.push_back((unsigned char)n);
+}
+
+static void PutLiterals(vector<unsigned char> &vOut, const unsigned char *p, size_t nLiterals, unsigned char nMatchCode)
+{
+    vOut.push_back((unsigned char)(((nLiterals < 15 ? nLiterals : 15) << 4) | nMatchCode));
+    if (nLiterals >= 15)
+        PutLength(vOut, nLiterals - 15);
+    vOut.insert(vOut.end(), p, p + nLiterals);
+}
+
+void LZCompress(const unsigned char *pIn, size_t nIn, vector<unsigned char> &vOut)
+{
+    vOut.clear();
+    vOut.reserve(nIn + nIn / 255 + 16);
+
+    size_t nAnchor = 0;
+    if (nIn > MATCH_FIND_LIMIT) {
+        vector<unsigned int> vTable(1 << HASH_LOG, NO_POS);
+        const size_t nMatchLimit = nIn - LAST_LITERALS;
+        const size_t nFindLimit = nIn - MATCH_FIND_LIMIT;
+        size_t i = 0;
+        while (i < nFindLimit) {
+            uint32_t v = Read32(pIn + i);
+            unsigned int h = HashPrefix(v);
+            size_t nRef = vTable[h];
+            vTable[h] = (unsigned int)i;
+            if (nRef == NO_POS || i - nRef > MAX_OFFSET || Read32(pIn + nRef) != v) {
+                i++;
+                continue;
+            }
+
+            size_t nMatch = MIN_MATCH;
+            while (i + nMatch < nMatchLimit && pIn[nRef + nMatch] == pIn[i + nMatch])
+                nMatch++;
+
+            size_t nMatchCode = nMatch - MIN_MATCH;
+            PutLiterals(vOut, pIn + nAnchor, i - nAnchor, (unsigned char)(nMatchCode < 15 ? nMatchCode : 15));
+            size_t nOffset = i - nRef;
+            vOut.push_back((unsigned char)(nOffset & 0xff));
+            vOut.push_back((unsigned char)(nOffset >> 8));
+            if (nMatchCode >= 15)
+                PutLength(vOut, nMatchCode - 15);
+
+            i += nMatch;
+            nAnchor = i;
+        }
+    }
+    PutLiterals(vOut, pIn + nAnchor, nIn - nAnchor, 0);
+}
+
+static bool GetLength(const unsigned char *pIn, size_t nIn, size_t &nPos, size_t &n)
+{
+    unsigned char b;
+    do {
+        if (nPos >= nIn)
+            return false;
+        b = pIn[nPos++];
+        n += b;
+    } while (b == 255);
+    return true;
+}
+
+bool LZDecompress(const unsigned char *pIn, size_t nIn, unsigned char *pOut, size_t nOut)
+{
+    size_t nPos = 0, nOutPos = 0;
+    while (nPos < nIn) {
+        unsigned char token = pIn[nPos++];
+
+        size_t nLiterals = token >> 4;
+        if (nLiterals == 15 && !GetLength(pIn, nIn, nPos, nLiterals))
+            return false;
+        if (nLiterals > nIn - nPos || nLiterals > nOut - nOutPos)
+            return false;
+        memcpy(pOut + nOutPos, pIn + nPos, nLiterals);
+        nPos += nLiterals;
+        nOutPos += nLiterals;
+
+        // the last sequence consists of literals only
+        if (nPos == nIn)
+            break;
+
+        if (nIn - nPos < 2)
+            return false;
+        size_t nOffset = pIn[nPos] | ((size_t)pIn[nPos + 1] << 8);
+        nPos += 2;
+        if (nOffset == 0 || nOffset > nOutPos)
+            return false;
+
+        size_t nMatch = token & 15;
+        if (nMatch == 15 && !GetLength(pIn, nIn, nPos, nMatch))
+            return false;
+        nMatch += MIN_MATCH;
+        if (nMatch > nOut - nOutPos)
+            return false;
+        // copy byte by byte, as the match may overlap the bytes it produces
+        const unsigned char *pMatch = pOut + nOutPos - nOffset;
+        for (size_t i = 0; i < nMatch; i++)
+            pOut[nOutPos + i] = pMatch[i];
+        nOutPos += nMatch;
+    }
+    return nOutPos == nOut;
+}
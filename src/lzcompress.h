@@ -0,0 +1,26 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_LZCOMPRESS_H
+#define BITCOIN_LZCOMPRESS_H
+
+#include <stddef.h>
+#include <vector>
+
+/** Fast LZ77 compression in the LZ4 block format.
+ *
+ * Matches are found through a small hash table of 4-byte prefixes within a
+ * 64 KiB window, and encoded as (literal run, offset, match length) sequences.
+ * There is no entropy coding stage: the point is to cut I/O at a CPU cost far
+ * below that of reading the saved bytes from disk. The uncompressed size is not
+ * part of the output; callers store it alongside.
+ */
+
+/** Compress nIn bytes at pIn into vOut (replacing its contents) */
+void LZCompress(const unsigned char *pIn, size_t nIn, std::vector<unsigned char> &vOut);
+
+/** Decompress nIn bytes at pIn into exactly nOut bytes at pOut.
+ *  Returns false if the input is malformed or does not expand to nOut bytes. */
+bool LZDecompress(const unsigned char *pIn, size_t nIn, unsigned char *pOut, size_t nOut);
+
+#endif
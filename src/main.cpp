@@ -12,12 +12,14 @@
 #include "ui_interface.h"
 #include "checkqueue.h"
 #include "checkpointsync.h"
+#include "lzcompress.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include <algorithm>
+#include <deque>
 #include <boost/assign/list_of.hpp>
 
 using namespace std;
@@ -53,6 +55,19 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
+bool fPruneMode = false;
+bool fHavePruned = false;
+uint64 nPruneTarget = 0;
+bool fCompressBlocks = false;
+// set when a block file was finished, so the next flush checks the prune target
+static bool fCheckForPruning = false;
+// With pruning, the info of the files before nLastBlockFile and their total size are kept in
+// memory (guarded by cs_LastBlockFile), loaded by the first PruneBlockFiles
+static vector<CBlockFileInfo> vinfoBlockFile;
+static uint64 nBlockFileUsage = 0;
+static bool fBlockFileInfoLoaded = false;
 int RequestedMasterNodeList = 0;
 unsigned int nCoinCacheSize = 5000;
 
@@ -74,8 +89,8 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+map<uint256, COrphanTx> mapOrphanTransactions;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -87,6 +102,7 @@ int64 nHPSTimerStart = 0;
 
 // Settings
 int64 nTransactionFee = 0;
+unsigned int nTxConfirmTarget = DEFAULT_TX_CONFIRM_TARGET;
 int64 nMinimumInputValue = DUST_HARD_LIMIT;
 
 
@@ -123,32 +139,258 @@ bool static GetTransaction(const uint256& hashTx, CWalletTx& wtx)
     return false;
 }
 
+// Wallet notifications. Validation only queues them; ThreadSyncWithWallets applies them
+// in the order they were queued, so a wallet never waits for cs_main to look through a
+// transaction that isn't its own and validation never waits for a wallet's disk.
+// Notifications are applied one at a time from the head of the queue, under
+// mutexWalletApply. The wallet thread only tries the locks a notification needs and
+// backs off if one is busy, so it never holds up whoever waits for mutexWalletApply;
+// applying a notification again after a partial attempt does no harm. Once the queue
+// is full, validation applies the oldest notifications itself rather than let it grow.
+// Until the thread runs (and in the unit tests) notifications are applied on the spot.
+struct CWalletNotification
+{
+    enum { TRANSACTION, BLOCK, DISCONNECTED, ERASE, BESTCHAIN, UPDATED };
+
+    int nKind;
+    uint256 hash;
+    CTransaction tx;
+    boost::shared_ptr<const CBlock> pblock;
+    bool fUpdate;
+    CBlockLocator locator;
+
+    CWalletNotification(int nKindIn, const uint256& hashIn) : nKind(nKindIn), hash(hashIn), fUpdate(false) {}
+};
+
+// Blocks, each a full copy, and notifications in all the queue holds at most
+static const unsigned int WALLET_NOTIFY_MAX_BLOCKS = 16;
+static const unsigned int WALLET_NOTIFY_MAX_QUEUED = 10000;
+
+static boost::mutex mutexWalletApply;  // held while applying the head of the queue; taken before mutexWalletNotify
+static boost::mutex mutexWalletNotify;
+static boost::condition_variable condWalletNotify;     // something was queued
+static boost::condition_variable condWalletNotifyDone; // something was applied
+static std::deque<CWalletNotification> dequeWalletNotify;
+static unsigned int nWalletNotifyBlocks = 0;
+static uint64 nWalletNotifyQueued = 0;
+static uint64 nWalletNotifyDone = 0;
+static bool fWalletNotifyThread = false;
+
+// Add or update the transaction in pwallet, if it's the wallet's. With fTry, the locks are
+// only tried, and false returned if one is busy.
+static bool SyncTransaction(CWallet* pwallet, const uint256& hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate, bool fTry)
+{
+    // most transactions aren't, and finding that out only needs the wallet
+    {
+        CCriticalBlock lockWallet(pwallet->cs_wallet, "pwallet->cs_wallet", __FILE__, __LINE__, fTry);
+        if (!lockWallet)
+            return false;
+        if (!pwallet->mapWallet.count(hash) && !pwallet->IsMine(tx) && !pwallet->IsFromMe(tx))
+        {
+            pwallet->WalletUpdateSpent(tx);
+            return true;
+        }
+    }
+    CCriticalBlock lockMain(cs_main, "cs_main", __FILE__, __LINE__, fTry);
+    if (!lockMain)
+        return false;
+    CCriticalBlock lockWallet(pwallet->cs_wallet, "pwallet->cs_wallet", __FILE__, __LINE__, fTry);
+    if (!lockWallet)
+        return false;
+    pwallet->AddToWalletIfInvolvingMe(hash, tx, pblock, fUpdate);
+    return true;
+}
+
+static bool ApplyWalletNotification(const CWalletNotification& notification, bool fTry)
+{
+    set<CWallet*> setpwallet;
+    {
+        LOCK(cs_setpwalletRegistered);
+        setpwallet = setpwalletRegistered;
+    }
+    BOOST_FOREACH(CWallet* pwallet, setpwallet)
+    {
+        switch (notification.nKind)
+        {
+        case CWalletNotification::TRANSACTION:
+            if (!SyncTransaction(pwallet, notification.hash, notification.tx, notification.pblock.get(), notification.fUpdate, fTry))
+                return false;
+            break;
+        case CWalletNotification::BLOCK:
+            for (unsigned int i = 0; i < notification.pblock->vtx.size(); i++)
+                if (!SyncTransaction(pwallet, notification.pblock->GetTxHash(i), notification.pblock->vtx[i], notification.pblock.get(), true, fTry))
+                    return false;
+            break;
+        default:
+        {
+            CCriticalBlock lockWallet(pwallet->cs_wallet, "pwallet->cs_wallet", __FILE__, __LINE__, fTry);
+            if (!lockWallet)
+                return false;
+            if (notification.nKind == CWalletNotification::ERASE)
+                pwallet->EraseFromWallet(notification.hash);
+            else if (notification.nKind == CWalletNotification::DISCONNECTED)
+                pwallet->BlockDisconnected(notification.hash);
+            else if (notification.nKind == CWalletNotification::BESTCHAIN)
+                pwallet->SetBestChain(notification.locator);
+            else
+                pwallet->UpdatedTransaction(notification.hash);
+            break;
+        }
+        }
+    }
+    return true;
+}
+
+// Apply the notification at the head of the queue. Returns false if the queue is empty
+// or, with fTry, a lock it needs is busy.
+static bool ApplyHeadWalletNotification(bool fTry)
+{
+    boost::mutex::scoped_lock lockApply(mutexWalletApply);
+    const CWalletNotification* pnotification;
+    {
+        boost::mutex::scoped_lock lock(mutexWalletNotify);
+        if (dequeWalletNotify.empty())
+            return false;
+        // only the holder of mutexWalletApply pops, and pushing leaves references valid
+        pnotification = &dequeWalletNotify.front();
+    }
+
+    try
+    {
+        if (!ApplyWalletNotification(*pnotification, fTry))
+            return false;
+    }
+    catch (std::exception& e)
+    {
+        PrintExceptionContinue(&e, "ApplyHeadWalletNotification()");
+    }
+
+    boost::mutex::scoped_lock lock(mutexWalletNotify);
+    if (pnotification->nKind == CWalletNotification::BLOCK)
+        nWalletNotifyBlocks--;
+    dequeWalletNotify.pop_front();
+    nWalletNotifyDone++;
+    condWalletNotifyDone.notify_all();
+    return true;
+}
+
+// queue the notification, or apply it right away when there is no thread to do it
+static void NotifyWallets(const CWalletNotification& notification)
+{
+    bool fQueued = false;
+    bool fFull = false;
+    {
+        boost::mutex::scoped_lock lock(mutexWalletNotify);
+        if (fWalletNotifyThread)
+        {
+            dequeWalletNotify.push_back(notification);
+            if (notification.nKind == CWalletNotification::BLOCK)
+                nWalletNotifyBlocks++;
+            nWalletNotifyQueued++;
+            condWalletNotify.notify_one();
+            fQueued = true;
+            fFull = nWalletNotifyBlocks > WALLET_NOTIFY_MAX_BLOCKS || dequeWalletNotify.size() > WALLET_NOTIFY_MAX_QUEUED;
+        }
+    }
+    if (!fQueued)
+    {
+        ApplyWalletNotification(notification, false);
+        return;
+    }
+
+    // the wallet thread fell behind: catch up here, in order, instead of queueing more
+    while (fFull && ApplyHeadWalletNotification(false))
+    {
+        boost::mutex::scoped_lock lock(mutexWalletNotify);
+        fFull = nWalletNotifyBlocks > WALLET_NOTIFY_MAX_BLOCKS || dequeWalletNotify.size() > WALLET_NOTIFY_MAX_QUEUED;
+    }
+}
+
+void ThreadSyncWithWallets()
+{
+    RenameThread("bitcoin-wallet-sync");
+    {
+        boost::mutex::scoped_lock lock(mutexWalletNotify);
+        fWalletNotifyThread = true;
+    }
+
+    while (true)
+    {
+        {
+            boost::mutex::scoped_lock lock(mutexWalletNotify);
+            while (dequeWalletNotify.empty())
+                condWalletNotify.wait(lock);
+        }
+        if (!ApplyHeadWalletNotification(true))
+            MilliSleep(10);
+    }
+}
+
+bool WaitForWallets(int64 nTimeout)
+{
+    boost::mutex::scoped_lock lock(mutexWalletNotify);
+    uint64 nWaitFor = nWalletNotifyQueued;
+    boost::system_time timeEnd = boost::get_system_time() + boost::posix_time::milliseconds(nTimeout);
+    while (nWalletNotifyDone < nWaitFor)
+        if (!condWalletNotifyDone.timed_wait(lock, timeEnd))
+            return nWalletNotifyDone >= nWaitFor;
+    return true;
+}
+
+void FlushWalletNotifications()
+{
+    while (ApplyHeadWalletNotification(false))
+        ;
+}
+
 // erases transaction with the given hash from all wallets
 void static EraseFromWallets(uint256 hash)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->EraseFromWallet(hash);
+    NotifyWallets(CWalletNotification(CWalletNotification::ERASE, hash));
 }
 
 // make sure all wallets know about the given transaction, in the given block
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->AddToWalletIfInvolvingMe(hash, tx, pblock, fUpdate);
+    CWalletNotification notification(CWalletNotification::TRANSACTION, hash);
+    notification.tx = tx;
+    if (pblock)
+        notification.pblock.reset(new CBlock(*pblock));
+    notification.fUpdate = fUpdate;
+    NotifyWallets(notification);
+}
+
+// make sure all wallets know about the transactions of a block just connected
+void static SyncBlockWithWallets(const CBlock& block, const uint256& hash)
+{
+    {
+        LOCK(cs_setpwalletRegistered);
+        if (setpwalletRegistered.empty())
+            return;
+    }
+    CWalletNotification notification(CWalletNotification::BLOCK, hash);
+    notification.pblock.reset(new CBlock(block));
+    NotifyWallets(notification);
+}
+
+// tell all wallets that a block left the main chain
+void static SyncDisconnectWithWallets(const uint256& hash)
+{
+    NotifyWallets(CWalletNotification(CWalletNotification::DISCONNECTED, hash));
 }
 
 // notify wallets about a new best chain
 void static SetBestChain(const CBlockLocator& loc)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->SetBestChain(loc);
+    CWalletNotification notification(CWalletNotification::BESTCHAIN, 0);
+    notification.locator = loc;
+    NotifyWallets(notification);
 }
 
 // notify wallets about an updated transaction
 void static UpdatedTransaction(const uint256& hashTx)
 {
-    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-        pwallet->UpdatedTransaction(hashTx);
+    NotifyWallets(CWalletNotification(CWalletNotification::UPDATED, hashTx));
 }
 
 // dump all wallets
@@ -178,6 +420,50 @@ void static ResendWalletTransactions()
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// CCoinsCommitment
+//
+
+// Serialization of a single unspent output as committed to by the rolling hash
+static void SerializeCommittedOutput(CDataStream &ss, const uint256 &txid, unsigned int n, const CCoins &coins)
+{
+    ss << txid;
+    ss << VARINT(n);
+    ss << VARINT(coins.nHeight*2+(coins.fCoinBase ? 1 : 0));
+    ss << coins.vout[n];
+}
+
+void CCoinsCommitment::AddOutput(const uint256 &txid, unsigned int n, const CCoins &coins)
+{
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    SerializeCommittedOutput(ss, txid, n, coins);
+    muhash.Insert(std::vector<unsigned char>(ss.begin(), ss.end()));
+    nTransactionOutputs++;
+    nSerializedSize += ss.size();
+    nTotalAmount += coins.vout[n].nValue;
+}
+
+void CCoinsCommitment::RemoveOutput(const uint256 &txid, unsigned int n, const CCoins &coins)
+{
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    SerializeCommittedOutput(ss, txid, n, coins);
+    muhash.Remove(std::vector<unsigned char>(ss.begin(), ss.end()));
+    nTransactionOutputs--;
+    nSerializedSize -= ss.size();
+    nTotalAmount -= coins.vout[n].nValue;
+}
+
+void CCoinsCommitment::GetStats(CCoinsStats &stats) const
+{
+    stats.nTransactions = nTransactions;
+    stats.nTransactionOutputs = nTransactionOutputs;
+    stats.nSerializedSize = nSerializedSize;
+    stats.hashSerialized = muhash.GetHash();
+    stats.nTotalAmount = nTotalAmount;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CCoinsView implementations
@@ -188,8 +474,9 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsCommitment *pcommit) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
+bool CCoinsView::GetCommitment(CCoinsCommitment &commit) { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView &viewIn) : base(&viewIn) { }
@@ -199,10 +486,11 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsCommitment *pcommit) { return base->BatchWrite(mapCoins, pindex, pcommit); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
+bool CCoinsViewBacked::GetCommitment(CCoinsCommitment &commit) { return base->GetCommitment(commit); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), fHaveCommitment(false) { }
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
     if (cacheCoins.count(txid)) {
@@ -254,15 +542,42 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
+bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsCommitment *pcommit) {
     for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
         cacheCoins[it->first] = it->second;
     pindexTip = pindex;
+    if (pcommit) {
+        commitment = *pcommit;
+        fHaveCommitment = true;
+    }
+    return true;
+}
+
+CCoinsCommitment *CCoinsViewCache::GetCommitment() {
+    if (!fHaveCommitment)
+        fHaveCommitment = base->GetCommitment(commitment);
+    return fHaveCommitment ? &commitment : NULL;
+}
+
+bool CCoinsViewCache::GetCommitment(CCoinsCommitment &commit) {
+    if (GetCommitment() == NULL)
+        return false;
+    commit = commitment;
+    return true;
+}
+
+bool CCoinsViewCache::GetStats(CCoinsStats &stats) {
+    CBlockIndex *pindex = GetBestBlock();
+    if (pindex == NULL || GetCommitment() == NULL)
+        return base->GetStats(stats);
+    stats.nHeight = pindex->nHeight;
+    stats.hashBlock = pindex->GetBlockHash();
+    commitment.GetStats(stats);
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
-    bool fOk = base->BatchWrite(cacheCoins, pindexTip);
+    bool fOk = base->BatchWrite(cacheCoins, pindexTip, fHaveCommitment ? &commitment : NULL);
     if (fOk)
         cacheCoins.clear();
     return fOk;
@@ -299,19 +614,55 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+// Orphan bytes held for each peer, and its orphans by expiry time (so oldest first)
+struct COrphanPeer
+{
+    unsigned int nBytes;
+    set<pair<int64, uint256> > setOrphans;
+
+    COrphanPeer() : nBytes(0) {}
+};
+static map<NodeId, COrphanPeer> mapOrphanPeers;
+static unsigned int nOrphanBytes = 0;
+
+void static EraseOrphanTx(uint256 hash)
+{
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
+        return;
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+    {
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
+    }
+
+    COrphanPeer& peer = mapOrphanPeers[orphan.fromPeer];
+    peer.nBytes -= orphan.nTxSize;
+    peer.setOrphans.erase(make_pair(orphan.nTimeExpire, hash));
+    if (peer.setOrphans.empty())
+        mapOrphanPeers.erase(orphan.fromPeer);
+    nOrphanBytes -= orphan.nTxSize;
+
+    mapOrphanTransactions.erase(it);
+}
+
+bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
-    // Ignore big transactions, to avoid af
+    // Ignore big transactions, to avoid a
     // send-big-orphans memory exhaustion attack. If a peer has a legitimate
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The pool as a whole is further bounded by MAX_ORPHAN_POOL_SIZE bytes.
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
     if (sz > 5000)
     {
@@ -319,45 +670,88 @@ bool AddOrphanTx(const CTransaction& tx)
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
+    int64 nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    mapOrphanTransactions[hash] = COrphanTx(tx, peer, nTimeExpire, sz);
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    COrphanPeer& orphanPeer = mapOrphanPeers[peer];
+    orphanPeer.nBytes += sz;
+    orphanPeer.setOrphans.insert(make_pair(nTimeExpire, hash));
+    nOrphanBytes += sz;
+
+    // A single peer only gets its share of the pool: make room among its own other orphans.
+    // Those entered in the same second expire at the same time, so the new one may sort first.
+    while (orphanPeer.nBytes > MAX_ORPHAN_POOL_SIZE_PER_PEER && orphanPeer.setOrphans.size() > 1)
+    {
+        set<pair<int64, uint256> >::const_iterator it = orphanPeer.setOrphans.begin();
+        if (it->second == hash)
+            ++it;
+        EraseOrphanTx(it->second);
+    }
 
-    printf("stored orphan tx %s (mapsz %"PRIszu")\n", hash.ToString().c_str(),
-        mapOrphanTransactions.size());
+    printf("stored orphan tx %s (mapsz %"PRIszu", %u bytes)\n", hash.ToString().c_str(),
+        mapOrphanTransactions.size(), nOrphanBytes);
     return true;
 }
 
-void static EraseOrphanTx(uint256 hash)
+void EraseOrphansFor(NodeId peer)
 {
-    if (!mapOrphanTransactions.count(hash))
+    map<NodeId, COrphanPeer>::iterator mi = mapOrphanPeers.find(peer);
+    if (mi == mapOrphanPeers.end())
         return;
-    const CTransaction& tx = mapOrphanTransactions[hash];
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-    {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
-    }
-    mapOrphanTransactions.erase(hash);
+    vector<uint256> vErase;
+    for (set<pair<int64, uint256> >::const_iterator it = mi->second.setOrphans.begin(); it != mi->second.setOrphans.end(); ++it)
+        vErase.push_back(it->second);
+    BOOST_FOREACH(const uint256& hash, vErase)
+        EraseOrphanTx(hash);
+    printf("Erased %u orphan tx from peer %d\n", (unsigned int)vErase.size(), peer);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+
+    // Drop the expired orphans; each peer's are sorted by expiry, so only the front is looked at
+    int64 nNow = GetTime();
+    vector<uint256> vExpired;
+    for (map<NodeId, COrphanPeer>::const_iterator mi = mapOrphanPeers.begin(); mi != mapOrphanPeers.end(); ++mi)
+        for (set<pair<int64, uint256> >::const_iterator it = mi->second.setOrphans.begin();
+             it != mi->second.setOrphans.end() && it->first <= nNow; ++it)
+            vExpired.push_back(it->second);
+    BOOST_FOREACH(const uint256& hash, vExpired)
+        EraseOrphanTx(hash);
+    nEvicted += vExpired.size();
+
+    // Then evict the oldest orphans of the peer holding the most bytes, which is
+    // whoever is flooding us rather than the peers sending the odd orphan
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanBytes > nMaxBytes)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        map<NodeId, COrphanPeer>::const_iterator miLargest = mapOrphanPeers.begin();
+        for (map<NodeId, COrphanPeer>::const_iterator mi = mapOrphanPeers.begin(); mi != mapOrphanPeers.end(); ++mi)
+            if (mi->second.nBytes > miLargest->second.nBytes)
+                miLargest = mi;
+        EraseOrphanTx(miLargest->second.setOrphans.begin()->second);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+// Collect the orphans spending any output of vParents, each once
+void static GetOrphanChildren(const vector<uint256>& vParents, vector<CTransaction>& vChildren)
+{
+    set<uint256> setSeen;
+    BOOST_FOREACH(const uint256& hashParent, vParents)
+    {
+        for (map<COutPoint, set<uint256> >::const_iterator mi = mapOrphanTransactionsByPrev.lower_bound(COutPoint(hashParent, 0));
+             mi != mapOrphanTransactionsByPrev.end() && mi->first.hash == hashParent; ++mi)
+        {
+            BOOST_FOREACH(const uint256& hash, mi->second)
+                if (setSeen.insert(hash).second)
+                    vChildren.push_back(mapOrphanTransactions[hash].tx);
+        }
+    }
+}
+
 
 
 
@@ -607,12 +1001,13 @@ bool CTransaction::CheckTransaction(CValidationState &state) const
 }
 
 int64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
-                              enum GetMinFee_mode mode) const
+                              enum GetMinFee_mode mode, unsigned int nBytes) const
 {
     // Base fee is either nMinTxFee or nMinRelayTxFee
     int64 nBaseFee = (mode == GMF_RELAY) ? nMinRelayTxFee : nMinTxFee;
 
-    unsigned int nBytes = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+    if (nBytes == 0)
+        nBytes = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
     unsigned int nNewBlockSize = nBlockSize + nBytes;
     int64 nMinFee = (1 + (int64)nBytes / 1000) * nBaseFee;
 
@@ -660,8 +1055,36 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
     }
 }
 
+static CCheckQueue<CScriptCheck> mempoolcheckqueue(128);
+// The queue takes one master at a time; whoever finds it busy checks its scripts itself
+static CCriticalSection cs_mempoolcheckqueue;
+
+void ThreadMempoolScriptCheck() {
+    RenameThread("bitcoin-txcheck");
+    mempoolcheckqueue.Thread();
+}
+
+// Verify the scripts of a loose transaction, whose inputs are all in view, on the mempool script check threads
+static bool CheckInputsParallel(CValidationState &state, const CTransaction &tx, CCoinsViewCache &view)
+{
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+    TRY_LOCK(cs_mempoolcheckqueue, lockQueue);
+    if (!nScriptCheckThreads || !lockQueue || tx.vin.size() < 2)
+        return tx.CheckInputs(state, view, true, flags);
+
+    std::vector<CScriptCheck> vChecks;
+    CCheckQueueControl<CScriptCheck> control(&mempoolcheckqueue);
+    if (!tx.CheckInputs(state, view, true, flags, &vChecks))
+        return false;
+    control.Add(vChecks);
+    if (control.Wait())
+        return true;
+    // Redo it serially, so CheckInputs can tell a non-canonical signature from an invalid one
+    return tx.CheckInputs(state, view, true, flags);
+}
+
 bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, std::vector<CScriptCheck> *pvChecks)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -683,78 +1106,85 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         return error("CTxMemPool::accept() : nonstandard transaction (%s)",
                      strNonStd.c_str());
 
-    // is it already in the memory pool?
     uint256 hash = tx.GetHash();
+    CTransaction* ptxOld = NULL;
+    CCoinsView dummy;
+    CCoinsViewCache view(dummy);
+    int nHeight = 0;
+
+    // The checks above need no lock. cs_main and cs are only held to look up the inputs here, and
+    // to insert the transaction at the end; the signatures are verified in between without them.
     {
-        LOCK(cs);
+        LOCK2(cs_main, cs);
+
+        // is it already in the memory pool?
         if (mapTx.count(hash))
             return false;
-    }
 
-    // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
-    {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (mapNextTx.count(outpoint))
+        // Check for conflicts with in-memory transactions
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
-            // Disable replacement feature for now
-            return false;
-
-            // Allow replacing with a newer version of the same transaction
-            if (i != 0)
-                return false;
-            ptxOld = mapNextTx[outpoint].ptx;
-            if (ptxOld->IsFinal())
-                return false;
-            if (!tx.IsNewerThan(*ptxOld))
-                return false;
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            COutPoint outpoint = tx.vin[i].prevout;
+            if (mapNextTx.count(outpoint))
             {
-                COutPoint outpoint = tx.vin[i].prevout;
-                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
+                // Disable replacement feature for now
+                return false;
+
+                // Allow replacing with a newer version of the same transaction
+                if (i != 0)
+                    return false;
+                ptxOld = mapNextTx[outpoint].ptx;
+                if (ptxOld->IsFinal())
+                    return false;
+                if (!tx.IsNewerThan(*ptxOld))
                     return false;
+                for (unsigned int i = 0; i < tx.vin.size(); i++)
+                {
+                    COutPoint outpoint = tx.vin[i].prevout;
+                    if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
+                        return false;
+                }
+                break;
             }
-            break;
         }
-    }
-
-    if (fCheckInputs)
-    {
-        CCoinsView dummy;
-        CCoinsViewCache view(dummy);
 
+        if (fCheckInputs)
         {
-        LOCK(cs);
-        CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
-        view.SetBackend(viewMemPool);
-
-        // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
+            CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+            view.SetBackend(viewMemPool);
 
-        // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // only helps filling in pfMissingInputs (to determine missing vs spent).
-        BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
-                if (pfMissingInputs)
-                    *pfMissingInputs = true;
+            // do we already have it?
+            if (view.HaveCoins(hash))
                 return false;
+
+            // do all inputs exist?
+            // Note that this does not check for the presence of actual outputs (see the next check for that),
+            // only helps filling in pfMissingInputs (to determine missing vs spent).
+            BOOST_FOREACH(const CTxIn txin, tx.vin) {
+                if (!view.HaveCoins(txin.prevout.hash)) {
+                    if (pfMissingInputs)
+                        *pfMissingInputs = true;
+                    return false;
+                }
             }
-        }
 
-        // are the actual inputs available?
-        if (!tx.HaveInputs(view))
-            return state.Invalid(error("CTxMemPool::accept() : inputs already spent"));
+            // are the actual inputs available?
+            if (!tx.HaveInputs(view))
+                return state.Invalid(error("CTxMemPool::accept() : inputs already spent"));
 
-        // Bring the best block into scope
-        view.GetBestBlock();
+            // Bring the best block into scope
+            view.GetBestBlock();
+            nHeight = nBestHeight;
 
-        // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
-        view.SetBackend(dummy);
+            // we have all inputs cached now, so switch back to dummy, so we don't need to keep the locks
+            view.SetBackend(dummy);
         }
+    }
 
+    int64 nFees = 0;
+    double dFeeRate = -1, dPriority = -1;
+    if (fCheckInputs)
+    {
         // Check for non-standard pay-to-script-hash in inputs
         if (!tx.AreInputsStandard(view) && !fTestNet)
             return error("CTxMemPool::accept() : nonstandard transaction input");
@@ -763,9 +1193,33 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
 
-        int64 nFees = tx.GetValueIn(view)-tx.GetValueOut();
+        nFees = tx.GetValueIn(view)-tx.GetValueOut();
         unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
+        // For the fee estimator: priority is sum(valuein * age) / txsize, where inputs still in the
+        // memory pool have no age yet. A transaction counts towards the fee rate estimate only if
+        // its priority could not get it mined for free, and towards the priority one if it pays
+        // less than the minimum fee.
+        dPriority = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            const CCoins &coins = view.GetCoins(txin.prevout.hash);
+            if (coins.nHeight != (int)MEMPOOL_HEIGHT)
+                dPriority += (double)coins.vout[txin.prevout.n].nValue * (nHeight - coins.nHeight + 1);
+        }
+        dPriority /= nSize;
+        dFeeRate = (double)nFees * 1000 / nSize;
+        if (CTransaction::AllowFree(dPriority))
+            dFeeRate = -1;
+        if (nFees >= CTransaction::nMinTxFee)
+            dPriority = -1;
+
+        // Nor if it pays less than what was evicted to keep the pool within -maxmempool
+        int64 nMempoolMinFee = GetMinFee(nSize);
+        if (nMempoolMinFee > 0 && nFees < nMempoolMinFee)
+            return state.Invalid(error("CTxMemPool::accept() : mempool min fee not met %s, %"PRI64d" < %"PRI64d,
+                                       hash.ToString().c_str(),
+                                       nFees, nMempoolMinFee));
+
         // Don't accept it if it can't get into a block
         int64 txMinFee = tx.GetMinFee(1000, true, GMF_RELAY);
         if (fLimitFree && nFees < txMinFee)
@@ -798,28 +1252,74 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
-        {
+        if (pvChecks) {
+            if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, pvChecks))
+                return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
+        } else if (!CheckInputsParallel(state, tx, view)) {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().c_str());
         }
     }
 
     // Store transaction in memory
     {
-        LOCK(cs);
+        LOCK2(cs_main, cs);
+
+        // The locks were released while the scripts were checked: make sure nothing else
+        // got in first, and that no block or eviction took the inputs away meanwhile
+        if (mapTx.count(hash))
+            return false;
+        if (!ptxOld)
+            BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                if (mapNextTx.count(txin.prevout))
+                    return false;
+        if (fCheckInputs)
+        {
+            CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+            CCoinsViewCache viewCommit(viewMemPool);
+            if (!tx.HaveInputs(viewCommit))
+                return state.Invalid(error("CTxMemPool::accept() : inputs spent while checking %s", hash.ToString().c_str()));
+            if (!CheckPackageLimits(tx, GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                    GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT)))
+                return state.Invalid(error("CTxMemPool::accept() : too many unconfirmed ancestors or descendants for %s", hash.ToString().c_str()));
+        }
+        else
+        {
+            // Transactions put back from a disconnected block skip the checks, but still need
+            // their fee to rank for eviction
+            CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+            CCoinsViewCache viewFee(viewMemPool);
+            if (tx.HaveInputs(viewFee))
+                nFees = tx.GetValueIn(viewFee)-tx.GetValueOut();
+        }
+
         if (ptxOld)
         {
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, tx, nFees);
+        if (pvChecks)
+            setUnverified.insert(hash);
+        if (fCheckInputs && !IsInitialBlockDownload())
+            feeEstimator.ProcessTransaction(hash, nHeight, dFeeRate, dPriority);
+
+        // keep the pool bounded: drop stale transactions, then the lowest fee rate packages
+        Expire(GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        if (!mapTx.count(hash))
+            return state.Invalid(error("CTxMemPool::accept() : mempool full, fee rate of %s too low", hash.ToString().c_str()));
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
-    // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
-    SyncWithWallets(hash, tx, NULL, true);
+    // If updated, erase old tx from wallet. With deferred script checks that is up to
+    // the caller, once they passed. Outside cs, as the wallets may be notified on the spot,
+    // and AcceptWalletTransaction takes cs_wallet before cs.
+    if (!pvChecks)
+    {
+        if (ptxOld)
+            EraseFromWallets(ptxOld->GetHash());
+        SyncWithWallets(hash, tx, NULL, true);
+    }
 
     return true;
 }
@@ -1048,18 +1548,123 @@ int GetInputAge(CTxIn& vin)
 
     const CCoins &coins = view.GetCoins(vin.prevout.hash);
 
-    return (pindexBest->nHeight+1) - coins.nHeight;
+    return (pindexBest->nHeight+1) - coins.nHeight;
+}
+
+
+bool CTxMemPool::CalculateAncestors(const CTransaction &tx, std::set<uint256> &setAncestors, unsigned int nLimit)
+{
+    vector<const CTransaction*> vWork;
+    vWork.push_back(&tx);
+    while (!vWork.empty()) {
+        const CTransaction *ptx = vWork.back();
+        vWork.pop_back();
+        BOOST_FOREACH(const CTxIn &txin, ptx->vin) {
+            map<uint256, CTransaction>::iterator mi = mapTx.find(txin.prevout.hash);
+            if (mi != mapTx.end() && setAncestors.insert(mi->first).second) {
+                if (setAncestors.size() > nLimit)
+                    return false;
+                vWork.push_back(&mi->second);
+            }
+        }
+    }
+    return true;
+}
+
+bool CTxMemPool::CheckPackageLimits(const CTransaction &tx, unsigned int nAncestorLimit, unsigned int nDescendantLimit)
+{
+    // With every transaction in the pool within both limits, the walks over ancestors and
+    // descendants when adding or removing one stay bounded too
+    LOCK(cs);
+    std::set<uint256> setAncestors;
+    if (nAncestorLimit == 0 || !CalculateAncestors(tx, setAncestors, nAncestorLimit - 1))
+        return false;
+    BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+        if (mapEntry[hashAncestor].nCountWithDescendants + 1 > nDescendantLimit)
+            return false;
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(const uint256 &hash, std::set<uint256> &setDescendants)
+{
+    vector<uint256> vWork;
+    vWork.push_back(hash);
+    while (!vWork.empty()) {
+        uint256 hashTx = vWork.back();
+        vWork.pop_back();
+        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
+        for (; it != mapNextTx.end() && it->first.hash == hashTx; ++it) {
+            uint256 hashChild = it->second.ptx->GetHash();
+            if (setDescendants.insert(hashChild).second)
+                vWork.push_back(hashChild);
+        }
+    }
 }
 
+void CTxMemPool::UpdateDescendantTotals(const uint256 &hash, int64 nSizeDiff, int64 nFeeDiff, int nCountDiff)
+{
+    std::map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    CTxMemPoolEntry &entry = mi->second;
+    setByDescendantFeeRate.erase(make_pair(entry.GetDescendantFeeRate(), hash));
+    entry.nSizeWithDescendants += nSizeDiff;
+    entry.nFeesWithDescendants += nFeeDiff;
+    entry.nCountWithDescendants += nCountDiff;
+    setByDescendantFeeRate.insert(make_pair(entry.GetDescendantFeeRate(), hash));
+}
 
-bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx, int64 nFee)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
+        // A transaction of a disconnected block can come back while its children are still
+        // in the pool. Those and their descendants gain it, and whatever ancestors it brings
+        // along that they did not have yet, so remember what they had before.
+        std::set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+        std::map<uint256, std::set<uint256> > mapPrevAncestors;
+        BOOST_FOREACH(const uint256 &hashDescendant, setDescendants)
+            CalculateAncestors(mapTx[hashDescendant], mapPrevAncestors[hashDescendant]);
+
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+
+        CTxMemPoolEntry entry(nFee, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION), GetTime(), nBestHeight);
+        std::set<uint256> setAncestors;
+        CalculateAncestors(tx, setAncestors);
+        BOOST_FOREACH(const uint256 &hashAncestor, setAncestors) {
+            const CTxMemPoolEntry &ancestor = mapEntry[hashAncestor];
+            entry.nCountWithAncestors++;
+            entry.nSizeWithAncestors += ancestor.nTxSize;
+            entry.nFeesWithAncestors += ancestor.nFee;
+            UpdateDescendantTotals(hashAncestor, entry.nTxSize, entry.nFee, 1);
+        }
+        BOOST_FOREACH(const uint256 &hashDescendant, setDescendants) {
+            CTxMemPoolEntry &descendant = mapEntry[hashDescendant];
+            entry.nCountWithDescendants++;
+            entry.nSizeWithDescendants += descendant.nTxSize;
+            entry.nFeesWithDescendants += descendant.nFee;
+            descendant.nCountWithAncestors++;
+            descendant.nSizeWithAncestors += entry.nTxSize;
+            descendant.nFeesWithAncestors += entry.nFee;
+            const std::set<uint256> &setPrevAncestors = mapPrevAncestors[hashDescendant];
+            BOOST_FOREACH(const uint256 &hashAncestor, setAncestors) {
+                if (setPrevAncestors.count(hashAncestor))
+                    continue;
+                const CTxMemPoolEntry &ancestor = mapEntry[hashAncestor];
+                descendant.nCountWithAncestors++;
+                descendant.nSizeWithAncestors += ancestor.nTxSize;
+                descendant.nFeesWithAncestors += ancestor.nFee;
+                UpdateDescendantTotals(hashAncestor, descendant.nTxSize, descendant.nFee, 1);
+            }
+        }
+        mapEntry[hash] = entry;
+        setByDescendantFeeRate.insert(make_pair(entry.GetDescendantFeeRate(), hash));
+        setByTime.insert(make_pair(entry.nTime, hash));
+        nTotalTxSize += entry.nTxSize;
         nTransactionsUpdated++;
     }
     return true;
@@ -1081,15 +1686,101 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
         }
         if (mapTx.count(hash))
         {
+            // take the transaction out of the totals of whatever remains around it
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+            if (mi != mapEntry.end()) {
+                const CTxMemPoolEntry &entry = mi->second;
+                std::set<uint256> setAncestors, setDescendants;
+                CalculateAncestors(tx, setAncestors);
+                BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+                    UpdateDescendantTotals(hashAncestor, -(int64)entry.nTxSize, -entry.nFee, -1);
+                CalculateDescendants(hash, setDescendants);
+                BOOST_FOREACH(const uint256 &hashDescendant, setDescendants) {
+                    CTxMemPoolEntry &descendant = mapEntry[hashDescendant];
+                    descendant.nCountWithAncestors--;
+                    descendant.nSizeWithAncestors -= entry.nTxSize;
+                    descendant.nFeesWithAncestors -= entry.nFee;
+                }
+                setByDescendantFeeRate.erase(make_pair(entry.GetDescendantFeeRate(), hash));
+                setByTime.erase(make_pair(entry.nTime, hash));
+                nTotalTxSize -= entry.nTxSize;
+                mapEntry.erase(mi);
+            }
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
+            setUnverified.erase(hash);
+            feeEstimator.RemoveTransaction(hash);
             nTransactionsUpdated++;
         }
     }
     return true;
 }
 
+int CTxMemPool::Expire(int64 nTime)
+{
+    LOCK(cs);
+    int nRemoved = 0;
+    while (!setByTime.empty() && setByTime.begin()->first < nTime) {
+        uint256 hash = setByTime.begin()->second;
+        unsigned int nSizeBefore = mapTx.size();
+        remove(CTransaction(mapTx[hash]), true);
+        nRemoved += nSizeBefore - mapTx.size();
+    }
+    if (nRemoved)
+        printf("CTxMemPool::Expire() : removed %d transactions\n", nRemoved);
+    return nRemoved;
+}
+
+void CTxMemPool::SetEntryTime(const uint256 &hash, int64 nTime)
+{
+    LOCK(cs);
+    std::map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    setByTime.erase(make_pair(mi->second.nTime, hash));
+    mi->second.nTime = nTime;
+    setByTime.insert(make_pair(nTime, hash));
+}
+
+int64 CTxMemPool::GetMinFee(unsigned int nSize)
+{
+    LOCK(cs);
+    if (dRollingMinFeeRate > 0) {
+        int64 nNow = GetTime();
+        dRollingMinFeeRate *= pow(0.5, (double)(nNow - nLastRollingFeeUpdate) / ROLLING_FEE_HALFLIFE);
+        nLastRollingFeeUpdate = nNow;
+        if (dRollingMinFeeRate < (double)CTransaction::nMinRelayTxFee / 2000)
+            dRollingMinFeeRate = 0;
+    }
+    return (int64)(dRollingMinFeeRate * nSize);
+}
+
+int CTxMemPool::TrimToSize(uint64 nSizeLimit)
+{
+    LOCK(cs);
+    int nRemoved = 0;
+    while (nTotalTxSize > nSizeLimit && !setByDescendantFeeRate.empty()) {
+        uint256 hash = setByDescendantFeeRate.begin()->second;
+
+        // whatever comes next has to pay more than the package that made room for it,
+        // or it would only take its place to be evicted in turn
+        double dEvictedRate = setByDescendantFeeRate.begin()->first + (double)CTransaction::nMinRelayTxFee / 1000;
+        GetMinFee(0); // decay the current minimum up to now first
+        if (dEvictedRate > dRollingMinFeeRate) {
+            dRollingMinFeeRate = dEvictedRate;
+            nLastRollingFeeUpdate = GetTime();
+        }
+
+        unsigned int nSizeBefore = mapTx.size();
+        remove(CTransaction(mapTx[hash]), true);
+        nRemoved += nSizeBefore - mapTx.size();
+    }
+    if (nRemoved)
+        printf("CTxMemPool::TrimToSize() : evicted %d transactions, %"PRI64u" bytes left\n", nRemoved, nTotalTxSize);
+    return nRemoved;
+}
+
 bool CTxMemPool::removeConflicts(const CTransaction &tx)
 {
     // Remove transactions which depend on inputs of tx, recursively
@@ -1105,11 +1796,65 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     return true;
 }
 
+void CTxMemPool::processBlock(int nHeight, const std::vector<CTransaction> &vtx)
+{
+    std::vector<uint256> vTxHashes;
+    vTxHashes.reserve(vtx.size());
+    BOOST_FOREACH(const CTransaction &tx, vtx)
+        vTxHashes.push_back(tx.GetHash());
+    LOCK(cs);
+    feeEstimator.ProcessBlock(nHeight, vTxHashes);
+}
+
+double CTxMemPool::estimateFee(int nBlocks)
+{
+    LOCK(cs);
+    return feeEstimator.EstimateFee(nBlocks);
+}
+
+double CTxMemPool::estimatePriority(int nBlocks)
+{
+    LOCK(cs);
+    return feeEstimator.EstimatePriority(nBlocks);
+}
+
+bool CTxMemPool::WriteFeeEstimates(CAutoFile &fileout)
+{
+    try {
+        LOCK(cs);
+        fileout << CLIENT_VERSION;
+        feeEstimator.Write(fileout);
+    } catch (std::exception &e) {
+        return error("CTxMemPool::WriteFeeEstimates() : %s", e.what());
+    }
+    return true;
+}
+
+bool CTxMemPool::ReadFeeEstimates(CAutoFile &filein)
+{
+    try {
+        int nVersion;
+        filein >> nVersion;
+        LOCK(cs);
+        if (!feeEstimator.Read(filein))
+            return error("CTxMemPool::ReadFeeEstimates() : incompatible fee estimates (version %d)", nVersion);
+    } catch (std::exception &e) {
+        return error("CTxMemPool::ReadFeeEstimates() : %s", e.what());
+    }
+    return true;
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
+    mapEntry.clear();
     mapNextTx.clear();
+    setByDescendantFeeRate.clear();
+    setByTime.clear();
+    setUnverified.clear();
+    nTotalTxSize = 0;
+    dRollingMinFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -1120,7 +1865,20 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
     LOCK(cs);
     vtxid.reserve(mapTx.size());
     for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+        if (!setUnverified.count((*mi).first))
+            vtxid.push_back((*mi).first);
+}
+
+void CTxMemPool::setVerified(const uint256 &hash)
+{
+    LOCK(cs);
+    setUnverified.erase(hash);
+}
+
+bool CTxMemPool::isVerified(const uint256 &hash)
+{
+    LOCK(cs);
+    return !setUnverified.count(hash);
 }
 
 
@@ -1198,7 +1956,7 @@ bool CWalletTx::AcceptWalletTransaction(bool fCheckInputs)
     {
         LOCK(mempool.cs);
         // Add previous supporting transactions first
-        BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
+        BOOST_FOREACH(CMerkleTx& tx, vtxPrev.Get())
         {
             if (!tx.IsCoinBase())
             {
@@ -1213,6 +1971,45 @@ bool CWalletTx::AcceptWalletTransaction(bool fCheckInputs)
 }
 
 
+bool GetAddressIndexKey(const CScript &scriptPubKey, unsigned char &nAddressType, uint160 &hashAddress)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    if (const CKeyID *pkeyID = boost::get<CKeyID>(&dest)) {
+        nAddressType = ADDRESS_TYPE_KEYHASH;
+        hashAddress = *pkeyID;
+        return true;
+    }
+    if (const CScriptID *pscriptID = boost::get<CScriptID>(&dest)) {
+        nAddressType = ADDRESS_TYPE_SCRIPTHASH;
+        hashAddress = *pscriptID;
+        return true;
+    }
+    return false;
+}
+
+bool GetAddressIndex(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressIndexKey, int64> > &vEntries, int nStartHeight, int nEndHeight)
+{
+    if (!fAddressIndex)
+        return error("GetAddressIndex() : address index not enabled");
+    return pblocktree->ReadAddressIndex(nAddressType, hashAddress, vEntries, nStartHeight, nEndHeight);
+}
+
+bool GetAddressUnspent(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent)
+{
+    if (!fAddressIndex)
+        return error("GetAddressUnspent() : address index not enabled");
+    return pblocktree->ReadAddressUnspentIndex(nAddressType, hashAddress, vUnspent);
+}
+
+bool GetSpentIndex(const COutPoint &outpoint, CSpentIndexValue &value)
+{
+    if (!fSpentIndex)
+        return false;
+    return pblocktree->ReadSpentIndex(outpoint, value);
+}
+
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1231,12 +2028,24 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                CAutoFile file(OpenBlockFile(CDiskBlockPos(postx.nFile, postx.nPos - 4), true), SER_DISK, CLIENT_VERSION);
                 CBlockHeader header;
                 try {
-                    file >> header;
-                    fseek(file, postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
+                    unsigned int nSizeField;
+                    file >> nSizeField;
+                    if (nSizeField & BLOCK_COMPRESSED_FLAG) {
+                        // a compressed block has to be expanded as a whole
+                        CDataStream ss(SER_DISK, CLIENT_VERSION);
+                        if (!ReadBlockData(postx, ss))
+                            return error("%s() : ReadBlockData failed", __PRETTY_FUNCTION__);
+                        ss >> header;
+                        ss.ignore(postx.nTxOffset);
+                        ss >> txOut;
+                    } else {
+                        file >> header;
+                        fseek(file, postx.nTxOffset, SEEK_CUR);
+                        file >> txOut;
+                    }
                 } catch (std::exception &e) {
                     return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
                 }
@@ -1304,11 +2113,11 @@ CBlockIndex* FindBlockByHeight(int nHeight)
     return pblockindex;
 }
 
-bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
+bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fCheckPOW)
 {
-    if (!ReadFromDisk(pindex->GetBlockPos()))
+    if (!ReadFromDisk(pindex->GetBlockPos(), fCheckPOW))
         return false;
-    if (GetHash() != pindex->GetBlockHash())
+    if (fCheckPOW && GetHash() != pindex->GetBlockHash())
         return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
     return true;
 }
@@ -1870,20 +2679,33 @@ unsigned int CTransaction::GetP2SHSigOpCount(CCoinsViewCache& inputs) const
     return nSigOps;
 }
 
-void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight, const uint256 &txhash) const
+void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight, const uint256 &txhash, CCoinsCommitment *pcommit) const
 {
     // mark inputs spent
     if (!IsCoinBase()) {
         BOOST_FOREACH(const CTxIn &txin, vin) {
             CCoins &coins = inputs.GetCoins(txin.prevout.hash);
+            if (pcommit && coins.IsAvailable(txin.prevout.n))
+                pcommit->RemoveOutput(txin.prevout.hash, txin.prevout.n, coins);
             CTxInUndo undo;
             assert(coins.Spend(txin.prevout, undo));
             txundo.vprevout.push_back(undo);
+            if (pcommit && coins.IsPruned())
+                pcommit->nTransactions--;
         }
     }
 
-    // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    // add outputs; BIP30 (see ConnectBlock) makes sure they overwrite no unspent ones the
+    // commitment still counts
+    CCoins outs(*this, nHeight);
+    if (pcommit) {
+        for (unsigned int i = 0; i < outs.vout.size(); i++)
+            if (outs.IsAvailable(i))
+                pcommit->AddOutput(txhash, i, outs);
+        if (!outs.IsPruned())
+            pcommit->nTransactions++;
+    }
+    assert(inputs.SetCoins(txhash, outs));
 }
 
 bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
@@ -2021,11 +2843,30 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
     if (blockUndo.vtxundo.size() + 1 != vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    CCoinsCommitment *pcommit = view.GetCommitment();
+
+    // Index entries to remove or restore; VerifyDB (pfClean set) disconnects on a scratch view only
+    bool fUpdateIndexes = (pfClean == NULL);
+    std::vector<std::pair<CAddressIndexKey, int64> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+    std::vector<std::pair<COutPoint, CSpentIndexValue> > vSpentIndex;
+
     // undo transactions in reverse order
     for (int i = vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = vtx[i];
         uint256 hash = tx.GetHash();
 
+        if (fAddressIndex && fUpdateIndexes) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                unsigned char nAddressType;
+                uint160 hashAddress;
+                if (!GetAddressIndexKey(tx.vout[k].scriptPubKey, nAddressType, hashAddress))
+                    continue;
+                vAddressIndex.push_back(make_pair(CAddressIndexKey(nAddressType, hashAddress, pindex->nHeight, hash, k, false), tx.vout[k].nValue));
+                vAddressUnspent.push_back(make_pair(CAddressUnspentKey(nAddressType, hashAddress, hash, k), CAddressUnspentValue()));
+            }
+        }
+
         // check that all outputs are available
         if (!view.HaveCoins(hash)) {
             fClean = fClean && error("DisconnectBlock() : outputs still spent? database corrupted");
@@ -2043,6 +2884,13 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
             fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
 
         // remove outputs
+        if (pcommit) {
+            for (unsigned int o = 0; o < outs.vout.size(); o++)
+                if (outs.IsAvailable(o))
+                    pcommit->RemoveOutput(hash, o, outs);
+            if (!outs.IsPruned())
+                pcommit->nTransactions--;
+        }
         outs = CCoins();
 
         // restore inputs
@@ -2069,15 +2917,38 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
                 }
                 if (coins.IsAvailable(out.n))
                     fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
+                if (pcommit) {
+                    if (coins.IsAvailable(out.n))
+                        pcommit->RemoveOutput(out.hash, out.n, coins);
+                    else if (coins.IsPruned())
+                        pcommit->nTransactions++;
+                }
                 if (coins.vout.size() < out.n+1)
                     coins.vout.resize(out.n+1);
                 coins.vout[out.n] = undo.txout;
+                if (fAddressIndex && fUpdateIndexes) {
+                    unsigned char nAddressType;
+                    uint160 hashAddress;
+                    if (GetAddressIndexKey(undo.txout.scriptPubKey, nAddressType, hashAddress)) {
+                        vAddressIndex.push_back(make_pair(CAddressIndexKey(nAddressType, hashAddress, pindex->nHeight, hash, j, true), -undo.txout.nValue));
+                        vAddressUnspent.push_back(make_pair(CAddressUnspentKey(nAddressType, hashAddress, out.hash, out.n),
+                                                            CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, coins.nHeight)));
+                    }
+                }
+                if (fSpentIndex && fUpdateIndexes)
+                    vSpentIndex.push_back(make_pair(out, CSpentIndexValue()));
+                if (pcommit)
+                    pcommit->AddOutput(out.hash, out.n, coins);
                 if (!view.SetCoins(out.hash, coins))
                     return error("DisconnectBlock() : cannot restore coin inputs");
             }
         }
     }
 
+    if ((fAddressIndex || fSpentIndex) && fUpdateIndexes)
+        if (!pblocktree->WriteTxIndexes(std::vector<std::pair<uint256, CDiskTxPos> >(), vAddressIndex, true, vAddressUnspent, vSpentIndex))
+            return state.Abort(_("Failed to write address and spent indexes"));
+
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev);
 
@@ -2121,10 +2992,177 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+static const uint64 MEMPOOL_DUMP_VERSION = 1;
+// number of transactions accepted per cs_main lock while loading mempool.dat
+static const unsigned int MEMPOOL_LOAD_BATCH = 500;
+static bool fMempoolLoaded = false;
+
+bool IsMempoolLoaded()
+{
+    return fMempoolLoaded;
+}
+
+void SetMempoolLoaded()
+{
+    fMempoolLoaded = true;
+}
+
+bool DumpMempool()
+{
+    int64 nStart = GetTimeMillis();
+
+    // Parents go before their children, so the file can be accepted in order
+    vector<CTransaction> vtx;
+    vector<int64> vTime;
+    {
+        LOCK(mempool.cs);
+        vector<pair<unsigned int, uint256> > vOrder;
+        vOrder.reserve(mempool.mapEntry.size());
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
+            vOrder.push_back(make_pair(mi->second.nCountWithAncestors, mi->first));
+        sort(vOrder.begin(), vOrder.end());
+        vtx.reserve(vOrder.size());
+        vTime.reserve(vOrder.size());
+        BOOST_FOREACH(const PAIRTYPE(unsigned int, uint256)& item, vOrder) {
+            vtx.push_back(mempool.mapTx[item.second]);
+            vTime.push_back(mempool.mapEntry[item.second].nTime);
+        }
+    }
+
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    CAutoFile fileout = CAutoFile(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+    try {
+        fileout << MEMPOOL_DUMP_VERSION << (uint64)vtx.size();
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            fileout << vtx[i] << vTime[i];
+        FileCommit(fileout);
+        fileout.fclose();
+    } catch (std::exception &e) {
+        return error("DumpMempool() : %s", e.what());
+    }
+    if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+        return error("DumpMempool() : rename failed");
+
+    printf("Dumped %u mempool transactions in %"PRI64d"ms\n", (unsigned int)vtx.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    int64 nStart = GetTimeMillis();
+    int64 nExpiry = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    int64 nNow = GetTime();
+    int nAccepted = 0, nFailed = 0, nExpired = 0;
+
+    CAutoFile filein = CAutoFile(fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein) {
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    try {
+        uint64 nVersion, nCount;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            fMempoolLoaded = true;
+            return error("LoadMempool() : unknown mempool.dat version %"PRI64u, nVersion);
+        }
+        filein >> nCount;
+
+        while (nCount > 0) {
+            boost::this_thread::interruption_point();
+
+            vector<CTransaction> vtx;
+            vector<int64> vTime;
+            while (nCount > 0 && vtx.size() < MEMPOOL_LOAD_BATCH) {
+                CTransaction tx;
+                int64 nTime;
+                filein >> tx >> nTime;
+                nCount--;
+                if (nTime + nExpiry < nNow) {
+                    nExpired++;
+                    continue;
+                }
+                vtx.push_back(tx);
+                vTime.push_back(nTime);
+            }
+
+            // cs_main is only held per batch, so the node keeps working while the pool fills
+            LOCK(cs_main);
+            vector<unsigned int> vAccepted;
+            bool fScriptsOk;
+            {
+                CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+                for (unsigned int i = 0; i < vtx.size(); i++) {
+                    CValidationState state;
+                    std::vector<CScriptCheck> vChecks;
+                    if (mempool.accept(state, vtx[i], true, false, NULL, nScriptCheckThreads ? &vChecks : NULL)) {
+                        control.Add(vChecks);
+                        vAccepted.push_back(i);
+                    }
+                }
+                fScriptsOk = control.Wait();
+            }
+            if (fScriptsOk) {
+                // only now that their scripts verified may the wallets and RPC see them
+                BOOST_FOREACH(unsigned int i, vAccepted)
+                    if (mempool.exists(vtx[i].GetHash())) {
+                        mempool.setVerified(vtx[i].GetHash());
+                        SyncWithWallets(vtx[i].GetHash(), vtx[i], NULL, true);
+                    }
+            } else {
+                // a script in this batch is invalid: take the batch out again and check one at a time
+                BOOST_FOREACH(unsigned int i, vAccepted)
+                    mempool.remove(vtx[i], true);
+                vAccepted.clear();
+                for (unsigned int i = 0; i < vtx.size(); i++) {
+                    CValidationState state;
+                    if (mempool.accept(state, vtx[i], true, false, NULL))
+                        vAccepted.push_back(i);
+                }
+            }
+            BOOST_FOREACH(unsigned int i, vAccepted)
+                mempool.SetEntryTime(vtx[i].GetHash(), vTime[i]);
+            nAccepted += vAccepted.size();
+            nFailed += vtx.size() - vAccepted.size();
+        }
+    } catch (std::exception &e) {
+        printf("LoadMempool() : failed to read mempool.dat (%s), continuing anyway\n", e.what());
+    }
+
+    fMempoolLoaded = true;
+    printf("Loaded %d mempool transactions (%d failed, %d expired) in %"PRI64d"ms\n", nAccepted, nFailed, nExpired, GetTimeMillis() - nStart);
+    return true;
+}
+
+// Set while -reindex connects the blocks it scanned, whose proof of work it checked against
+// the hashes it reuses. Guarded by cs_main.
+static bool fReindexConnect = false;
+
+// whether header is the one pindex was built from, which proves it hashes to pindex's hash
+static bool HeaderMatchesIndex(const CBlockHeader &header, const CBlockIndex *pindex)
+{
+    return header.nVersion == pindex->nVersion &&
+           header.hashPrevBlock == (pindex->pprev ? pindex->pprev->GetBlockHash() : 0) &&
+           header.hashMerkleRoot == pindex->hashMerkleRoot &&
+           header.nTime == pindex->nTime &&
+           header.nBits == pindex->nBits &&
+           header.nNonce == pindex->nNonce;
+}
+
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, bool fHeaderChecked, bool fUpdateIndexes)
 {
-    // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(state, !fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in. When reindexing, the proof
+    // of work was checked against the hash of the index entry while scanning; a header matching
+    // the entry needs no hashing again.
+    if (fHeaderChecked) {
+        if (!HeaderMatchesIndex(*this, pindex))
+            return state.Abort(_("Block data does not match the block index"));
+        if (!CheckBlock(state, false, true))
+            return false;
+    } else if (!CheckBlock(state, !fJustCheck, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2132,7 +3170,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
-    if (GetHash() == hashGenesisBlock) {
+    if ((fHeaderChecked ? pindex->GetBlockHash() : GetHash()) == hashGenesisBlock) {
         view.SetBestBlock(pindex);
         pindexGenesisBlock = pindex;
         return true;
@@ -2170,6 +3208,9 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
     CBlockUndo blockundo;
 
+    // The output set commitment is only maintained for views that get committed
+    CCoinsCommitment *pcommit = fJustCheck ? NULL : view.GetCommitment();
+
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64 nStart = GetTimeMicros();
@@ -2179,9 +3220,13 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(vtx.size());
+    std::vector<std::pair<CAddressIndexKey, int64> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+    std::vector<std::pair<COutPoint, CSpentIndexValue> > vSpentIndex;
     for (unsigned int i=0; i<vtx.size(); i++)
     {
         const CTransaction &tx = vtx[i];
+        const uint256 &hash = GetTxHash(i);
 
         nInputs += tx.vin.size();
         nSigOps += tx.GetLegacySigOpCount();
@@ -2209,14 +3254,44 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
+
+            // record the outputs being spent while they are still in the view
+            if ((fAddressIndex || fSpentIndex) && fUpdateIndexes && !fJustCheck) {
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    const COutPoint &prevout = tx.vin[j].prevout;
+                    if (fAddressIndex) {
+                        const CTxOut &prev = view.GetCoins(prevout.hash).vout[prevout.n];
+                        unsigned char nAddressType;
+                        uint160 hashAddress;
+                        if (GetAddressIndexKey(prev.scriptPubKey, nAddressType, hashAddress)) {
+                            vAddressIndex.push_back(make_pair(CAddressIndexKey(nAddressType, hashAddress, pindex->nHeight, hash, j, true), -prev.nValue));
+                            vAddressUnspent.push_back(make_pair(CAddressUnspentKey(nAddressType, hashAddress, prevout.hash, prevout.n), CAddressUnspentValue()));
+                        }
+                    }
+                    if (fSpentIndex)
+                        vSpentIndex.push_back(make_pair(prevout, CSpentIndexValue(hash, j, pindex->nHeight)));
+                }
+            }
+        }
+
+        if (fAddressIndex && fUpdateIndexes && !fJustCheck) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                unsigned char nAddressType;
+                uint160 hashAddress;
+                if (!GetAddressIndexKey(tx.vout[k].scriptPubKey, nAddressType, hashAddress))
+                    continue;
+                vAddressIndex.push_back(make_pair(CAddressIndexKey(nAddressType, hashAddress, pindex->nHeight, hash, k, false), tx.vout[k].nValue));
+                vAddressUnspent.push_back(make_pair(CAddressUnspentKey(nAddressType, hashAddress, hash, k),
+                                                    CAddressUnspentValue(tx.vout[k].nValue, tx.vout[k].scriptPubKey, pindex->nHeight)));
+            }
         }
 
         CTxUndo txundo;
-        tx.UpdateCoins(state, view, txundo, pindex->nHeight, GetTxHash(i));
+        tx.UpdateCoins(state, view, txundo, pindex->nHeight, hash, pcommit);
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
 
-        vPos.push_back(std::make_pair(GetTxHash(i), pos));
+        vPos.push_back(std::make_pair(hash, pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64 nTime = GetTimeMicros() - nStart;
@@ -2257,20 +3332,39 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             return state.Abort(_("Failed to write block index"));
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
+    // one batch, so the indexes never disagree about whether the block was connected
+    if (!fTxIndex)
+        vPos.clear();
+    if (fTxIndex || fAddressIndex || fSpentIndex)
+        if (!pblocktree->WriteTxIndexes(vPos, vAddressIndex, false, vAddressUnspent, vSpentIndex))
             return state.Abort(_("Failed to write transaction index"));
 
     // add this block to the view's block chain
     assert(view.SetBestBlock(pindex));
 
     // Watch for transactions paying to me
-    for (unsigned int i=0; i<vtx.size(); i++)
-        SyncWithWallets(GetTxHash(i), vtx[i], this, true);
+    SyncBlockWithWallets(*this, pindex->GetBlockHash());
 
     return true;
 }
 
+// Only guards swapping the pointer: publishing and reading a snapshot never wait for cs_main
+static CCriticalSection cs_chaintip;
+static boost::shared_ptr<const CChainTip> pchaintip(new CChainTip());
+
+static void PublishChainTip(CBlockIndex* pindex)
+{
+    boost::shared_ptr<const CChainTip> ptip(pindex ? new CChainTip(pindex) : new CChainTip());
+    LOCK(cs_chaintip);
+    pchaintip.swap(ptip);
+}
+
+boost::shared_ptr<const CChainTip> GetChainTip()
+{
+    LOCK(cs_chaintip);
+    return pchaintip;
+}
+
 bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 {
     // All modifications to the coin state will be done in this cache.
@@ -2332,10 +3426,12 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     vector<CTransaction> vDelete;
     BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
         CBlock block;
-        if (!block.ReadFromDisk(pindex))
+        // a reindex checked the proof of work while scanning; ConnectBlock then only compares the
+        // header with the index entry, without hashing it
+        if (!block.ReadFromDisk(pindex, !fReindexConnect))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        if (!block.ConnectBlock(state, pindex, view, false, fReindexConnect)) {
             if (state.IsInvalid()) {
                 InvalidChainFound(pindexNew);
                 InvalidBlockFound(pindex);
@@ -2345,7 +3441,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (fBenchmark)
             printf("- Connect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
 
-        // Queue memory transactions to delete
+        // Queue memory transactions to delete, after the fee estimator has seen how long they took
+        if (!IsInitialBlockDownload())
+            mempool.processBlock(pindex->nHeight, block.vtx);
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
             vDelete.push_back(tx);
     }
@@ -2360,7 +3458,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize || (fPruneMode && !fReindex && fCheckForPruning)) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2372,6 +3470,10 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         pblocktree->Sync();
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
+
+        // Only prune once the coin database no longer depends on the deleted undo data
+        if (fPruneMode && !fReindex && !PruneBlockFiles(pindexNew->nHeight))
+            return state.Abort(_("Failed to prune block files"));
     }
 
     // At this point, all changes have been done to the database.
@@ -2381,6 +3483,8 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
         if (pindex->pprev)
             pindex->pprev->pnext = NULL;
+    BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
+        SyncDisconnectWithWallets(pindex->GetBlockHash());
 
     // Connect longer branch
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
@@ -2416,6 +3520,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    PublishChainTip(pindexNew);
     printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0), (unsigned long)pindexNew->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str(),
@@ -2451,10 +3556,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 }
 
 
-bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
+bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos, const uint256 &hash)
 {
     // Check for duplicate
-    uint256 hash = GetHash();
     if (mapBlockIndex.count(hash))
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
@@ -2513,12 +3617,18 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
             infoLastBlockFile.SetNull();
             pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile);
             fUpdatedLast = true;
+            fBlockFileInfoLoaded = false;
         }
     } else {
         while (infoLastBlockFile.nSize + nAddSize >= MAX_BLOCKFILE_SIZE) {
             printf("Leaving block file %i: %s\n", nLastBlockFile, infoLastBlockFile.ToString().c_str());
             FlushBlockFile(true);
+            if (fBlockFileInfoLoaded) {
+                vinfoBlockFile.push_back(infoLastBlockFile);
+                nBlockFileUsage += infoLastBlockFile.nSize + infoLastBlockFile.nUndoSize;
+            }
             nLastBlockFile++;
+            fCheckForPruning = fPruneMode;
             infoLastBlockFile.SetNull();
             pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile); // check whether data for the new file somehow already exist; can fail just fine
             fUpdatedLast = true;
@@ -2575,6 +3685,10 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
         nNewSize = (info.nUndoSize += nAddSize);
         if (!pblocktree->WriteBlockFileInfo(nFile, info))
             return state.Abort(_("Failed to write block info"));
+        if (fBlockFileInfoLoaded && nFile < (int)vinfoBlockFile.size()) {
+            vinfoBlockFile[nFile].nUndoSize = info.nUndoSize;
+            nBlockFileUsage += nAddSize;
+        }
     }
 
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
@@ -2811,10 +3925,25 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     return true;
 }
 
-bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
+// Read the size field of the blk?????.dat record whose data starts at pos
+static bool ReadBlockSizeField(const CDiskBlockPos &pos, unsigned int &nSizeField)
+{
+    if (pos.nPos < 4)
+        return error("ReadBlockSizeField() : invalid position");
+    CAutoFile filein = CAutoFile(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 4), true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadBlockSizeField() : OpenBlockFile failed");
+    try {
+        filein >> nSizeField;
+    } catch (std::exception &e) {
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
+}
+
+bool CBlock::AcceptBlock(CValidationState &state, const uint256 &hash, CDiskBlockPos *dbp)
 {
     // Check for duplicate
-    uint256 hash = GetHash();
     if (mapBlockIndex.count(hash))
         return state.Invalid(error("AcceptBlock() : block already in mapBlockIndex"));
 
@@ -2901,16 +4030,27 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
 
     // Write block to history file
     try {
-        unsigned int nBlockSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+        std::vector<unsigned char> vData;
+        unsigned int nSizeField = 0;
+        unsigned int nBlockSize;
+        if (dbp == NULL) {
+            nSizeField = GetDiskData(vData);
+            nBlockSize = vData.size();
+        } else {
+            // the block is already on disk, possibly compressed: account for the record as stored
+            if (!ReadBlockSizeField(*dbp, nSizeField))
+                return error("AcceptBlock() : ReadBlockSizeField failed");
+            nBlockSize = nSizeField & ~BLOCK_COMPRESSED_FLAG;
+        }
         CDiskBlockPos blockPos;
         if (dbp != NULL)
             blockPos = *dbp;
         if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, nTime, dbp != NULL))
             return error("AcceptBlock() : FindBlockPos failed");
         if (dbp == NULL)
-            if (!WriteToDisk(blockPos))
+            if (!WriteToDisk(blockPos, vData, nSizeField))
                 return state.Abort(_("Failed to write block"));
-        if (!AddToBlockIndex(state, blockPos))
+        if (!AddToBlockIndex(state, blockPos, hash))
             return error("AcceptBlock() : AddToBlockIndex failed");
     } catch(std::runtime_error &e) {
         return state.Abort(_("System error: ") + e.what());
@@ -2946,17 +4086,17 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fCheckPOW, const uint256 *phash)
 {
     // Check for duplicate
-    uint256 hash = pblock->GetHash();
+    uint256 hash = phash ? *phash : pblock->GetHash();
     if (mapBlockIndex.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().c_str()));
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
     // Preliminary checks
-    if (!pblock->CheckBlock(state))
+    if (!pblock->CheckBlock(state, fCheckPOW))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
@@ -2991,7 +4131,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     }
 
     // Store to disk
-    if (!pblock->AcceptBlock(state, dbp))
+    if (!pblock->AcceptBlock(state, hash, dbp))
         return error("ProcessBlock() : AcceptBlock FAILED");
 
     // Recursively process any orphan blocks that depended on this one
@@ -3007,9 +4147,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             CBlock* pblockOrphan = (*mi).second;
             // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan resolution (that is, feeding people an invalid block based on LegitBlockX in order to get anyone relaying LegitBlockX banned)
             CValidationState stateDummy;
-            if (pblockOrphan->AcceptBlock(stateDummy))
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
+            uint256 hashOrphan = pblockOrphan->GetHash();
+            if (pblockOrphan->AcceptBlock(stateDummy, hashOrphan))
+                vWorkQueue.push_back(hashOrphan);
+            mapOrphanBlocks.erase(hashOrphan);
             delete pblockOrphan;
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
@@ -3210,35 +4351,184 @@ CCriticalSection cs_LastBlockFile;
 CBlockFileInfo infoLastBlockFile;
 int nLastBlockFile = 0;
 
-FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
-{
-    if (pos.IsNull())
-        return NULL;
-    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
-    boost::filesystem::create_directories(path.parent_path());
-    FILE* file = fopen(path.string().c_str(), "rb+");
-    if (!file && !fReadOnly)
-        file = fopen(path.string().c_str(), "wb+");
-    if (!file) {
-        printf("Unable to open file %s\n", path.string().c_str());
-        return NULL;
+FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
+{
+    if (pos.IsNull())
+        return NULL;
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
+    boost::filesystem::create_directories(path.parent_path());
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    if (!file && !fReadOnly)
+        file = fopen(path.string().c_str(), "wb+");
+    if (!file) {
+        printf("Unable to open file %s\n", path.string().c_str());
+        return NULL;
+    }
+    if (pos.nPos) {
+        if (fseek(file, pos.nPos, SEEK_SET)) {
+            printf("Unable to seek to position %u of %s\n", pos.nPos, path.string().c_str());
+            fclose(file);
+            return NULL;
+        }
+    }
+    return file;
+}
+
+FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly) {
+    return OpenDiskFile(pos, "blk", fReadOnly);
+}
+
+bool ReadBlockData(const CDiskBlockPos &pos, CDataStream &ss)
+{
+    // the record's size field precedes the block data
+    if (pos.nPos < 4)
+        return error("ReadBlockData() : invalid position");
+    CAutoFile filein = CAutoFile(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 4), true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadBlockData() : OpenBlockFile failed");
+
+    try {
+        unsigned int nSizeField;
+        filein >> nSizeField;
+        unsigned int nSize = nSizeField & ~BLOCK_COMPRESSED_FLAG;
+        if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+            return error("ReadBlockData() : invalid block size %u", nSize);
+        if (!(nSizeField & BLOCK_COMPRESSED_FLAG)) {
+            ss.resize(nSize);
+            filein.read(&ss[0], nSize);
+            return true;
+        }
+        std::vector<unsigned char> vData(nSize);
+        filein.read((char*)&vData[0], nSize);
+        return DecompressBlockData(vData, ss);
+    } catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+}
+
+bool DecompressBlockData(const std::vector<unsigned char> &vData, CDataStream &ss)
+{
+    // compressed data is the uncompressed size followed by the compressed block
+    if (vData.size() < 4)
+        return error("DecompressBlockData() : truncated data");
+    unsigned int nRawSize;
+    memcpy(&nRawSize, &vData[0], 4);
+    if (nRawSize == 0 || nRawSize > MAX_BLOCK_SIZE)
+        return error("DecompressBlockData() : invalid block size %u", nRawSize);
+    ss.resize(nRawSize);
+    if (!LZDecompress(&vData[0] + 4, vData.size() - 4, (unsigned char*)&ss[0], nRawSize))
+        return error("DecompressBlockData() : corrupt compressed block");
+    return true;
+}
+
+unsigned int CBlock::GetDiskData(std::vector<unsigned char> &vData) const
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << *this;
+    if (fCompressBlocks) {
+        std::vector<unsigned char> vCompressed;
+        LZCompress((const unsigned char*)&ss[0], ss.size(), vCompressed);
+        if (vCompressed.size() + 4 < ss.size()) {
+            unsigned int nRawSize = ss.size();
+            vData.resize(4 + vCompressed.size());
+            memcpy(&vData[0], &nRawSize, 4);
+            memcpy(&vData[4], &vCompressed[0], vCompressed.size());
+            return vData.size() | BLOCK_COMPRESSED_FLAG;
+        }
+    }
+    vData.assign(ss.begin(), ss.end());
+    return vData.size();
+}
+
+FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly) {
+    return OpenDiskFile(pos, "rev", fReadOnly);
+}
+
+// Forget the data and undo positions of all blocks stored in files that are about to be deleted,
+// in one walk over the block index
+static bool PruneBlockFileSet(const set<int> &setFiles)
+{
+    for (map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (!(pindex->nStatus & BLOCK_HAVE_MASK) || !setFiles.count(pindex->nFile))
+            continue;
+        pindex->nStatus &= ~BLOCK_HAVE_MASK;
+        pindex->nFile = 0;
+        pindex->nDataPos = 0;
+        pindex->nUndoPos = 0;
+        CDiskBlockIndex blockindex(pindex);
+        if (!pblocktree->WriteBlockIndex(blockindex))
+            return false;
+    }
+    BOOST_FOREACH(int nFile, setFiles)
+        if (!pblocktree->WriteBlockFileInfo(nFile, CBlockFileInfo()))
+            return false;
+    return true;
+}
+
+bool PruneBlockFiles(int nTipHeight)
+{
+    fCheckForPruning = false;
+    if (nTipHeight <= (int)MIN_BLOCKS_TO_KEEP)
+        return true;
+
+    LOCK(cs_LastBlockFile);
+
+    if (!fBlockFileInfoLoaded) {
+        vinfoBlockFile.assign(nLastBlockFile, CBlockFileInfo());
+        nBlockFileUsage = 0;
+        for (int nFile = 0; nFile < nLastBlockFile; nFile++) {
+            pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
+            nBlockFileUsage += vinfoBlockFile[nFile].nSize + vinfoBlockFile[nFile].nUndoSize;
+        }
+        fBlockFileInfoLoaded = true;
+    }
+
+    // Leave room for the pre-allocated chunks of the file currently being written
+    uint64 nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    uint64 nTarget = nPruneTarget > nBuffer ? nPruneTarget - nBuffer : 0;
+    uint64 nUsage = nBlockFileUsage + infoLastBlockFile.nSize + infoLastBlockFile.nUndoSize;
+    if (nUsage <= nTarget)
+        return true;
+
+    unsigned int nLastBlockWeCanPrune = nTipHeight - MIN_BLOCKS_TO_KEEP;
+    set<int> setPruned;
+    for (int nFile = 0; nFile < nLastBlockFile && nUsage > nTarget; nFile++) {
+        const CBlockFileInfo &info = vinfoBlockFile[nFile];
+        if (info.nSize == 0)
+            continue;
+        // the height range of a file tells whether it may still be needed for a reorganisation
+        if (info.nHeightLast > nLastBlockWeCanPrune)
+            continue;
+        nUsage -= info.nSize + info.nUndoSize;
+        setPruned.insert(nFile);
     }
-    if (pos.nPos) {
-        if (fseek(file, pos.nPos, SEEK_SET)) {
-            printf("Unable to seek to position %u of %s\n", pos.nPos, path.string().c_str());
-            fclose(file);
-            return NULL;
-        }
+    if (setPruned.empty())
+        return true;
+
+    if (!PruneBlockFileSet(setPruned))
+        return false;
+    BOOST_FOREACH(int nFile, setPruned) {
+        nBlockFileUsage -= vinfoBlockFile[nFile].nSize + vinfoBlockFile[nFile].nUndoSize;
+        vinfoBlockFile[nFile].SetNull();
     }
-    return file;
-}
 
-FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly) {
-    return OpenDiskFile(pos, "blk", fReadOnly);
-}
+    if (!fHavePruned) {
+        fHavePruned = true;
+        if (!pblocktree->WriteFlag("prunedblockfiles", true))
+            return false;
+    }
+    // The block index must not point into the files anymore before they disappear
+    if (!pblocktree->Sync())
+        return false;
 
-FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly) {
-    return OpenDiskFile(pos, "rev", fReadOnly);
+    BOOST_FOREACH(int nFile, setPruned) {
+        boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile));
+        boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("rev%05u.dat", nFile));
+        printf("Pruned block file blk%05u.dat and undo file rev%05u.dat\n", nFile, nFile);
+    }
+    printf("PruneBlockFiles(): block storage now %"PRI64u" MiB (target %"PRI64u" MiB)\n", nUsage / 1024 / 1024, nPruneTarget / 1024 / 1024);
+    return true;
 }
 
 CBlockIndex * InsertBlockIndex(uint256 hash)
@@ -3261,15 +4551,16 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
-{
-    if (!pblocktree->LoadBlockIndexGuts())
-        return false;
+// Set when mapBlockIndex was loaded from the snapshot rather than from the block tree database
+static bool fBlockIndexFromSnapshot = false;
 
-    boost::this_thread::interruption_point();
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "index.snapshot";
+}
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+static void SortByHeight(vector<pair<int, CBlockIndex*> > &vSortedByHeight)
+{
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
     {
@@ -3277,13 +4568,175 @@ bool static LoadBlockIndexDB()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    int64 nStart = GetTimeMillis();
+
+    // Entries are written parents-first, so each one can refer to its parent by position
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    SortByHeight(vSortedByHeight);
+    map<CBlockIndex*, int> mapPos;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    {
+        LOCK(cs_LastBlockFile);
+        ss << CLIENT_VERSION << nLastBlockFile << infoLastBlockFile.nSize << infoLastBlockFile.nUndoSize;
+    }
+    ss << (unsigned int)vSortedByHeight.size();
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
-        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
-            setBlockIndexValid.insert(pindex);
+        int nPrev = -1;
+        if (pindex->pprev) {
+            map<CBlockIndex*, int>::iterator mi = mapPos.find(pindex->pprev);
+            if (mi == mapPos.end())
+                return error("WriteBlockIndexSnapshot() : parent of %s not written yet", pindex->GetBlockHash().ToString().c_str());
+            nPrev = mi->second;
+        }
+        int nPos = mapPos.size();
+        mapPos[pindex] = nPos;
+        ss << pindex->GetBlockHash() << nPrev << CDiskBlockIndex(pindex) << pindex->nChainWork << pindex->nChainTx;
+    }
+    uint256 hashSnapshot = Hash(ss.begin(), ss.end());
+
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = GetDataDir() / "blocks" / "index.snapshot.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : open failed");
+    if (fwrite(&ss[0], 1, ss.size(), file) != ss.size()) {
+        fclose(file);
+        return error("WriteBlockIndexSnapshot() : write failed");
+    }
+    FileCommit(file);
+    fclose(file);
+    if (!RenameOver(pathTmp, pathSnapshot))
+        return error("WriteBlockIndexSnapshot() : rename failed");
+
+    // only now mark it valid
+    if (!pblocktree->WriteBlockIndexSnapshot(hashSnapshot))
+        return error("WriteBlockIndexSnapshot() : failed to write snapshot hash");
+    printf("Wrote block index snapshot (%u entries) in %"PRI64d"ms\n", (unsigned int)vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+// Load mapBlockIndex from the snapshot written at the last clean shutdown, if it is still current.
+// Saves deserializing every 'b' record, hashing every header and recomputing the chain work.
+static bool LoadBlockIndexSnapshot()
+{
+    uint256 hashSnapshot;
+    if (!pblocktree->ReadBlockIndexSnapshot(hashSnapshot))
+        return false;
+    // From here on the block tree database will change, so the snapshot can be used only once
+    pblocktree->EraseBlockIndexSnapshot();
+
+    int64 nStart = GetTimeMillis();
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    FILE *file = fopen(pathSnapshot.string().c_str(), "rb");
+    if (!file)
+        return false;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    try {
+        ss.resize(boost::filesystem::file_size(pathSnapshot));
+    } catch (std::exception &e) {
+        fclose(file);
+        return false;
+    }
+    bool fRead = ss.empty() || fread(&ss[0], 1, ss.size(), file) == ss.size();
+    fclose(file);
+    if (!fRead || Hash(ss.begin(), ss.end()) != hashSnapshot)
+        return error("LoadBlockIndexSnapshot() : snapshot does not match the block database");
+
+    vector<CBlockIndex*> vIndex;
+    try {
+        int nVersion = 0, nSnapshotLastFile = 0;
+        unsigned int nSnapshotSize = 0, nSnapshotUndoSize = 0, nEntries = 0;
+        ss >> nVersion >> nSnapshotLastFile >> nSnapshotSize >> nSnapshotUndoSize >> nEntries;
+        if (nVersion != CLIENT_VERSION)
+            return false;
+
+        // a block file that grew since the snapshot was written means the database moved on
+        int nLastFile = 0;
+        CBlockFileInfo info;
+        pblocktree->ReadLastBlockFile(nLastFile);
+        pblocktree->ReadBlockFileInfo(nLastFile, info);
+        if (nLastFile != nSnapshotLastFile || info.nSize != nSnapshotSize || info.nUndoSize != nSnapshotUndoSize)
+            return error("LoadBlockIndexSnapshot() : block files changed since the snapshot was written");
+
+        vIndex.reserve(nEntries);
+        for (unsigned int i = 0; i < nEntries; i++) {
+            uint256 hash;
+            int nPrev;
+            CDiskBlockIndex diskindex;
+            uint256 nChainWork;
+            unsigned int nChainTx;
+            ss >> hash >> nPrev >> diskindex >> nChainWork >> nChainTx;
+            if (nPrev >= (int)vIndex.size())
+                throw std::runtime_error("entry refers to a later parent");
+
+            CBlockIndex* pindexNew = InsertBlockIndex(hash);
+            vIndex.push_back(pindexNew);
+            pindexNew->pprev          = nPrev < 0 ? NULL : vIndex[nPrev];
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+            pindexNew->nChainWork     = nChainWork;
+            pindexNew->nChainTx       = nChainTx;
+            if (!pindexNew->CheckIndex())
+                throw std::runtime_error("CheckIndex failed: " + pindexNew->ToString());
+
+            if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
+                pindexGenesisBlock = pindexNew;
+            if ((pindexNew->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindexNew->nStatus & BLOCK_FAILED_MASK))
+                setBlockIndexValid.insert(pindexNew);
+        }
+    } catch (std::exception &e) {
+        BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+            delete pindex;
+        UnloadBlockIndex();
+        return error("LoadBlockIndexSnapshot() : deserialize error: %s", e.what());
+    }
+
+    printf("LoadBlockIndexSnapshot(): loaded %u entries in %"PRI64d"ms\n", (unsigned int)vIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CheckBlockIndexSnapshot()
+{
+    if (!fBlockIndexFromSnapshot)
+        return true;
+    return pblocktree->CheckBlockIndex();
+}
+
+bool static LoadBlockIndexDB()
+{
+    fBlockIndexFromSnapshot = LoadBlockIndexSnapshot();
+    if (!fBlockIndexFromSnapshot) {
+        if (!pblocktree->LoadBlockIndexGuts())
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        // Calculate nChainWork
+        vector<pair<int, CBlockIndex*> > vSortedByHeight;
+        SortByHeight(vSortedByHeight);
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+        {
+            CBlockIndex* pindex = item.second;
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
+                setBlockIndexValid.insert(pindex);
+        }
     }
 
     // Load block file info
@@ -3310,6 +4763,15 @@ bool static LoadBlockIndexDB()
     // Check whether we have a transaction index
     pblocktree->ReadFlag("txindex", fTxIndex);
     printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    printf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    printf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+
+    // Check whether block files have been pruned
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        printf("LoadBlockIndexDB(): block files have been pruned\n");
 
     // Load hashBestChain pointer to end of best chain
     pindexBest = pcoinsTip->GetBestBlock();
@@ -3318,6 +4780,7 @@ bool static LoadBlockIndexDB()
     hashBestChain = pindexBest->GetBlockHash();
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexBest->nChainWork;
+    PublishChainTip(pindexBest);
 
     // set 'next' pointers in best chain
     CBlockIndex *pindex = pindexBest;
@@ -3335,79 +4798,119 @@ bool static LoadBlockIndexDB()
 
 bool VerifyDB(int nCheckLevel, int nCheckDepth)
 {
-    if (pindexBest == NULL || pindexBest->pprev == NULL)
+    CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = pindexBest;
+    }
+    if (pindexTip == NULL || pindexTip->pprev == NULL)
         return true;
 
     // Verify blocks in the best chain
     if (nCheckDepth <= 0)
         nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
+    if (nCheckDepth > pindexTip->nHeight)
+        nCheckDepth = pindexTip->nHeight;
     nCheckLevel = std::max(0, std::min(4, nCheckLevel));
     printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CCoinsViewCache coins(*pcoinsTip, true);
-    CBlockIndex* pindexState = pindexBest;
-    CBlockIndex* pindexFailure = NULL;
-    int nGoodTransactions = 0;
     CValidationState state;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    // Check levels 0 to 2 only hold cs_main while reading, so the node stays usable meanwhile
+    for (CBlockIndex* pindex = pindexTip; pindex && pindex->pprev; pindex = pindex->pprev)
     {
         boost::this_thread::interruption_point();
-        if (pindex->nHeight < nBestHeight-nCheckDepth)
+        if (pindex->nHeight < pindexTip->nHeight-nCheckDepth)
             break;
         CBlock block;
-        // check level 0: read from disk
-        if (!block.ReadFromDisk(pindex))
-            return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        {
+            LOCK(cs_main);
+            // pruned blocks cannot be verified
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                break;
+            // check level 0: read from disk
+            if (!block.ReadFromDisk(pindex))
+                return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+            // check level 2: verify undo validity
+            if (nCheckLevel >= 2) {
+                CBlockUndo undo;
+                CDiskBlockPos pos = pindex->GetUndoPos();
+                if (!pos.IsNull()) {
+                    if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                        return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+                }
+            }
+        }
         // check level 1: verify block validity
         if (nCheckLevel >= 1 && !block.CheckBlock(state, true, true, false))
             return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            }
-        }
-        // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
-            bool fClean = true;
-            if (!block.DisconnectBlock(state, pindex, coins, &fClean))
-                return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            pindexState = pindex->pprev;
-            if (!fClean) {
-                nGoodTransactions = 0;
-                pindexFailure = pindex;
-            } else
-                nGoodTransactions += block.vtx.size();
+    }
+    if (nCheckLevel < 3)
+        return true;
+
+    // Check levels 3 and 4 work against the coins database, which must not move meanwhile. cs_main
+    // is taken per block, and the checks given up once the best chain changed in between.
+    CCoinsViewCache coins(*pcoinsTip, true);
+    CBlockIndex* pindexState = pindexTip;
+    CBlockIndex* pindexFailure = NULL;
+    int nGoodTransactions = 0;
+    // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
+    for (CBlockIndex* pindex = pindexTip; pindex && pindex->pprev; pindex = pindex->pprev)
+    {
+        boost::this_thread::interruption_point();
+        if (pindex->nHeight < pindexTip->nHeight-nCheckDepth)
+            break;
+        LOCK(cs_main);
+        if (pindexBest != pindexTip) {
+            printf("VerifyDB() : best chain changed, skipping coin database checks\n");
+            return true;
         }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
+        if ((coins.GetCacheSize() + pcoinsTip->GetCacheSize()) > 2*nCoinCacheSize + 32000)
+            break;
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        bool fClean = true;
+        if (!block.DisconnectBlock(state, pindex, coins, &fClean))
+            return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        pindexState = pindex->pprev;
+        if (!fClean) {
+            nGoodTransactions = 0;
+            pindexFailure = pindex;
+        } else
+            nGoodTransactions += block.vtx.size();
     }
     if (pindexFailure)
-        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", pindexBest->nHeight - pindexFailure->nHeight + 1, nGoodTransactions);
+        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", pindexTip->nHeight - pindexFailure->nHeight + 1, nGoodTransactions);
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
         CBlockIndex *pindex = pindexState;
-        while (pindex != pindexBest) {
+        while (pindex != pindexTip) {
             boost::this_thread::interruption_point();
+            LOCK(cs_main);
+            if (pindexBest != pindexTip) {
+                printf("VerifyDB() : best chain changed, skipping coin database checks\n");
+                return true;
+            }
             pindex = pindex->pnext;
             CBlock block;
             if (!block.ReadFromDisk(pindex))
                 return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            if (!block.ConnectBlock(state, pindex, coins))
+            // on a scratch view; the address and spent indexes already describe the tip
+            if (!block.ConnectBlock(state, pindex, coins, false, false, false))
                 return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         }
     }
 
-    printf("No coin database inconsistencies in last %i blocks (%i transactions)\n", pindexBest->nHeight - pindexState->nHeight, nGoodTransactions);
+    printf("No coin database inconsistencies in last %i blocks (%i transactions)\n", pindexTip->nHeight - pindexState->nHeight, nGoodTransactions);
 
     return true;
 }
 
 void UnloadBlockIndex()
 {
+    PublishChainTip(NULL);
     mapBlockIndex.clear();
     setBlockIndexValid.clear();
     pindexGenesisBlock = NULL;
@@ -3447,6 +4950,11 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    // Likewise for the address and spent indexes
+    fAddressIndex = GetBoolArg("-addressindex", false);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+    fSpentIndex = GetBoolArg("-spentindex", false);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
     printf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3550,14 +5058,15 @@ bool InitBlockIndex() {
 
         // Start new block file
         try {
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            std::vector<unsigned char> vData;
+            unsigned int nSizeField = block.GetDiskData(vData);
             CDiskBlockPos blockPos;
             CValidationState state;
-            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.nTime))
+            if (!FindBlockPos(state, blockPos, vData.size()+8, 0, block.nTime))
                 return error("LoadBlockIndex() : FindBlockPos failed");
-            if (!block.WriteToDisk(blockPos))
+            if (!block.WriteToDisk(blockPos, vData, nSizeField))
                 return error("LoadBlockIndex() : writing genesis block to disk failed");
-            if (!block.AddToBlockIndex(state, blockPos))
+            if (!block.AddToBlockIndex(state, blockPos, hash))
                 return error("LoadBlockIndex() : genesis block not accepted");
             if (!WriteSyncCheckpoint(hashGenesisBlock))
                 return error("LoadBlockIndex() : failed to init sync checkpoint");
@@ -3645,6 +5154,31 @@ void PrintBlockTree()
     }
 }
 
+// Check the size field of a blk?????.dat record
+static bool IsValidBlockSizeField(unsigned int nSizeField)
+{
+    unsigned int nSize = nSizeField & ~BLOCK_COMPRESSED_FLAG;
+    if (nSizeField & BLOCK_COMPRESSED_FLAG)
+        return nSize > 4 && nSize <= MAX_BLOCK_SIZE;
+    return nSize >= 80 && nSize <= MAX_BLOCK_SIZE;
+}
+
+// Deserialize (the start of) a block from a blk?????.dat record, expanding it if it is compressed
+template<typename T>
+static void ReadBlockRecord(CBufferedFile &blkdat, unsigned int nSizeField, T &obj)
+{
+    if (!(nSizeField & BLOCK_COMPRESSED_FLAG)) {
+        blkdat >> obj;
+        return;
+    }
+    std::vector<unsigned char> vData(nSizeField & ~BLOCK_COMPRESSED_FLAG);
+    blkdat.read((char*)&vData[0], vData.size());
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    if (!DecompressBlockData(vData, ss))
+        throw std::ios_base::failure("corrupt compressed block");
+    ss >> obj;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64 nStart = GetTimeMillis();
@@ -3682,7 +5216,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                     continue;
                 // read size
                 blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                if (!IsValidBlockSizeField(nSize))
                     continue;
             } catch (std::exception &e) {
                 // no valid block header found; don't complain
@@ -3691,9 +5225,9 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
             try {
                 // read block
                 uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
+                blkdat.SetLimit(nBlockPos + (nSize & ~BLOCK_COMPRESSED_FLAG));
                 CBlock block;
-                blkdat >> block;
+                ReadBlockRecord(blkdat, nSize, block);
                 nRewind = blkdat.GetPos();
 
                 // process block
@@ -3720,6 +5254,303 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+// Locate the blocks in a block file and hash their headers, skipping over the transactions
+static void ScanBlockFile(int nFile, std::vector<CBlockFileEntry> &vEntries)
+{
+    CDiskBlockPos pos(nFile, 0);
+    FILE *file = OpenBlockFile(pos, true);
+    if (!file)
+        return;
+
+    unsigned char pchMessageStart[4];
+    GetMessageStart(pchMessageStart);
+
+    try {
+        CBufferedFile blkdat(file, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+        uint64 nRewind = blkdat.GetPos();
+        while (blkdat.good() && !blkdat.eof()) {
+            boost::this_thread::interruption_point();
+
+            // the end of the previous block may lie beyond the buffered data
+            if (!blkdat.SetPos(nRewind))
+                blkdat.Seek(nRewind);
+            nRewind++; // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0, nSizeField = 0;
+            try {
+                // locate a header
+                unsigned char buf[4];
+                blkdat.FindByte(pchMessageStart[0]);
+                nRewind = blkdat.GetPos()+1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, pchMessageStart, 4))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                if (!IsValidBlockSizeField(nSize))
+                    continue;
+                nSizeField = nSize;
+                nSize &= ~BLOCK_COMPRESSED_FLAG;
+            } catch (std::exception &e) {
+                // no valid block header found; don't complain
+                break;
+            }
+            try {
+                // read block header only
+                uint64 nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(nBlockPos + nSize);
+                CBlockHeader header;
+                ReadBlockRecord(blkdat, nSizeField, header);
+
+                CBlockFileEntry entry;
+                entry.hash = header.GetHash();
+                if (!CheckProofOfWork(entry.hash, header.nBits))
+                    continue;
+                entry.hashPrev = header.hashPrevBlock;
+                entry.nPos = nBlockPos;
+                entry.nSize = nSize;
+                vEntries.push_back(entry);
+                nRewind = nBlockPos + nSize;
+            } catch (std::exception &e) {
+                printf("%s() : Deserialize or I/O error caught during scan\n", __PRETTY_FUNCTION__);
+            }
+        }
+    } catch (boost::thread_interrupted) {
+        fclose(file);
+        throw;
+    } catch(std::runtime_error &e) {
+        printf("%s() : error scanning blk%05u.dat: %s\n", __PRETTY_FUNCTION__, (unsigned int)nFile, e.what());
+    }
+    fclose(file);
+}
+
+// Work shared between the -reindex scan threads
+struct CReindexScan
+{
+    boost::mutex mutex;
+    std::vector<int> vFilesToScan;
+    unsigned int nNext;
+    std::vector<std::vector<CBlockFileEntry> > vFileEntries;
+
+    CReindexScan() : nNext(0) {}
+};
+
+static void ThreadScanBlockFiles(CReindexScan *pscan)
+{
+    RenameThread("bitcoin-reindex");
+    while (true) {
+        int nFile;
+        {
+            boost::mutex::scoped_lock lock(pscan->mutex);
+            if (pscan->nNext >= pscan->vFilesToScan.size())
+                return;
+            nFile = pscan->vFilesToScan[pscan->nNext++];
+        }
+        std::vector<CBlockFileEntry> &vEntries = pscan->vFileEntries[nFile];
+        ScanBlockFile(nFile, vEntries);
+        printf("Scanned block file blk%05u.dat: %u blocks\n", (unsigned int)nFile, (unsigned int)vEntries.size());
+        // checkpoint, so an interrupted reindex does not have to scan this file again
+        pblocktree->WriteBlockFileScan(nFile, vEntries);
+    }
+}
+
+// A block to connect during -reindex, in the order they are connected
+struct CReindexBlock
+{
+    int nFile;
+    const CBlockFileEntry *pentry;
+
+    CReindexBlock(int nFileIn, const CBlockFileEntry *pentryIn) : nFile(nFileIn), pentry(pentryIn) {}
+};
+
+// Blocks read ahead of the -reindex connect phase, which takes them in order
+struct CReindexReader
+{
+    static const unsigned int MAX_READ_AHEAD = 16;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    const std::vector<CReindexBlock> &vOrder;
+    std::deque<std::pair<bool, CBlock> > queue; // read successfully, block
+    unsigned int nTaken;
+
+    CReindexReader(const std::vector<CReindexBlock> &vOrderIn) : vOrder(vOrderIn), nTaken(0) {}
+
+    // wait for the next block in order; false if it could not be read
+    bool Next(CBlock &block)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        while (queue.empty())
+            cond.wait(lock);
+        bool fRead = queue.front().first;
+        block = queue.front().second;
+        queue.pop_front();
+        nTaken++;
+        cond.notify_all();
+        return fRead;
+    }
+};
+
+static void ThreadReadReindexBlocks(CReindexReader *preader)
+{
+    RenameThread("bitcoin-reindex");
+    for (unsigned int i = 0; i < preader->vOrder.size(); i++) {
+        {
+            boost::mutex::scoped_lock lock(preader->mutex);
+            while (i >= preader->nTaken + CReindexReader::MAX_READ_AHEAD)
+                preader->cond.wait(lock);
+        }
+        const CReindexBlock &item = preader->vOrder[i];
+        std::pair<bool, CBlock> read(false, CBlock());
+        try {
+            // expands compressed records; proof of work was verified against the header while scanning
+            read.first = read.second.ReadFromDisk(CDiskBlockPos(item.nFile, item.pentry->nPos), false);
+        } catch (std::exception &e) {
+            printf("%s() : error reading block: %s\n", __PRETTY_FUNCTION__, e.what());
+        }
+        boost::mutex::scoped_lock lock(preader->mutex);
+        preader->queue.push_back(read);
+        preader->cond.notify_all();
+    }
+}
+
+bool ReindexBlockFiles(int nThreads)
+{
+    int64 nStart = GetTimeMillis();
+
+    int nFiles = 0;
+    while (true) {
+        FILE *file = OpenBlockFile(CDiskBlockPos(nFiles, 0), true);
+        if (!file)
+            break;
+        fclose(file);
+        nFiles++;
+    }
+
+    // Scan phase: locate all blocks, on several threads
+    CReindexScan scan;
+    scan.vFileEntries.resize(nFiles);
+    for (int nFile = 0; nFile < nFiles; nFile++)
+        if (!pblocktree->ReadBlockFileScan(nFile, scan.vFileEntries[nFile]))
+            scan.vFilesToScan.push_back(nFile);
+    if (!scan.vFilesToScan.empty()) {
+        nThreads = std::max(1, std::min(nThreads, (int)scan.vFilesToScan.size()));
+        printf("Scanning %u block files using %d threads...\n", (unsigned int)scan.vFilesToScan.size(), nThreads);
+        boost::thread_group threadGroupScan;
+        for (int i = 0; i < nThreads; i++)
+            threadGroupScan.create_thread(boost::bind(&ThreadScanBlockFiles, &scan));
+        try {
+            threadGroupScan.join_all();
+        } catch (boost::thread_interrupted) {
+            threadGroupScan.interrupt_all();
+            threadGroupScan.join_all();
+            throw;
+        }
+    }
+    printf("Located blocks in %d block files in %"PRI64d"ms\n", nFiles, GetTimeMillis() - nStart);
+
+    // Connect phase: accept the blocks parents-first, so none are lost as orphans. The order
+    // follows from the links found while scanning, so the blocks can be read ahead of time.
+    std::vector<CReindexBlock> vOrder;
+    {
+        typedef std::pair<int, const CBlockFileEntry*> FileEntry;
+        std::multimap<uint256, FileEntry> mapNext;
+        std::deque<FileEntry> queue;
+        {
+            LOCK(cs_main);
+            for (int nFile = 0; nFile < nFiles; nFile++) {
+                BOOST_FOREACH(const CBlockFileEntry &entry, scan.vFileEntries[nFile]) {
+                    if (mapBlockIndex.count(entry.hash))
+                        continue; // accepted before an interruption
+                    if (entry.hash == hashGenesisBlock || mapBlockIndex.count(entry.hashPrev))
+                        queue.push_back(FileEntry(nFile, &entry));
+                    else
+                        mapNext.insert(make_pair(entry.hashPrev, FileEntry(nFile, &entry)));
+                }
+            }
+        }
+        while (!queue.empty()) {
+            FileEntry item = queue.front();
+            queue.pop_front();
+            vOrder.push_back(CReindexBlock(item.first, item.second));
+            std::multimap<uint256, FileEntry>::iterator mi = mapNext.lower_bound(item.second->hash);
+            while (mi != mapNext.end() && mi->first == item.second->hash) {
+                queue.push_back(mi->second);
+                mapNext.erase(mi++);
+            }
+        }
+        if (!mapNext.empty())
+            printf("ReindexBlockFiles() : %u blocks without known parent skipped\n", (unsigned int)mapNext.size());
+    }
+
+    CReindexReader reader(vOrder);
+    boost::thread threadRead(boost::bind(&ThreadReadReindexBlocks, &reader));
+    int nLoaded = 0;
+    try {
+        for (unsigned int i = 0; i < vOrder.size(); i++) {
+            boost::this_thread::interruption_point();
+            const CBlockFileEntry &entry = *vOrder[i].pentry;
+            CDiskBlockPos pos(vOrder[i].nFile, entry.nPos);
+            CBlock block;
+            if (!reader.Next(block)) {
+                error("ReindexBlockFiles() : failed to read block at blk%05u.dat:%u", (unsigned int)pos.nFile, pos.nPos);
+                continue;
+            }
+
+            LOCK(cs_main);
+            if (mapBlockIndex.count(entry.hash))
+                continue; // duplicate copy of a block
+            if (entry.hash != hashGenesisBlock && !mapBlockIndex.count(entry.hashPrev))
+                continue; // its parent was not accepted
+            CValidationState state;
+            // proof of work was verified against the header while scanning, and the hash is reused
+            fReindexConnect = true;
+            bool fProcessed = ProcessBlock(state, NULL, &block, &pos, false, &entry.hash);
+            fReindexConnect = false;
+            if (fProcessed)
+                nLoaded++;
+            if (state.IsError()) {
+                threadRead.interrupt();
+                threadRead.join();
+                return false;
+            }
+            if (nLoaded % 10000 == 0)
+                printf("Reindexed %d blocks...\n", nLoaded);
+        }
+    } catch (boost::thread_interrupted) {
+        threadRead.interrupt();
+        threadRead.join();
+        throw;
+    }
+    threadRead.join();
+
+    // Blocks were accepted out of file order; make sure new blocks get appended behind all existing data
+    if (nFiles > 0) {
+        LOCK(cs_LastBlockFile);
+        int nFile = nFiles - 1;
+        unsigned int nEnd = 0;
+        BOOST_FOREACH(const CBlockFileEntry &entry, scan.vFileEntries[nFile])
+            nEnd = std::max(nEnd, entry.nPos + entry.nSize);
+        if (nLastBlockFile != nFile) {
+            nLastBlockFile = nFile;
+            infoLastBlockFile.SetNull();
+            pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile);
+            pblocktree->WriteLastBlockFile(nLastBlockFile);
+            fBlockFileInfoLoaded = false;
+        }
+        if (infoLastBlockFile.nSize < nEnd) {
+            infoLastBlockFile.nSize = nEnd;
+            pblocktree->WriteBlockFileInfo(nLastBlockFile, infoLastBlockFile);
+        }
+    }
+
+    for (int nFile = 0; nFile < nFiles; nFile++)
+        pblocktree->EraseBlockFileScan(nFile);
+
+    printf("Reindexed %d blocks in %"PRI64d"ms\n", nLoaded, GetTimeMillis() - nStart);
+    return true;
+}
+
 
 
 
@@ -3763,8 +5594,9 @@ string GetWarnings(string strFor)
         strStatusBar = strMiscWarning;
     }
 
-    // Longer invalid proof-of-work chain
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    // Longer invalid proof-of-work chain (RPC calls ask this without cs_main, so use the published tip)
+    boost::shared_ptr<const CChainTip> tip = GetChainTip();
+    if (tip->pindex && nBestInvalidWork > tip->nChainWork + (tip->pindex->GetBlockWork() * 6).getuint256())
     {
         nPriority = 2000;
         strStatusBar = strRPC = _("Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.");
@@ -3876,6 +5708,12 @@ void static ProcessGetData(CNode* pfrom)
                          send = false;
                        }
                     }
+                    // The block data may have been pruned
+                    if (send && !(((*mi).second)->nStatus & BLOCK_HAVE_DATA)) {
+                        printf("ProcessGetData(): block %s has been pruned, not sending\n", inv.hash.ToString().c_str());
+                        vNotFound.push_back(inv);
+                        send = false;
+                    }
                 } else {
                     send = false;
                 }
@@ -4475,6 +6313,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 printf("  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
                 break;
             }
+            // Don't announce blocks whose data has been pruned
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            {
+                printf("  getblocks stopping at pruned block %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -4527,9 +6371,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
+        // This runs without cs_main (see ProcessMessages): AcceptToMemoryPool only takes it to look
+        // up the inputs and to insert, so nothing else waits while the signatures are checked
         vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
 
@@ -4541,37 +6385,42 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs))
         {
             RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
+            {
+                LOCK(cs_main);
+                mapAlreadyAskedFor.erase(inv);
+            }
             vEraseQueue.push_back(inv.hash);
 
             printf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %"PRIszu")\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                 tx.GetHash().ToString().c_str(),
-                mempool.mapTx.size());
+                mempool.size());
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+            // Process the orphan transactions that depended on this one, a generation at a time:
+            // the children of everything accepted in one round are looked up together
+            vector<uint256> vParents(1, inv.hash);
+            while (!vParents.empty())
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
+                vector<CTransaction> vChildren;
+                {
+                    LOCK(cs_main);
+                    GetOrphanChildren(vParents, vChildren);
+                }
+                vParents.clear();
+                BOOST_FOREACH(CTransaction& orphanTx, vChildren)
                 {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
+                    uint256 orphanHash = orphanTx.GetHash();
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
                     // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
                     // anyone relaying LegitTxX banned)
                     CValidationState stateDummy;
 
-                    if (tx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
+                    if (orphanTx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
                     {
                         printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
                         RelayTransaction(orphanTx, orphanHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
-                        vWorkQueue.push_back(orphanHash);
+                        vParents.push_back(orphanHash);
                         vEraseQueue.push_back(orphanHash);
                     }
                     else if (!fMissingInputs2)
@@ -4581,17 +6430,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                         printf("   removed orphan tx %s\n", orphanHash.ToString().c_str());
                     }
                 }
-            }
 
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+                LOCK(cs_main);
+                BOOST_FOREACH(const uint256& hash, vParents)
+                    mapAlreadyAskedFor.erase(CInv(MSG_TX, hash));
+                BOOST_FOREACH(uint256 hash, vEraseQueue)
+                    EraseOrphanTx(hash);
+                vEraseQueue.clear();
+            }
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx);
+            LOCK(cs_main);
+            AddOrphanTx(tx, pfrom->id);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, MAX_ORPHAN_POOL_SIZE);
             if (nEvicted > 0)
                 printf("mapOrphan overflow, removed %u tx\n", nEvicted);
         }
@@ -4881,7 +6735,10 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
-            {
+            if (strCommand == "tx") {
+                // takes cs_main itself, and only for the parts that need it
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            } else {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
             }
@@ -5886,6 +7743,8 @@ public:
 
         // orphan transactions
         mapOrphanTransactions.clear();
+        mapOrphanTransactionsByPrev.clear();
+        mapOrphanPeers.clear();
     }
 } instance_of_cmaincleanup;
 
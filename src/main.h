@@ -11,16 +11,20 @@
 #include "script.h"
 #include "hashblock.h"
 #include "base58.h"
+#include "muhash.h"
+#include "feeestimator.h"
 
 #include <list>
 #include <algorithm>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
 
 //#define static_assert(numeric_limits<double>::max_exponent() > 8, "your double sux");
 
 class CWallet;
 class CBlock;
 class CBlockIndex;
+class CChainTip;
 class CKeyItem;
 class CReserveKey;
 
@@ -59,8 +63,26 @@ static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 17000;
 static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 /** The maximum allowed number of signature check operations in a block (network rule) */
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
+/** Default for -maxmempool, maximum megabytes of serialized transactions kept in the memory pool */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, hours after which unconfirmed transactions are dropped from the memory pool */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -limitancestorcount, the most in-pool ancestors (itself included) a transaction may have */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitdescendantcount, the most in-pool descendants (itself included) a transaction may have */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Seconds in which the memory pool minimum fee raised by an eviction decays to half */
+static const int64 ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+/** Default for -txconfirmtarget, the number of blocks within which wallet transactions should confirm */
+static const unsigned int DEFAULT_TX_CONFIRM_TARGET = 2;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** The maximum total serialized size of the orphan transactions kept in memory */
+static const unsigned int MAX_ORPHAN_POOL_SIZE = 5 * MAX_BLOCK_SIZE;
+/** The part of the orphan pool a single peer can fill before its oldest orphans are dropped */
+static const unsigned int MAX_ORPHAN_POOL_SIZE_PER_PEER = MAX_ORPHAN_POOL_SIZE / 10;
+/** Seconds after which an orphan transaction whose parents never showed up is dropped */
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -69,6 +91,12 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Set in the size field of a blk?????.dat record whose block data is stored compressed */
+static const unsigned int BLOCK_COMPRESSED_FLAG = 0x80000000;
+/** Number of blocks below the tip whose block and undo files are never pruned */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
+/** Smallest allowed -prune target: MIN_BLOCKS_TO_KEEP full blocks plus undo data, chunk pre-allocation and a safety margin */
+static const uint64 MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 /** Dust Soft Limit, allowed with additional fee per output */
@@ -123,6 +151,12 @@ extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern int nAskedForBlocks;    // Nodes sent a getblocks 0
 extern bool fTxIndex;
+extern bool fAddressIndex;     // -addressindex: index outputs and inputs by the address they pay or spend
+extern bool fSpentIndex;       // -spentindex: index which input spends each output
+extern bool fPruneMode;        // -prune is active: delete old block and undo files
+extern bool fHavePruned;       // block and undo files have been deleted at some point
+extern uint64 nPruneTarget;    // target size of block and undo files in bytes
+extern bool fCompressBlocks;   // -compressblocks: store new blocks compressed when that saves space
 extern unsigned int nCoinCacheSize;
 extern CDarkSendPool darkSendPool;
 extern CDarkSendSigner darkSendSigner;
@@ -135,6 +169,7 @@ extern std::map<uint256, CBlock*> mapOrphanBlocks;
 
 // Settings
 extern int64 nTransactionFee;
+extern unsigned int nTxConfirmTarget;
 extern int64 nMinimumInputValue;
 
 // Minimum disk space required - used in CheckDiskSpace()
@@ -145,10 +180,16 @@ class CReserveKey;
 class CCoinsDB;
 class CBlockTreeDB;
 struct CDiskBlockPos;
+struct CAddressIndexKey;
+struct CAddressUnspentKey;
+struct CAddressUnspentValue;
+struct CSpentIndexValue;
+class COutPoint;
 class CCoins;
 class CTxUndo;
 class CCoinsView;
 class CCoinsViewCache;
+class CCoinsCommitment;
 class CScriptCheck;
 class CValidationState;
 
@@ -160,24 +201,52 @@ void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Apply the notifications queued for the registered wallets, from now on on this thread only */
+void ThreadSyncWithWallets();
+/** Wait up to nTimeout milliseconds for the wallets to catch up with everything queued so far */
+bool WaitForWallets(int64 nTimeout);
+/** Apply whatever notifications are still queued, on the calling thread */
+void FlushWalletNotifications();
+/** Process an incoming block; phash may pass in its hash if the caller already computed it */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fCheckPOW = true, const uint256 *phash = NULL);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** Read the serialized block stored at pos into ss, expanding it if it was stored compressed */
+bool ReadBlockData(const CDiskBlockPos &pos, CDataStream &ss);
+/** Expand the data of a compressed blk?????.dat record into ss */
+bool DecompressBlockData(const std::vector<unsigned char> &vData, CDataStream &ss);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** Delete the oldest block and undo files until their total size is below the -prune target,
+    never touching files holding any of the last MIN_BLOCKS_TO_KEEP blocks below nTipHeight */
+bool PruneBlockFiles(int nTipHeight);
+/** Load the memory pool saved in mempool.dat, accepting it in batches whose scripts are checked in parallel */
+bool LoadMempool();
+/** Save the memory pool to mempool.dat */
+bool DumpMempool();
+/** Whether LoadMempool has finished; dumping before that would lose the transactions not loaded yet */
+bool IsMempoolLoaded();
+/** Count the mempool as loaded without reading mempool.dat (with -persistmempool=0) */
+void SetMempoolLoaded();
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Rebuild the block index from the blk?????.dat files: locate the blocks on nThreads threads,
+    then accept them in chain order. Resumes from the scan results of an interrupted run. */
+bool ReindexBlockFiles(int nThreads);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
-/** Verify consistency of the block and coin databases */
+/** Verify consistency of the block and coin databases; safe to call without holding cs_main */
 bool VerifyDB(int nCheckLevel, int nCheckDepth);
+/** Write the in-memory block index to blocks/index.snapshot, to be loaded by the next startup */
+bool WriteBlockIndexSnapshot();
+/** Compare a block index loaded from the snapshot with the block tree database */
+bool CheckBlockIndexSnapshot();
 /** Print the loaded block tree */
 void PrintBlockTree();
 /** Find a block by height in the currently-connected chain */
@@ -188,6 +257,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread checking scripts of transactions entering the memory pool */
+void ThreadMempoolScriptCheck();
 //** Get age of an input */
 int GetInputAge(CTxIn& vin);
 /** Run the miner threads */
@@ -213,10 +284,18 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
+/** Retrieve the address index entries of an address between two heights (inclusive) */
+bool GetAddressIndex(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressIndexKey, int64> > &vEntries, int nStartHeight = 0, int nEndHeight = std::numeric_limits<int>::max());
+/** Retrieve the unspent outputs paying to an address */
+bool GetAddressUnspent(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent);
+/** Find the input spending an output */
+bool GetSpentIndex(const COutPoint &outpoint, CSpentIndexValue &value);
 /** Connect/disconnect blocks until pindexNew is the new tip of the active block chain */
 bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew);
 /** Find the best known block, and make it the tip of the block chain */
 bool ConnectBestBlock(CValidationState &state);
+/** The tip of the active chain as last published; never NULL, and safe to use without cs_main */
+boost::shared_ptr<const CChainTip> GetChainTip();
 /** Create a new block index entry for a given block hash */
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Verify a signature */
@@ -494,6 +573,156 @@ public:
 };
 
 
+/** Address index types */
+enum
+{
+    ADDRESS_TYPE_KEYHASH = 1,
+    ADDRESS_TYPE_SCRIPTHASH = 2,
+};
+
+/** Entry of the address index: an output paying to, or an input spending from, an address.
+ *
+ * Keys sort by address and then by height (stored big endian), so the history
+ * of an address within a range of heights is a single range scan.
+ */
+struct CAddressIndexKey
+{
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    int nHeight;
+    uint256 txhash;
+    unsigned int nIndex;    // input or output index in txhash
+    bool fSpending;
+
+    CAddressIndexKey() : nAddressType(0), hashAddress(0), nHeight(0), txhash(0), nIndex(0), fSpending(false) {}
+
+    CAddressIndexKey(unsigned char nAddressTypeIn, const uint160 &hashAddressIn, int nHeightIn,
+                     const uint256 &txhashIn, unsigned int nIndexIn, bool fSpendingIn) :
+        nAddressType(nAddressTypeIn), hashAddress(hashAddressIn), nHeight(nHeightIn),
+        txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const
+    {
+        ::Serialize(s, nAddressType, nType, nVersion);
+        hashAddress.Serialize(s, nType, nVersion);
+        unsigned char pchHeight[4] = { (unsigned char)(nHeight >> 24), (unsigned char)(nHeight >> 16),
+                                       (unsigned char)(nHeight >> 8), (unsigned char)nHeight };
+        s.write((char*)pchHeight, 4);
+        txhash.Serialize(s, nType, nVersion);
+        ::Serialize(s, nIndex, nType, nVersion);
+        ::Serialize(s, fSpending, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion)
+    {
+        ::Unserialize(s, nAddressType, nType, nVersion);
+        hashAddress.Unserialize(s, nType, nVersion);
+        unsigned char pchHeight[4];
+        s.read((char*)pchHeight, 4);
+        nHeight = (pchHeight[0] << 24) | (pchHeight[1] << 16) | (pchHeight[2] << 8) | pchHeight[3];
+        txhash.Unserialize(s, nType, nVersion);
+        ::Unserialize(s, nIndex, nType, nVersion);
+        ::Unserialize(s, fSpending, nType, nVersion);
+    }
+};
+
+/** Key of the index of unspent outputs by address */
+struct CAddressUnspentKey
+{
+    unsigned char nAddressType;
+    uint160 hashAddress;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddressUnspentKey() : nAddressType(0), hashAddress(0), txhash(0), nIndex(0) {}
+
+    CAddressUnspentKey(unsigned char nAddressTypeIn, const uint160 &hashAddressIn, const uint256 &txhashIn, unsigned int nIndexIn) :
+        nAddressType(nAddressTypeIn), hashAddress(hashAddressIn), txhash(txhashIn), nIndex(nIndexIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nAddressType);
+        READWRITE(hashAddress);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+    )
+};
+
+/** An unspent output in the address index; a null value erases the entry */
+struct CAddressUnspentValue
+{
+    int64 nValue;
+    CScript scriptPubKey;
+    int nHeight;
+
+    CAddressUnspentValue() { SetNull(); }
+
+    CAddressUnspentValue(int64 nValueIn, const CScript &scriptPubKeyIn, int nHeightIn) :
+        nValue(nValueIn), scriptPubKey(scriptPubKeyIn), nHeight(nHeightIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(scriptPubKey);
+        READWRITE(nHeight);
+    )
+
+    void SetNull()
+    {
+        nValue = -1;
+        scriptPubKey.clear();
+        nHeight = 0;
+    }
+
+    bool IsNull() const
+    {
+        return nValue == -1;
+    }
+};
+
+/** Where an output was spent, in the spent index; a null value erases the entry */
+struct CSpentIndexValue
+{
+    uint256 txid;
+    unsigned int nInputIndex;
+    int nHeight;
+
+    CSpentIndexValue() { SetNull(); }
+
+    CSpentIndexValue(const uint256 &txidIn, unsigned int nInputIndexIn, int nHeightIn) :
+        txid(txidIn), nInputIndex(nInputIndexIn), nHeight(nHeightIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txid);
+        READWRITE(nInputIndex);
+        READWRITE(nHeight);
+    )
+
+    void SetNull()
+    {
+        txid = 0;
+        nInputIndex = 0;
+        nHeight = 0;
+    }
+
+    bool IsNull() const
+    {
+        return txid == 0;
+    }
+};
+
+/** Find the address index type and hash of the address a script pays to; false if it is not indexed */
+bool GetAddressIndexKey(const CScript &scriptPubKey, unsigned char &nAddressType, uint160 &hashAddress);
+
+
 
 enum GetMinFee_mode
 {
@@ -661,7 +890,8 @@ public:
 // Apply the effects of this transaction on the UTXO set represented by view
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight, const uint256 &txhash);
 
-    int64 GetMinFee(unsigned int nBlockSize=1, bool fAllowFree=true, enum GetMinFee_mode mode=GMF_BLOCK) const;
+    // nBytes, if given, stands in for the serialized size, e.g. of a transaction not yet signed
+    int64 GetMinFee(unsigned int nBlockSize=1, bool fAllowFree=true, enum GetMinFee_mode mode=GMF_BLOCK, unsigned int nBytes=0) const;
 
     friend bool operator==(const CTransaction& a, const CTransaction& b)
     {
@@ -710,7 +940,7 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
                      std::vector<CScriptCheck> *pvChecks = NULL) const;
 
     // Apply the effects of this transaction on the UTXO set represented by view
-    void UpdateCoins(CValidationState &state, CCoinsViewCache &view, CTxUndo &txundo, int nHeight, const uint256 &txhash) const;
+    void UpdateCoins(CValidationState &state, CCoinsViewCache &view, CTxUndo &txundo, int nHeight, const uint256 &txhash, CCoinsCommitment *pcommit = NULL) const;
 
     // Context-independent validity checks
     bool CheckTransaction(CValidationState &state) const;
@@ -1552,7 +1782,12 @@ public:
         return hash;
     }
 
-    bool WriteToDisk(CDiskBlockPos &pos)
+    // Serialize the block as stored in a blk?????.dat record, compressed if -compressblocks
+    // is set and that saves space. Returns the value for the record's size field.
+    unsigned int GetDiskData(std::vector<unsigned char> &vData) const;
+
+    // Write the record produced by GetDiskData
+    bool WriteToDisk(CDiskBlockPos &pos, const std::vector<unsigned char> &vData, unsigned int nSizeField)
     {
         // Open history file to append
         CAutoFile fileout = CAutoFile(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
@@ -1562,15 +1797,15 @@ public:
         // Write index header
         unsigned char pchMessageStart[4];
         GetMessageStart(pchMessageStart);
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(pchMessageStart) << nSize;
+        fileout << FLATDATA(pchMessageStart) << nSizeField;
 
         // Write block
         long fileOutPos = ftell(fileout);
         if (fileOutPos < 0)
             return error("CBlock::WriteToDisk() : ftell failed");
         pos.nPos = (unsigned int)fileOutPos;
-        fileout << *this;
+        if (!vData.empty())
+            fileout.write((const char*)&vData[0], vData.size());
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
@@ -1580,25 +1815,25 @@ public:
         return true;
     }
 
-    bool ReadFromDisk(const CDiskBlockPos &pos)
+    bool ReadFromDisk(const CDiskBlockPos &pos, bool fCheckPOW = true)
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+        // Read block data, which may be stored compressed
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        if (!ReadBlockData(pos, ss))
+            return error("CBlock::ReadFromDisk() : ReadBlockData failed");
 
         // Read block
         try {
-            filein >> *this;
+            ss >> *this;
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
         }
 
         // Check the header
-        if (!CheckProofOfWork(GetPoWHash(), nBits))
+        if (fCheckPOW && !CheckProofOfWork(GetPoWHash(), nBits))
             return error("CBlock::ReadFromDisk() : errors in block header");
 
         return true;
@@ -1635,21 +1870,25 @@ public:
      *  of problems. Note that in any case, coins may be modified. */
     bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins.
+    // With fHeaderChecked (reindex), the proof of work was checked against pindex's hash already,
+    // and the header only has to match pindex. Without fUpdateIndexes, the address and spent
+    // indexes are left alone, as when reconnecting on a scratch view.
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, bool fHeaderChecked=false, bool fUpdateIndexes=true);
 
-    // Read a block from disk
-    bool ReadFromDisk(const CBlockIndex* pindex);
+    // Read a block from disk. Without fCheckPOW the block is taken to be the one the index
+    // entry describes, and its header is not hashed again.
+    bool ReadFromDisk(const CBlockIndex* pindex, bool fCheckPOW = true);
 
-    // Add this block to the block index, and if necessary, switch the active block chain to this
-    bool AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos);
+    // Add this block, whose hash is hash, to the block index, and if necessary, switch the active block chain to this
+    bool AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos, const uint256 &hash);
 
     // Context-independent validity checks
     bool CheckBlock(CValidationState &state, bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckVotes=true) const;
 
-    // Store block on disk
+    // Store block, whose hash is hash, on disk
     // if dbp is provided, the file is known to already reside on disk
-    bool AcceptBlock(CValidationState &state, CDiskBlockPos *dbp = NULL);
+    bool AcceptBlock(CValidationState &state, const uint256 &hash, CDiskBlockPos *dbp = NULL);
 
     
     bool MasterNodePaymentsOn() const
@@ -1720,13 +1959,35 @@ public:
          if (nBlocks==0 || nTimeFirst > nTimeIn)
              nTimeFirst = nTimeIn;
          nBlocks++;
-         if (nHeightIn > nHeightFirst)
+         if (nHeightIn > nHeightLast)
              nHeightLast = nHeightIn;
          if (nTimeIn > nTimeLast)
              nTimeLast = nTimeIn;
      }
 };
 
+/** Location of a block found while scanning a block file during -reindex */
+class CBlockFileEntry
+{
+public:
+    uint256 hash;
+    uint256 hashPrev;
+    unsigned int nPos;         // offset of the block data (past magic and size)
+    unsigned int nSize;        // serialized size of the block
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(hash);
+        READWRITE(hashPrev);
+        READWRITE(VARINT(nPos));
+        READWRITE(VARINT(nSize));
+    )
+
+    CBlockFileEntry() {
+        nPos = 0;
+        nSize = 0;
+    }
+};
+
 extern CCriticalSection cs_LastBlockFile;
 extern CBlockFileInfo infoLastBlockFile;
 extern int nLastBlockFile;
@@ -1967,6 +2228,31 @@ struct CBlockIndexWorkComparator
     }
 };
 
+/** An immutable snapshot of the active chain tip.
+ *
+ * A new one is published each time the tip changes, so that readers such as
+ * the RPC calls reporting chain state need not wait for cs_main while blocks
+ * are being connected. pindex may be followed backwards through pprev without
+ * cs_main, as block index entries and their ancestry never change once added.
+ */
+class CChainTip
+{
+public:
+    CBlockIndex* pindex; // NULL while there is no chain
+    int nHeight;
+    uint256 hashBlock;
+    unsigned int nBits;
+    uint256 nChainWork;
+    int64 nTime;
+    int64 nMedianTimePast;
+
+    CChainTip() : pindex(NULL), nHeight(-1), hashBlock(0), nBits(0), nChainWork(0), nTime(0), nMedianTimePast(0) {}
+
+    explicit CChainTip(CBlockIndex* pindexIn) : pindex(pindexIn), nHeight(pindexIn->nHeight),
+        hashBlock(pindexIn->GetBlockHash()), nBits(pindexIn->nBits), nChainWork(pindexIn->nChainWork),
+        nTime(pindexIn->GetBlockTime()), nMedianTimePast(pindexIn->GetMedianTimePast()) {}
+};
+
 
 
 /** Used to marshal pointers into hashes for db storage. */
@@ -2228,22 +2514,125 @@ public:
 
 
 
+/** A transaction kept until its missing inputs arrive, with the peer that sent it */
+class COrphanTx
+{
+public:
+    CTransaction tx;
+    NodeId fromPeer;
+    int64 nTimeExpire;
+    unsigned int nTxSize;
+
+    COrphanTx() : fromPeer(-1), nTimeExpire(0), nTxSize(0) {}
+    COrphanTx(const CTransaction &txIn, NodeId peer, int64 nTimeExpireIn, unsigned int nTxSizeIn) :
+        tx(txIn), fromPeer(peer), nTimeExpire(nTimeExpireIn), nTxSize(nTxSizeIn) {}
+};
+
+/** Erase the orphan transactions a peer sent, once it is gone (requires cs_main) */
+void EraseOrphansFor(NodeId peer);
+
+
+
+/** Fee, size and dependency bookkeeping for a transaction in the memory pool */
+class CTxMemPoolEntry
+{
+public:
+    int64 nFee;                 // fee paid by the transaction itself (0 if unknown)
+    unsigned int nTxSize;       // serialized size
+    int64 nTime;                // time it entered the pool
+    int nHeight;                // best chain height when it entered the pool
+
+    // totals over the transaction and its in-pool descendants
+    unsigned int nCountWithDescendants;
+    uint64 nSizeWithDescendants;
+    int64 nFeesWithDescendants;
+
+    // totals over the transaction and its in-pool ancestors
+    unsigned int nCountWithAncestors;
+    uint64 nSizeWithAncestors;
+    int64 nFeesWithAncestors;
+
+    CTxMemPoolEntry(int64 nFeeIn = 0, unsigned int nTxSizeIn = 0, int64 nTimeIn = 0, int nHeightIn = 0) :
+        nFee(nFeeIn), nTxSize(nTxSizeIn), nTime(nTimeIn), nHeight(nHeightIn),
+        nCountWithDescendants(1), nSizeWithDescendants(nTxSizeIn), nFeesWithDescendants(nFeeIn),
+        nCountWithAncestors(1), nSizeWithAncestors(nTxSizeIn), nFeesWithAncestors(nFeeIn) {}
+
+    // fee rate of the transaction together with everything that spends it, in satoshis per byte;
+    // evicting by this never leaves a child behind that pays for a low fee parent
+    double GetDescendantFeeRate() const
+    {
+        return nSizeWithDescendants ? (double)nFeesWithDescendants / nSizeWithDescendants : 0.0;
+    }
+};
+
 class CTxMemPool
 {
+private:
+    // lowest package fee rate first, oldest first
+    std::set<std::pair<double, uint256> > setByDescendantFeeRate;
+    std::set<std::pair<int64, uint256> > setByTime;
+    // accepted with their script checks deferred, and not known to pass them yet
+    std::set<uint256> setUnverified;
+    uint64 nTotalTxSize;
+    CFeeEstimator feeEstimator;
+    // fee rate (satoshis per byte) a transaction must beat after evictions, and when it last changed
+    double dRollingMinFeeRate;
+    int64 nLastRollingFeeUpdate;
+
+    // stops and returns false once there are more than nLimit ancestors
+    bool CalculateAncestors(const CTransaction &tx, std::set<uint256> &setAncestors,
+                            unsigned int nLimit = std::numeric_limits<unsigned int>::max());
+    void CalculateDescendants(const uint256 &hash, std::set<uint256> &setDescendants);
+    void UpdateDescendantTotals(const uint256 &hash, int64 nSizeDiff, int64 nFeeDiff, int nCountDiff);
+
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
     std::map<COutPoint, CInPoint> mapNextTx;
 
-    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
+    CTxMemPool() : nTotalTxSize(0), dRollingMinFeeRate(0), nLastRollingFeeUpdate(0) {}
+
+    // If pvChecks is not NULL, script checks are pushed onto it instead of being performed, and the
+    // transaction is added regardless, hidden from queryHashes: the caller must remove it again if
+    // any of them fails, and otherwise call setVerified and pass it on to the wallets itself.
+    bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs,
+                std::vector<CScriptCheck> *pvChecks = NULL);
     bool acceptable(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
     bool acceptableInputs(CValidationState &state, CTransaction &tx, bool fLimitFree);
-    bool addUnchecked(const uint256& hash, const CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTransaction &tx, int64 nFee = 0);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
+    // the hashes of the transactions whose scripts are verified
     void queryHashes(std::vector<uint256>& vtxid);
+    // Make a transaction accepted with deferred script checks visible, once those passed
+    void setVerified(const uint256 &hash);
+    bool isVerified(const uint256 &hash);
     void pruneSpent(const uint256& hash, CCoins &coins);
+    // Remove transactions (and their descendants) that entered the pool before nTime
+    int Expire(int64 nTime);
+    // Evict the lowest fee rate packages until the serialized size is at most nSizeLimit
+    int TrimToSize(uint64 nSizeLimit);
+    // Fee a transaction of nSize bytes must pay to get in, above the fee rates evicted lately (0 if none were)
+    int64 GetMinFee(unsigned int nSize);
+    // Whether tx could enter without exceeding the ancestor count limit, or the descendant count limit of its ancestors
+    bool CheckPackageLimits(const CTransaction &tx, unsigned int nAncestorLimit, unsigned int nDescendantLimit);
+    // Restore the time a transaction entered the pool (when loading it from disk)
+    void SetEntryTime(const uint256 &hash, int64 nTime);
+    // Feed the fee estimator the transactions of a block connected at nHeight
+    void processBlock(int nHeight, const std::vector<CTransaction> &vtx);
+    // Fee rate (satoshis per 1000 bytes) and priority needed to confirm within nBlocks, or -1 if unknown
+    double estimateFee(int nBlocks);
+    double estimatePriority(int nBlocks);
+    bool WriteFeeEstimates(CAutoFile &fileout);
+    bool ReadFeeEstimates(CAutoFile &filein);
+
+    uint64 GetTotalTxSize()
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
 
     unsigned long size()
     {
@@ -2277,6 +2666,43 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** Running commitment to the unspent transaction output set.
+ *  It is updated as blocks are connected and disconnected and stored together
+ *  with the best block, so statistics about the set never require a scan.
+ *  Outputs are only ever added for a txid without unspent outputs: ConnectBlock
+ *  enforces BIP30 on every block, so no transaction overwrites an earlier one with
+ *  the same txid. Were that rule ever relaxed, the overwritten outputs would have to
+ *  be removed from the commitment first, or it would keep counting outputs that
+ *  left the set. */
+class CCoinsCommitment
+{
+public:
+    CMuHash3072 muhash;
+    uint64 nTransactions;
+    uint64 nTransactionOutputs;
+    uint64 nSerializedSize;
+    int64 nTotalAmount;
+
+    CCoinsCommitment() : nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(muhash);
+        READWRITE(VARINT(nTransactions));
+        READWRITE(VARINT(nTransactionOutputs));
+        READWRITE(VARINT(nSerializedSize));
+        READWRITE(nTotalAmount);
+    )
+
+    // Account for an output becoming spendable (unspent output n of txid)
+    void AddOutput(const uint256 &txid, unsigned int n, const CCoins &coins);
+
+    // Account for an unspent output being spent
+    void RemoveOutput(const uint256 &txid, unsigned int n, const CCoins &coins);
+
+    // Fill in the output set statistics
+    void GetStats(CCoinsStats &stats) const;
+};
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2297,12 +2723,16 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock), optionally
+    // replacing the output set commitment
+    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsCommitment *pcommit = NULL);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
 
+    // Retrieve the running commitment to the unspent transaction output set
+    virtual bool GetCommitment(CCoinsCommitment &commit);
+
     // As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -2321,8 +2751,9 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsCommitment *pcommit = NULL);
     bool GetStats(CCoinsStats &stats);
+    bool GetCommitment(CCoinsCommitment &commit);
 };
 
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
@@ -2331,6 +2762,8 @@ class CCoinsViewCache : public CCoinsViewBacked
 protected:
     CBlockIndex *pindexTip;
     std::map<uint256,CCoins> cacheCoins;
+    CCoinsCommitment commitment;
+    bool fHaveCommitment;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2341,13 +2774,19 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsCommitment *pcommit = NULL);
+    bool GetStats(CCoinsStats &stats);
+    bool GetCommitment(CCoinsCommitment &commit);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
     // copying.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return the modifiable output set commitment of this cache, or NULL if the
+    // underlying view does not maintain one.
+    CCoinsCommitment *GetCommitment();
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
@@ -0,0 +1,81 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "muhash.h"
+#include "hash.h"
+
+#include <openssl/sha.h>
+
+using namespace std;
+
+// 2^3072 - 1103717, the largest prime below 2^3072
+static const CBigNum bnModulus = (CBigNum(1) << 3072) - CBigNum(1103717);
+
+CMuHash3072::CMuHash3072() : bnNumerator(1), bnDenominator(1)
+{
+}
+
+void CMuHash3072::ToGroupElement(const vector<unsigned char> &vchData, CBigNum &bnOut)
+{
+    // Expand SHA256(data) into 3072 bits: SHA256(SHA256(data) || i) for i = 0..11
+    unsigned char pchSeed[32 + 1];
+    SHA256(vchData.empty() ? pchSeed : &vchData[0], vchData.size(), pchSeed);
+
+    unsigned char pchExpanded[BYTE_SIZE];
+    for (unsigned int i = 0; i < BYTE_SIZE / 32; i++) {
+        pchSeed[32] = (unsigned char)i;
+        SHA256(pchSeed, sizeof(pchSeed), pchExpanded + 32 * i);
+    }
+
+    if (!BN_bin2bn(pchExpanded, sizeof(pchExpanded), &bnOut))
+        throw bignum_error("CMuHash3072::ToGroupElement : BN_bin2bn failed");
+
+    // Values at or above the modulus occur with negligible probability; reduce them anyway
+    if (bnOut >= bnModulus)
+        bnOut -= bnModulus;
+}
+
+void CMuHash3072::Insert(const vector<unsigned char> &vchData)
+{
+    CAutoBN_CTX pctx;
+    CBigNum bnElement;
+    ToGroupElement(vchData, bnElement);
+    if (!BN_mod_mul(&bnNumerator, &bnNumerator, &bnElement, &bnModulus, pctx))
+        throw bignum_error("CMuHash3072::Insert : BN_mod_mul failed");
+}
+
+void CMuHash3072::Remove(const vector<unsigned char> &vchData)
+{
+    CAutoBN_CTX pctx;
+    CBigNum bnElement;
+    ToGroupElement(vchData, bnElement);
+    if (!BN_mod_mul(&bnDenominator, &bnDenominator, &bnElement, &bnModulus, pctx))
+        throw bignum_error("CMuHash3072::Remove : BN_mod_mul failed");
+}
+
+void CMuHash3072::Normalize()
+{
+    if (BN_is_one(&bnDenominator))
+        return;
+
+    CAutoBN_CTX pctx;
+    CBigNum bnInverse;
+    if (!BN_mod_inverse(&bnInverse, &bnDenominator, &bnModulus, pctx))
+        throw bignum_error("CMuHash3072::Normalize : BN_mod_inverse failed");
+    if (!BN_mod_mul(&bnNumerator, &bnNumerator, &bnInverse, &bnModulus, pctx))
+        throw bignum_error("CMuHash3072::Normalize : BN_mod_mul failed");
+    bnDenominator = 1;
+}
+
+uint256 CMuHash3072::GetHash() const
+{
+    CMuHash3072 normalized(*this);
+    normalized.Normalize();
+
+    unsigned char pchData[BYTE_SIZE];
+    memset(pchData, 0, sizeof(pchData));
+    int nBytes = BN_num_bytes(&normalized.bnNumerator);
+    BN_bn2bin(&normalized.bnNumerator, pchData + sizeof(pchData) - nBytes);
+    return Hash(pchData, pchData + sizeof(pchData));
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_MUHASH_H
+#define BITCOIN_MUHASH_H
+
+#include <vector>
+
+#include "bignum.h"
+#include "serialize.h"
+#include "uint256.h"
+
+/** Rolling hash of a multiset of byte strings (MuHash).
+ *
+ * Every element is mapped onto the multiplicative group of integers modulo
+ * the prime 2^3072 - 1103717 by expanding its SHA256 hash, and the set hash is
+ * the product of all its elements. Inserting or removing an element is a single
+ * modular multiplication, and the result does not depend on the order in which
+ * elements were added. Removals are accumulated in a separate denominator so no
+ * modular inverse is needed until the final hash is requested.
+ */
+class CMuHash3072
+{
+private:
+    CBigNum bnNumerator;
+    CBigNum bnDenominator;
+
+    static void ToGroupElement(const std::vector<unsigned char> &vchData, CBigNum &bnOut);
+
+public:
+    static const unsigned int BYTE_SIZE = 384;
+
+    CMuHash3072();
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(bnNumerator);
+        READWRITE(bnDenominator);
+    )
+
+    // Add an element to the set
+    void Insert(const std::vector<unsigned char> &vchData);
+
+    // Remove an element that was previously added to the set
+    void Remove(const std::vector<unsigned char> &vchData);
+
+    // Fold the denominator into the numerator (one modular inverse)
+    void Normalize();
+
+    // Hash of the current set; equal sets always give equal results
+    uint256 GetHash() const;
+};
+
+#endif // BITCOIN_MUHASH_H
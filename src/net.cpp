@@ -804,7 +804,15 @@ void ThreadSocketHandler()
                             {
                                 TRY_LOCK(pnode->cs_inventory, lockInv);
                                 if (lockInv)
-                                    fDelete = true;
+                                {
+                                    // its orphans would only sit in the pool until they expire
+                                    TRY_LOCK(cs_main, lockMain);
+                                    if (lockMain)
+                                    {
+                                        EraseOrphansFor(pnode->id);
+                                        fDelete = true;
+                                    }
+                                }
                             }
                         }
                     }
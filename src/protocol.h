@@ -70,6 +70,8 @@ enum
 {
     NODE_NETWORK = (1 << 0),
     NODE_BLOOM = (1 << 1),
+    // the node prunes its block storage and only serves the last MIN_BLOCKS_TO_KEEP blocks
+    NODE_NETWORK_LIMITED = (1 << 10),
 };
 
 /** A CService with information about it as peer */
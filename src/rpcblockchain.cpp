@@ -43,31 +43,31 @@ double GetDifficulty(const CBlockIndex* blockindex)
 }
 
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, CJSONWriter& result)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
+    result.BeginObject();
+    result.Key("hash").String(block.GetHash().GetHex());
     CMerkleTx txGen(block.vtx[0]);
     txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    Array txs;
+    result.Key("confirmations").Int(txGen.GetDepthInMainChain());
+    result.Key("size").Int(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    result.Key("height").Int(blockindex->nHeight);
+    result.Key("version").Int(block.nVersion);
+    result.Key("merkleroot").String(block.hashMerkleRoot.GetHex());
+    result.Key("tx").BeginArray();
     BOOST_FOREACH(const CTransaction&tx, block.vtx)
-        txs.push_back(tx.GetHash().GetHex());
-    result.push_back(Pair("tx", txs));
-    result.push_back(Pair("time", (boost::int64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (boost::uint64_t)block.nNonce));
-    result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
+        result.String(tx.GetHash().GetHex());
+    result.EndArray();
+    result.Key("time").Int(block.GetBlockTime());
+    result.Key("nonce").UInt(block.nNonce);
+    result.Key("bits").String(HexBits(block.nBits));
+    result.Key("difficulty").Real(GetDifficulty(blockindex));
 
     if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
+        result.Key("previousblockhash").String(blockindex->pprev->GetBlockHash().GetHex());
     if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-    return result;
+        result.Key("nextblockhash").String(blockindex->pnext->GetBlockHash().GetHex());
+    result.EndObject();
 }
 
 
@@ -78,7 +78,7 @@ Value getblockcount(const Array& params, bool fHelp)
             "getblockcount\n"
             "Returns the number of blocks in the longest block chain.");
 
-    return nBestHeight;
+    return GetChainTip()->nHeight;
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -88,7 +88,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             "getbestblockhash\n"
             "Returns the hash of the best (tip) block in the longest block chain.");
 
-    return hashBestChain.GetHex();
+    return GetChainTip()->hashBlock.GetHex();
 }
 
 Value getdifficulty(const Array& params, bool fHelp)
@@ -98,7 +98,7 @@ Value getdifficulty(const Array& params, bool fHelp)
             "getdifficulty\n"
             "Returns the proof-of-work difficulty as a multiple of the minimum difficulty.");
 
-    return GetDifficulty();
+    return GetDifficulty(GetChainTip()->pindex);
 }
 
 
@@ -119,20 +119,128 @@ Value settxfee(const Array& params, bool fHelp)
 }
 
 Value getrawmempool(const Array& params, bool fHelp)
+{
+    return ValueFromWriter(&getrawmempool, params, fHelp);
+}
+
+void getrawmempool(const Array& params, bool fHelp, CJSONWriter& result)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getrawmempool [verbose=false]\n"
+            "Returns all transaction ids in memory pool.\n"
+            "If verbose is true, returns an Object with information about each of them by id.");
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (!fVerbose)
+    {
+        vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+
+        result.BeginArray();
+        BOOST_FOREACH(const uint256& hash, vtxid)
+            result.String(hash.ToString());
+        result.EndArray();
+        return;
+    }
+
+    LOCK(mempool.cs);
+    result.BeginObject();
+    for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
+    {
+        // like queryHashes, leave out what has not passed its script checks yet
+        if (!mempool.isVerified(mi->first))
+            continue;
+        const CTxMemPoolEntry& e = mi->second;
+        result.Key(mi->first.ToString()).BeginObject();
+        result.Key("size").Int(e.nTxSize);
+        result.Key("fee").Amount(e.nFee);
+        result.Key("time").Int(e.nTime);
+        result.Key("height").Int(e.nHeight);
+        result.Key("descendantcount").Int(e.nCountWithDescendants);
+        result.Key("descendantsize").UInt(e.nSizeWithDescendants);
+        result.Key("descendantfees").Amount(e.nFeesWithDescendants);
+        result.Key("ancestorcount").Int(e.nCountWithAncestors);
+        result.Key("ancestorsize").UInt(e.nSizeWithAncestors);
+        result.Key("ancestorfees").Amount(e.nFeesWithAncestors);
+        // the transactions in the pool it spends from, of those that are listed
+        set<uint256> setDepends;
+        map<uint256, CTransaction>::const_iterator mitx = mempool.mapTx.find(mi->first);
+        if (mitx != mempool.mapTx.end())
+            BOOST_FOREACH(const CTxIn& txin, mitx->second.vin)
+                if (mempool.mapTx.count(txin.prevout.hash) && mempool.isVerified(txin.prevout.hash))
+                    setDepends.insert(txin.prevout.hash);
+        result.Key("depends").BeginArray();
+        BOOST_FOREACH(const uint256& hash, setDepends)
+            result.String(hash.ToString());
+        result.EndArray();
+        result.EndObject();
+    }
+    result.EndObject();
+}
+
+Value getmempoolinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
-            "getrawmempool\n"
-            "Returns all transaction ids in memory pool.");
+            "getmempoolinfo\n"
+            "Returns an object containing the size of the memory pool and its limit.");
+
+    Object ret;
+    ret.push_back(Pair("size", (boost::int64_t)mempool.size()));
+    ret.push_back(Pair("bytes", (boost::int64_t)mempool.GetTotalTxSize()));
+    ret.push_back(Pair("maxmempool", (boost::int64_t)GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000));
+    return ret;
+}
+
+Value estimatefee(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "estimatefee <nblocks>\n"
+            "Returns the fee per kilobyte a transaction needs to begin confirmation within <nblocks> blocks,\n"
+            "or -1 if not enough transactions have been observed yet.");
+
+    int nBlocks = params[0].get_int();
+    if (nBlocks < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid nblocks");
+
+    double dFeeRate = mempool.estimateFee(nBlocks);
+    if (dFeeRate < 0)
+        return -1.0;
+    return ValueFromAmount((int64)dFeeRate);
+}
+
+Value estimatepriority(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "estimatepriority <nblocks>\n"
+            "Returns the priority a zero-fee transaction needs to begin confirmation within <nblocks> blocks,\n"
+            "or -1 if not enough transactions have been observed yet.");
 
-    vector<uint256> vtxid;
-    mempool.queryHashes(vtxid);
+    int nBlocks = params[0].get_int();
+    if (nBlocks < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid nblocks");
 
-    Array a;
-    BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
+    return mempool.estimatePriority(nBlocks);
+}
 
-    return a;
+Value savemempool(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "Dumps the memory pool to mempool.dat in the data directory.");
+
+    if (!IsMempoolLoaded())
+        throw JSONRPCError(RPC_MISC_ERROR, "The mempool was not loaded yet");
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+    return Value::null;
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -151,6 +259,11 @@ Value getblockhash(const Array& params, bool fHelp)
 }
 
 Value getblock(const Array& params, bool fHelp)
+{
+    return ValueFromWriter(&getblock, params, fHelp);
+}
+
+void getblock(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -171,17 +284,20 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex);
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA))
+        throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
+    if (!block.ReadFromDisk(pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
     if (!fVerbose)
     {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
         ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        result.String(HexStr(ssBlock.begin(), ssBlock.end()));
+        return;
     }
 
-    return blockToJSON(block, pblockindex);
+    blockToJSON(block, pblockindex, result);
 }
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
@@ -189,7 +305,8 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "gettxoutsetinfo\n"
-            "Returns statistics about the unspent transaction output set.");
+            "Returns statistics about the unspent transaction output set.\n"
+            "hash_serialized is a rolling (MuHash) commitment to the set, maintained as blocks are connected.");
 
     Object ret;
 
@@ -268,3 +385,177 @@ Value verifychain(const Array& params, bool fHelp)
     return VerifyDB(nCheckLevel, nCheckDepth);
 }
 
+
+// Addresses given as one address string or an array of them
+static void ParseAddresses(const Value& value, vector<pair<unsigned char, uint160> >& vAddresses)
+{
+    Array arr;
+    if (value.type() == str_type)
+        arr.push_back(value);
+    else if (value.type() == array_type)
+        arr = value.get_array();
+    else
+        throw JSONRPCError(RPC_TYPE_ERROR, "Expected an address or an array of addresses");
+
+    BOOST_FOREACH(const Value& v, arr)
+    {
+        if (v.type() != str_type)
+            throw JSONRPCError(RPC_TYPE_ERROR, "Expected an address or an array of addresses");
+        CTxDestination dest = CBitcoinAddress(v.get_str()).Get();
+        if (const CKeyID *pkeyID = boost::get<CKeyID>(&dest))
+            vAddresses.push_back(make_pair((unsigned char)ADDRESS_TYPE_KEYHASH, (uint160)*pkeyID));
+        else if (const CScriptID *pscriptID = boost::get<CScriptID>(&dest))
+            vAddresses.push_back(make_pair((unsigned char)ADDRESS_TYPE_SCRIPTHASH, (uint160)*pscriptID));
+        else
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid CryptoBit address: ") + v.get_str());
+    }
+}
+
+static string AddressFromIndex(unsigned char nAddressType, const uint160& hashAddress)
+{
+    if (nAddressType == ADDRESS_TYPE_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hashAddress)).ToString();
+    return CBitcoinAddress(CKeyID(hashAddress)).ToString();
+}
+
+static void EnsureAddressIndex()
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled (restart with -addressindex and -reindex)");
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address or [address,...]>\n"
+            "Returns the balance of the given addresses, and the total they have received.\n"
+            "Requires -addressindex.");
+
+    EnsureAddressIndex();
+    vector<pair<unsigned char, uint160> > vAddresses;
+    ParseAddresses(params[0], vAddresses);
+
+    int64 nBalance = 0, nReceived = 0;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        vector<pair<CAddressIndexKey, int64> > vEntries;
+        if (!GetAddressIndex(vAddresses[i].first, vAddresses[i].second, vEntries))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+        for (unsigned int j = 0; j < vEntries.size(); j++)
+        {
+            nBalance += vEntries[j].second;
+            if (vEntries[j].second > 0)
+                nReceived += vEntries[j].second;
+        }
+    }
+
+    Object result;
+    result.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(Pair("received", ValueFromAmount(nReceived)));
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos <address or [address,...]>\n"
+            "Returns the unspent outputs paying to the given addresses, as objects of\n"
+            "{address, txid, vout, scriptPubKey, amount, height}.\n"
+            "Requires -addressindex.");
+
+    EnsureAddressIndex();
+    vector<pair<unsigned char, uint160> > vAddresses;
+    ParseAddresses(params[0], vAddresses);
+
+    Array result;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        if (!GetAddressUnspent(vAddresses[i].first, vAddresses[i].second, vUnspent))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+        string strAddress = AddressFromIndex(vAddresses[i].first, vAddresses[i].second);
+        for (unsigned int j = 0; j < vUnspent.size(); j++)
+        {
+            const CAddressUnspentKey& key = vUnspent[j].first;
+            const CAddressUnspentValue& value = vUnspent[j].second;
+            Object entry;
+            entry.push_back(Pair("address", strAddress));
+            entry.push_back(Pair("txid", key.txhash.GetHex()));
+            entry.push_back(Pair("vout", (int)key.nIndex));
+            entry.push_back(Pair("scriptPubKey", HexStr(value.scriptPubKey.begin(), value.scriptPubKey.end())));
+            entry.push_back(Pair("amount", ValueFromAmount(value.nValue)));
+            entry.push_back(Pair("height", value.nHeight));
+            result.push_back(entry);
+        }
+    }
+    return result;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresstxids <address or [address,...]> [start height] [end height]\n"
+            "Returns the ids of the transactions paying to or spending from the given addresses,\n"
+            "ordered by block height, optionally only those between two heights (inclusive).\n"
+            "Requires -addressindex.");
+
+    EnsureAddressIndex();
+    vector<pair<unsigned char, uint160> > vAddresses;
+    ParseAddresses(params[0], vAddresses);
+    int nStart = 0, nEnd = std::numeric_limits<int>::max();
+    if (params.size() > 1)
+        nStart = params[1].get_int();
+    if (params.size() > 2)
+        nEnd = params[2].get_int();
+    if (nStart < 0 || nEnd < nStart)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid height range");
+
+    // by height, then by txid; each transaction once
+    vector<pair<int, uint256> > vTxids;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        vector<pair<CAddressIndexKey, int64> > vEntries;
+        if (!GetAddressIndex(vAddresses[i].first, vAddresses[i].second, vEntries, nStart, nEnd))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+        for (unsigned int j = 0; j < vEntries.size(); j++)
+            vTxids.push_back(make_pair(vEntries[j].first.nHeight, vEntries[j].first.txhash));
+    }
+    std::sort(vTxids.begin(), vTxids.end());
+
+    Array result;
+    set<uint256> setSeen;
+    for (unsigned int i = 0; i < vTxids.size(); i++)
+        if (setSeen.insert(vTxids[i].second).second)
+            result.push_back(vTxids[i].second.GetHex());
+    return result;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo <txid> <n>\n"
+            "Returns the input spending output n of transaction txid, as {txid, vin, height}.\n"
+            "Requires -spentindex.");
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled (restart with -spentindex and -reindex)");
+
+    uint256 hash(params[0].get_str());
+    int n = params[1].get_int();
+    if (n < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid output index");
+
+    CSpentIndexValue value;
+    if (!GetSpentIndex(COutPoint(hash, n), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    Object result;
+    result.push_back(Pair("txid", value.txid.GetHex()));
+    result.push_back(Pair("vin", (int)value.nInputIndex));
+    result.push_back(Pair("height", value.nHeight));
+    return result;
+}
@@ -32,6 +32,15 @@ public:
     }
 };
 
+// The rescan only reads blocks without cs_main and cs_wallet, so the node and other calls carry on meanwhile
+static void RescanWallet()
+{
+    if (pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true) < 0)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan aborted, incomplete or already running; the keys were added, rescan again to find their transactions");
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    pwalletMain->ReacceptWalletTransactions();
+}
+
 Value importprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 3)
@@ -60,21 +69,80 @@ Value importprivkey(const Array& params, bool fHelp)
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
-        pwalletMain->MarkDirty();
         pwalletMain->SetAddressBookName(vchAddress, strLabel);
 
         if (!pwalletMain->AddKeyPubKey(key, pubkey))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-            pwalletMain->ReacceptWalletTransactions();
+        pwalletMain->MarkDirty();
+    }
+
+    if (fRescan)
+        RescanWallet();
+
+    return Value::null;
+}
+
+Value importprivkeys(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "importprivkeys <[\"cryptobitprivkey\",...]> [label] [rescan=true]\n"
+            "Adds several private keys (as returned by dumpprivkey) to your wallet,\n"
+            "then rescans the block chain once for all of them.");
+
+    const Array& arrKeys = params[0].get_array();
+    string strLabel = "";
+    if (params.size() > 1)
+        strLabel = params[1].get_str();
+
+    bool fRescan = true;
+    if (params.size() > 2)
+        fRescan = params[2].get_bool();
+
+    // Check all the keys before adding any
+    vector<CKey> vKeys;
+    BOOST_FOREACH(const Value& value, arrKeys)
+    {
+        CBitcoinSecret vchSecret;
+        if (!vchSecret.SetString(value.get_str()))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key: " + value.get_str());
+        vKeys.push_back(vchSecret.GetKey());
+    }
+
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        BOOST_FOREACH(const CKey& key, vKeys)
+        {
+            CPubKey pubkey = key.GetPubKey();
+            pwalletMain->SetAddressBookName(pubkey.GetID(), strLabel);
+            if (!pwalletMain->AddKeyPubKey(key, pubkey))
+                throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
         }
+
+        pwalletMain->MarkDirty();
     }
 
+    if (fRescan)
+        RescanWallet();
+
     return Value::null;
 }
 
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "Stops a running wallet rescan, without adding anything it found.\n"
+            "Returns false if no rescan was running.");
+
+    bool fRunning = pwalletMain->GetRescanProgress() >= 0;
+    pwalletMain->AbortRescan();
+    return fRunning;
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
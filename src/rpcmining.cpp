@@ -14,12 +14,8 @@ using namespace std;
 // Return average network hashes per second based on the last 'lookup' blocks,
 // or from the last difficulty change if 'lookup' is nonpositive.
 // If 'height' is nonnegative, compute the estimate at the time when a given block was found.
-Value GetNetworkHashPS(int lookup, int height) {
-    CBlockIndex *pb = pindexBest;
-
-    if (height >= 0 && height < nBestHeight)
-        pb = FindBlockByHeight(height);
-
+// Only follows pprev from pb, so needs no lock
+Value GetNetworkHashPS(int lookup, const CBlockIndex *pb) {
     if (pb == NULL || !pb->nHeight)
         return 0;
 
@@ -31,7 +27,7 @@ Value GetNetworkHashPS(int lookup, int height) {
     if (lookup > pb->nHeight)
         lookup = pb->nHeight;
 
-    CBlockIndex *pb0 = pb;
+    const CBlockIndex *pb0 = pb;
     int64 minTime = pb0->GetBlockTime();
     int64 maxTime = minTime;
     for (int i = 0; i < lookup; i++) {
@@ -60,7 +56,12 @@ Value getnetworkhashps(const Array& params, bool fHelp)
             "Pass in [blocks] to override # of blocks, -1 specifies since last difficulty change.\n"
             "Pass in [height] to estimate the network speed at the time when a certain block was found.");
 
-    return GetNetworkHashPS(params.size() > 0 ? params[0].get_int() : 120, params.size() > 1 ? params[1].get_int() : -1);
+    CBlockIndex *pb = pindexBest;
+    int height = params.size() > 1 ? params[1].get_int() : -1;
+    if (height >= 0 && height < nBestHeight)
+        pb = FindBlockByHeight(height);
+
+    return GetNetworkHashPS(params.size() > 0 ? params[0].get_int() : 120, pb);
 }
 
 
@@ -146,16 +147,19 @@ Value getmininginfo(const Array& params, bool fHelp)
             "getmininginfo\n"
             "Returns an object containing mining-related information.");
 
+    // Served from the published chain tip, without waiting for cs_main
+    boost::shared_ptr<const CChainTip> tip = GetChainTip();
+
     Object obj;
-    obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("blocks",        tip->nHeight));
     obj.push_back(Pair("currentblocksize",(uint64_t)nLastBlockSize));
     obj.push_back(Pair("currentblocktx",(uint64_t)nLastBlockTx));
-    obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
+    obj.push_back(Pair("difficulty",    (double)GetDifficulty(tip->pindex)));
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     obj.push_back(Pair("generate",      GetBoolArg("-gen")));
     obj.push_back(Pair("genproclimit",  (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
-    obj.push_back(Pair("networkhashps", getnetworkhashps(params, false)));
+    obj.push_back(Pair("networkhashps", GetNetworkHashPS(120, tip->pindex)));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
     obj.push_back(Pair("testnet",       fTestNet));
     return obj;
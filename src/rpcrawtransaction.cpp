@@ -51,88 +51,106 @@ vector<unsigned char> ParseHexO(const Object& o, string strKey)
     return ParseHexV(find_value(o, strKey), strKey);
 }
 
-void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out)
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, CJSONWriter& out)
 {
     txnouttype type;
     vector<CTxDestination> addresses;
     int nRequired;
 
-    out.push_back(Pair("asm", scriptPubKey.ToString()));
-    out.push_back(Pair("hex", HexStr(scriptPubKey.begin(), scriptPubKey.end())));
+    out.Key("asm").String(scriptPubKey.ToString());
+    out.Key("hex").String(HexStr(scriptPubKey.begin(), scriptPubKey.end()));
 
     if (!ExtractDestinations(scriptPubKey, type, addresses, nRequired))
     {
-        out.push_back(Pair("type", GetTxnOutputType(TX_NONSTANDARD)));
+        out.Key("type").String(GetTxnOutputType(TX_NONSTANDARD));
         return;
     }
 
-    out.push_back(Pair("reqSigs", nRequired));
-    out.push_back(Pair("type", GetTxnOutputType(type)));
+    out.Key("reqSigs").Int(nRequired);
+    out.Key("type").String(GetTxnOutputType(type));
 
-    Array a;
+    out.Key("addresses").BeginArray();
     BOOST_FOREACH(const CTxDestination& addr, addresses)
-        a.push_back(CBitcoinAddress(addr).ToString());
-    out.push_back(Pair("addresses", a));
+        out.String(CBitcoinAddress(addr).ToString());
+    out.EndArray();
+}
+
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out)
+{
+    string strJSON;
+    CJSONWriter writer(strJSON);
+    writer.BeginObject();
+    ScriptPubKeyToJSON(scriptPubKey, writer);
+    writer.EndObject();
+    Value value;
+    ParseJSON(strJSON, value);
+    const Object& o = value.get_obj();
+    out.insert(out.end(), o.begin(), o.end());
 }
 
-void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, CJSONWriter& entry)
 {
-    entry.push_back(Pair("txid", tx.GetHash().GetHex()));
-    entry.push_back(Pair("version", tx.nVersion));
-    entry.push_back(Pair("locktime", (boost::int64_t)tx.nLockTime));
-    Array vin;
+    entry.Key("txid").String(tx.GetHash().GetHex());
+    entry.Key("version").Int(tx.nVersion);
+    entry.Key("locktime").Int(tx.nLockTime);
+    entry.Key("vin").BeginArray();
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        Object in;
+        entry.BeginObject();
         if (tx.IsCoinBase())
-            in.push_back(Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
+            entry.Key("coinbase").String(HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
         else
         {
-            in.push_back(Pair("txid", txin.prevout.hash.GetHex()));
-            in.push_back(Pair("vout", (boost::int64_t)txin.prevout.n));
-            Object o;
-            o.push_back(Pair("asm", txin.scriptSig.ToString()));
-            o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
-            in.push_back(Pair("scriptSig", o));
+            entry.Key("txid").String(txin.prevout.hash.GetHex());
+            entry.Key("vout").Int(txin.prevout.n);
+            entry.Key("scriptSig").BeginObject();
+            entry.Key("asm").String(txin.scriptSig.ToString());
+            entry.Key("hex").String(HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
+            entry.EndObject();
         }
-        in.push_back(Pair("sequence", (boost::int64_t)txin.nSequence));
-        vin.push_back(in);
+        entry.Key("sequence").Int(txin.nSequence);
+        entry.EndObject();
     }
-    entry.push_back(Pair("vin", vin));
-    Array vout;
+    entry.EndArray();
+    entry.Key("vout").BeginArray();
     for (unsigned int i = 0; i < tx.vout.size(); i++)
     {
         const CTxOut& txout = tx.vout[i];
-        Object out;
-        out.push_back(Pair("value", ValueFromAmount(txout.nValue)));
-        out.push_back(Pair("n", (boost::int64_t)i));
-        Object o;
-        ScriptPubKeyToJSON(txout.scriptPubKey, o);
-        out.push_back(Pair("scriptPubKey", o));
-        vout.push_back(out);
+        entry.BeginObject();
+        entry.Key("value").Amount(txout.nValue);
+        entry.Key("n").Int(i);
+        entry.Key("scriptPubKey").BeginObject();
+        ScriptPubKeyToJSON(txout.scriptPubKey, entry);
+        entry.EndObject();
+        entry.EndObject();
     }
-    entry.push_back(Pair("vout", vout));
+    entry.EndArray();
 
     if (hashBlock != 0)
     {
-        entry.push_back(Pair("blockhash", hashBlock.GetHex()));
+        entry.Key("blockhash").String(hashBlock.GetHex());
         map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
             if (pindex->IsInMainChain())
             {
-                entry.push_back(Pair("confirmations", 1 + nBestHeight - pindex->nHeight));
-                entry.push_back(Pair("time", (boost::int64_t)pindex->nTime));
-                entry.push_back(Pair("blocktime", (boost::int64_t)pindex->nTime));
+                entry.Key("confirmations").Int(1 + nBestHeight - pindex->nHeight);
+                entry.Key("time").Int(pindex->nTime);
+                entry.Key("blocktime").Int(pindex->nTime);
             }
             else
-                entry.push_back(Pair("confirmations", 0));
+                entry.Key("confirmations").Int(0);
         }
     }
 }
 
 Value getrawtransaction(const Array& params, bool fHelp)
+{
+    return ValueFromWriter(&getrawtransaction, params, fHelp);
+}
+
+void getrawtransaction(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -158,12 +176,15 @@ Value getrawtransaction(const Array& params, bool fHelp)
     string strHex = HexStr(ssTx.begin(), ssTx.end());
 
     if (!fVerbose)
-        return strHex;
+    {
+        result.String(strHex);
+        return;
+    }
 
-    Object result;
-    result.push_back(Pair("hex", strHex));
+    result.BeginObject();
+    result.Key("hex").String(strHex);
     TxToJSON(tx, hashBlock, result);
-    return result;
+    result.EndObject();
 }
 
 Value listunspent(const Array& params, bool fHelp)
@@ -314,6 +335,11 @@ Value createrawtransaction(const Array& params, bool fHelp)
 }
 
 Value decoderawtransaction(const Array& params, bool fHelp)
+{
+    return ValueFromWriter(&decoderawtransaction, params, fHelp);
+}
+
+void decoderawtransaction(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() != 1)
         throw runtime_error(
@@ -330,10 +356,9 @@ Value decoderawtransaction(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX decode failed");
     }
 
-    Object result;
+    result.BeginObject();
     TxToJSON(tx, 0, result);
-
-    return result;
+    result.EndObject();
 }
 
 Value signrawtransaction(const Array& params, bool fHelp)
@@ -51,6 +51,25 @@ void WalletTxToJSON(const CWalletTx& wtx, Object& entry)
         entry.push_back(Pair(item.first, item.second));
 }
 
+static void WalletTxToJSON(const CWalletTx& wtx, CJSONWriter& entry)
+{
+    int confirms = wtx.GetDepthInMainChain();
+    entry.Key("confirmations").Int(confirms);
+    if (wtx.IsCoinBase())
+        entry.Key("generated").Bool(true);
+    if (confirms)
+    {
+        entry.Key("blockhash").String(wtx.hashBlock.GetHex());
+        entry.Key("blockindex").Int(wtx.nIndex);
+        entry.Key("blocktime").Int(mapBlockIndex[wtx.hashBlock]->nTime);
+    }
+    entry.Key("txid").String(wtx.GetHash().GetHex());
+    entry.Key("time").Int(wtx.GetTxTime());
+    entry.Key("timereceived").Int(wtx.nTimeReceived);
+    BOOST_FOREACH(const PAIRTYPE(string,string)& item, wtx.mapValue)
+        entry.Key(item.first).String(item.second);
+}
+
 string AccountFromValue(const Value& value)
 {
     string strAccount = value.get_str();
@@ -69,22 +88,46 @@ Value getinfo(const Array& params, bool fHelp)
     proxyType proxy;
     GetProxy(NET_IPV4, proxy);
 
+    // Chain state comes from the published tip and the wallet figures need only cs_wallet,
+    // so this doesn't wait for a block being connected
+    boost::shared_ptr<const CChainTip> tip = GetChainTip();
+    int nConnections;
+    {
+        LOCK(cs_vNodes);
+        nConnections = vNodes.size();
+    }
+    int64 nBalance = 0, nKeyPoolOldest = 0;
+    unsigned int nKeyPoolSize = 0;
+    CHDChain hdChain;
+    if (pwalletMain) {
+        nBalance = pwalletMain->GetBalanceNoWait();
+        LOCK(pwalletMain->cs_wallet);
+        nKeyPoolOldest = pwalletMain->GetOldestKeyPoolTime();
+        nKeyPoolSize = pwalletMain->GetKeyPoolSize();
+        hdChain = pwalletMain->hdChain;
+    }
+
     Object obj;
     obj.push_back(Pair("version",       (int)CLIENT_VERSION));
     obj.push_back(Pair("protocolversion",(int)PROTOCOL_VERSION));
     if (pwalletMain) {
         obj.push_back(Pair("walletversion", pwalletMain->GetVersion()));
-        obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
+        obj.push_back(Pair("balance",       ValueFromAmount(nBalance)));
     }
-    obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("blocks",        tip->nHeight));
     obj.push_back(Pair("timeoffset",    (boost::int64_t)GetTimeOffset()));
-    obj.push_back(Pair("connections",   (int)vNodes.size()));
+    obj.push_back(Pair("connections",   nConnections));
     obj.push_back(Pair("proxy",         (proxy.first.IsValid() ? proxy.first.ToStringIPPort() : string())));
-    obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
+    obj.push_back(Pair("difficulty",    (double)GetDifficulty(tip->pindex)));
     obj.push_back(Pair("testnet",       fTestNet));
     if (pwalletMain) {
-        obj.push_back(Pair("keypoololdest", (boost::int64_t)pwalletMain->GetOldestKeyPoolTime()));
-        obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
+        obj.push_back(Pair("keypoololdest", (boost::int64_t)nKeyPoolOldest));
+        obj.push_back(Pair("keypoolsize",   (int)nKeyPoolSize));
+        if (!hdChain.IsNull())
+            obj.push_back(Pair("hdmasterkeyid", hdChain.masterKeyID.GetHex()));
+        int nRescanProgress = pwalletMain->GetRescanProgress();
+        if (nRescanProgress >= 0)
+            obj.push_back(Pair("rescanprogress", nRescanProgress));
     }
     obj.push_back(Pair("paytxfee",      ValueFromAmount(nTransactionFee)));
     obj.push_back(Pair("mininput",      ValueFromAmount(nMinimumInputValue)));
@@ -110,9 +153,6 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey, false))
@@ -622,6 +662,9 @@ Value movecmd(const Array& params, bool fHelp)
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
+
     return true;
 }
 
@@ -727,6 +770,85 @@ Value sendmany(const Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+Value sendmanybatch(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 4)
+        throw runtime_error(
+            "sendmanybatch <fromaccount> {address:amount,...} [minconf=1] [comment]\n"
+            "amounts are double-precision floating point numbers\n"
+            "Pays out to any number of addresses, in as many transactions as it takes.\n"
+            "Returns the ids of the transactions."
+            + HelpRequiringPassphrase());
+
+    string strAccount = AccountFromValue(params[0]);
+    Object sendTo = params[1].get_obj();
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+
+    set<CBitcoinAddress> setAddress;
+    vector<pair<CScript, int64> > vecSend;
+
+    int64 totalAmount = 0;
+    BOOST_FOREACH(const Pair& s, sendTo)
+    {
+        CBitcoinAddress address(s.name_);
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid CryptoBit address: ")+s.name_);
+
+        if (setAddress.count(address))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, string("Invalid parameter, duplicated address: ")+s.name_);
+        setAddress.insert(address);
+
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(address.Get());
+        int64 nAmount = AmountFromValue(s.value_);
+        totalAmount += nAmount;
+
+        vecSend.push_back(make_pair(scriptPubKey, nAmount));
+    }
+
+    EnsureWalletIsUnlocked();
+
+    // Check funds
+    int64 nBalance = GetAccountBalance(strAccount, nMinDepth);
+    if (totalAmount > nBalance)
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Account has insufficient funds");
+
+    // Send
+    CReserveKey keyChange(pwalletMain);
+    vector<CWalletTx> vwtx;
+    int64 nFeeRequired = 0;
+    string strFailReason;
+    if (!pwalletMain->CreateTransactions(vecSend, vwtx, keyChange, nFeeRequired, strFailReason))
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, strFailReason);
+    BOOST_FOREACH(CWalletTx& wtx, vwtx)
+    {
+        wtx.strFromAccount = strAccount;
+        if (params.size() > 3 && params[3].type() != null_type && !params[3].get_str().empty())
+            wtx.mapValue["comment"] = params[3].get_str();
+    }
+    vector<uint256> vNotAccepted;
+    if (!pwalletMain->CommitTransactions(vwtx, keyChange, vNotAccepted))
+        throw JSONRPCError(RPC_WALLET_ERROR, "Transaction commit failed");
+
+    Array ret;
+    BOOST_FOREACH(const CWalletTx& wtx, vwtx)
+        ret.push_back(wtx.GetHash().GetHex());
+    if (!vNotAccepted.empty())
+    {
+        // they are all in the wallet by now, so the caller has to know them anyway
+        Array notAccepted;
+        BOOST_FOREACH(const uint256& hash, vNotAccepted)
+            notAccepted.push_back(hash.GetHex());
+        Object error = JSONRPCError(RPC_WALLET_ERROR, "Some of the transactions were committed but could not be broadcast");
+        error.push_back(Pair("txids", ret));
+        error.push_back(Pair("notaccepted", notAccepted));
+        throw error;
+    }
+    return ret;
+}
+
 //
 // Used by addmultisigaddress / createmultisig:
 //
@@ -976,7 +1098,27 @@ Value listreceivedbyaccount(const Array& params, bool fHelp)
     return ListReceived(params, true);
 }
 
-void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, Array& ret)
+// An entry of listtransactions and the like, before it is written out
+struct CTxListEntry
+{
+    const CWalletTx* pwtx;            // the transaction, or
+    const CAccountingEntry* pacentry; // the move between accounts
+    string strAccount;
+    CTxDestination address;
+    string strCategory;
+    int64 nAmount;
+    bool fSend;                       // whether nFee applies
+    int64 nFee;
+
+    CTxListEntry(const CWalletTx* pwtxIn, const string& strAccountIn, const CTxDestination& addressIn,
+                 const string& strCategoryIn, int64 nAmountIn) :
+        pwtx(pwtxIn), pacentry(NULL), strAccount(strAccountIn), address(addressIn),
+        strCategory(strCategoryIn), nAmount(nAmountIn), fSend(false), nFee(0) {}
+    explicit CTxListEntry(const CAccountingEntry* pacentryIn) :
+        pwtx(NULL), pacentry(pacentryIn), nAmount(0), fSend(false), nFee(0) {}
+};
+
+static void GetTxListEntries(const CWalletTx& wtx, const string& strAccount, int nMinDepth, vector<CTxListEntry>& vEntries)
 {
     int64 nFee;
     string strSentAccount;
@@ -992,15 +1134,10 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
     {
         BOOST_FOREACH(const PAIRTYPE(CTxDestination, int64)& s, listSent)
         {
-            Object entry;
-            entry.push_back(Pair("account", strSentAccount));
-            entry.push_back(Pair("address", CBitcoinAddress(s.first).ToString()));
-            entry.push_back(Pair("category", "send"));
-            entry.push_back(Pair("amount", ValueFromAmount(-s.second)));
-            entry.push_back(Pair("fee", ValueFromAmount(-nFee)));
-            if (fLong)
-                WalletTxToJSON(wtx, entry);
-            ret.push_back(entry);
+            CTxListEntry entry(&wtx, strSentAccount, s.first, "send", -s.second);
+            entry.fSend = true;
+            entry.nFee = -nFee;
+            vEntries.push_back(entry);
         }
     }
 
@@ -1014,47 +1151,73 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
                 account = pwalletMain->mapAddressBook[r.first];
             if (fAllAccounts || (account == strAccount))
             {
-                Object entry;
-                entry.push_back(Pair("account", account));
-                entry.push_back(Pair("address", CBitcoinAddress(r.first).ToString()));
+                string strCategory = "receive";
                 if (wtx.IsCoinBase())
                 {
                     if (wtx.GetDepthInMainChain() < 1)
-                        entry.push_back(Pair("category", "orphan"));
+                        strCategory = "orphan";
                     else if (wtx.GetBlocksToMaturity() > 0)
-                        entry.push_back(Pair("category", "immature"));
+                        strCategory = "immature";
                     else
-                        entry.push_back(Pair("category", "generate"));
+                        strCategory = "generate";
                 }
-                else
-                    entry.push_back(Pair("category", "receive"));
-                entry.push_back(Pair("amount", ValueFromAmount(r.second)));
-                if (fLong)
-                    WalletTxToJSON(wtx, entry);
-                ret.push_back(entry);
+                vEntries.push_back(CTxListEntry(&wtx, account, r.first, strCategory, r.second));
             }
         }
     }
 }
 
-void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Array& ret)
+void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, Array& ret)
 {
-    bool fAllAccounts = (strAccount == string("*"));
-
-    if (fAllAccounts || acentry.strAccount == strAccount)
+    vector<CTxListEntry> vEntries;
+    GetTxListEntries(wtx, strAccount, nMinDepth, vEntries);
+    BOOST_FOREACH(const CTxListEntry& e, vEntries)
     {
         Object entry;
-        entry.push_back(Pair("account", acentry.strAccount));
-        entry.push_back(Pair("category", "move"));
-        entry.push_back(Pair("time", (boost::int64_t)acentry.nTime));
-        entry.push_back(Pair("amount", ValueFromAmount(acentry.nCreditDebit)));
-        entry.push_back(Pair("otheraccount", acentry.strOtherAccount));
-        entry.push_back(Pair("comment", acentry.strComment));
+        entry.push_back(Pair("account", e.strAccount));
+        entry.push_back(Pair("address", CBitcoinAddress(e.address).ToString()));
+        entry.push_back(Pair("category", e.strCategory));
+        entry.push_back(Pair("amount", ValueFromAmount(e.nAmount)));
+        if (e.fSend)
+            entry.push_back(Pair("fee", ValueFromAmount(e.nFee)));
+        if (fLong)
+            WalletTxToJSON(wtx, entry);
         ret.push_back(entry);
     }
 }
 
+static void TxListEntryToJSON(const CTxListEntry& e, CJSONWriter& entry)
+{
+    entry.BeginObject();
+    if (e.pacentry)
+    {
+        const CAccountingEntry& acentry = *e.pacentry;
+        entry.Key("account").String(acentry.strAccount);
+        entry.Key("category").String("move");
+        entry.Key("time").Int(acentry.nTime);
+        entry.Key("amount").Amount(acentry.nCreditDebit);
+        entry.Key("otheraccount").String(acentry.strOtherAccount);
+        entry.Key("comment").String(acentry.strComment);
+    }
+    else
+    {
+        entry.Key("account").String(e.strAccount);
+        entry.Key("address").String(CBitcoinAddress(e.address).ToString());
+        entry.Key("category").String(e.strCategory);
+        entry.Key("amount").Amount(e.nAmount);
+        if (e.fSend)
+            entry.Key("fee").Amount(e.nFee);
+        WalletTxToJSON(*e.pwtx, entry);
+    }
+    entry.EndObject();
+}
+
 Value listtransactions(const Array& params, bool fHelp)
+{
+    return ValueFromWriter(&listtransactions, params, fHelp);
+}
+
+void listtransactions(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -1076,40 +1239,35 @@ Value listtransactions(const Array& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
-    Array ret;
+    vector<CTxListEntry> vEntries;
+    bool fAllAccounts = (strAccount == string("*"));
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    const CWallet::TxItems & txOrdered = pwalletMain->wtxOrdered;
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
+            GetTxListEntries(*pwtx, strAccount, 0, vEntries);
         CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
+        if (pacentry != 0 && (fAllAccounts || pacentry->strAccount == strAccount))
+            vEntries.push_back(CTxListEntry(pacentry));
 
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        if ((int64)vEntries.size() >= (int64)nCount + nFrom) break;
     }
-    // ret is newest to oldest
-
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-    Array::iterator first = ret.begin();
-    std::advance(first, nFrom);
-    Array::iterator last = ret.begin();
-    std::advance(last, nFrom+nCount);
-
-    if (last != ret.end()) ret.erase(last, ret.end());
-    if (first != ret.begin()) ret.erase(ret.begin(), first);
-
-    std::reverse(ret.begin(), ret.end()); // Return oldest to newest
-
-    return ret;
+    // vEntries is newest to oldest
+
+    if (nFrom > (int)vEntries.size())
+        nFrom = vEntries.size();
+    if ((int64)nFrom + nCount > (int64)vEntries.size())
+        nCount = vEntries.size() - nFrom;
+
+    // Return oldest to newest
+    result.BeginArray();
+    for (int i = nFrom + nCount - 1; i >= nFrom; i--)
+        TxListEntryToJSON(vEntries[i], result);
+    result.EndArray();
 }
 
 Value listaccounts(const Array& params, bool fHelp)
@@ -1150,9 +1308,7 @@ Value listaccounts(const Array& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CAccountingEntry& entry, pwalletMain->laccentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
     Object ret;
@@ -1192,12 +1348,22 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (depth == -1)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions);
+    }
+    else
+    {
+        // Only transactions outside any block or in one above pindex can be shallower than
+        // depth, and the height index leads straight to them
+        const CWallet::TxHeights & txHeights = pwalletMain->mapTxHeights;
+        CWallet::TxHeights::const_iterator itUnconfirmed = txHeights.upper_bound(-1);
+        for (CWallet::TxHeights::const_iterator it = txHeights.begin(); it != itUnconfirmed; ++it)
+            ListTransactions(*(*it).second, "*", 0, true, transactions);
+        for (CWallet::TxHeights::const_iterator it = txHeights.upper_bound(pindex->nHeight); it != txHeights.end(); ++it)
+            if ((*it).second->GetDepthInMainChain() < depth)
+                ListTransactions(*(*it).second, "*", 0, true, transactions);
     }
 
     uint256 lastblock;
@@ -1293,14 +1459,6 @@ Value keypoolrefill(const Array& params, bool fHelp)
 }
 
 
-void ThreadTopUpKeyPool(void* parg)
-{
-    // Make this thread recognisable as the key-topping-up thread
-    RenameThread("bitcoin-key-top");
-
-    pwalletMain->TopUpKeyPool();
-}
-
 void ThreadCleanWalletPassphrase(void* parg)
 {
     // Make this thread recognisable as the wallet relocking thread
@@ -1376,7 +1534,7 @@ Value walletpassphrase(const Array& params, bool fHelp)
             "walletpassphrase <passphrase> <timeout>\n"
             "Stores the wallet decryption key in memory for <timeout> seconds.");
 
-    NewThread(ThreadTopUpKeyPool, NULL);
+    pwalletMain->RequestKeyPoolTopUp();
     int64* pnSleepTime = new int64(params[1].get_int64());
     NewThread(ThreadCleanWalletPassphrase, pnSleepTime);
 
@@ -1462,8 +1620,16 @@ Value encryptwallet(const Array& params, bool fHelp)
             "encryptwallet <passphrase>\n"
             "Encrypts the wallet with <passphrase>.");
 
+    if (pwalletMain->IsFileDamaged())
+        throw JSONRPCError(RPC_WALLET_ENCRYPTION_FAILED, "Error: The wallet file has damaged records. Restart with -salvagewallet before encrypting it.");
     if (!pwalletMain->EncryptWallet(strWalletPass))
-        throw JSONRPCError(RPC_WALLET_ENCRYPTION_FAILED, "Error: Failed to encrypt the wallet.");
+    {
+        if (!pwalletMain->IsCrypted())
+            throw JSONRPCError(RPC_WALLET_ENCRYPTION_FAILED, "Error: Failed to encrypt the wallet.");
+        // the keys are encrypted, but the old file could not be rewritten
+        StartShutdown();
+        throw JSONRPCError(RPC_WALLET_ENCRYPTION_FAILED, "Error: The wallet was encrypted, but its file could not be rewritten and may still hold unencrypted keys. CryptoBit server stopping.");
+    }
 
     // BDB seems to have a bad habit of writing old data into
     // slack space in .dat files; that is bad if the old data is
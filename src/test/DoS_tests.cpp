@@ -16,10 +16,10 @@
 #include <stdint.h>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CTransaction> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes);
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
 
 CService ip(uint32_t i)
 {
@@ -133,11 +133,11 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CTransaction>::iterator it;
+    std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second;
+    return it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -159,7 +159,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx);
+        AddOrphanTx(tx, i);
     }
 
     // ... and 50 that depend on other orphans:
@@ -176,7 +176,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx);
+        AddOrphanTx(tx, i);
     }
 
     // This really-big orphan should be ignored:
@@ -200,19 +200,82 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx));
+        BOOST_CHECK(!AddOrphanTx(tx, i));
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, MAX_ORPHAN_POOL_SIZE);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, MAX_ORPHAN_POOL_SIZE);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, MAX_ORPHAN_POOL_SIZE);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
 
+static CTransaction OrphanSpending(const uint256& hashPrev, unsigned int n)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_bounds)
+{
+    // Orphans are indexed by the outpoint they spend
+    uint256 hashParent = GetRandHash();
+    CTransaction tx0 = OrphanSpending(hashParent, 0), tx1 = OrphanSpending(hashParent, 1);
+    BOOST_CHECK(AddOrphanTx(tx0, 1));
+    BOOST_CHECK(AddOrphanTx(tx1, 1));
+    BOOST_CHECK(!AddOrphanTx(tx1, 2));
+    BOOST_CHECK(mapOrphanTransactionsByPrev.count(COutPoint(hashParent, 0)));
+    BOOST_CHECK(mapOrphanTransactionsByPrev.count(COutPoint(hashParent, 1)));
+    BOOST_CHECK(mapOrphanTransactions[tx1.GetHash()].fromPeer == 1);
+
+    // The byte bound evicts the oldest orphans of the peer holding the most
+    unsigned int nSize = mapOrphanTransactions[tx0.GetHash()].nTxSize;
+    SetMockTime(GetTime() + 1);
+    CTransaction txOther = OrphanSpending(GetRandHash(), 0);
+    BOOST_CHECK(AddOrphanTx(txOther, 2));
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, 2 * nSize), 1U);
+    BOOST_CHECK(mapOrphanTransactions.count(txOther.GetHash()));
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 2U);
+
+    // Orphans expire
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME - 1);
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, MAX_ORPHAN_POOL_SIZE), 1U);
+    BOOST_CHECK(mapOrphanTransactions.count(txOther.GetHash()));
+    SetMockTime(GetTime() + 1);
+    LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, MAX_ORPHAN_POOL_SIZE);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+
+    // A single peer cannot fill more than its share of the pool; what makes room is never the
+    // orphan just stored, although all of them expire at the same time
+    for (unsigned int i = 0; i <= MAX_ORPHAN_POOL_SIZE_PER_PEER / nSize + 10; i++)
+    {
+        CTransaction tx = OrphanSpending(GetRandHash(), i);
+        BOOST_CHECK(AddOrphanTx(tx, 3));
+        BOOST_CHECK(mapOrphanTransactions.count(tx.GetHash()));
+    }
+    BOOST_CHECK(mapOrphanTransactions.size() * nSize <= MAX_ORPHAN_POOL_SIZE_PER_PEER);
+
+    // A peer's orphans go with it
+    CTransaction txKept = OrphanSpending(GetRandHash(), 0);
+    BOOST_CHECK(AddOrphanTx(txKept, 4));
+    EraseOrphansFor(3);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 1U);
+    BOOST_CHECK(mapOrphanTransactions.count(txKept.GetHash()));
+    LimitOrphanTxSize(0, MAX_ORPHAN_POOL_SIZE);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
 {
     // Test signature caching code (see key.cpp Verify() methods)
@@ -237,7 +300,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx);
+        AddOrphanTx(tx, i);
     }
 
     // Create a transaction that depends on orphans:
@@ -297,7 +360,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
     mapArgs.erase("-maxsigcachesize");
 
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, MAX_ORPHAN_POOL_SIZE);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
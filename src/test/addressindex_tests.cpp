@@ -0,0 +1,73 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+static string KeyBytes(const CAddressIndexKey &key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << make_pair('a', key);
+    return ss.str();
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    uint160 hashA(1), hashB(2);
+    uint256 txid(3);
+
+    // entries of one address sort by height, whatever the transaction
+    BOOST_CHECK(KeyBytes(CAddressIndexKey(1, hashA, 255, txid, 0, false)) < KeyBytes(CAddressIndexKey(1, hashA, 256, 0, 0, false)));
+    BOOST_CHECK(KeyBytes(CAddressIndexKey(1, hashA, 70000, txid, 5, true)) < KeyBytes(CAddressIndexKey(1, hashA, 70001, 0, 0, false)));
+    // and all of them before those of another address
+    BOOST_CHECK(KeyBytes(CAddressIndexKey(1, hashA, 1000000, txid, 0, false)) < KeyBytes(CAddressIndexKey(1, hashB, 0, 0, 0, false)));
+    BOOST_CHECK(KeyBytes(CAddressIndexKey(1, hashB, 1000000, txid, 0, false)) < KeyBytes(CAddressIndexKey(2, hashA, 0, 0, 0, false)));
+
+    CAddressIndexKey key(2, hashB, 123456, txid, 7, true), key2;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << key;
+    BOOST_CHECK_EQUAL(ss.size(), key.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    ss >> key2;
+    BOOST_CHECK_EQUAL(key2.nAddressType, 2);
+    BOOST_CHECK(key2.hashAddress == hashB);
+    BOOST_CHECK_EQUAL(key2.nHeight, 123456);
+    BOOST_CHECK(key2.txhash == txid);
+    BOOST_CHECK_EQUAL(key2.nIndex, 7U);
+    BOOST_CHECK(key2.fSpending);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_scripts)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    unsigned char nType;
+    uint160 hash;
+
+    CScript p2pkh;
+    p2pkh.SetDestination(pubkey.GetID());
+    BOOST_CHECK(GetAddressIndexKey(p2pkh, nType, hash));
+    BOOST_CHECK_EQUAL(nType, ADDRESS_TYPE_KEYHASH);
+    BOOST_CHECK(hash == pubkey.GetID());
+
+    // pay-to-pubkey outputs count for the key's address
+    CScript p2pk;
+    p2pk << pubkey << OP_CHECKSIG;
+    BOOST_CHECK(GetAddressIndexKey(p2pk, nType, hash));
+    BOOST_CHECK_EQUAL(nType, ADDRESS_TYPE_KEYHASH);
+    BOOST_CHECK(hash == pubkey.GetID());
+
+    CScript p2sh;
+    p2sh.SetDestination(p2pkh.GetID());
+    BOOST_CHECK(GetAddressIndexKey(p2sh, nType, hash));
+    BOOST_CHECK_EQUAL(nType, ADDRESS_TYPE_SCRIPTHASH);
+    BOOST_CHECK(hash == p2pkh.GetID());
+
+    CScript nonstandard;
+    nonstandard << OP_RETURN;
+    BOOST_CHECK(!GetAddressIndexKey(nonstandard, nType, hash));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,44 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include "key.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bip32_tests)
+
+static void CheckExtKey(const CExtKey& key, const string& strSecret, const string& strChainCode)
+{
+    BOOST_CHECK(key.key.IsValid());
+    BOOST_CHECK(key.key.IsCompressed());
+    BOOST_CHECK_EQUAL(HexStr(key.key.begin(), key.key.end()), strSecret);
+    BOOST_CHECK_EQUAL(HexStr(key.vchChainCode, key.vchChainCode + 32), strChainCode);
+}
+
+// test vector 1 of BIP32
+BOOST_AUTO_TEST_CASE(bip32_test1)
+{
+    vector<unsigned char> vchSeed = ParseHex("000102030405060708090a0b0c0d0e0f");
+
+    CExtKey master;
+    master.SetMaster(&vchSeed[0], vchSeed.size());
+    CheckExtKey(master, "e8f32e723decf4051aefac8e2c93c9c5b214313817cdb01a1494b917c8436b35",
+                "873dff81c02f525623fd1fe5167eac3a55a049de3d314bb42ee227ffed37d508");
+
+    // m/0H
+    CExtKey child;
+    BOOST_CHECK(master.Derive(child, BIP32_HARDENED_KEY_LIMIT));
+    CheckExtKey(child, "edb2e14f9ee77d26dd93b4ecede8d16ed408ce149b6cd80b0715a2d911a0afea",
+                "47fdacbd0f1097043b78c63c20c34ef4ed9a111d980047ad16282c7ae6236141");
+
+    // m/0H/1
+    CExtKey grandchild;
+    BOOST_CHECK(child.Derive(grandchild, 1));
+    CheckExtKey(grandchild, "3c6cb8d0f6a264c91ea8b5030fadaa8e538b020f0a387421a12de9319dc93368",
+                "2a7857631386ba23dacac34180dd1983734e444fdbf774041578e9b6adb37c19");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
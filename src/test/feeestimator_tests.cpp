@@ -0,0 +1,67 @@
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+#include "feeestimator.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(feeestimator_tests)
+
+BOOST_AUTO_TEST_CASE(feeestimator_buckets)
+{
+    CConfirmStats stats;
+    stats.Init(1000, 1e8, 1.1, 25);
+    BOOST_CHECK_EQUAL(stats.GetMaxConfirms(), 25U);
+    BOOST_CHECK_EQUAL(stats.FindBucket(0), 0U);
+    BOOST_CHECK_EQUAL(stats.FindBucket(999), 0U);
+    BOOST_CHECK_EQUAL(stats.FindBucket(1000), 1U);
+    BOOST_CHECK_EQUAL(stats.FindBucket(1e12), stats.vBucketBounds.size() - 1);
+
+    // Not enough data: no estimate
+    BOOST_CHECK_EQUAL(stats.Estimate(1, 5, 0.85), -1);
+    stats.Record(stats.FindBucket(50000), 50000, 1);
+    BOOST_CHECK_EQUAL(stats.Estimate(1, 5, 0.85), -1);
+}
+
+BOOST_AUTO_TEST_CASE(feeestimator_estimates)
+{
+    CFeeEstimator estimator;
+    BOOST_CHECK_EQUAL(estimator.EstimateFee(1), -1);
+    BOOST_CHECK_EQUAL(estimator.EstimatePriority(1), -1);
+
+    // Each block, transactions paying 100000 per kB confirm in the next block, those paying
+    // 20000 within three, and those paying 5000 never do
+    int nHeight = 100;
+    unsigned int nTx = 0;
+    vector<uint256> vSlow;
+    for (int nBlock = 0; nBlock < 60; nBlock++) {
+        vector<uint256> vConfirmed;
+        for (int i = 0; i < 5; i++) {
+            uint256 hashFast = ++nTx, hashSlow = ++nTx, hashStuck = ++nTx;
+            estimator.ProcessTransaction(hashFast, nHeight, 100000, -1);
+            estimator.ProcessTransaction(hashSlow, nHeight, 20000, -1);
+            estimator.ProcessTransaction(hashStuck, nHeight, 5000, -1);
+            vConfirmed.push_back(hashFast);
+            vSlow.push_back(hashSlow);
+        }
+        if (vSlow.size() >= 15) {
+            vConfirmed.insert(vConfirmed.end(), vSlow.begin(), vSlow.begin() + 5);
+            vSlow.erase(vSlow.begin(), vSlow.begin() + 5);
+        }
+        estimator.ProcessBlock(++nHeight, vConfirmed);
+    }
+
+    double dFast = estimator.EstimateFee(1);
+    double dSlow = estimator.EstimateFee(3);
+    BOOST_CHECK(dFast > 90000 && dFast < 110000);
+    BOOST_CHECK(dSlow > 18000 && dSlow < 22000);
+    // a longer target never costs more, and beyond the longest tracked the longest applies
+    BOOST_CHECK(estimator.EstimateFee(10) <= dSlow);
+    BOOST_CHECK_EQUAL(estimator.EstimateFee(1000), estimator.EstimateFee(CFeeEstimator::MAX_CONFIRMS));
+    BOOST_CHECK_EQUAL(estimator.EstimateFee(0), -1);
+    // nothing was tracked by priority
+    BOOST_CHECK_EQUAL(estimator.EstimatePriority(1), -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,86 @@
+#include <boost/test/unit_test.hpp>
+#include <string>
+
+#include "jsonwriter.h"
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace std;
+using namespace json_spirit;
+
+BOOST_AUTO_TEST_SUITE(jsonwriter_tests)
+
+BOOST_AUTO_TEST_CASE(jsonwriter_events)
+{
+    string str;
+    CJSONWriter writer(str);
+    writer.BeginObject();
+    writer.Key("a").Int(-5);
+    writer.Key("b").BeginArray();
+    writer.UInt(18446744073709551615ULL);
+    writer.Bool(true);
+    writer.Null();
+    writer.BeginObject();
+    writer.EndObject();
+    writer.EndArray();
+    writer.Key("c").Amount(-150000001);
+    writer.Key("d").Amount(2100000000000000LL);
+    writer.Key("e").String("q\"\\\n\x01\xe9/");
+    writer.EndObject();
+    BOOST_CHECK_EQUAL(str, "{\"a\":-5,\"b\":[18446744073709551615,true,null,{}],"
+                           "\"c\":-1.50000001,\"d\":21000000.00000000,\"e\":\"q\\\"\\\\\\n\\u0001\\u00E9/\"}");
+
+    // undo a partly written value
+    str.clear();
+    writer.BeginArray();
+    writer.Int(1);
+    CJSONWriter::Mark mark = writer.GetMark();
+    writer.BeginObject();
+    writer.Key("x").Int(2);
+    writer.Rewind(mark);
+    writer.String("y");
+    writer.EndArray();
+    BOOST_CHECK_EQUAL(str, "[1,\"y\"]");
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_matches_json_spirit)
+{
+    const char *pszJSON = "{\"result\":[1,-2,3.25000000,\"x\\u00FF\\t\",false,null,{\"k\":[]}],\"id\":18446744073709551615}";
+    Value value;
+    BOOST_CHECK(read_string(string(pszJSON), value));
+
+    string str;
+    CJSONWriter writer(str);
+    writer.Write(value);
+    BOOST_CHECK_EQUAL(str, write_string(value, false));
+
+    Value parsed;
+    BOOST_CHECK(ParseJSON(str, parsed));
+    BOOST_CHECK_EQUAL(write_string(parsed, false), write_string(value, false));
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_parse)
+{
+    Value value;
+    BOOST_CHECK(ParseJSON(" [ 1 , 2.5e1, \"a\\/b\\x41\" ] ", value));
+    BOOST_CHECK(value.type() == array_type);
+    const Array &arr = value.get_array();
+    BOOST_CHECK_EQUAL(arr.size(), 3U);
+    BOOST_CHECK(arr[0].type() == int_type && arr[0].get_int() == 1);
+    BOOST_CHECK(arr[1].type() == real_type && arr[1].get_real() == 25.0);
+    BOOST_CHECK_EQUAL(arr[2].get_str(), "a/bA");
+
+    BOOST_CHECK(ParseJSON("-9223372036854775808", value) && value.get_int64() == -9223372036854775807LL - 1);
+    BOOST_CHECK(ParseJSON("true", value) && value.get_bool());
+    BOOST_CHECK(ParseJSON("{}", value) && value.get_obj().empty());
+
+    BOOST_CHECK(!ParseJSON("", value));
+    BOOST_CHECK(!ParseJSON("[1,]", value));
+    BOOST_CHECK(!ParseJSON("{\"a\" 1}", value));
+    BOOST_CHECK(!ParseJSON("\"unterminated", value));
+    BOOST_CHECK(!ParseJSON("01x", value));
+    BOOST_CHECK(!ParseJSON("[1] 2", value));
+    BOOST_CHECK(!ParseJSON(string(1000, '['), value));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
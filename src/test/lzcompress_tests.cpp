@@ -0,0 +1,71 @@
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+#include "lzcompress.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(lzcompress_tests)
+
+static bool RoundTrip(const vector<unsigned char> &vIn, size_t &nCompressed)
+{
+    vector<unsigned char> vCompressed;
+    LZCompress(vIn.empty() ? NULL : &vIn[0], vIn.size(), vCompressed);
+    nCompressed = vCompressed.size();
+    vector<unsigned char> vOut(vIn.size() + 1);
+    if (!LZDecompress(&vCompressed[0], vCompressed.size(), &vOut[0], vIn.size()))
+        return false;
+    vOut.resize(vIn.size());
+    return vOut == vIn;
+}
+
+BOOST_AUTO_TEST_CASE(lzcompress_roundtrip)
+{
+    size_t nCompressed;
+    for (unsigned int nSize = 0; nSize < 100; nSize++) {
+        vector<unsigned char> v(nSize);
+        for (unsigned int i = 0; i < nSize; i++)
+            v[i] = insecure_rand();
+        BOOST_CHECK(RoundTrip(v, nCompressed));
+    }
+
+    // random data does not compress, but must survive
+    vector<unsigned char> vRandom(100000);
+    for (unsigned int i = 0; i < vRandom.size(); i++)
+        vRandom[i] = insecure_rand();
+    BOOST_CHECK(RoundTrip(vRandom, nCompressed));
+
+    // long runs and repeated fragments, as found in blocks, compress well
+    vector<unsigned char> vRepeated(100000);
+    for (unsigned int i = 0; i < vRepeated.size(); i++)
+        vRepeated[i] = (i % 300 < 40) ? insecure_rand() : (i % 7);
+    BOOST_CHECK(RoundTrip(vRepeated, nCompressed));
+    BOOST_CHECK(nCompressed < vRepeated.size() / 2);
+
+    vector<unsigned char> vZero(1000000);
+    BOOST_CHECK(RoundTrip(vZero, nCompressed));
+    BOOST_CHECK(nCompressed < 5000);
+}
+
+BOOST_AUTO_TEST_CASE(lzcompress_malformed)
+{
+    vector<unsigned char> vIn(5000);
+    for (unsigned int i = 0; i < vIn.size(); i++)
+        vIn[i] = i % 13;
+    vector<unsigned char> vCompressed;
+    LZCompress(&vIn[0], vIn.size(), vCompressed);
+    vector<unsigned char> vOut(vIn.size() + 1);
+
+    // wrong expected size
+    BOOST_CHECK(!LZDecompress(&vCompressed[0], vCompressed.size(), &vOut[0], vIn.size() - 1));
+    BOOST_CHECK(!LZDecompress(&vCompressed[0], vCompressed.size(), &vOut[0], vIn.size() + 1));
+    // truncated input
+    BOOST_CHECK(!LZDecompress(&vCompressed[0], vCompressed.size() - 1, &vOut[0], vIn.size()));
+
+    // a match reaching back before the start of the output
+    const unsigned char bad[] = { 0x10, 'a', 0x05, 0x00 };
+    BOOST_CHECK(!LZDecompress(bad, sizeof(bad), &vOut[0], 5));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,160 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// A transaction spending output n of prev (or nothing if prev is NULL)
+static CTransaction MakeTx(const CTransaction *prev, unsigned int n, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    if (prev)
+        tx.vin[0].prevout = COutPoint(prev->GetHash(), n);
+    else
+        tx.vin[0].prevout = COutPoint(uint256(insecure_rand()), 0);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[1].nValue = nValue;
+    tx.vout[1].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_totals)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeTx(NULL, 0, 1000);
+    CTransaction txChild = MakeTx(&txParent, 0, 500);
+    CTransaction txGrandChild = MakeTx(&txChild, 0, 250);
+    unsigned int nSize = ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION);
+
+    pool.addUnchecked(txParent.GetHash(), txParent, 100);
+    pool.addUnchecked(txChild.GetHash(), txChild, 2000);
+    pool.addUnchecked(txGrandChild.GetHash(), txGrandChild, 30);
+
+    const CTxMemPoolEntry &parent = pool.mapEntry[txParent.GetHash()];
+    BOOST_CHECK_EQUAL(parent.nCountWithDescendants, 3U);
+    BOOST_CHECK_EQUAL(parent.nFeesWithDescendants, 2130);
+    BOOST_CHECK_EQUAL(parent.nSizeWithDescendants, 3U * nSize);
+
+    const CTxMemPoolEntry &grandchild = pool.mapEntry[txGrandChild.GetHash()];
+    BOOST_CHECK_EQUAL(grandchild.nCountWithAncestors, 3U);
+    BOOST_CHECK_EQUAL(grandchild.nFeesWithAncestors, 2130);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 3U * nSize);
+
+    // confirming the parent leaves the others with smaller ancestor totals
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(pool.mapEntry[txChild.GetHash()].nCountWithAncestors, 1U);
+    BOOST_CHECK_EQUAL(pool.mapEntry[txGrandChild.GetHash()].nFeesWithAncestors, 2030);
+    BOOST_CHECK_EQUAL(pool.mapEntry[txChild.GetHash()].nFeesWithDescendants, 2030);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 2U * nSize);
+
+    pool.clear();
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+    BOOST_CHECK(pool.mapEntry.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_readd_parent)
+{
+    CTxMemPool pool;
+    CTransaction txGrandParent = MakeTx(NULL, 0, 1000);
+    CTransaction txParent = MakeTx(&txGrandParent, 0, 500);
+    CTransaction txChild = MakeTx(&txParent, 0, 250);
+    CTransaction txOther = MakeTx(&txGrandParent, 1, 500);
+    // the child also spends a sibling of the parent, so it has the grandparent already
+    txChild.vin.push_back(CTxIn(COutPoint(txOther.GetHash(), 0)));
+    unsigned int nSize = ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nChildSize = ::GetSerializeSize(txChild, SER_NETWORK, PROTOCOL_VERSION);
+
+    pool.addUnchecked(txGrandParent.GetHash(), txGrandParent, 10);
+    pool.addUnchecked(txOther.GetHash(), txOther, 20);
+    pool.addUnchecked(txChild.GetHash(), txChild, 3000);
+
+    // the parent comes back from a disconnected block under its child
+    pool.addUnchecked(txParent.GetHash(), txParent, 400);
+
+    const CTxMemPoolEntry &parent = pool.mapEntry[txParent.GetHash()];
+    BOOST_CHECK_EQUAL(parent.nCountWithDescendants, 2U);
+    BOOST_CHECK_EQUAL(parent.nFeesWithDescendants, 3400);
+    BOOST_CHECK_EQUAL(parent.nSizeWithDescendants, nSize + nChildSize);
+    BOOST_CHECK_EQUAL(parent.nCountWithAncestors, 2U);
+    BOOST_CHECK_EQUAL(parent.nFeesWithAncestors, 410);
+
+    const CTxMemPoolEntry &child = pool.mapEntry[txChild.GetHash()];
+    BOOST_CHECK_EQUAL(child.nCountWithAncestors, 4U);
+    BOOST_CHECK_EQUAL(child.nFeesWithAncestors, 3430);
+    BOOST_CHECK_EQUAL(child.nSizeWithAncestors, 3U * nSize + nChildSize);
+
+    const CTxMemPoolEntry &grandparent = pool.mapEntry[txGrandParent.GetHash()];
+    BOOST_CHECK_EQUAL(grandparent.nCountWithDescendants, 4U);
+    BOOST_CHECK_EQUAL(grandparent.nFeesWithDescendants, 3430);
+
+    // and taking them out again leaves every total where it started
+    pool.remove(txChild);
+    BOOST_CHECK_EQUAL(pool.mapEntry[txParent.GetHash()].nCountWithDescendants, 1U);
+    BOOST_CHECK_EQUAL(pool.mapEntry[txParent.GetHash()].nSizeWithDescendants, nSize);
+    BOOST_CHECK_EQUAL(pool.mapEntry[txGrandParent.GetHash()].nCountWithDescendants, 3U);
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(pool.mapEntry[txGrandParent.GetHash()].nCountWithDescendants, 2U);
+    BOOST_CHECK_EQUAL(pool.mapEntry[txGrandParent.GetHash()].nFeesWithDescendants, 30);
+    BOOST_CHECK_EQUAL(pool.mapEntry[txGrandParent.GetHash()].nSizeWithDescendants, 2U * nSize);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+    CTransaction txLow = MakeTx(NULL, 0, 1000);
+    CTransaction txHigh = MakeTx(NULL, 0, 1000);
+    CTransaction txLowParent = MakeTx(NULL, 0, 1000);
+    CTransaction txRichChild = MakeTx(&txLowParent, 1, 500);
+    unsigned int nSize = ::GetSerializeSize(txLow, SER_NETWORK, PROTOCOL_VERSION);
+
+    pool.addUnchecked(txLow.GetHash(), txLow, 10);
+    pool.addUnchecked(txHigh.GetHash(), txHigh, 50000);
+    pool.addUnchecked(txLowParent.GetHash(), txLowParent, 0);
+    pool.addUnchecked(txRichChild.GetHash(), txRichChild, 20000);
+
+    // the zero fee parent is kept alive by its child; the low fee loner goes first
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nSize), 0);
+    BOOST_CHECK_EQUAL(pool.TrimToSize(3 * nSize), 1);
+    BOOST_CHECK(!pool.exists(txLow.GetHash()));
+    BOOST_CHECK(pool.exists(txLowParent.GetHash()));
+
+    // and newcomers now have to pay more than it did
+    BOOST_CHECK(pool.GetMinFee(nSize) >= 10 + CTransaction::nMinRelayTxFee * (int64)nSize / 1000 - 1);
+
+    // evicting a package takes the descendants along
+    BOOST_CHECK_EQUAL(pool.TrimToSize(nSize), 2);
+    BOOST_CHECK(!pool.exists(txLowParent.GetHash()));
+    BOOST_CHECK(!pool.exists(txRichChild.GetHash()));
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+
+    BOOST_CHECK_EQUAL(pool.TrimToSize(0), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_limits)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeTx(NULL, 0, 1000);
+    CTransaction txChild = MakeTx(&txParent, 0, 500);
+    CTransaction txSibling = MakeTx(&txParent, 1, 500);
+    CTransaction txGrandChild = MakeTx(&txChild, 0, 250);
+
+    pool.addUnchecked(txParent.GetHash(), txParent, 100);
+    pool.addUnchecked(txChild.GetHash(), txChild, 100);
+
+    // the grandchild would be the third in its chain
+    BOOST_CHECK(pool.CheckPackageLimits(txGrandChild, 3, 3));
+    BOOST_CHECK(!pool.CheckPackageLimits(txGrandChild, 2, 3));
+
+    // and the sibling the third descendant of the parent
+    BOOST_CHECK(pool.CheckPackageLimits(txSibling, 2, 3));
+    BOOST_CHECK(!pool.CheckPackageLimits(txSibling, 2, 2));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
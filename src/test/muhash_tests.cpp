@@ -0,0 +1,55 @@
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+#include "muhash.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(muhash_tests)
+
+BOOST_AUTO_TEST_CASE(muhash_order_independent)
+{
+    vector<unsigned char> a = ParseHex("00");
+    vector<unsigned char> b = ParseHex("0102030405");
+    vector<unsigned char> c = ParseHex("deadbeef");
+
+    CMuHash3072 empty;
+    CMuHash3072 h1, h2;
+    h1.Insert(a); h1.Insert(b); h1.Insert(c);
+    h2.Insert(c); h2.Insert(a); h2.Insert(b);
+    BOOST_CHECK(h1.GetHash() == h2.GetHash());
+    BOOST_CHECK(h1.GetHash() != empty.GetHash());
+
+    // removing an element is the inverse of adding it
+    h1.Remove(b);
+    CMuHash3072 h3;
+    h3.Insert(a); h3.Insert(c);
+    BOOST_CHECK(h1.GetHash() == h3.GetHash());
+
+    h1.Remove(a); h1.Remove(c);
+    BOOST_CHECK(h1.GetHash() == empty.GetHash());
+
+    // the same element twice is not the same as once
+    CMuHash3072 h4;
+    h4.Insert(a); h4.Insert(a); h4.Insert(c);
+    BOOST_CHECK(h4.GetHash() != h3.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(muhash_serialize)
+{
+    CMuHash3072 h;
+    h.Insert(ParseHex("0102"));
+    h.Remove(ParseHex("0304"));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << h;
+    CMuHash3072 h2;
+    ss >> h2;
+    BOOST_CHECK(h.GetHash() == h2.GetHash());
+
+    h.Normalize();
+    BOOST_CHECK(h.GetHash() == h2.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
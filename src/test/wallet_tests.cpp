@@ -291,4 +291,320 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+
+BOOST_AUTO_TEST_CASE(coin_selection_bnb_tests)
+{
+    CoinSet setCoinsRet;
+    int64 nValueRet;
+
+    empty_wallet();
+    add_coin(1*CENT); add_coin(2*CENT); add_coin(3*CENT); add_coin(4*CENT);
+
+    // exact matches, needing no change
+    BOOST_CHECK( wallet.SelectCoinsBnB(10 * CENT, 0, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 4U);
+    BOOST_CHECK( wallet.SelectCoinsBnB( 5 * CENT, 0, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 5 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+    BOOST_CHECK(!wallet.SelectCoinsBnB(11 * CENT, 0, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+
+    // an excess is only accepted up to the cost of change
+    BOOST_CHECK(!wallet.SelectCoinsBnB(45 * CENT / 10, 4 * CENT / 10, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK( wallet.SelectCoinsBnB(45 * CENT / 10, 5 * CENT / 10, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 5 * CENT);
+
+    // coins worth no more than the fee to spend them are left out
+    BOOST_CHECK(!wallet.SelectCoinsBnB( 1 * CENT, 0, 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK( wallet.SelectCoinsBnB( 2 * CENT, 0, 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 2 * CENT);
+
+    // a young coin is only used at the lower confirmation levels
+    empty_wallet();
+    add_coin(5*CENT, 4);
+    BOOST_CHECK(!wallet.SelectCoinsBnB( 5 * CENT, 0, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK( wallet.SelectCoinsBnB( 5 * CENT, 0, 0, 1, 1, vCoins, setCoinsRet, nValueRet));
+
+    // many equal coins: an unreachable target gives up rather than trying every subset
+    empty_wallet();
+    for (int i = 0; i < 1000; i++)
+        add_coin(2*CENT);
+    BOOST_CHECK( wallet.SelectCoinsBnB(500 * CENT, 0, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 250U);
+    BOOST_CHECK(!wallet.SelectCoinsBnB(999 * CENT, 0, 0, 1, 6, vCoins, setCoinsRet, nValueRet));
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(lazy_vtxprev)
+{
+    CWalletTx wtx;
+    wtx.vin.resize(1);
+    wtx.vout.resize(1);
+    wtx.vout[0].nValue = 1 * CENT;
+    for (int i = 0; i < 3; i++)
+    {
+        CMerkleTx tx;
+        tx.vin.resize(2);
+        tx.vin[0].scriptSig = CScript() << OP_1 << OP_2;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i * CENT;
+        tx.vMerkleBranch.resize(i);
+        tx.nIndex = i;
+        wtx.vtxPrev.Get().push_back(tx);
+    }
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << wtx;
+    CDataStream ssCopy(ss);
+
+    // read from a stream, the supporting transactions stay serialized until used
+    CWalletTx wtxRead;
+    ss >> wtxRead;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(!wtxRead.vtxPrev.IsLoaded());
+    BOOST_CHECK_EQUAL(wtxRead.vout[0].nValue, 1 * CENT);
+
+    CDataStream ssWritten(SER_DISK, CLIENT_VERSION);
+    ssWritten << wtxRead;
+    BOOST_CHECK(ssWritten.str() == ssCopy.str());
+
+    BOOST_CHECK_EQUAL(wtxRead.vtxPrev.Get().size(), 3U);
+    BOOST_CHECK(wtxRead.vtxPrev.IsLoaded());
+    BOOST_CHECK_EQUAL(wtxRead.vtxPrev.Get()[2].vout[0].nValue, 2 * CENT);
+    BOOST_CHECK_EQUAL(wtxRead.vtxPrev.Get()[2].vMerkleBranch.size(), 2U);
+
+    // cut short, it fails like any other read
+    CDataStream ssShort(ssCopy.begin(), ssCopy.begin() + 110, SER_DISK, CLIENT_VERSION);
+    CWalletTx wtxShort;
+    BOOST_CHECK_THROW(ssShort >> wtxShort, std::ios_base::failure);
+}
+
+// sign an output paying to scriptPubKey a few times (signature sizes vary) and check
+// that MaxScriptSigSize never comes out smaller than the real thing
+static void check_scriptsig_size(const CKeyStore& keystore, const CScript& scriptPubKey)
+{
+    unsigned int nMaxSize = MaxScriptSigSize(keystore, scriptPubKey);
+    BOOST_CHECK(nMaxSize > 0);
+
+    CTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = 1 * COIN;
+    txFrom.vout[0].scriptPubKey = scriptPubKey;
+    for (int i = 0; i < 20; i++)
+    {
+        CTransaction txTo;
+        txTo.nLockTime = i; // a different signature every time
+        txTo.vin.resize(1);
+        txTo.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+        txTo.vout.resize(1);
+        txTo.vout[0].nValue = 1 * COIN;
+        BOOST_CHECK(SignSignature(keystore, txFrom, txTo, 0));
+        BOOST_CHECK(txTo.vin[0].scriptSig.size() <= nMaxSize);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(max_scriptsig_size)
+{
+    CBasicKeyStore keystore;
+    CKey key[4];
+    for (int i = 0; i < 4; i++)
+    {
+        key[i].MakeNewKey(i % 2 == 0);
+        keystore.AddKey(key[i]);
+    }
+
+    // P2PK
+    CScript scriptPubKey;
+    scriptPubKey << key[0].GetPubKey() << OP_CHECKSIG;
+    check_scriptsig_size(keystore, scriptPubKey);
+
+    // P2PKH, with a compressed and an uncompressed key
+    for (int i = 0; i < 2; i++)
+    {
+        scriptPubKey.SetDestination(key[i].GetPubKey().GetID());
+        check_scriptsig_size(keystore, scriptPubKey);
+    }
+
+    // bare multisig, 2 of 3 with both kinds of keys
+    vector<CPubKey> vPubKeys;
+    for (int i = 1; i < 4; i++)
+        vPubKeys.push_back(key[i].GetPubKey());
+    CScript scriptMulti;
+    scriptMulti.SetMultisig(2, vPubKeys);
+    check_scriptsig_size(keystore, scriptMulti);
+
+    // P2SH around that multisig and around a P2PKH
+    BOOST_CHECK(keystore.AddCScript(scriptMulti));
+    scriptPubKey.SetDestination(scriptMulti.GetID());
+    check_scriptsig_size(keystore, scriptPubKey);
+
+    CScript scriptPKH;
+    scriptPKH.SetDestination(key[1].GetPubKey().GetID());
+    BOOST_CHECK(keystore.AddCScript(scriptPKH));
+    scriptPubKey.SetDestination(scriptPKH.GetID());
+    check_scriptsig_size(keystore, scriptPubKey);
+}
+
+BOOST_AUTO_TEST_CASE(create_transactions_split)
+{
+    CWallet walletSplit;
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(walletSplit.AddKeyPubKey(key, key.GetPubKey()));
+    // the change goes here; the key pool stays empty
+    walletSplit.vchDefaultKey = key.GetPubKey();
+
+    // ten confirmed coins of 100
+    CScript scriptMine;
+    scriptMine.SetDestination(key.GetPubKey().GetID());
+    for (int i = 0; i < 10; i++)
+    {
+        CTransaction tx;
+        tx.nLockTime = i;
+        tx.vout.push_back(CTxOut(100 * COIN, scriptMine));
+        CWalletTx wtx(&walletSplit, tx);
+        wtx.hashBlock = hashGenesisBlock;
+        wtx.nIndex = 0;
+        wtx.fMerkleVerified = true;
+        BOOST_CHECK(walletSplit.AddToWallet(wtx));
+    }
+
+    // far more payees than fit in one standard transaction
+    vector<pair<CScript, int64> > vecSend;
+    for (unsigned int i = 0; i < 4000; i++)
+    {
+        CScript scriptPayee;
+        scriptPayee.SetDestination(CKeyID(uint160(i + 1)));
+        vecSend.push_back(make_pair(scriptPayee, 1 * CENT));
+    }
+
+    vector<CWalletTx> vwtx;
+    CReserveKey reservekey(&walletSplit);
+    int64 nFee;
+    string strFailReason;
+    BOOST_CHECK(walletSplit.CreateTransactions(vecSend, vwtx, reservekey, nFee, strFailReason));
+    BOOST_CHECK(vwtx.size() > 1);
+
+    set<COutPoint> setSpent;
+    set<CScript> setPayees;
+    unsigned int nPayees = 0;
+    int64 nPaid = 0;
+    BOOST_FOREACH(const CWalletTx& wtx, vwtx)
+    {
+        BOOST_CHECK(::GetSerializeSize(*(CTransaction*)&wtx, SER_NETWORK, PROTOCOL_VERSION) < MAX_STANDARD_TX_SIZE);
+        // no coin is spent twice
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            BOOST_CHECK(setSpent.insert(txin.prevout).second);
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        {
+            if (txout.scriptPubKey == scriptMine)
+                continue;
+            nPayees++;
+            nPaid += txout.nValue;
+            setPayees.insert(txout.scriptPubKey);
+        }
+    }
+    BOOST_CHECK_EQUAL(nPayees, vecSend.size());
+    BOOST_CHECK_EQUAL(setPayees.size(), vecSend.size());
+    BOOST_CHECK_EQUAL(nPaid, 4000 * CENT);
+}
+
+// the cached balances against the sums over all of mapWallet that they replace
+static void check_cached_balances(const CWallet& w)
+{
+    int64 nBalance = 0, nUnconfirmed = 0, nImmature = 0;
+    {
+        LOCK(w.cs_wallet);
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, w.mapWallet)
+        {
+            const CWalletTx& wtx = item.second;
+            bool fConfirmed = wtx.IsConfirmed();
+            if (fConfirmed)
+                nBalance += wtx.GetAvailableCredit(false);
+            if (!wtx.IsFinal() || !fConfirmed)
+                nUnconfirmed += wtx.GetAvailableCredit(false);
+            nImmature += wtx.GetImmatureCredit(false);
+        }
+    }
+    BOOST_CHECK_EQUAL(w.GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(w.GetUnconfirmedBalance(), nUnconfirmed);
+    BOOST_CHECK_EQUAL(w.GetImmatureBalance(), nImmature);
+}
+
+// the outputs coin selection gets to see, both through setSpendable and by value
+static set<COutPoint> spendable_outputs(const CWallet& w, bool fOnlyConfirmed)
+{
+    set<COutPoint> setOutputs;
+    vector<COutput> vOutputs, vByValue;
+    w.AvailableCoins(vOutputs, fOnlyConfirmed);
+    w.AvailableCoins(vByValue, fOnlyConfirmed, NULL, true);
+    BOOST_CHECK_EQUAL(vOutputs.size(), vByValue.size());
+    BOOST_FOREACH(const COutput& out, vOutputs)
+        setOutputs.insert(COutPoint(out.tx->GetHash(), out.i));
+    BOOST_FOREACH(const COutput& out, vByValue)
+        BOOST_CHECK(setOutputs.count(COutPoint(out.tx->GetHash(), out.i)));
+    return setOutputs;
+}
+
+BOOST_AUTO_TEST_CASE(cached_balances)
+{
+    CWallet walletCached;
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(walletCached.AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine, scriptPayee;
+    scriptMine.SetDestination(key.GetPubKey().GetID());
+    scriptPayee.SetDestination(CKeyID(uint160(1)));
+
+    // a confirmed credit
+    CTransaction txCredit;
+    txCredit.vout.push_back(CTxOut(100 * COIN, scriptMine));
+    CWalletTx wtxCredit(&walletCached, txCredit);
+    wtxCredit.hashBlock = hashGenesisBlock;
+    wtxCredit.nIndex = 0;
+    wtxCredit.fMerkleVerified = true;
+    BOOST_CHECK(walletCached.AddToWallet(wtxCredit));
+    uint256 hashCredit = txCredit.GetHash();
+    BOOST_CHECK_EQUAL(walletCached.GetBalance(), 100 * COIN);
+    check_cached_balances(walletCached);
+    set<COutPoint> setCredit;
+    setCredit.insert(COutPoint(hashCredit, 0));
+    BOOST_CHECK(spendable_outputs(walletCached, true) == setCredit);
+
+    // spending it, with change, in the same block
+    CTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(COutPoint(hashCredit, 0)));
+    txSpend.vout.push_back(CTxOut(30 * COIN, scriptPayee));
+    txSpend.vout.push_back(CTxOut(60 * COIN, scriptMine));
+    CWalletTx wtxSpend(&walletCached, txSpend);
+    wtxSpend.hashBlock = hashGenesisBlock;
+    wtxSpend.nIndex = 0;
+    wtxSpend.fMerkleVerified = true;
+    BOOST_CHECK(walletCached.AddToWallet(wtxSpend));
+    uint256 hashSpend = txSpend.GetHash();
+    BOOST_CHECK(walletCached.mapWallet[hashCredit].IsSpent(0));
+    BOOST_CHECK_EQUAL(walletCached.GetBalance(), 60 * COIN);
+    check_cached_balances(walletCached);
+    set<COutPoint> setChange;
+    setChange.insert(COutPoint(hashSpend, 1));
+    BOOST_CHECK(spendable_outputs(walletCached, true) == setChange);
+
+    // the block is disconnected: the change is still ours, but no longer confirmed
+    walletCached.BlockDisconnected(hashGenesisBlock);
+    BOOST_CHECK_EQUAL(walletCached.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(walletCached.GetUnconfirmedBalance(), 60 * COIN);
+    check_cached_balances(walletCached);
+    BOOST_CHECK(spendable_outputs(walletCached, true).empty());
+    BOOST_CHECK(spendable_outputs(walletCached, false) == setChange);
+
+    // and connected again, everything is back where it was
+    BOOST_CHECK(walletCached.AddToWallet(wtxCredit));
+    BOOST_CHECK(walletCached.AddToWallet(wtxSpend));
+    walletCached.mapWallet[hashCredit].fMerkleVerified = true;
+    walletCached.mapWallet[hashSpend].fMerkleVerified = true;
+    BOOST_CHECK_EQUAL(walletCached.GetBalance(), 60 * COIN);
+    BOOST_CHECK_EQUAL(walletCached.GetUnconfirmedBalance(), 0);
+    check_cached_balances(walletCached);
+    BOOST_CHECK(spendable_outputs(walletCached, true) == setChange);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,169 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "walletlog.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(walletlog_tests)
+
+static CSerializeData Data(const string& str)
+{
+    return CSerializeData(str.begin(), str.end());
+}
+
+static string ReadString(const CWalletLog& log, const string& strKey)
+{
+    CSerializeData vchValue;
+    if (!log.Read(Data(strKey), vchValue))
+        return "<missing>";
+    return string(vchValue.begin(), vchValue.end());
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_replay)
+{
+    boost::filesystem::path path = GetDataDir() / "walletlog_replay.log";
+    {
+        CWalletLog log;
+        BOOST_CHECK(log.Open(path));
+        BOOST_CHECK(log.Write(Data("a"), Data("1")));
+        BOOST_CHECK(log.Write(Data("b"), Data("2")));
+        BOOST_CHECK(!log.Write(Data("b"), Data("3"), false));
+        BOOST_CHECK(log.Erase(Data("a")));
+
+        vector<CWalletLogOp> vOps;
+        vOps.push_back(CWalletLogOp(Data("c"), Data("3")));
+        vOps.push_back(CWalletLogOp(Data("b"), Data("4")));
+        BOOST_CHECK(log.WriteBatch(vOps));
+        BOOST_CHECK(log.Sync());
+    }
+
+    // a record torn at the end of the file is cut off, the rest replays
+    FILE* file = fopen(path.string().c_str(), "ab");
+    fwrite("\x40\x00\x00\x00xyz", 1, 7, file);
+    fclose(file);
+
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path));
+    BOOST_CHECK(!log.IsDamaged());
+    BOOST_CHECK_EQUAL(ReadString(log, "a"), "<missing>");
+    BOOST_CHECK_EQUAL(ReadString(log, "b"), "4");
+    BOOST_CHECK_EQUAL(ReadString(log, "c"), "3");
+
+    // keys come back in order
+    CSerializeData vchKey, vchValue;
+    BOOST_CHECK(log.Seek(vchKey, vchValue, true));
+    BOOST_CHECK(vchKey == Data("b"));
+    BOOST_CHECK(log.Seek(vchKey, vchValue, false));
+    BOOST_CHECK(vchKey == Data("c"));
+    BOOST_CHECK(!log.Seek(vchKey, vchValue, false));
+    log.Close();
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_damaged)
+{
+    boost::filesystem::path path = GetDataDir() / "walletlog_damaged.log";
+    {
+        CWalletLog log;
+        BOOST_CHECK(log.Open(path));
+        BOOST_CHECK(log.Write(Data("a"), Data("1")));
+        BOOST_CHECK(log.Write(Data("b"), Data("2")));
+    }
+
+    // flip the value of the first record: only that record is lost
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    fseek(file, 17, SEEK_SET);
+    fputc('9', file);
+    fclose(file);
+
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path));
+    BOOST_CHECK(log.IsDamaged());
+    BOOST_CHECK_EQUAL(ReadString(log, "a"), "<missing>");
+    BOOST_CHECK_EQUAL(ReadString(log, "b"), "2");
+    // the damaged record must survive: no compaction
+    BOOST_CHECK(!log.NeedsCompaction());
+    BOOST_CHECK(!log.Compact());
+    log.Close();
+
+    // the damaged file is copied aside once, not on every open
+    boost::filesystem::path pathQuarantine = log.GetQuarantinePath();
+    BOOST_CHECK(boost::filesystem::exists(pathQuarantine));
+    boost::filesystem::remove(pathQuarantine);
+    BOOST_CHECK(log.Open(path));
+    BOOST_CHECK(boost::filesystem::exists(pathQuarantine));
+    uint64 nQuarantineSize = boost::filesystem::file_size(pathQuarantine);
+    BOOST_CHECK(log.Write(Data("c"), Data("3")));
+    log.Close();
+    BOOST_CHECK(log.Open(path));
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathQuarantine), nQuarantineSize);
+
+    // salvaging rewrites the intact records and clears the damage
+    BOOST_CHECK(log.Compact(true));
+    BOOST_CHECK(!log.IsDamaged());
+    log.Close();
+    BOOST_CHECK(log.Open(path));
+    BOOST_CHECK(!log.IsDamaged());
+    BOOST_CHECK_EQUAL(ReadString(log, "a"), "<missing>");
+    BOOST_CHECK_EQUAL(ReadString(log, "b"), "2");
+    BOOST_CHECK_EQUAL(ReadString(log, "c"), "3");
+    log.Close();
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_damaged_size)
+{
+    boost::filesystem::path path = GetDataDir() / "walletlog_damaged_size.log";
+    {
+        CWalletLog log;
+        BOOST_CHECK(log.Open(path));
+        BOOST_CHECK(log.Write(Data("a"), Data("1")));
+        BOOST_CHECK(log.Write(Data("b"), Data("2")));
+        BOOST_CHECK(log.Write(Data("c"), Data("3")));
+    }
+    uint64 nSize = boost::filesystem::file_size(path);
+
+    // make the size of the first record run past the end of the file: not a torn
+    // write, since intact records follow, so nothing is cut off
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    fseek(file, 10, SEEK_SET);
+    fputc(0x7f, file);
+    fclose(file);
+
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path));
+    BOOST_CHECK(log.IsDamaged());
+    BOOST_CHECK_EQUAL(ReadString(log, "a"), "<missing>");
+    BOOST_CHECK_EQUAL(ReadString(log, "b"), "2");
+    BOOST_CHECK_EQUAL(ReadString(log, "c"), "3");
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize);
+    BOOST_CHECK(!log.Compact());
+    log.Close();
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_compact)
+{
+    boost::filesystem::path path = GetDataDir() / "walletlog_compact.log";
+    CWalletLog log;
+    BOOST_CHECK(log.Open(path));
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(log.Write(Data("key"), Data(strprintf("%d", i))));
+    BOOST_CHECK(log.Write(Data("other"), Data("x")));
+    uint64 nSize = boost::filesystem::file_size(path);
+
+    BOOST_CHECK(log.Compact());
+    BOOST_CHECK(boost::filesystem::file_size(path) < nSize);
+    BOOST_CHECK(log.Write(Data("new"), Data("y")));
+    log.Close();
+
+    BOOST_CHECK(log.Open(path));
+    BOOST_CHECK_EQUAL(ReadString(log, "key"), "99");
+    BOOST_CHECK_EQUAL(ReadString(log, "other"), "x");
+    BOOST_CHECK_EQUAL(ReadString(log, "new"), "y");
+    log.Close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
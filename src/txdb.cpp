@@ -20,6 +20,10 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
+void static BatchWriteCommitment(CLevelDBBatch &batch, const CCoinsCommitment &commit) {
+    batch.Write('M', commit);
+}
+
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
 }
 
@@ -53,7 +57,7 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
+bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsCommitment *pcommit) {
     printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
 
     CLevelDBBatch batch;
@@ -61,6 +65,8 @@ bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockI
         BatchWriteCoins(batch, it->first, it->second);
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
+    if (pcommit)
+        BatchWriteCommitment(batch, *pcommit);
 
     return db.WriteBatch(batch);
 }
@@ -107,18 +113,73 @@ bool CBlockTreeDB::ReadReindexing(bool &fReindexing) {
     return true;
 }
 
+bool CBlockTreeDB::WriteBlockFileScan(int nFile, const std::vector<CBlockFileEntry> &vEntries) {
+    return Write(make_pair('S', nFile), vEntries);
+}
+
+bool CBlockTreeDB::ReadBlockFileScan(int nFile, std::vector<CBlockFileEntry> &vEntries) {
+    return Read(make_pair('S', nFile), vEntries);
+}
+
+bool CBlockTreeDB::EraseBlockFileScan(int nFile) {
+    return Erase(make_pair('S', nFile));
+}
+
+bool CBlockTreeDB::WriteBlockIndexSnapshot(const uint256 &hashSnapshot) {
+    return Write('X', hashSnapshot, true);
+}
+
+bool CBlockTreeDB::ReadBlockIndexSnapshot(uint256 &hashSnapshot) {
+    return Read('X', hashSnapshot);
+}
+
+bool CBlockTreeDB::EraseBlockIndexSnapshot() {
+    return Erase('X', true);
+}
+
 bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
+bool CCoinsViewDB::GetCommitment(CCoinsCommitment &commit) {
+    if (db.Read('M', commit))
+        return true;
+
+    // No commitment stored yet: either the database is empty, or it was
+    // created by a version that did not maintain one.
+    if (!db.Exists('B')) {
+        commit = CCoinsCommitment();
+        return true;
+    }
+    printf("Building UTXO set commitment from coin database...\n");
+    int64 nStart = GetTimeMillis();
+    if (!BuildCommitment(commit))
+        return false;
+    printf(" commitment built in %"PRI64d"ms\n", GetTimeMillis() - nStart);
+
+    CLevelDBBatch batch;
+    BatchWriteCommitment(batch, commit);
+    return db.WriteBatch(batch);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+    CBlockIndex *pindex = GetBestBlock();
+    if (pindex == NULL)
+        return false;
+    CCoinsCommitment commit;
+    if (!GetCommitment(commit))
+        return false;
+    stats.nHeight = pindex->nHeight;
+    stats.hashBlock = pindex->GetBlockHash();
+    commit.GetStats(stats);
+    return true;
+}
+
+bool CCoinsViewDB::BuildCommitment(CCoinsCommitment &commit) {
     leveldb::Iterator *pcursor = db.NewIterator();
     pcursor->SeekToFirst();
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock()->GetBlockHash();
-    ss << stats.hashBlock;
-    int64 nTotalAmount = 0;
+    commit = CCoinsCommitment();
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -133,32 +194,19 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n'); 
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                for (unsigned int i=0; i<coins.vout.size(); i++)
+                    if (coins.IsAvailable(i))
+                        commit.AddOutput(txhash, i, coins);
+                if (!coins.IsPruned())
+                    commit.nTransactions++;
             }
             pcursor->Next();
         } catch (std::exception &e) {
+            delete pcursor;
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
     delete pcursor;
-    stats.nHeight = GetBestBlock()->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -173,6 +221,103 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::WriteTxIndexes(const std::vector<std::pair<uint256, CDiskTxPos> > &vPos,
+                                  const std::vector<std::pair<CAddressIndexKey, int64> > &vAddressIndex, bool fEraseAddressIndex,
+                                  const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vAddressUnspent,
+                                  const std::vector<std::pair<COutPoint, CSpentIndexValue> > &vSpentIndex) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vPos.begin(); it!=vPos.end(); it++)
+        batch.Write(make_pair('t', it->first), it->second);
+    for (std::vector<std::pair<CAddressIndexKey, int64> >::const_iterator it=vAddressIndex.begin(); it!=vAddressIndex.end(); it++) {
+        if (fEraseAddressIndex)
+            batch.Erase(make_pair('a', it->first));
+        else
+            batch.Write(make_pair('a', it->first), it->second);
+    }
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vAddressUnspent.begin(); it!=vAddressUnspent.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('u', it->first));
+        else
+            batch.Write(make_pair('u', it->first), it->second);
+    }
+    for (std::vector<std::pair<COutPoint, CSpentIndexValue> >::const_iterator it=vSpentIndex.begin(); it!=vSpentIndex.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('p', it->first));
+        else
+            batch.Write(make_pair('p', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressIndex(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressIndexKey, int64> > &vEntries, int nStartHeight, int nEndHeight) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    // keys of an address sort by height, so start at the first one at nStartHeight
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', CAddressIndexKey(nAddressType, hashAddress, nStartHeight, 0, 0, false));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType >> key;
+            if (chType != 'a' || key.nAddressType != nAddressType || key.hashAddress != hashAddress || key.nHeight > nEndHeight)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            int64 nValue;
+            ssValue >> nValue;
+            vEntries.push_back(make_pair(key, nValue));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vEntries) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', CAddressUnspentKey(nAddressType, hashAddress, 0, 0));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType >> key;
+            if (chType != 'u' || key.nAddressType != nAddressType || key.hashAddress != hashAddress)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vEntries.push_back(make_pair(key, value));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const COutPoint &outpoint, CSpentIndexValue &value) {
+    return Read(make_pair('p', outpoint), value);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -242,6 +387,56 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     return true;
 }
 
+bool CBlockTreeDB::CheckBlockIndex()
+{
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('b', uint256(0));
+    pcursor->Seek(ssKeySet.str());
+
+    // Every stored block must be known with the same height and parent. Entries are never
+    // removed and those fields never change, so this holds while the node keeps running.
+    bool fOk = true;
+    unsigned int nChecked = 0;
+    while (pcursor->Valid() && fOk) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 'b')
+                break;
+            uint256 hash;
+            ssKey >> hash;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            {
+                LOCK(cs_main);
+                std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+                if (mi == mapBlockIndex.end())
+                    fOk = error("CheckBlockIndex() : block %s missing", hash.ToString().c_str());
+                else if (mi->second->nHeight != diskindex.nHeight ||
+                         (mi->second->pprev ? mi->second->pprev->GetBlockHash() : 0) != diskindex.hashPrev)
+                    fOk = error("CheckBlockIndex() : block %s differs", hash.ToString().c_str());
+            }
+            nChecked++;
+            pcursor->Next();
+        } catch (std::exception &e) {
+            fOk = error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+
+    if (fOk)
+        printf("CheckBlockIndex(): %u entries match\n", nChecked);
+    return fOk;
+}
+
 bool CBlockTreeDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
 {
     return Read(string("hashSyncCheckpoint"), hashCheckpoint);
@@ -21,8 +21,12 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex, const CCoinsCommitment *pcommit = NULL);
     bool GetStats(CCoinsStats &stats);
+    bool GetCommitment(CCoinsCommitment &commit);
+
+    // Recompute the output set commitment by scanning the whole database
+    bool BuildCommitment(CCoinsCommitment &commit);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -43,11 +47,28 @@ public:
     bool WriteLastBlockFile(int nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
+    bool WriteBlockFileScan(int nFile, const std::vector<CBlockFileEntry> &vEntries);
+    bool ReadBlockFileScan(int nFile, std::vector<CBlockFileEntry> &vEntries);
+    bool EraseBlockFileScan(int nFile);
+    bool WriteBlockIndexSnapshot(const uint256 &hashSnapshot);
+    bool ReadBlockIndexSnapshot(uint256 &hashSnapshot);
+    bool EraseBlockIndexSnapshot();
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    // The transaction, address and spent index changes of one block, in a single batch. With
+    // fEraseAddressIndex the address index entries are erased rather than written; null unspent
+    // and spent values erase their entries.
+    bool WriteTxIndexes(const std::vector<std::pair<uint256, CDiskTxPos> > &vPos,
+                        const std::vector<std::pair<CAddressIndexKey, int64> > &vAddressIndex, bool fEraseAddressIndex,
+                        const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vAddressUnspent,
+                        const std::vector<std::pair<COutPoint, CSpentIndexValue> > &vSpentIndex);
+    bool ReadAddressIndex(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressIndexKey, int64> > &vEntries, int nStartHeight, int nEndHeight);
+    bool ReadAddressUnspentIndex(unsigned char nAddressType, const uint160 &hashAddress, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vEntries);
+    bool ReadSpentIndex(const COutPoint &outpoint, CSpentIndexValue &value);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
+    bool CheckBlockIndex();
 	bool ReadSyncCheckpoint(uint256& hashCheckpoint);
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
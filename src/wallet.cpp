@@ -9,6 +9,7 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include "coincontrol.h"
+#include "init.h"
 #include <boost/algorithm/string/replace.hpp>
 
 using namespace std;
@@ -19,6 +20,10 @@ using namespace std;
 // mapWallet
 //
 
+// Typical serialized sizes of a signed pay-to-pubkey-hash input and of a change output
+static const unsigned int WALLET_INPUT_SIZE = 148;
+static const unsigned int WALLET_CHANGE_OUTPUT_SIZE = 34;
+
 struct CompareValueOnly
 {
     bool operator()(const pair<int64, pair<const CWalletTx*, unsigned int> >& t1,
@@ -28,16 +33,28 @@ struct CompareValueOnly
     }
 };
 
+struct CompareValueDescending
+{
+    bool operator()(const pair<int64, const COutput*>& t1,
+                    const pair<int64, const COutput*>& t2) const
+    {
+        return t1.first > t2.first;
+    }
+};
+
 CPubKey CWallet::GenerateNewKey()
 {
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
 
     RandAddSeedPerfmon();
     CKey secret;
-    secret.MakeNewKey(fCompressed);
+    if (IsHDEnabled())
+        DeriveNewChildKey(secret);
+    else
+        secret.MakeNewKey(fCompressed);
 
     // Compressed public keys were introduced in version 0.6.0
-    if (fCompressed)
+    if (secret.IsCompressed())
         SetMinVersion(FEATURE_COMPRPUBKEY);
 
     CPubKey pubkey = secret.GetPubKey();
@@ -46,6 +63,69 @@ CPubKey CWallet::GenerateNewKey()
     return pubkey;
 }
 
+// m/0'/0', the parent of the keys of the chain
+bool CWallet::GetHDChainKey(CExtKey& chainKey) const
+{
+    CKey seed;
+    if (!GetKey(hdChain.masterKeyID, seed))
+        return false;
+    CExtKey masterKey, accountKey;
+    masterKey.SetMaster(seed.begin(), seed.size());
+    return masterKey.Derive(accountKey, BIP32_HARDENED_KEY_LIMIT) &&
+           accountKey.Derive(chainKey, BIP32_HARDENED_KEY_LIMIT);
+}
+
+void CWallet::DeriveNewChildKey(CKey& secret)
+{
+    LOCK(cs_wallet);
+    CExtKey chainKey, childKey;
+    if (!GetHDChainKey(chainKey))
+        throw std::runtime_error("CWallet::DeriveNewChildKey() : HD seed not found");
+    // children we have already, as when the counter was not written, are skipped
+    do
+    {
+        if (!chainKey.Derive(childKey, hdChain.nExternalChainCounter | BIP32_HARDENED_KEY_LIMIT))
+            childKey.key = CKey();
+        hdChain.nExternalChainCounter++;
+    }
+    while (!childKey.key.IsValid() || HaveKey(childKey.key.GetPubKey().GetID()));
+    secret = childKey.key;
+    if (!SetHDChain(hdChain))
+        throw std::runtime_error("CWallet::DeriveNewChildKey() : writing HD chain failed");
+}
+
+CPubKey CWallet::GenerateNewHDMasterKey()
+{
+    RandAddSeedPerfmon();
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    if (!AddKeyPubKey(key, pubkey))
+        throw std::runtime_error("CWallet::GenerateNewHDMasterKey() : AddKey failed");
+    return pubkey;
+}
+
+bool CWallet::SetHDMasterKey(const CPubKey& pubkey)
+{
+    LOCK(cs_wallet);
+    // keys of an earlier chain stay in the wallet; new ones come from the new seed
+    CHDChain newHdChain;
+    newHdChain.masterKeyID = pubkey.GetID();
+    if (!SetHDChain(newHdChain))
+        return false;
+    SetMinVersion(FEATURE_HD);
+    return true;
+}
+
+bool CWallet::SetHDChain(const CHDChain& chain)
+{
+    LOCK(cs_wallet);
+    if (fFileBacked && !CWalletDB(strWalletFile).WriteHDChain(chain))
+        return false;
+    hdChain = chain;
+    return true;
+}
+
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
 {
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
@@ -88,6 +168,25 @@ bool CWallet::AddCScript(const CScript& redeemScript)
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
+// Choose nDeriveIterations so deriving the key from strPassphrase takes about -walletkdftime
+// milliseconds on this machine, from two timed derivations
+static void CalibrateDeriveIterations(const SecureString& strPassphrase, CMasterKey& kMasterKey)
+{
+    int64 nTargetTime = std::max(GetArg("-walletkdftime", 100), (int64)1);
+    CCrypter crypter;
+
+    int64 nStartTime = GetTimeMillis();
+    crypter.SetKeyFromPassphrase(strPassphrase, kMasterKey.vchSalt, 25000, kMasterKey.nDerivationMethod);
+    double dIterations = 25000.0 * nTargetTime / std::max(GetTimeMillis() - nStartTime, (int64)1);
+    dIterations = std::min(std::max(dIterations, 25000.0), (double)std::numeric_limits<int>::max());
+
+    nStartTime = GetTimeMillis();
+    crypter.SetKeyFromPassphrase(strPassphrase, kMasterKey.vchSalt, (int)dIterations, kMasterKey.nDerivationMethod);
+    dIterations = (dIterations + dIterations * nTargetTime / std::max(GetTimeMillis() - nStartTime, (int64)1)) / 2;
+
+    kMasterKey.nDeriveIterations = (unsigned int)std::min(std::max(dIterations, 25000.0), (double)std::numeric_limits<int>::max());
+}
+
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
 {
     if (!IsLocked())
@@ -129,16 +228,7 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
                 return false;
             if (CCryptoKeyStore::Unlock(vMasterKey))
             {
-                int64 nStartTime = GetTimeMillis();
-                crypter.SetKeyFromPassphrase(strNewWalletPassphrase, pMasterKey.second.vchSalt, pMasterKey.second.nDeriveIterations, pMasterKey.second.nDerivationMethod);
-                pMasterKey.second.nDeriveIterations = pMasterKey.second.nDeriveIterations * (100 / ((double)(GetTimeMillis() - nStartTime)));
-
-                nStartTime = GetTimeMillis();
-                crypter.SetKeyFromPassphrase(strNewWalletPassphrase, pMasterKey.second.vchSalt, pMasterKey.second.nDeriveIterations, pMasterKey.second.nDerivationMethod);
-                pMasterKey.second.nDeriveIterations = (pMasterKey.second.nDeriveIterations + pMasterKey.second.nDeriveIterations * 100 / ((double)(GetTimeMillis() - nStartTime))) / 2;
-
-                if (pMasterKey.second.nDeriveIterations < 25000)
-                    pMasterKey.second.nDeriveIterations = 25000;
+                CalibrateDeriveIterations(strNewWalletPassphrase, pMasterKey.second);
 
                 printf("Wallet passphrase changed to an nDeriveIterations of %i\n", pMasterKey.second.nDeriveIterations);
 
@@ -163,6 +253,37 @@ void CWallet::SetBestChain(const CBlockLocator& loc)
     walletdb.WriteBestBlock(loc);
 }
 
+void CWallet::BlockDisconnected(const uint256& hashBlock)
+{
+    LOCK(cs_wallet);
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi == mapBlockIndex.end())
+        return;
+    int nHeight = (*mi).second->nHeight;
+    vector<CWalletTx*> vDisconnected;
+    pair<TxHeights::iterator, TxHeights::iterator> range = mapTxHeights.equal_range(nHeight);
+    for (TxHeights::iterator it = range.first; it != range.second; ++it)
+        if ((*it).second->hashBlock == hashBlock)
+            vDisconnected.push_back((*it).second);
+
+    // Until a block takes them again they are in none, so listsinceblock finds them
+    // among the transactions outside any block
+    BOOST_FOREACH(CWalletTx* pwtx, vDisconnected)
+    {
+        EraseTxHeight(nHeight, pwtx);
+        pwtx->hashBlock = 0;
+        pwtx->vMerkleBranch.clear();
+        pwtx->nIndex = -1;
+        pwtx->fMerkleVerified = false;
+        mapTxHeights.insert(make_pair(-1, pwtx));
+        pwtx->MarkDirty();
+        uint256 hash = pwtx->GetHash();
+        UpdateSpendable(hash, *pwtx);
+        pwtx->WriteToDisk();
+        NotifyTransactionChanged(this, hash, CT_UPDATED);
+    }
+}
+
 // This class implements an addrIncoming entry that causes pre-0.4
 // clients to crash on startup if reading a private-key-encrypted wallet.
 class CCorruptAddress
@@ -223,6 +344,10 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
         return false;
+    // The damaged records would keep the file from being rewritten, and with it the
+    // unencrypted keys
+    if (IsFileDamaged())
+        return error("EncryptWallet() : %s has damaged records, restart with -salvagewallet first", strWalletFile.c_str());
 
     CKeyingMaterial vMasterKey;
     RandAddSeedPerfmon();
@@ -237,16 +362,7 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
     RAND_bytes(&kMasterKey.vchSalt[0], WALLET_CRYPTO_SALT_SIZE);
 
     CCrypter crypter;
-    int64 nStartTime = GetTimeMillis();
-    crypter.SetKeyFromPassphrase(strWalletPassphrase, kMasterKey.vchSalt, 25000, kMasterKey.nDerivationMethod);
-    kMasterKey.nDeriveIterations = 2500000 / ((double)(GetTimeMillis() - nStartTime));
-
-    nStartTime = GetTimeMillis();
-    crypter.SetKeyFromPassphrase(strWalletPassphrase, kMasterKey.vchSalt, kMasterKey.nDeriveIterations, kMasterKey.nDerivationMethod);
-    kMasterKey.nDeriveIterations = (kMasterKey.nDeriveIterations + kMasterKey.nDeriveIterations * 100 / ((double)(GetTimeMillis() - nStartTime))) / 2;
-
-    if (kMasterKey.nDeriveIterations < 25000)
-        kMasterKey.nDeriveIterations = 25000;
+    CalibrateDeriveIterations(strWalletPassphrase, kMasterKey);
 
     printf("Encrypting Wallet with an nDeriveIterations of %i\n", kMasterKey.nDeriveIterations);
 
@@ -287,12 +403,30 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 
         Lock();
         Unlock(strWalletPassphrase);
+        // The seed was on disk unencrypted, so the chain starts over from a new one
+        if (IsHDEnabled())
+        {
+            bool fNewSeed = false;
+            try {
+                fNewSeed = SetHDMasterKey(GenerateNewHDMasterKey());
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "EncryptWallet()");
+            }
+            if (!fNewSeed)
+                exit(1); //We would go on deriving keys from the seed that was on disk unencrypted...die and let the user reload the wallet and encrypt it again.
+        }
         NewKeyPool();
         Lock();
 
         // Need to completely rewrite the wallet file; if we don't, bdb might keep
         // bits of the unencrypted private key in slack space in the database file.
-        CDB::Rewrite(strWalletFile);
+        if (!CDB::Rewrite(strWalletFile))
+        {
+            strMiscWarning = _("Warning: The wallet was encrypted, but its file could not be rewritten and may still hold unencrypted keys.");
+            return error("EncryptWallet() : rewriting %s failed", strWalletFile.c_str());
+        }
+        // and the copies set aside when migrating or repairing it still hold the keys unencrypted
+        CDB::ScrubBackups(strWalletFile);
 
     }
     NotifyStatusChanged(this);
@@ -300,6 +434,14 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
     return true;
 }
 
+bool CWallet::IsFileDamaged() const
+{
+    if (!fFileBacked)
+        return false;
+    CWalletLog* plog = bitdb.GetLog(strWalletFile);
+    return plog && plog->IsDamaged();
+}
+
 int64 CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
 {
     int64 nRet = nOrderPosNext++;
@@ -311,31 +453,66 @@ int64 CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+// Height of the block a wallet transaction is in, or -1
+static int GetWalletTxHeight(const CWalletTx& wtx)
 {
-    CWalletDB walletdb(strWalletFile);
-
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    if (wtx.hashBlock == 0)
+        return -1;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    return mi == mapBlockIndex.end() ? -1 : (*mi).second->nHeight;
+}
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
+void CWallet::BuildTxIndexes()
+{
+    LOCK(cs_wallet);
+    wtxOrdered.clear();
+    mapTxHeights.clear();
+    laccentries.clear();
+    CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
-        CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
-    }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
-    {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        CWalletTx* pwtx = &(*it).second;
+        wtxOrdered.insert(make_pair(pwtx->nOrderPos, TxPair(pwtx, (CAccountingEntry*)0)));
+        mapTxHeights.insert(make_pair(GetWalletTxHeight(*pwtx), pwtx));
     }
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+void CWallet::UnindexWalletTx(CWalletTx* pwtx)
+{
+    // cs_wallet must be held
+    pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(pwtx->nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
+        if ((*it).second.first == pwtx)
+        {
+            wtxOrdered.erase(it);
+            break;
+        }
+    EraseTxHeight(GetWalletTxHeight(*pwtx), pwtx);
+}
+
+void CWallet::EraseTxHeight(int nHeight, CWalletTx* pwtx)
+{
+    // cs_wallet must be held
+    pair<TxHeights::iterator, TxHeights::iterator> range = mapTxHeights.equal_range(nHeight);
+    for (TxHeights::iterator it = range.first; it != range.second; ++it)
+        if ((*it).second == pwtx)
+        {
+            mapTxHeights.erase(it);
+            break;
+        }
+}
 
-    return txOrdered;
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
+{
+    LOCK(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
 }
 
-void CWallet::WalletUpdateSpent(const CTransaction &tx)
+void CWallet::WalletUpdateSpent(const CTransaction &tx, CWalletDB *pwalletdb)
 {
     // Anytime a signature is successfully verified, it's proof the outpoint is spent.
     // Update the wallet spent flag if it doesn't know due to wallet.dat being
@@ -354,7 +531,8 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                 {
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
-                    wtx.WriteToDisk();
+                    UpdateSpendable(txin.prevout.hash, wtx);
+                    wtx.WriteToDisk(pwalletdb);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -366,12 +544,40 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        // what is ours may have changed too, so the spendable set is rebuilt
+        setSpendable.clear();
+        setSpendableByValue.clear();
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        {
             item.second.MarkDirty();
+            UpdateSpendable(item.first, item.second);
+        }
+    }
+}
+
+void CWallet::UpdateSpendable(const uint256& hash, const CWalletTx& wtx)
+{
+    // cs_wallet must be held
+    bool fSpendable = false;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        pair<int64, COutPoint> output(wtx.vout[i].nValue, COutPoint(hash, i));
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+        {
+            fSpendable = true;
+            setSpendableByValue.insert(output);
+        }
+        else
+            setSpendableByValue.erase(output);
     }
+    if (fSpendable)
+        setSpendable.insert(hash);
+    else
+        setSpendable.erase(hash);
+    fBalanceCached = false;
 }
 
-bool CWallet::AddToWallet(const CWalletTx& wtxIn)
+bool CWallet::AddToWallet(const CWalletTx& wtxIn, CWalletDB *pwalletdb)
 {
     uint256 hash = wtxIn.GetHash();
     {
@@ -384,7 +590,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         if (fInsertedNew)
         {
             wtx.nTimeReceived = GetAdjustedTime();
-            wtx.nOrderPos = IncOrderPosNext();
+            wtx.nOrderPos = IncOrderPosNext(pwalletdb);
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -396,9 +603,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64 latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        const TxItems & txOrdered = wtxOrdered;
+                        for (TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -434,6 +640,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         }
 
         bool fUpdated = false;
+        int nOldHeight = GetWalletTxHeight(wtx);
         if (!fInsertedNew)
         {
             // Merge
@@ -455,17 +662,46 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
+        UpdateSpendable(hash, wtx);
+
+        // A payment to a key still in the pool means a copy of this wallet, e.g. the one
+        // a backup was made from, gave it out. Not while writing through pwalletdb,
+        // whose transaction the pool's writes would bypass.
+        if (!pwalletdb)
+        {
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            {
+                CTxDestination dest;
+                if (!ExtractDestination(txout.scriptPubKey, dest))
+                    continue;
+                const CKeyID *keyID = boost::get<CKeyID>(&dest);
+                if (!keyID)
+                    continue;
+                map<CKeyID, int64>::const_iterator mi = mapKeyPoolIDs.find(*keyID);
+                if (mi != mapKeyPoolIDs.end() && setKeyPool.count(mi->second))
+                    MarkReserveKeysAsUsed(mi->second);
+            }
+        }
+
+        // keep the height index in step with the block the transaction is in
+        int nHeight = GetWalletTxHeight(wtx);
+        if (!fInsertedNew && nHeight != nOldHeight)
+            EraseTxHeight(nOldHeight, &wtx);
+        if (fInsertedNew || nHeight != nOldHeight)
+            mapTxHeights.insert(make_pair(nHeight, &wtx));
 
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
         // Write to disk
         if (fInsertedNew || fUpdated)
-            if (!wtx.WriteToDisk())
+            if (!wtx.WriteToDisk(pwalletdb))
                 return false;
 #ifndef QT_GUI
-        // If default receiving address gets used, replace it with a new one
-        if (vchDefaultKey.IsValid()) {
+        // If default receiving address gets used, replace it with a new one. Not while
+        // writing through pwalletdb, whose transaction that would bypass; the key is
+        // replaced when the transaction is next updated.
+        if (vchDefaultKey.IsValid() && !pwalletdb) {
             CScript scriptDefaultKey;
             scriptDefaultKey.SetDestination(vchDefaultKey.GetID());
             BOOST_FOREACH(const CTxOut& txout, wtx.vout)
@@ -483,7 +719,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         }
 #endif
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
-        WalletUpdateSpent(wtx);
+        WalletUpdateSpent(wtx, pwalletdb);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -530,8 +766,18 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            const CWalletTx& wtx = (*mi).second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                setSpendableByValue.erase(make_pair(wtx.vout[i].nValue, COutPoint(hash, i)));
+            setSpendable.erase(hash);
+            fBalanceCached = false;
+            UnindexWalletTx(&(*mi).second);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -709,8 +955,92 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, int64& nReceived,
     }
 }
 
+// Walking the length prefixes of serialized CMerkleTxs measures them without building any
+static void SkipBytes(const unsigned char*& p, const unsigned char* pend, uint64 nBytes)
+{
+    if ((uint64)(pend - p) < nBytes)
+        throw std::ios_base::failure("CWalletTxPrev::Unserialize() : end of data");
+    p += nBytes;
+}
+
+static uint64 SkipCompactSize(const unsigned char*& p, const unsigned char* pend)
+{
+    SkipBytes(p, pend, 1);
+    uint64 nSize = p[-1];
+    unsigned int nBytes = (nSize == 253 ? 2 : nSize == 254 ? 4 : nSize == 255 ? 8 : 0);
+    if (nBytes)
+    {
+        const unsigned char* pSize = p;
+        SkipBytes(p, pend, nBytes);
+        nSize = 0;
+        for (int i = nBytes - 1; i >= 0; i--)
+            nSize = (nSize << 8) | pSize[i];
+    }
+    if (nSize > (uint64)MAX_SIZE)
+        throw std::ios_base::failure("CWalletTxPrev::Unserialize() : size too large");
+    return nSize;
+}
+
+static void SkipMerkleTx(const unsigned char*& p, const unsigned char* pend)
+{
+    SkipBytes(p, pend, 4); // nVersion
+    for (uint64 n = SkipCompactSize(p, pend); n > 0; n--)
+    {
+        SkipBytes(p, pend, 36); // prevout
+        SkipBytes(p, pend, SkipCompactSize(p, pend)); // scriptSig
+        SkipBytes(p, pend, 4); // nSequence
+    }
+    for (uint64 n = SkipCompactSize(p, pend); n > 0; n--)
+    {
+        SkipBytes(p, pend, 8); // nValue
+        SkipBytes(p, pend, SkipCompactSize(p, pend)); // scriptPubKey
+    }
+    SkipBytes(p, pend, 4); // nLockTime
+    SkipBytes(p, pend, 32); // hashBlock
+    SkipBytes(p, pend, 32 * SkipCompactSize(p, pend)); // vMerkleBranch
+    SkipBytes(p, pend, 4); // nIndex
+}
+
+void CWalletTxPrev::Unserialize(CDataStream& s, int nType, int nVersion)
+{
+    vtx.clear();
+    vchData.clear();
+    if (s.empty())
+        throw std::ios_base::failure("CWalletTxPrev::Unserialize() : end of data");
+    const unsigned char* pbegin = (const unsigned char*)&s[0];
+    const unsigned char* pend = pbegin + s.size();
+    const unsigned char* p = pbegin;
+    for (uint64 n = SkipCompactSize(p, pend); n > 0; n--)
+        SkipMerkleTx(p, pend);
+    // an empty vector is not worth keeping serialized
+    if (p - pbegin > 1)
+    {
+        vchData.assign((const char*)pbegin, (const char*)p);
+        nDataType = nType;
+        nDataVersion = nVersion;
+    }
+    s.ignore(p - pbegin);
+}
+
+void CWalletTxPrev::Load() const
+{
+    if (vchData.empty())
+        return;
+    try {
+        CDataStream ss(vchData, nDataType, nDataVersion);
+        ss >> vtx;
+    }
+    catch (std::exception &e) {
+        // can't happen to data Unserialize measured, but don't leave half of it
+        printf("CWalletTxPrev::Load() : %s\n", e.what());
+        vtx.clear();
+    }
+    vchData.clear();
+}
+
 void CWalletTx::AddSupportingTransactions()
 {
+    std::vector<CMerkleTx>& vtxPrev = this->vtxPrev.Get();
     vtxPrev.clear();
 
     const int COPY_DEPTH = 3;
@@ -736,7 +1066,7 @@ void CWalletTx::AddSupportingTransactions()
                 if (mi != pwallet->mapWallet.end())
                 {
                     tx = (*mi).second;
-                    BOOST_FOREACH(const CMerkleTx& txWalletPrev, (*mi).second.vtxPrev)
+                    BOOST_FOREACH(const CMerkleTx& txWalletPrev, (*mi).second.vtxPrev.Get())
                         mapWalletPrev[txWalletPrev.GetHash()] = &txWalletPrev;
                 }
                 else if (mapWalletPrev.count(hash))
@@ -763,238 +1093,617 @@ void CWalletTx::AddSupportingTransactions()
     reverse(vtxPrev.begin(), vtxPrev.end());
 }
 
-bool CWalletTx::WriteToDisk()
+bool CWalletTx::WriteToDisk(CWalletDB *pwalletdb)
 {
+    if (pwalletdb)
+        return pwalletdb->WriteTx(GetHash(), *this);
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
-// Scan the block chain (starting in pindexStart) for transactions
-// from or to us. If fUpdate is true, found transactions that already
-// exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+// What a rescan looks for. This is a superset test, run on the scan threads without
+// any lock; AddToWalletIfInvolvingMe decides on the transactions it lets through.
+struct CWalletScanFilter
 {
-    int ret = 0;
+    std::set<uint160> setIDs;          // our key IDs and script IDs
+    std::set<COutPoint> setOutPoints;  // our outputs, to find transactions spending them
+    std::set<uint256> setTxHashes;     // wallet transactions to update
 
-    CBlockIndex* pindex = pindexStart;
+    bool IsRelevant(const CScript& scriptPubKey) const
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        if (setIDs.empty())
+            return false;
+        txnouttype whichType;
+        vector<vector<unsigned char> > vSolutions;
+        if (!Solver(scriptPubKey, whichType, vSolutions))
+            return false;
+        switch (whichType)
         {
-            CBlock block;
-            block.ReadFromDisk(pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
-            {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
-                    ret++;
-            }
-            pindex = pindex->pnext;
+        case TX_PUBKEY:
+            return setIDs.count(Hash160(vSolutions[0]));
+        case TX_PUBKEYHASH:
+        case TX_SCRIPTHASH:
+            return setIDs.count(uint160(vSolutions[0]));
+        case TX_MULTISIG:
+            // the keys sit between the two counts
+            for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                if (setIDs.count(Hash160(vSolutions[i])))
+                    return true;
+            return false;
+        default:
+            return false;
         }
     }
-    return ret;
-}
 
-void CWallet::ReacceptWalletTransactions()
-{
-    bool fRepeat = true;
-    while (fRepeat)
+    bool IsRelevant(const CTransaction& tx, const uint256& hash) const
     {
-        LOCK(cs_wallet);
-        fRepeat = false;
-        bool fMissing = false;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        if (setTxHashes.count(hash))
+            return true;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            if (IsRelevant(txout.scriptPubKey))
+                return true;
+        if (!setOutPoints.empty())
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                if (setOutPoints.count(txin.prevout))
+                    return true;
+        return false;
+    }
+};
+
+// Blocks a rescan thread claims at a time
+static const unsigned int WALLET_SCAN_BATCH = 16;
+
+// Work shared between the rescan threads
+struct CWalletScan
+{
+    boost::mutex mutex;
+    boost::condition_variable condDone;
+    const CWallet* pwallet;
+    const std::vector<CBlockIndex*>& vChain;
+    const CWalletScanFilter& filter;
+    unsigned int nNext;
+    unsigned int nDone;
+    int nRunning;
+    bool fFailed;  // a block could not be read
+    // chain position -> indexes of the matching transactions in that block
+    std::map<unsigned int, std::set<unsigned int> > mapMatches;
+    // outputs of the matches that may be ours, whose spends a second pass has to find
+    std::set<COutPoint> setNewOutPoints;
+
+    CWalletScan(const CWallet* pwalletIn, const std::vector<CBlockIndex*>& vChainIn, const CWalletScanFilter& filterIn, unsigned int nStart) :
+        pwallet(pwalletIn), vChain(vChainIn), filter(filterIn), nNext(nStart), nDone(nStart), nRunning(0), fFailed(false) {}
+};
+
+static void ThreadScanWalletBlocks(CWalletScan *pscan)
+{
+    RenameThread("bitcoin-rescan");
+    while (true) {
+        unsigned int nBegin, nEnd;
         {
-            CWalletTx& wtx = item.second;
-            if (wtx.IsCoinBase() && wtx.IsSpent(0))
-                continue;
+            boost::mutex::scoped_lock lock(pscan->mutex);
+            if (pscan->nNext >= pscan->vChain.size() || pscan->fFailed || ShutdownRequested() || pscan->pwallet->IsAbortingRescan()) {
+                pscan->nRunning--;
+                pscan->condDone.notify_all();
+                return;
+            }
+            nBegin = pscan->nNext;
+            nEnd = std::min(nBegin + WALLET_SCAN_BATCH, (unsigned int)pscan->vChain.size());
+            pscan->nNext = nEnd;
+        }
 
-            CCoins coins;
-            bool fUpdated = false;
-            bool fFound = pcoinsTip->GetCoins(wtx.GetHash(), coins);
-            if (fFound || wtx.GetDepthInMainChain() > 0)
-            {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                for (unsigned int i = 0; i < wtx.vout.size(); i++)
-                {
-                    if (wtx.IsSpent(i))
-                        continue;
-                    if ((i >= coins.vout.size() || coins.vout[i].IsNull()) && IsMine(wtx.vout[i]))
-                    {
-                        wtx.MarkSpent(i);
-                        fUpdated = true;
-                        fMissing = true;
-                    }
-                }
-                if (fUpdated)
-                {
-                    printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
-                    wtx.MarkDirty();
-                    wtx.WriteToDisk();
-                }
+        std::map<unsigned int, std::set<unsigned int> > mapMatches;
+        std::set<COutPoint> setNewOutPoints;
+        bool fFailed = false;
+        for (unsigned int nPos = nBegin; nPos < nEnd && !fFailed; nPos++) {
+            CBlock block;
+            // the block index already vouches for the blocks of the main chain
+            if (!block.ReadFromDisk(pscan->vChain[nPos], false)) {
+                printf("ScanForWalletTransactions() : could not read block at height %d\n", pscan->vChain[nPos]->nHeight);
+                fFailed = true;
+                break;
             }
-            else
-            {
-                // Re-accept any txes of ours that aren't already in a block
-                if (!wtx.IsCoinBase())
-                    wtx.AcceptWalletTransaction(false);
+            for (unsigned int i = 0; i < block.vtx.size(); i++) {
+                const CTransaction& tx = block.vtx[i];
+                uint256 hash = tx.GetHash();
+                if (!pscan->filter.IsRelevant(tx, hash))
+                    continue;
+                mapMatches[nPos].insert(i);
+                for (unsigned int n = 0; n < tx.vout.size(); n++)
+                    if (pscan->filter.IsRelevant(tx.vout[n].scriptPubKey))
+                        setNewOutPoints.insert(COutPoint(hash, n));
             }
         }
-        if (fMissing)
+
+        boost::mutex::scoped_lock lock(pscan->mutex);
+        if (fFailed)
         {
-            // TODO: optimize this to scan just part of the block chain?
-            if (ScanForWalletTransactions(pindexGenesisBlock))
-                fRepeat = true;  // Found missing transactions: re-do re-accept.
+            pscan->fFailed = true;
+            continue;
         }
+        pscan->mapMatches.insert(mapMatches.begin(), mapMatches.end());
+        pscan->setNewOutPoints.insert(setNewOutPoints.begin(), setNewOutPoints.end());
+        pscan->nDone += nEnd - nBegin;
+        pscan->condDone.notify_all();
     }
 }
 
-void CWalletTx::RelayWalletTransaction()
+// Run the scan threads over the chain from scan.nNext on. Returns false if aborted or
+// a block could not be read.
+static bool RunWalletScan(CWallet* pwallet, CWalletScan& scan, bool fReportProgress)
 {
-    BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
-    {
-        // Important: versions of bitcoin before 0.8.6 had a bug that inserted
-        // empty transactions into the vtxPrev, which will cause the node to be
-        // banned when retransmitted, hence the check for !tx.vin.empty()
-        if (!tx.IsCoinBase() && !tx.vin.empty())
-            if (tx.GetDepthInMainChain() == 0)
-                RelayTransaction((CTransaction)tx, tx.GetHash());
-    }
-    if (!IsCoinBase())
+    unsigned int nStart = scan.nNext;
+    unsigned int nTotal = scan.vChain.size() - nStart;
+    int nThreads = std::max(1, std::min(nScriptCheckThreads, (int)(nTotal / WALLET_SCAN_BATCH) + 1));
+
+    boost::thread_group threadGroupScan;
     {
-        if (GetDepthInMainChain() == 0) {
-            uint256 hash = GetHash();
-            printf("Relaying wtx %s\n", hash.ToString().c_str());
-            RelayTransaction((CTransaction)*this, hash);
+        boost::mutex::scoped_lock lock(scan.mutex);
+        for (int i = 0; i < nThreads; i++) {
+            threadGroupScan.create_thread(boost::bind(&ThreadScanWalletBlocks, &scan));
+            scan.nRunning++;
+        }
+
+        int64 nLastReport = GetTime();
+        while (scan.nRunning > 0) {
+            scan.condDone.timed_wait(lock, boost::posix_time::seconds(1));
+            if (fReportProgress && nTotal > 0) {
+                int nProgress = (int)((uint64)(scan.nDone - nStart) * 100 / nTotal);
+                pwallet->SetRescanProgress(nProgress);
+                if (GetTime() - nLastReport >= 10) {
+                    printf("Rescan: %u of %u blocks (%d%%)\n", scan.nDone - nStart, nTotal, nProgress);
+                    nLastReport = GetTime();
+                }
+            }
         }
     }
+    threadGroupScan.join_all();
+
+    return !scan.fFailed && scan.nDone >= scan.vChain.size();
 }
 
-void CWallet::ResendWalletTransactions()
+// Scan the block chain (starting in pindexStart) for transactions
+// from or to us. If fUpdate is true, found transactions that already
+// exist in the wallet will be updated.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
-    // Do this infrequently and randomly to avoid giving away
-    // that these are our transactions.
-    static int64 nNextTime;
-    if (GetTime() < nNextTime)
-        return;
-    bool fFirst = (nNextTime == 0);
-    nNextTime = GetTime() + GetRand(30 * 60);
-    if (fFirst)
-        return;
+    {
+        LOCK(cs_rescan);
+        if (fScanningWallet)
+        {
+            printf("ScanForWalletTransactions() : a rescan is already running\n");
+            return -1;
+        }
+        fScanningWallet = true;
+        fAbortRescan = false;
+        nRescanProgress = 0;
+    }
 
-    // Only do it if there's been a new block since last time
-    static int64 nLastTime;
-    if (nTimeBestReceived < nLastTime)
-        return;
-    nLastTime = GetTime();
+    int64 nStart = GetTimeMillis();
+    // Only reading the blocks goes without locks; the chain is taken as it is now, and a
+    // block a reorganization takes out of it meanwhile is passed over when applying
+    std::vector<CBlockIndex*> vChain;
+    {
+        LOCK(cs_main);
+        for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+            vChain.push_back(pindex);
+    }
 
-    // Rebroadcast any of our txes that aren't in a block yet
-    printf("ResendWalletTransactions()\n");
+    // Keys found used may make the key pool move on to keys not looked for yet, so there
+    // is another round over the chain for those until no more turn up
+    std::set<uint160> setScanned;
+    int ret = 0;
+    bool fComplete = true;
+    for (int nRound = 0; fComplete; nRound++)
     {
-        LOCK(cs_wallet);
-        // Sort them in chronological order
-        multimap<unsigned int, CWalletTx*> mapSorted;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        CWalletScanFilter filter;
+        unsigned int nMarkedUsed;
         {
-            CWalletTx& wtx = item.second;
-            // Don't rebroadcast until it's had plenty of time that
-            // it should have gotten in already by now.
-            if (nTimeBestReceived - (int64)wtx.nTimeReceived > 5 * 60)
-                mapSorted.insert(make_pair(wtx.nTimeReceived, &wtx));
+            LOCK(cs_wallet);
+            std::set<CKeyID> setKeys;
+            GetKeys(setKeys);
+            std::set<CScriptID> setScriptIDs;
+            GetCScriptIDs(setScriptIDs);
+            BOOST_FOREACH(const CKeyID& keyID, setKeys)
+                if (!setScanned.count(keyID))
+                    filter.setIDs.insert(keyID);
+            BOOST_FOREACH(const CScriptID& scriptID, setScriptIDs)
+                if (!setScanned.count(scriptID))
+                    filter.setIDs.insert(scriptID);
+            if (nRound == 0)
+            {
+                BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+                {
+                    if (fUpdate)
+                        filter.setTxHashes.insert(item.first);
+                    for (unsigned int i = 0; i < item.second.vout.size(); i++)
+                        if (IsMine(item.second.vout[i]))
+                            filter.setOutPoints.insert(COutPoint(item.first, i));
+                }
+            }
+            nMarkedUsed = nKeyPoolMarkedUsed;
         }
-        BOOST_FOREACH(PAIRTYPE(const unsigned int, CWalletTx*)& item, mapSorted)
+        if (nRound > 0 && filter.setIDs.empty())
+            break;
+
+        // First pass: transactions paying us, spending what we had, or already known. The
+        // second pass only looks for spends of the outputs the first one turned up.
+        CWalletScan scan(this, vChain, filter, 0);
+        fComplete = RunWalletScan(this, scan, true);
+        std::map<unsigned int, std::set<unsigned int> > mapMatches;
+        mapMatches.swap(scan.mapMatches);
+
+        CWalletScanFilter filterSpends;
+        BOOST_FOREACH(const COutPoint& outpoint, scan.setNewOutPoints)
+            if (!filter.setOutPoints.count(outpoint))
+                filterSpends.setOutPoints.insert(outpoint);
+        if (fComplete && !filterSpends.setOutPoints.empty()) {
+            CWalletScan scanSpends(this, vChain, filterSpends, mapMatches.begin()->first);
+            fComplete = RunWalletScan(this, scanSpends, false);
+            for (std::map<unsigned int, std::set<unsigned int> >::iterator it = scanSpends.mapMatches.begin(); it != scanSpends.mapMatches.end(); ++it)
+                mapMatches[it->first].insert(it->second.begin(), it->second.end());
+        }
+        if (!fComplete)
+            break;
+
+        // Apply the matches in chain order
+        bool fMoreKeys;
         {
-            CWalletTx& wtx = *item.second;
-            wtx.RelayWalletTransaction();
+            LOCK2(cs_main, cs_wallet);
+            for (std::map<unsigned int, std::set<unsigned int> >::iterator it = mapMatches.begin(); it != mapMatches.end(); ++it)
+            {
+                if (!vChain[it->first]->IsInMainChain())
+                    continue;
+                CBlock block;
+                if (!block.ReadFromDisk(vChain[it->first], false))
+                {
+                    printf("ScanForWalletTransactions() : could not read block at height %d\n", vChain[it->first]->nHeight);
+                    fComplete = false;
+                    break;
+                }
+                BOOST_FOREACH(unsigned int i, it->second)
+                {
+                    const CTransaction& tx = block.vtx[i];
+                    if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
+                        ret++;
+                }
+            }
+            fMoreKeys = nKeyPoolMarkedUsed != nMarkedUsed;
         }
+        if (!fComplete)
+            break;
+        printf("Rescan: %u blocks, %u with matches, %d transactions added or updated in %"PRI64d"ms\n",
+               (unsigned int)vChain.size(), (unsigned int)mapMatches.size(), ret, GetTimeMillis() - nStart);
+
+        if (!fMoreKeys)
+            break;
+        setScanned.insert(filter.setIDs.begin(), filter.setIDs.end());
+        TopUpKeyPool();
+    }
+    if (!fComplete)
+    {
+        printf("Rescan aborted or incomplete\n");
+        ret = -1;
     }
-}
 
+    {
+        LOCK(cs_rescan);
+        fScanningWallet = false;
+    }
+    return ret;
+}
 
+bool CWallet::IsAbortingRescan() const
+{
+    LOCK(cs_rescan);
+    return fAbortRescan;
+}
 
+void CWallet::SetRescanProgress(int nProgress)
+{
+    LOCK(cs_rescan);
+    nRescanProgress = nProgress;
+}
 
+void CWallet::AbortRescan()
+{
+    LOCK(cs_rescan);
+    if (fScanningWallet)
+        fAbortRescan = true;
+}
 
+int CWallet::GetRescanProgress() const
+{
+    LOCK(cs_rescan);
+    return fScanningWallet ? nRescanProgress : -1;
+}
 
-//////////////////////////////////////////////////////////////////////////////
-//
-// Actions
-//
+bool CWallet::ReacceptWalletTransaction(CWalletTx& wtx)
+{
+    if (wtx.IsCoinBase() && wtx.IsSpent(0))
+        return false;
 
+    CCoins coins;
+    bool fMissing = false;
+    bool fFound = pcoinsTip->GetCoins(wtx.GetHash(), coins);
+    if (fFound || wtx.GetDepthInMainChain() > 0)
+    {
+        // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        {
+            if (wtx.IsSpent(i))
+                continue;
+            if ((i >= coins.vout.size() || coins.vout[i].IsNull()) && IsMine(wtx.vout[i]))
+            {
+                wtx.MarkSpent(i);
+                fMissing = true;
+            }
+        }
+        if (fMissing)
+        {
+            printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
+            wtx.MarkDirty();
+            UpdateSpendable(wtx.GetHash(), wtx);
+            wtx.WriteToDisk();
+        }
+    }
+    else
+    {
+        // Re-accept any txes of ours that aren't already in a block
+        if (!wtx.IsCoinBase())
+            wtx.AcceptWalletTransaction(false);
+    }
+    return fMissing;
+}
 
-int64 CWallet::GetBalance() const
+void CWallet::ReacceptWalletTransactions()
 {
-    int64 nTotal = 0;
+    bool fRepeat = true;
+    while (fRepeat)
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        fRepeat = false;
+        bool fMissing = false;
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            if (ReacceptWalletTransaction(item.second))
+                fMissing = true;
+        if (fMissing)
+        {
+            // TODO: optimize this to scan just part of the block chain?
+            if (ScanForWalletTransactions(pindexGenesisBlock) > 0)
+                fRepeat = true;  // Found missing transactions: re-do re-accept.
+        }
+    }
+}
+
+// Does what ReacceptWalletTransactions does a batch at a time, so that the wallet stays
+// usable while a large one is gone through after startup
+void ThreadReacceptWalletTransactions(CWallet* pwallet)
+{
+    RenameThread("bitcoin-wallet-accept");
+
+    static const unsigned int WALLET_REACCEPT_BATCH = 100;
+    int64 nStart = GetTimeMillis();
+    bool fRepeat = true;
+    while (fRepeat)
+    {
+        fRepeat = false;
+        bool fMissing = false;
+        bool fStarted = false;
+        uint256 hashLast;
+        bool fDone = false;
+        while (!fDone)
+        {
+            boost::this_thread::interruption_point();
+            LOCK2(cs_main, pwallet->cs_wallet);
+            // continue after the last one done, wherever that is now
+            map<uint256, CWalletTx>::iterator mi = fStarted ? pwallet->mapWallet.upper_bound(hashLast) : pwallet->mapWallet.begin();
+            for (unsigned int n = 0; mi != pwallet->mapWallet.end() && n < WALLET_REACCEPT_BATCH; ++mi, n++)
+            {
+                if (pwallet->ReacceptWalletTransaction((*mi).second))
+                    fMissing = true;
+                hashLast = (*mi).first;
+                fStarted = true;
+            }
+            fDone = (mi == pwallet->mapWallet.end());
+        }
+        if (fMissing)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
+            if (pwallet->ScanForWalletTransactions(pindexGenesisBlock) > 0)
+                fRepeat = true;  // Found missing transactions: re-do re-accept.
         }
     }
+    printf("Reaccepted wallet transactions in %"PRI64d"ms\n", GetTimeMillis() - nStart);
+}
 
-    return nTotal;
+void CWalletTx::RelayWalletTransaction()
+{
+    BOOST_FOREACH(const CMerkleTx& tx, vtxPrev.Get())
+    {
+        // Important: versions of bitcoin before 0.8.6 had a bug that inserted
+        // empty transactions into the vtxPrev, which will cause the node to be
+        // banned when retransmitted, hence the check for !tx.vin.empty()
+        if (!tx.IsCoinBase() && !tx.vin.empty())
+            if (tx.GetDepthInMainChain() == 0)
+                RelayTransaction((CTransaction)tx, tx.GetHash());
+    }
+    if (!IsCoinBase())
+    {
+        if (GetDepthInMainChain() == 0) {
+            uint256 hash = GetHash();
+            printf("Relaying wtx %s\n", hash.ToString().c_str());
+            RelayTransaction((CTransaction)*this, hash);
+        }
+    }
 }
 
-int64 CWallet::GetUnconfirmedBalance() const
+void CWallet::ResendWalletTransactions()
 {
-    int64 nTotal = 0;
+    // Do this infrequently and randomly to avoid giving away
+    // that these are our transactions.
+    static int64 nNextTime;
+    if (GetTime() < nNextTime)
+        return;
+    bool fFirst = (nNextTime == 0);
+    nNextTime = GetTime() + GetRand(30 * 60);
+    if (fFirst)
+        return;
+
+    // Only do it if there's been a new block since last time
+    static int64 nLastTime;
+    if (nTimeBestReceived < nLastTime)
+        return;
+    nLastTime = GetTime();
+
+    // Rebroadcast any of our txes that aren't in a block yet
+    printf("ResendWalletTransactions()\n");
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // Sort them in chronological order
+        multimap<unsigned int, CWalletTx*> mapSorted;
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
+            CWalletTx& wtx = item.second;
+            // Don't rebroadcast until it's had plenty of time that
+            // it should have gotten in already by now.
+            if (nTimeBestReceived - (int64)wtx.nTimeReceived > 5 * 60)
+                mapSorted.insert(make_pair(wtx.nTimeReceived, &wtx));
+        }
+        BOOST_FOREACH(PAIRTYPE(const unsigned int, CWalletTx*)& item, mapSorted)
+        {
+            CWalletTx& wtx = *item.second;
+            wtx.RelayWalletTransaction();
         }
     }
-    return nTotal;
 }
 
-int64 CWallet::GetImmatureBalance() const
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Actions
+//
+
+
+void CWallet::CacheBalances() const
+{
+    // cs_wallet must be held. Depths, and so confirmation and maturity, only change with
+    // the best block; everything else that matters goes through UpdateSpendable.
+    uint256 hashTip = GetChainTip()->hashBlock;
+    if (fBalanceCached && hashTip == hashBalanceTip)
+        return;
+
+    nBalanceCached = 0;
+    nUnconfirmedBalanceCached = 0;
+    nImmatureBalanceCached = 0;
+    bool fAllFinal = true;
+    BOOST_FOREACH(const uint256& hash, setSpendable)
+    {
+        const CWalletTx* pcoin = &mapWallet.find(hash)->second;
+        bool fFinal = pcoin->IsFinal();
+        bool fConfirmed = pcoin->IsConfirmed();
+        if (fConfirmed)
+            nBalanceCached += pcoin->GetAvailableCredit();
+        if (!fFinal || !fConfirmed)
+            nUnconfirmedBalanceCached += pcoin->GetAvailableCredit();
+        nImmatureBalanceCached += pcoin->GetImmatureCredit();
+        fAllFinal &= fFinal;
+    }
+    // a time-locked transaction can become final without a new block
+    fBalanceCached = fAllFinal;
+    hashBalanceTip = hashTip;
+}
+
+int64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nBalanceCached;
+}
+
+int64 CWallet::GetBalanceNoWait() const
 {
-    int64 nTotal = 0;
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        TRY_LOCK(cs_main, lockMain);
+        if (!lockMain)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
+            LOCK(cs_wallet);
+            if (hashBalanceTip != 0)
+                return nBalanceCached;
         }
     }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalance();
+}
+
+int64 CWallet::GetUnconfirmedBalance() const
+{
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nUnconfirmedBalanceCached;
+}
+
+int64 CWallet::GetImmatureBalance() const
+{
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nImmatureBalanceCached;
 }
 
 // populate vCoins with vector of spendable COutputs
-void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl) const
+void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fSortByValue) const
 {
     vCoins.clear();
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (fSortByValue)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsConfirmed())
-                continue;
+            for (set<pair<int64, COutPoint> >::const_reverse_iterator it = setSpendableByValue.rbegin(); it != setSpendableByValue.rend(); ++it)
+            {
+                const COutPoint& outpoint = (*it).second;
+                const CWalletTx* pcoin = &mapWallet.find(outpoint.hash)->second;
+                if (IsAvailableTx(pcoin, fOnlyConfirmed) && IsAvailableOutput(pcoin, outpoint.hash, outpoint.n, coinControl))
+                    vCoins.push_back(COutput(pcoin, outpoint.n, pcoin->GetDepthInMainChain()));
+            }
+            return;
+        }
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+        BOOST_FOREACH(const uint256& hash, setSpendable)
+        {
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
+            if (!IsAvailableTx(pcoin, fOnlyConfirmed))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i))) 
-                        vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
-            }
+            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+                if (!pcoin->IsSpent(i) && IsMine(pcoin->vout[i]) && IsAvailableOutput(pcoin, hash, i, coinControl))
+                    vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
+bool CWallet::IsAvailableTx(const CWalletTx* pcoin, bool fOnlyConfirmed) const
+{
+    if (!pcoin->IsFinal())
+        return false;
+
+    if (fOnlyConfirmed && !pcoin->IsConfirmed())
+        return false;
+
+    if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+        return false;
+
+    return true;
+}
+
+bool CWallet::IsAvailableOutput(const CWalletTx* pcoin, const uint256& hash, unsigned int n, const CCoinControl *coinControl) const
+{
+    return !IsLockedCoin(hash, n) && pcoin->vout[n].nValue >= nMinimumInputValue &&
+           (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(hash, n));
+}
+
+static void ApproximateBestSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTotalLower, int64 nTargetValue,
                                   vector<char>& vfBest, int64& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1040,7 +1749,7 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
     }
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
@@ -1052,10 +1761,12 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     coinLowestLarger.second.first = NULL;
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
+    // Rather than shuffling a copy of vCoins, ties for an exact match or for the lowest
+    // larger coin are broken at random, and so is the order of the smaller coins
+    int nExactMatches = 0, nLowestLargerTies = 0;
+    pair<const CWalletTx*,unsigned int> coinExact;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1069,9 +1780,8 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
 
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            if (GetRandInt(++nExactMatches) == 0)
+                coinExact = coin.second;
         }
         else if (n < nTargetValue + CENT)
         {
@@ -1079,11 +1789,23 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
             nTotalLower += n;
         }
         else if (n < coinLowestLarger.first)
+        {
+            coinLowestLarger = coin;
+            nLowestLargerTies = 1;
+        }
+        else if (n == coinLowestLarger.first && GetRandInt(++nLowestLargerTies) == 0)
         {
             coinLowestLarger = coin;
         }
     }
 
+    if (nExactMatches > 0)
+    {
+        setCoinsRet.insert(coinExact);
+        nValueRet += nTargetValue;
+        return true;
+    }
+
     if (nTotalLower == nTargetValue)
     {
         for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -1104,6 +1826,7 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     }
 
     // Solve subset sum by stochastic approximation
+    random_shuffle(vValue.begin(), vValue.end(), GetRandInt);
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     int64 nBest;
@@ -1139,10 +1862,103 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     return true;
 }
 
-bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
+// How many steps the branch and bound search may take before giving up
+static const int BNB_MAX_TRIES = 100000;
+
+bool CWallet::SelectCoinsBnB(int64 nTargetValue, int64 nCostOfChange, int64 nInputFee, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
+                             set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    // Values, largest first; outputs worth no more than it costs to spend them are left out
+    vector<pair<int64, const COutput*> > vPool;
+    int64 nAvailable = 0;
+    BOOST_FOREACH(const COutput& output, vCoins)
+    {
+        if (output.nDepth < (output.tx->IsFromMe() ? nConfMine : nConfTheirs))
+            continue;
+        int64 n = output.tx->vout[output.i].nValue;
+        if (n <= nInputFee)
+            continue;
+        vPool.push_back(make_pair(n, &output));
+        nAvailable += n;
+    }
+    if (nAvailable < nTargetValue)
+        return false;
+    for (unsigned int i = 1; i < vPool.size(); i++)
+        if (vPool[i].first > vPool[i - 1].first)
+        {
+            stable_sort(vPool.begin(), vPool.end(), CompareValueDescending());
+            break;
+        }
+
+    // Depth first search over include/exclude decisions, largest coins first. A branch is
+    // cut once it overshoots the window or can no longer reach the target; among the
+    // selections that land in the window, the one with the least excess wins.
+    vector<bool> vfSelected, vfBest;
+    int64 nValue = 0, nBestExcess = std::numeric_limits<int64>::max();
+    for (int nTries = 0; nTries < BNB_MAX_TRIES; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nValue + nAvailable < nTargetValue || nValue > nTargetValue + nCostOfChange)
+            fBacktrack = true;
+        else if (nValue >= nTargetValue)
+        {
+            if (nValue - nTargetValue <= nBestExcess)
+            {
+                vfBest = vfSelected;
+                nBestExcess = nValue - nTargetValue;
+                if (nBestExcess == 0)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Undo trailing exclusions, then exclude the last coin still included
+            while (!vfSelected.empty() && !vfSelected.back())
+            {
+                vfSelected.pop_back();
+                nAvailable += vPool[vfSelected.size()].first;
+            }
+            if (vfSelected.empty())
+                break;
+            vfSelected.back() = false;
+            nValue -= vPool[vfSelected.size() - 1].first;
+        }
+        else
+        {
+            unsigned int n = vfSelected.size();
+            nAvailable -= vPool[n].first;
+            // Including a coin of the same value as one just excluded leads to selections
+            // already tried
+            if (n > 0 && !vfSelected.back() && vPool[n].first == vPool[n - 1].first)
+                vfSelected.push_back(false);
+            else
+            {
+                vfSelected.push_back(true);
+                nValue += vPool[n].first;
+            }
+        }
+    }
+
+    if (vfBest.empty())
+        return false;
+    for (unsigned int i = 0; i < vfBest.size(); i++)
+        if (vfBest[i])
+        {
+            setCoinsRet.insert(make_pair(vPool[i].second->tx, vPool[i].second->i));
+            nValueRet += vPool[i].first;
+        }
+    return true;
+}
+
+bool CWallet::SelectCoins(int64 nTargetValue, int64 nCostOfChange, int64 nInputFee, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
 {
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
+    AvailableCoins(vCoins, true, coinControl, true);
     
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
@@ -1155,17 +1971,145 @@ bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
+    // At each confirmation level, first look for inputs that need no change, then let the
+    // knapsack solver pick some that do
+    return (SelectCoinsBnB(nTargetValue, nCostOfChange, nInputFee, 1, 6, vCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsBnB(nTargetValue, nCostOfChange, nInputFee, 1, 1, vCoins, setCoinsRet, nValueRet) ||
             SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsBnB(nTargetValue, nCostOfChange, nInputFee, 0, 1, vCoins, setCoinsRet, nValueRet) ||
             SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet));
 }
 
+unsigned int MaxScriptSigSize(const CKeyStore& keystore, const CScript& scriptPubKey)
+{
+    // a DER signature takes at most 72 bytes, plus its hash type byte and push opcode
+    static const unsigned int nSigPushSize = 74;
+
+    txnouttype whichType;
+    std::vector<std::vector<unsigned char> > vSolutions;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return 0;
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+        return nSigPushSize;
+    case TX_PUBKEYHASH:
+    {
+        CPubKey vchPubKey;
+        if (!keystore.GetPubKey(CKeyID(uint160(vSolutions[0])), vchPubKey))
+            return 0;
+        return nSigPushSize + 1 + vchPubKey.size();
+    }
+    case TX_MULTISIG:
+        return 1 + nSigPushSize * vSolutions.front()[0];
+    case TX_SCRIPTHASH:
+    {
+        CScript subscript;
+        if (!keystore.GetCScript(CScriptID(uint160(vSolutions[0])), subscript))
+            return 0;
+        unsigned int nSize = MaxScriptSigSize(keystore, subscript);
+        if (nSize == 0)
+            return 0;
+        // the serialized subscript follows, pushed with at most a 3 byte opcode
+        return nSize + 3 + subscript.size();
+    }
+    default:
+        return 0;
+    }
+}
+
+// Inputs each signing thread is expected to take at least
+static const unsigned int WALLET_SIGN_BATCH = 8;
+
+struct CWalletSign
+{
+    boost::mutex mutex;
+    const CKeyStore& keystore;
+    const CTransaction& txTo;
+    const std::vector<const CWalletTx*>& vFrom;
+    std::vector<CScript> vScriptSig;
+    unsigned int nNext;
+    bool fFailed;
+
+    CWalletSign(const CKeyStore& keystoreIn, const CTransaction& txToIn, const std::vector<const CWalletTx*>& vFromIn) :
+        keystore(keystoreIn), txTo(txToIn), vFrom(vFromIn), vScriptSig(txToIn.vin.size()), nNext(0), fFailed(false) {}
+};
+
+static void ThreadSignWalletInputs(CWalletSign *psign)
+{
+    RenameThread("bitcoin-sign");
+    // the transaction the others are signing can't be read meanwhile, so sign a copy
+    CTransaction txTmp(psign->txTo);
+    while (true) {
+        unsigned int nIn;
+        {
+            boost::mutex::scoped_lock lock(psign->mutex);
+            if (psign->fFailed || psign->nNext >= txTmp.vin.size())
+                return;
+            nIn = psign->nNext++;
+        }
+
+        bool fSigned = SignSignature(psign->keystore, *psign->vFrom[nIn], txTmp, nIn);
+
+        boost::mutex::scoped_lock lock(psign->mutex);
+        if (fSigned)
+            psign->vScriptSig[nIn] = txTmp.vin[nIn].scriptSig;
+        else
+            psign->fFailed = true;
+    }
+}
+
+// Sign every input of txNew, input n spending an output of vFrom[n]. Large transactions
+// are signed on up to -par threads.
+static bool SignWalletInputs(const CCryptoKeyStore& keystore, CTransaction& txNew, const std::vector<const CWalletTx*>& vFrom)
+{
+    // decrypt the keys of all inputs up front, under one cipher context
+    std::set<CKeyID> setKeyID;
+    for (unsigned int nIn = 0; nIn < txNew.vin.size(); nIn++)
+    {
+        txnouttype type;
+        std::vector<CTxDestination> vDest;
+        int nRequired;
+        if (!ExtractDestinations(vFrom[nIn]->vout[txNew.vin[nIn].prevout.n].scriptPubKey, type, vDest, nRequired))
+            continue;
+        BOOST_FOREACH(const CTxDestination& dest, vDest)
+            if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest))
+                setKeyID.insert(*pkeyID);
+    }
+    keystore.CacheKeys(setKeyID);
+
+    int nThreads = std::min(nScriptCheckThreads, (int)(txNew.vin.size() / WALLET_SIGN_BATCH));
+    if (nThreads <= 1)
+    {
+        for (unsigned int nIn = 0; nIn < txNew.vin.size(); nIn++)
+            if (!SignSignature(keystore, *vFrom[nIn], txNew, nIn))
+                return false;
+        return true;
+    }
+
+    CWalletSign sign(keystore, txNew, vFrom);
+    boost::thread_group threadGroupSign;
+    for (int i = 0; i < nThreads; i++)
+        threadGroupSign.create_thread(boost::bind(&ThreadSignWalletInputs, &sign));
+    threadGroupSign.join_all();
+    if (sign.fFailed)
+        return false;
+
+    for (unsigned int nIn = 0; nIn < txNew.vin.size(); nIn++)
+        txNew.vin[nIn].scriptSig = sign.vScriptSig[nIn];
+    return true;
+}
+
 
 
 
 bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
-                                CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl)
+                                CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl,
+                                bool* pfTooLarge)
 {
+    if (pfTooLarge)
+        *pfTooLarge = false;
     int64 nValue = 0;
     BOOST_FOREACH (const PAIRTYPE(CScript, int64)& s, vecSend)
     {
@@ -1187,6 +2131,17 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
     {
         LOCK2(cs_main, cs_wallet);
         {
+            // Price of spending an input and of a change output, at the rate this transaction
+            // is expected to pay
+            int64 nFeeRate = nTransactionFee;
+            if (nFeeRate == 0)
+            {
+                double dFeeRate = mempool.estimateFee(nTxConfirmTarget);
+                nFeeRate = dFeeRate > 0 ? (int64)dFeeRate : CTransaction::nMinTxFee;
+            }
+            int64 nInputFee = nFeeRate * WALLET_INPUT_SIZE / 1000;
+            int64 nCostOfChange = nFeeRate * (WALLET_CHANGE_OUTPUT_SIZE + WALLET_INPUT_SIZE) / 1000;
+
             nFeeRet = nTransactionFee;
             loop
             {
@@ -1211,7 +2166,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 int64 nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
+                if (!SelectCoins(nTotalValue, nCostOfChange, nInputFee, setCoins, nValueIn, coinControl))
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -1236,6 +2191,13 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                     nFeeRet += nMoveToFee;
                 }
 
+                // Change worth less than adding it and later spending it would cost goes to the fee
+                if (nChange > 0 && nChange < nCostOfChange)
+                {
+                    nFeeRet += nChange;
+                    nChange = 0;
+                }
+
                 if (nChange > 0)
                 {
                     // Fill a vout to ourself
@@ -1284,37 +2246,68 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                     reservekey.ReturnKey();
 
                 // Fill vin
+                vector<const CWalletTx*> vFrom;
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
+                {
                     wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
+                    vFrom.push_back(coin.first);
+                }
 
-                // Sign
-                int nIn = 0;
-                BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                // Signing waits until the fee is settled; until then the size counts the
+                // largest scriptSig each input can get, unless one can't be sized unsigned
+                unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+                bool fSigned = false;
+                for (unsigned int nIn = 0; nIn < wtxNew.vin.size(); nIn++)
+                {
+                    unsigned int nSigSize = MaxScriptSigSize(*this, vFrom[nIn]->vout[wtxNew.vin[nIn].prevout.n].scriptPubKey);
+                    if (nSigSize == 0)
                     {
-                        strFailReason = _("Signing transaction failed");
-                        return false;
+                        if (!SignWalletInputs(*this, wtxNew, vFrom))
+                        {
+                            strFailReason = _("Signing transaction failed");
+                            return false;
+                        }
+                        nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+                        fSigned = true;
+                        break;
                     }
+                    nBytes += GetSizeOfCompactSize(nSigSize) - 1 + nSigSize;
+                }
 
                 // Limit size
-                unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
                 if (nBytes >= MAX_STANDARD_TX_SIZE)
                 {
                     strFailReason = _("Transaction too large");
+                    if (pfTooLarge)
+                        *pfTooLarge = true;
                     return false;
                 }
                 dPriority /= nBytes;
 
                 // Check that enough fee is included
                 int64 nPayFee = nTransactionFee * (1 + (int64)nBytes / 1000);
+                if (nTransactionFee == 0)
+                {
+                    // Without -paytxfee, pay what recent transactions needed to confirm in time
+                    double dFeeRate = mempool.estimateFee(nTxConfirmTarget);
+                    if (dFeeRate > 0)
+                        nPayFee = (int64)(dFeeRate * nBytes / 1000);
+                }
                 bool fAllowFree = CTransaction::AllowFree(dPriority);
-                int64 nMinFee = wtxNew.GetMinFee(1, fAllowFree, GMF_SEND);
+                int64 nMinFee = wtxNew.GetMinFee(1, fAllowFree, GMF_SEND, nBytes);
                 if (nFeeRet < max(nPayFee, nMinFee))
                 {
                     nFeeRet = max(nPayFee, nMinFee);
                     continue;
                 }
 
+                // Sign
+                if (!fSigned && !SignWalletInputs(*this, wtxNew, vFrom))
+                {
+                    strFailReason = _("Signing transaction failed");
+                    return false;
+                }
+
                 // Fill vtxPrev by copying from previous transactions vtxPrev
                 wtxNew.AddSupportingTransactions();
                 wtxNew.fTimeReceivedIsTxTime = true;
@@ -1360,6 +2353,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 CWalletTx &coin = mapWallet[txin.prevout.hash];
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
+                UpdateSpendable(txin.prevout.hash, coin);
                 coin.WriteToDisk();
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
@@ -1383,6 +2377,222 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
     return true;
 }
 
+// Bytes of outputs a transaction of a batch gets at most; the rest of a standard
+// transaction is left for its inputs
+static const unsigned int WALLET_BATCH_OUTPUTS_SIZE = MAX_STANDARD_TX_SIZE / 2;
+
+// Pay vecSend in as many transactions as it takes to keep each of them standard.
+// Their change all goes to the key of reservekey. Hold cs_wallet until they are
+// committed, as the coins they spend aren't marked before.
+bool CWallet::CreateTransactions(const vector<pair<CScript, int64> >& vecSend,
+                                 vector<CWalletTx>& vwtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason)
+{
+    // Split the payees into parts whose outputs fit
+    deque<vector<pair<CScript, int64> > > dqSend;
+    unsigned int nPartSize = 0;
+    BOOST_FOREACH (const PAIRTYPE(CScript, int64)& s, vecSend)
+    {
+        unsigned int nOutSize = ::GetSerializeSize(CTxOut(s.second, s.first), SER_NETWORK, PROTOCOL_VERSION);
+        if (dqSend.empty() || nPartSize + nOutSize > WALLET_BATCH_OUTPUTS_SIZE)
+        {
+            dqSend.push_back(vector<pair<CScript, int64> >());
+            nPartSize = 0;
+        }
+        dqSend.back().push_back(s);
+        nPartSize += nOutSize;
+    }
+    if (dqSend.empty())
+    {
+        strFailReason = _("Transaction amounts must be positive");
+        return false;
+    }
+
+    vwtxNew.clear();
+    nFeeRet = 0;
+    {
+        LOCK2(cs_main, cs_wallet);
+
+        CPubKey vchPubKey;
+        if (!reservekey.GetReservedKey(vchPubKey))
+        {
+            strFailReason = _("Keypool ran out, please call keypoolrefill first");
+            return false;
+        }
+        CCoinControl coinControl;
+        coinControl.destChange = vchPubKey.GetID();
+
+        // Coins taken by the transactions made so far are locked, so that the next
+        // ones select others
+        vector<COutPoint> vLocked;
+        bool fRet = true;
+        while (!dqSend.empty())
+        {
+            vector<pair<CScript, int64> > vecPart;
+            vecPart.swap(dqSend.front());
+            dqSend.pop_front();
+
+            CWalletTx wtx;
+            CReserveKey reservekeyUnused(this);
+            int64 nFee = 0;
+            bool fTooLarge;
+            if (!CreateTransaction(vecPart, wtx, reservekeyUnused, nFee, strFailReason, &coinControl, &fTooLarge))
+            {
+                // a part that takes too many inputs is halved
+                if (vecPart.size() > 1 && fTooLarge)
+                {
+                    vector<pair<CScript, int64> >::iterator mid = vecPart.begin() + vecPart.size() / 2;
+                    dqSend.push_front(vector<pair<CScript, int64> >(mid, vecPart.end()));
+                    dqSend.push_front(vector<pair<CScript, int64> >(vecPart.begin(), mid));
+                    continue;
+                }
+                fRet = false;
+                break;
+            }
+            BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            {
+                setLockedCoins.insert(txin.prevout);
+                vLocked.push_back(txin.prevout);
+            }
+            nFeeRet += nFee;
+            vwtxNew.push_back(wtx);
+        }
+
+        BOOST_FOREACH(const COutPoint& outpoint, vLocked)
+            setLockedCoins.erase(outpoint);
+        if (!fRet)
+        {
+            vwtxNew.clear();
+            return false;
+        }
+
+        // the change key goes back to the pool if none of the transactions has change
+        CScript scriptChange;
+        scriptChange.SetDestination(vchPubKey.GetID());
+        bool fChange = false;
+        BOOST_FOREACH(const CWalletTx& wtx, vwtxNew)
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+                fChange |= (txout.scriptPubKey == scriptChange);
+        if (!fChange)
+            reservekey.ReturnKey();
+        return true;
+    }
+}
+
+// Call after CreateTransactions. The transactions are all recorded in one database
+// transaction before any is broadcast. Returns false if they could not be recorded;
+// once they are, the ones the memory pool refused are listed in vNotAccepted and are
+// left to be rebroadcast with the other wallet transactions.
+bool CWallet::CommitTransactions(vector<CWalletTx>& vwtxNew, CReserveKey& reservekey, vector<uint256>& vNotAccepted)
+{
+    vNotAccepted.clear();
+    {
+        LOCK2(cs_main, cs_wallet);
+
+        // The records as they will be: the new transactions, and the coins they spend with
+        // those marked spent. They go to disk in one database transaction first, and the
+        // wallet in memory only follows once that committed.
+        map<uint256, CWalletTx> mapWrite;
+        int64 nOrderPos = nOrderPosNext;
+        int64 nNow = GetAdjustedTime();
+        BOOST_FOREACH(CWalletTx& wtxNew, vwtxNew)
+        {
+            printf("CommitTransactions: %s\n", wtxNew.GetHash().ToString().c_str());
+            wtxNew.BindWallet(this);
+            if (mapWallet.count(wtxNew.GetHash()))
+                continue;
+            wtxNew.nTimeReceived = wtxNew.nTimeSmart = nNow;
+            wtxNew.nOrderPos = nOrderPos++;
+            mapWrite[wtxNew.GetHash()] = wtxNew;
+        }
+        BOOST_FOREACH(const CWalletTx& wtxNew, vwtxNew)
+        {
+            BOOST_FOREACH(const CTxIn& txin, wtxNew.vin)
+            {
+                map<uint256, CWalletTx>::iterator mi = mapWrite.find(txin.prevout.hash);
+                if (mi == mapWrite.end())
+                {
+                    map<uint256, CWalletTx>::const_iterator miWallet = mapWallet.find(txin.prevout.hash);
+                    if (miWallet == mapWallet.end())
+                        continue;
+                    mi = mapWrite.insert(*miWallet).first;
+                }
+                mi->second.MarkSpent(txin.prevout.n);
+            }
+        }
+
+        if (fFileBacked)
+        {
+            CWalletDB walletdb(strWalletFile, "r+");
+            if (!walletdb.TxnBegin())
+                return error("CommitTransactions() : could not begin database transaction");
+            bool fWritten = walletdb.WriteOrderPosNext(nOrderPos);
+            for (map<uint256, CWalletTx>::const_iterator it = mapWrite.begin(); fWritten && it != mapWrite.end(); ++it)
+                fWritten = walletdb.WriteTx(it->first, it->second);
+            if (!fWritten)
+            {
+                walletdb.TxnAbort();
+                return error("CommitTransactions() : could not write transactions");
+            }
+            if (!walletdb.TxnCommit())
+                return error("CommitTransactions() : could not commit database transaction");
+        }
+
+        // Now the wallet in memory
+        nOrderPosNext = nOrderPos;
+        BOOST_FOREACH(const CWalletTx& wtxNew, vwtxNew)
+        {
+            uint256 hash = wtxNew.GetHash();
+            if (mapWallet.count(hash))
+                continue;
+            CWalletTx& wtx = mapWallet[hash] = mapWrite[hash];
+            wtx.BindWallet(this);
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+            mapTxHeights.insert(make_pair(GetWalletTxHeight(wtx), &wtx));
+            UpdateSpendable(hash, wtx);
+            NotifyTransactionChanged(this, hash, CT_NEW);
+
+            // notify an external script when a wallet transaction comes in or is updated
+            std::string strCmd = GetArg("-walletnotify", "");
+            if (!strCmd.empty())
+            {
+                boost::replace_all(strCmd, "%s", hash.GetHex());
+                boost::thread t(runCommand, strCmd); // thread runs free
+            }
+        }
+        BOOST_FOREACH(const CWalletTx& wtxNew, vwtxNew)
+        {
+            // Mark old coins as spent
+            BOOST_FOREACH(const CTxIn& txin, wtxNew.vin)
+            {
+                map<uint256, CWalletTx>::iterator mi = mapWallet.find(txin.prevout.hash);
+                if (mi == mapWallet.end())
+                    continue;
+                CWalletTx &coin = (*mi).second;
+                coin.MarkSpent(txin.prevout.n);
+                UpdateSpendable(txin.prevout.hash, coin);
+                NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
+            }
+        }
+
+        // Take key pair from key pool so it won't be used again
+        reservekey.KeepKey();
+
+        // Broadcast
+        BOOST_FOREACH(CWalletTx& wtxNew, vwtxNew)
+        {
+            mapRequestCount[wtxNew.GetHash()] = 0;
+            if (!wtxNew.AcceptToMemoryPool(true, false))
+            {
+                printf("CommitTransactions() : Error: Transaction %s not valid\n", wtxNew.GetHash().ToString().c_str());
+                vNotAccepted.push_back(wtxNew.GetHash());
+                continue;
+            }
+            wtxNew.RelayWalletTransaction();
+        }
+        return true;
+    }
+}
+
 
 
 
@@ -1441,6 +2651,9 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return DB_LOAD_OK;
     fFirstRunRet = false;
     DBErrors nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+    // transactions were loaded straight into mapWallet
+    MarkDirty();
+    BuildTxIndexes();
     if (nLoadWalletRet == DB_NEED_REWRITE)
     {
         if (CDB::Rewrite(strWalletFile, "\x04pool"))
@@ -1530,6 +2743,73 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
 // Mark old keypool keys as used,
 // and generate all new keys
 //
+// Keys each key generating thread is expected to make at least
+static const unsigned int KEYPOOL_GEN_BATCH = 64;
+
+// A key made for the key pool, with what it takes to store it
+struct CKeyPoolKey
+{
+    CKey key;
+    CPubKey pubkey;
+    CPrivKey privkey; // for unencrypted wallets only
+};
+
+// Keys come from pchainKey, children nFirstChild on, if given; else they are random
+static void ThreadGenerateKeys(CKeyPoolKey* pkeys, unsigned int nKeys, bool fCompressed, bool fPrivKey, const CExtKey* pchainKey, unsigned int nFirstChild)
+{
+    RenameThread("bitcoin-keygen");
+    for (unsigned int i = 0; i < nKeys; i++)
+    {
+        if (pchainKey)
+        {
+            CExtKey childKey;
+            // an invalid child, a chance of 1 in 2^127, is left out
+            if (!pchainKey->Derive(childKey, (nFirstChild + i) | BIP32_HARDENED_KEY_LIMIT))
+                continue;
+            pkeys[i].key = childKey.key;
+        }
+        else
+            pkeys[i].key.MakeNewKey(fCompressed);
+        pkeys[i].pubkey = pkeys[i].key.GetPubKey();
+        if (fPrivKey)
+            pkeys[i].privkey = pkeys[i].key.GetPrivKey();
+    }
+}
+
+// Make nKeys new keys on up to -par threads
+static void GenerateKeyPoolKeys(unsigned int nKeys, bool fCompressed, bool fPrivKey, const CExtKey* pchainKey, unsigned int nFirstChild, vector<CKeyPoolKey>& vKeys)
+{
+    RandAddSeedPerfmon();
+    vKeys.resize(nKeys);
+    if (nKeys == 0)
+        return;
+
+    int nThreads = max(1, min(nScriptCheckThreads, (int)(nKeys / KEYPOOL_GEN_BATCH)));
+    if (nThreads == 1)
+    {
+        ThreadGenerateKeys(&vKeys[0], nKeys, fCompressed, fPrivKey, pchainKey, nFirstChild);
+        return;
+    }
+    boost::thread_group threadGroupKeys;
+    unsigned int nStart = 0;
+    for (int i = 0; i < nThreads; i++)
+    {
+        unsigned int nEnd = (uint64)nKeys * (i + 1) / nThreads;
+        threadGroupKeys.create_thread(boost::bind(&ThreadGenerateKeys, &vKeys[nStart], nEnd - nStart, fCompressed, fPrivKey, pchainKey, nFirstChild + nStart));
+        nStart = nEnd;
+    }
+    // the threads write to vKeys, so they are waited for even on shutdown
+    boost::this_thread::disable_interruption di;
+    threadGroupKeys.join_all();
+}
+
+// Size under which the key pool gets topped up in the background
+static unsigned int GetKeyPoolLowWater()
+{
+    int64 nTargetSize = max(GetArg("-keypool", 100), (int64)0);
+    return (unsigned int)max(GetArg("-keypoolmin", nTargetSize / 2), (int64)0);
+}
+
 bool CWallet::NewKeyPool()
 {
     {
@@ -1538,48 +2818,172 @@ bool CWallet::NewKeyPool()
         BOOST_FOREACH(int64 nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
         setKeyPool.clear();
+        mapKeyPoolIDs.clear();
 
         if (IsLocked())
             return false;
 
-        int64 nKeys = max(GetArg("-keypool", 100), (int64)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64 nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
-        printf("CWallet::NewKeyPool wrote %"PRI64d" new keys\n", nKeys);
+        TopUpKeyPool();
+        printf("CWallet::NewKeyPool wrote %"PRIszu" new keys\n", setKeyPool.size());
     }
     return true;
 }
 
-bool CWallet::TopUpKeyPool()
+// Fill the key pool up to nSize keys, or -keypool if 0. The keys are made without
+// holding cs_wallet, and all written in one database transaction.
+bool CWallet::TopUpKeyPool(unsigned int nSize)
 {
+    unsigned int nTargetSize = nSize > 0 ? nSize : max(GetArg("-keypool", 100), 0LL);
+    unsigned int nMissing;
+    bool fCompressed;
+    bool fCrypted;
+    bool fHD;
+    CExtKey chainKey;
+    unsigned int nFirstChild = 0;
     {
         LOCK(cs_wallet);
 
         if (IsLocked())
             return false;
 
+        // the pool is kept one over its size
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
+        nMissing = nTargetSize + 1 - setKeyPool.size();
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+        fCrypted = IsCrypted();
+        fHD = IsHDEnabled();
+        if (fHD)
+        {
+            if (!GetHDChainKey(chainKey))
+                return false;
+            nFirstChild = hdChain.nExternalChainCounter;
+        }
+    }
+
+    vector<CKeyPoolKey> vKeys;
+    GenerateKeyPoolKeys(nMissing, fCompressed, !fCrypted, fHD ? &chainKey : NULL, nFirstChild, vKeys);
+
+    {
+        LOCK(cs_wallet);
+
+        if (IsLocked() || IsCrypted() != fCrypted || IsHDEnabled() != fHD)
+            return false;
+        // another top-up may have run meanwhile
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
+        nMissing = min(nMissing, (unsigned int)(nTargetSize + 1 - setKeyPool.size()));
+
+        // Compressed public keys were introduced in version 0.6.0
+        if (fCompressed)
+            SetMinVersion(FEATURE_COMPRPUBKEY);
+
         CWalletDB walletdb(strWalletFile);
+        if (fFileBacked && !walletdb.TxnBegin())
+            throw runtime_error("TopUpKeyPool() : could not begin database transaction");
+        // AddCryptedKey writes through pwalletdbEncryption when it is set, as when encrypting
+        if (fFileBacked && fCrypted)
+            pwalletdbEncryption = &walletdb;
+
+        int64 nEnd = setKeyPool.empty() ? 1 : *(--setKeyPool.end()) + 1;
+        vector<CKeyID> vAdded;
+        unsigned int nUsed = 0;
+        bool fOk = true;
+        for (; nUsed < vKeys.size() && vAdded.size() < nMissing && fOk; nUsed++)
+        {
+            const CKeyPoolKey& k = vKeys[nUsed];
+            // chain keys may be ours already, from a top-up that ran meanwhile
+            if (!k.key.IsValid() || HaveKey(k.pubkey.GetID()))
+                continue;
+            fOk = CCryptoKeyStore::AddKeyPubKey(k.key, k.pubkey) &&
+                  (!fFileBacked || ((fCrypted || walletdb.WriteKey(k.pubkey, k.privkey)) &&
+                                    walletdb.WritePool(nEnd + vAdded.size(), CKeyPool(k.pubkey))));
+            vAdded.push_back(k.pubkey.GetID());
+        }
+        if (fHD && fOk)
+        {
+            hdChain.nExternalChainCounter = max(hdChain.nExternalChainCounter, nFirstChild + nUsed);
+            fOk = !fFileBacked || walletdb.WriteHDChain(hdChain);
+        }
 
-        // Top up key pool
-        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
+        pwalletdbEncryption = NULL;
+        if (!fOk)
         {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRI64d", size=%"PRIszu"\n", nEnd, setKeyPool.size());
+            walletdb.TxnAbort();
+            throw runtime_error("TopUpKeyPool() : writing generated key failed");
         }
+        if (fFileBacked && !walletdb.TxnCommit())
+            throw runtime_error("TopUpKeyPool() : could not commit database transaction");
+
+        for (unsigned int i = 0; i < vAdded.size(); i++)
+        {
+            setKeyPool.insert(nEnd + i);
+            mapKeyPoolIDs[vAdded[i]] = nEnd + i;
+        }
+        printf("keypool added %"PRIszu" keys from %"PRI64d", size=%"PRIszu"\n", vAdded.size(), nEnd, setKeyPool.size());
     }
     return true;
 }
 
+// Take the keys of the pool up to nIndex out of it, as used. A top-up then adds keys
+// past them, which for a key chain are the ones that copy of the wallet gives out next.
+void CWallet::MarkReserveKeysAsUsed(int64 nIndex)
+{
+    LOCK(cs_wallet);
+    CWalletDB walletdb(strWalletFile);
+    std::set<int64>::iterator it = setKeyPool.begin();
+    while (it != setKeyPool.end() && *it <= nIndex)
+    {
+        if (fFileBacked)
+            walletdb.ErasePool(*it);
+        printf("keypool mark used %"PRI64d"\n", *it);
+        setKeyPool.erase(it++);
+    }
+    for (std::map<CKeyID, int64>::iterator mi = mapKeyPoolIDs.begin(); mi != mapKeyPoolIDs.end(); )
+    {
+        if (mi->second <= nIndex)
+            mapKeyPoolIDs.erase(mi++);
+        else
+            ++mi;
+    }
+    nKeyPoolMarkedUsed++;
+    RequestKeyPoolTopUp();
+}
+
+void CWallet::RequestKeyPoolTopUp()
+{
+    boost::mutex::scoped_lock lock(mutexKeyPoolTopUp);
+    fKeyPoolTopUpRequested = true;
+    condKeyPoolTopUp.notify_all();
+}
+
+void CWallet::WaitForKeyPoolTopUpRequest()
+{
+    boost::mutex::scoped_lock lock(mutexKeyPoolTopUp);
+    while (!fKeyPoolTopUpRequested)
+        condKeyPoolTopUp.wait(lock);
+    fKeyPoolTopUpRequested = false;
+}
+
+void ThreadTopUpKeyPool(CWallet* pwallet)
+{
+    // Make this thread recognisable as the key-topping-up thread
+    RenameThread("bitcoin-key-top");
+
+    while (true)
+    {
+        try
+        {
+            pwallet->TopUpKeyPool();
+        }
+        catch (std::exception& e)
+        {
+            PrintExceptionContinue(&e, "ThreadTopUpKeyPool()");
+        }
+        pwallet->WaitForKeyPoolTopUpRequest();
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -1588,7 +2992,14 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
         LOCK(cs_wallet);
 
         if (!IsLocked())
-            TopUpKeyPool();
+        {
+            // Only an empty pool is filled here, with just enough to go on; the rest
+            // is left to ThreadTopUpKeyPool
+            if (setKeyPool.empty())
+                TopUpKeyPool(1);
+            if (setKeyPool.size() <= GetKeyPoolLowWater())
+                RequestKeyPoolTopUp();
+        }
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -1600,6 +3011,8 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
         setKeyPool.erase(setKeyPool.begin());
         if (!walletdb.ReadPool(nIndex, keypool))
             throw runtime_error("ReserveKeyFromKeyPool() : read failed");
+        // once out of the pool its index may be given to another key
+        mapKeyPoolIDs.erase(keypool.vchPubKey.GetID());
         if (!HaveKey(keypool.vchPubKey.GetID()))
             throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
         assert(keypool.vchPubKey.IsValid());
@@ -1633,12 +3046,13 @@ void CWallet::KeepKey(int64 nIndex)
     printf("keypool keep %"PRI64d"\n", nIndex);
 }
 
-void CWallet::ReturnKey(int64 nIndex)
+void CWallet::ReturnKey(int64 nIndex, const CPubKey& pubkey)
 {
     // Return to key pool
     {
         LOCK(cs_wallet);
         setKeyPool.insert(nIndex);
+        mapKeyPoolIDs[pubkey.GetID()] = nIndex;
     }
     printf("keypool return %"PRI64d"\n", nIndex);
 }
@@ -1674,7 +3088,7 @@ int64 CWallet::GetOldestKeyPoolTime()
     ReserveKeyFromKeyPool(nIndex, keypool);
     if (nIndex == -1)
         return GetTime();
-    ReturnKey(nIndex);
+    ReturnKey(nIndex, keypool.vchPubKey);
     return keypool.nTime;
 }
 
@@ -1842,7 +3256,7 @@ void CReserveKey::KeepKey()
 void CReserveKey::ReturnKey()
 {
     if (nIndex != -1)
-        pwallet->ReturnKey(nIndex);
+        pwallet->ReturnKey(nIndex, vchPubKey);
     nIndex = -1;
     vchPubKey = CPubKey();
 }
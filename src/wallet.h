@@ -31,6 +31,7 @@ enum WalletFeature
 
     FEATURE_WALLETCRYPT = 40000, // wallet encryption
     FEATURE_COMPRPUBKEY = 60000, // compressed public keys
+    FEATURE_HD = 91100, // deterministic key chain (CHDChain)
 
     FEATURE_LATEST = 60000
 };
@@ -69,7 +70,9 @@ public:
 class CWallet : public CCryptoKeyStore
 {
 private:
-    bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
+    bool SelectCoins(int64 nTargetValue, int64 nCostOfChange, int64 nInputFee, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
+    bool IsAvailableTx(const CWalletTx* pcoin, bool fOnlyConfirmed) const;
+    bool IsAvailableOutput(const CWalletTx* pcoin, const uint256& hash, unsigned int n, const CCoinControl *coinControl) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -79,6 +82,43 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // transactions with outputs of ours that are not spent yet; balances and coin
+    // selection only need to look at these rather than all of mapWallet
+    std::set<uint256> setSpendable;
+    // the same outputs one by one, ordered by value for coin selection
+    std::set<std::pair<int64, COutPoint> > setSpendableByValue;
+    // balances over setSpendable, valid until it changes or the best block moves
+    mutable bool fBalanceCached;
+    mutable uint256 hashBalanceTip;
+    mutable int64 nBalanceCached;
+    mutable int64 nUnconfirmedBalanceCached;
+    mutable int64 nImmatureBalanceCached;
+
+    void UpdateSpendable(const uint256& hash, const CWalletTx& wtx);
+    void CacheBalances() const;
+
+    void BuildTxIndexes();
+    void UnindexWalletTx(CWalletTx* pwtx);
+    void EraseTxHeight(int nHeight, CWalletTx* pwtx);
+
+    // state of a running ScanForWalletTransactions, guarded by cs_rescan
+    mutable CCriticalSection cs_rescan;
+    bool fScanningWallet;
+    bool fAbortRescan;
+    int nRescanProgress;
+
+    // wakes the thread that tops up the key pool in the background
+    boost::mutex mutexKeyPoolTopUp;
+    boost::condition_variable condKeyPoolTopUp;
+    bool fKeyPoolTopUpRequested;
+    // times keys of the pool were found used on the chain, see MarkReserveKeysAsUsed
+    unsigned int nKeyPoolMarkedUsed;
+
+    bool GetHDChainKey(CExtKey& chainKey) const;
+    void DeriveNewChildKey(CKey& secret);
+    void MarkReserveKeysAsUsed(int64 nIndex);
+
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -86,6 +126,10 @@ public:
     std::string strWalletFile;
 
     std::set<int64> setKeyPool;
+    // key pool index of each key put in the pool; stale once the key leaves it
+    std::map<CKeyID, int64> mapKeyPoolIDs;
+
+    CHDChain hdChain;
 
 
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
@@ -100,6 +144,12 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fBalanceCached = false;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        nRescanProgress = 0;
+        fKeyPoolTopUpRequested = false;
+        nKeyPoolMarkedUsed = 0;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -110,6 +160,12 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fBalanceCached = false;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        nRescanProgress = 0;
+        fKeyPoolTopUpRequested = false;
+        nKeyPoolMarkedUsed = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -125,8 +181,15 @@ public:
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
-    void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    // fSortByValue lists the largest outputs first
+    void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL, bool fSortByValue=false) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    /** Branch and bound search for inputs adding up to between nTargetValue and
+        nTargetValue + nCostOfChange, so that the transaction needs no change. Outputs worth
+        no more than nInputFee, the fee to spend one, are left out. vCoins should be sorted
+        by value, largest first.
+     */
+    bool SelectCoinsBnB(int64 nTargetValue, int64 nCostOfChange, int64 nInputFee, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
     void UnlockCoin(COutPoint& output);
@@ -140,6 +203,15 @@ public:
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
     bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    void LoadKeyPool(int64 nIndex, const CKeyPool& keypool) { setKeyPool.insert(nIndex); mapKeyPoolIDs[keypool.vchPubKey.GetID()] = nIndex; }
+
+    // New keys come from the key chain of hdChain once it has a seed
+    bool IsHDEnabled() const { return !hdChain.IsNull(); }
+    // Make a random seed for a new key chain
+    CPubKey GenerateNewHDMasterKey();
+    bool SetHDMasterKey(const CPubKey& pubkey);
+    bool SetHDChain(const CHDChain& chain);
+    void LoadHDChain(const CHDChain& chain) { hdChain = chain; }
 
     bool LoadMinVersion(int nVersion) { nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
@@ -153,6 +225,8 @@ public:
     bool Unlock(const SecureString& strWalletPassphrase);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
     bool EncryptWallet(const SecureString& strWalletPassphrase);
+    /** Whether the wallet file has records that were skipped as damaged when loading it */
+    bool IsFileDamaged() const;
 
     /** Increment the next transaction order id
         @return next transaction order id
@@ -162,37 +236,65 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
-     */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    // The wallet's activity log: transactions and accounting entries by nOrderPos
+    TxItems wtxOrdered;
+    // Accounting entries, read from the database once when loading
+    std::list<CAccountingEntry> laccentries;
+
+    // Wallet transactions by the height of the block they are in, -1 if none
+    typedef std::multimap<int, CWalletTx*> TxHeights;
+    TxHeights mapTxHeights;
+
+    // Add an accounting entry, already written to the database, to the activity log
+    void AddAccountingEntry(const CAccountingEntry& acentry);
 
     void MarkDirty();
-    bool AddToWallet(const CWalletTx& wtxIn);
+    bool AddToWallet(const CWalletTx& wtxIn, CWalletDB *pwalletdb = NULL);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
-    void WalletUpdateSpent(const CTransaction& prevout);
+    void WalletUpdateSpent(const CTransaction& prevout, CWalletDB *pwalletdb = NULL);
+    /** Scan the block chain from pindexStart for transactions from or to us
+        @return number of transactions added or updated, or -1 if the scan was aborted
+     */
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    // Ask a running rescan to stop; it then applies nothing
+    void AbortRescan();
+    // Percentage done of the running rescan, or -1 if there is none
+    int GetRescanProgress() const;
+    // used by the rescan threads
+    bool IsAbortingRescan() const;
+    void SetRescanProgress(int nProgress);
     void ReacceptWalletTransactions();
+    // returns whether outputs of wtx turned out to be spent by transactions not in the wallet
+    bool ReacceptWalletTransaction(CWalletTx& wtx);
     void ResendWalletTransactions();
     int64 GetBalance() const;
+    // GetBalance without waiting for cs_main: while a block is being connected, the
+    // balance as last computed
+    int64 GetBalanceNoWait() const;
     int64 GetUnconfirmedBalance() const;
     int64 GetImmatureBalance() const;
+    // pfTooLarge, if given, is set when the transaction failed for being too large
     bool CreateTransaction(const std::vector<std::pair<CScript, int64> >& vecSend,
-                           CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl=NULL);
+                           CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl=NULL,
+                           bool* pfTooLarge=NULL);
     bool CreateTransaction(CScript scriptPubKey, int64 nValue,
                            CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
+    bool CreateTransactions(const std::vector<std::pair<CScript, int64> >& vecSend,
+                            std::vector<CWalletTx>& vwtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason);
+    bool CommitTransactions(std::vector<CWalletTx>& vwtxNew, CReserveKey& reservekey, std::vector<uint256>& vNotAccepted);
     std::string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
     std::string SendMoneyToDestination(const CTxDestination &address, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
     bool NewKeyPool();
-    bool TopUpKeyPool();
+    bool TopUpKeyPool(unsigned int nSize = 0);
+    void RequestKeyPoolTopUp();
+    void WaitForKeyPoolTopUpRequest();
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
-    void ReturnKey(int64 nIndex);
+    void ReturnKey(int64 nIndex, const CPubKey& pubkey);
     bool GetKeyFromPool(CPubKey &key, bool fAllowReuse=true);
     int64 GetOldestKeyPoolTime();
     void GetAllReserveKeys(std::set<CKeyID>& setAddress);
@@ -264,6 +366,8 @@ public:
         return nChange;
     }
     void SetBestChain(const CBlockLocator& loc);
+    /** Take the transactions out of a block that left the main chain, and out of its height in mapTxHeights */
+    void BlockDisconnected(const uint256& hashBlock);
 
     DBErrors LoadWallet(bool& fFirstRunRet);
 
@@ -361,6 +465,57 @@ static void WriteOrderPos(const int64& nOrderPos, mapValue_t& mapValue)
 }
 
 
+/** The supporting transactions stored with a wallet transaction.
+ *
+ * Read from a CDataStream, as when loading the wallet, they are only measured and
+ * kept serialized, and built the first time Get() is called. Most belong to long
+ * confirmed transactions and are never needed again.
+ */
+class CWalletTxPrev
+{
+private:
+    mutable std::vector<CMerkleTx> vtx;
+    // vtx as serialized, while it has not been built yet
+    mutable CSerializeData vchData;
+    int nDataType;
+    int nDataVersion;
+
+    void Load() const;
+
+public:
+    CWalletTxPrev() : nDataType(0), nDataVersion(0) {}
+
+    std::vector<CMerkleTx>& Get() { Load(); return vtx; }
+    const std::vector<CMerkleTx>& Get() const { Load(); return vtx; }
+    bool IsLoaded() const { return vchData.empty(); }
+    void clear() { vtx.clear(); vchData.clear(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        if (!vchData.empty())
+            return vchData.size();
+        return ::GetSerializeSize(vtx, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        if (!vchData.empty())
+            s.write(&vchData[0], vchData.size());
+        else
+            ::Serialize(s, vtx, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        vchData.clear();
+        ::Unserialize(s, vtx, nType, nVersion);
+    }
+
+    void Unserialize(CDataStream& s, int nType, int nVersion);
+};
+
 /** A transaction with a bunch of additional info that only the owner cares about.
  * It includes any unrecorded transactions needed to link it back to the block chain.
  */
@@ -370,7 +525,7 @@ private:
     const CWallet* pwallet;
 
 public:
-    std::vector<CMerkleTx> vtxPrev;
+    CWalletTxPrev vtxPrev;
     mapValue_t mapValue;
     std::vector<std::pair<std::string, std::string> > vOrderForm;
     unsigned int fTimeReceivedIsTxTime;
@@ -651,7 +806,7 @@ public:
         // consider it confirmed if all dependencies are confirmed
         std::map<uint256, const CMerkleTx*> mapPrev;
         std::vector<const CMerkleTx*> vWorkQueue;
-        vWorkQueue.reserve(vtxPrev.size()+1);
+        vWorkQueue.reserve(vtxPrev.Get().size()+1);
         vWorkQueue.push_back(this);
         for (unsigned int i = 0; i < vWorkQueue.size(); i++)
         {
@@ -666,7 +821,7 @@ public:
 
             if (mapPrev.empty())
             {
-                BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
+                BOOST_FOREACH(const CMerkleTx& tx, vtxPrev.Get())
                     mapPrev[tx.GetHash()] = &tx;
             }
 
@@ -680,7 +835,7 @@ public:
         return true;
     }
 
-    bool WriteToDisk();
+    bool WriteToDisk(CWalletDB *pwalletdb = NULL);
 
     int64 GetTxTime() const;
     int GetRequestCount() const;
@@ -858,6 +1013,13 @@ private:
     std::vector<char> _ssExtra;
 };
 
+/** Upper bound on the size of the scriptSig that signing an output with scriptPubKey
+ *  gives, or 0 if it can't be told without signing */
+unsigned int MaxScriptSigSize(const CKeyStore& keystore, const CScript& scriptPubKey);
+
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+void ThreadTopUpKeyPool(CWallet* pwallet);
+void ThreadReacceptWalletTransactions(CWallet* pwallet);
+
 #endif
@@ -69,7 +69,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -86,7 +86,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            delete pcursor;
             throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
         }
 
@@ -105,7 +105,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    delete pcursor;
 }
 
 
@@ -331,7 +331,15 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             int64 nIndex;
             ssKey >> nIndex;
-            pwallet->setKeyPool.insert(nIndex);
+            CKeyPool keypool;
+            ssValue >> keypool;
+            pwallet->LoadKeyPool(nIndex, keypool);
+        }
+        else if (strType == "hdchain")
+        {
+            CHDChain chain;
+            ssValue >> chain;
+            pwallet->LoadHDChain(chain);
         }
         else if (strType == "version")
         {
@@ -389,7 +397,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             printf("Error getting wallet database cursor\n");
@@ -431,7 +439,14 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 printf("%s\n", strErr.c_str());
         }
-        pcursor->close();
+        delete pcursor;
+
+        // Records the log skipped as damaged may have been transactions
+        if (plog && plog->IsDamaged())
+        {
+            fNoncriticalErrors = true;
+            SoftSetBoolArg("-rescan", true);
+        }
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -493,6 +508,20 @@ void ThreadFlushWalletDB(const string& strFile)
 
         if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
+            CWalletLog* plog = bitdb.GetLog(strFile);
+            if (plog)
+            {
+                // No need to wait for handles to close: sync, and compact while writers go on
+                nLastFlushed = nWalletDBUpdated;
+                plog->Sync();
+                if (plog->NeedsCompaction())
+                {
+                    boost::this_thread::interruption_point();
+                    plog->Compact();
+                }
+                continue;
+            }
+
             TRY_LOCK(bitdb.cs_db,lockDb);
             if (lockDb)
             {
@@ -532,6 +561,17 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
+    CWalletLog* plog = bitdb.GetLog(wallet.strWalletFile);
+    if (plog)
+    {
+        filesystem::path pathDest(strDest);
+        if (filesystem::is_directory(pathDest))
+            pathDest /= plog->GetPath().filename();
+        if (!plog->Backup(pathDest))
+            return false;
+        printf("copied %s to %s\n", plog->GetPath().string().c_str(), pathDest.string().c_str());
+        return true;
+    }
     while (true)
     {
         {
@@ -23,6 +23,43 @@ enum DBErrors
     DB_NEED_REWRITE
 };
 
+/** The deterministic key chain of a wallet. Its keys are derived from a seed key along
+ * m/0'/0'/i' (BIP32, hardened), so that the seed alone brings them all back.
+ */
+class CHDChain
+{
+public:
+    static const int CURRENT_VERSION = 1;
+    int nVersion;
+    unsigned int nExternalChainCounter; // child number of the next key
+    CKeyID masterKeyID;                 // the seed, kept in the key store like any other key
+
+    CHDChain()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(nExternalChainCounter);
+        READWRITE(masterKeyID);
+    )
+
+    void SetNull()
+    {
+        nVersion = CURRENT_VERSION;
+        nExternalChainCounter = 0;
+        masterKeyID = CKeyID();
+    }
+
+    bool IsNull() const
+    {
+        return masterKeyID == 0;
+    }
+};
+
 /** Access to the wallet database (wallet.dat) */
 class CWalletDB : public CDB
 {
@@ -121,6 +158,12 @@ public:
         return Erase(std::make_pair(std::string("pool"), nPool));
     }
 
+    bool WriteHDChain(const CHDChain& chain)
+    {
+        nWalletDBUpdated++;
+        return Write(std::string("hdchain"), chain);
+    }
+
     // Settings are no longer stored in wallet.dat; these are
     // used only for backwards compatibility:
     template<typename T>
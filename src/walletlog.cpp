@@ -0,0 +1,520 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "hash.h"
+#include "util.h"
+#include "version.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+using namespace boost;
+
+// file header: magic, then the format version as a little-endian 32 bit number
+static const unsigned char pchWalletLogMagic[4] = { 'w', 'l', 'o', 'g' };
+static const unsigned int WALLETLOG_HEADER_SIZE = 8;
+// records: payload size (32 bit LE), payload, first 4 bytes of the double-SHA256 of size and payload
+static const unsigned int WALLETLOG_RECORD_OVERHEAD = 8;
+// operations per record when compacting
+static const unsigned int WALLETLOG_COMPACT_BATCH = 1000;
+
+bool CWalletLogKeyCompare::operator()(const CSerializeData& a, const CSerializeData& b) const
+{
+    size_t nMin = std::min(a.size(), b.size());
+    int c = nMin ? memcmp(&a[0], &b[0], nMin) : 0;
+    if (c != 0)
+        return c < 0;
+    return a.size() < b.size();
+}
+
+static void AppendLE32(CSerializeData& vch, unsigned int n)
+{
+    for (int i = 0; i < 4; i++)
+        vch.push_back((char)((n >> (8 * i)) & 0xff));
+}
+
+static unsigned int ReadLE32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// the share of the file a record takes, roughly: its key, value and framing
+static uint64 RecordSize(const CSerializeData& vchKey, const CSerializeData& vchValue)
+{
+    return vchKey.size() + vchValue.size() + 10;
+}
+
+static bool WriteHeader(FILE* file)
+{
+    CSerializeData vch(pchWalletLogMagic, pchWalletLogMagic + sizeof(pchWalletLogMagic));
+    AppendLE32(vch, CWalletLog::CURRENT_VERSION);
+    return fwrite(&vch[0], 1, vch.size(), file) == vch.size();
+}
+
+// write vOps to file as one record and add its size to nBytes
+static bool WriteRecord(FILE* file, const vector<CWalletLogOp>& vOps, uint64& nBytes)
+{
+    CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+    ssPayload << vOps;
+
+    CSerializeData vchRecord;
+    vchRecord.reserve(ssPayload.size() + WALLETLOG_RECORD_OVERHEAD);
+    AppendLE32(vchRecord, ssPayload.size());
+    vchRecord.insert(vchRecord.end(), ssPayload.begin(), ssPayload.end());
+    uint256 hash = Hash(vchRecord.begin(), vchRecord.end());
+    vchRecord.insert(vchRecord.end(), (const char*)hash.begin(), (const char*)hash.begin() + 4);
+    if (fwrite(&vchRecord[0], 1, vchRecord.size(), file) != vchRecord.size())
+        return false;
+    nBytes += vchRecord.size();
+    return true;
+}
+
+// whether a record with an intact checksum starts at nPos; its payload size goes to nPayload
+static bool IsValidRecord(const unsigned char* pbegin, uint64 nSize, uint64 nPos, uint64& nPayload)
+{
+    if (nSize - nPos < WALLETLOG_RECORD_OVERHEAD)
+        return false;
+    nPayload = ReadLE32(pbegin + nPos);
+    if (nPayload > nSize - nPos - WALLETLOG_RECORD_OVERHEAD)
+        return false;
+    const unsigned char* pPayload = pbegin + nPos + 4;
+    uint256 hash = Hash(pbegin + nPos, pPayload + nPayload);
+    return memcmp(hash.begin(), pPayload + nPayload, 4) == 0;
+}
+
+CWalletLog::CWalletLog() : file(NULL), nFileSize(0), nLiveSize(0), nAppended(0), nSynced(0), fDamaged(false)
+{
+}
+
+CWalletLog::~CWalletLog()
+{
+    Close();
+}
+
+void CWalletLog::Apply(const CWalletLogOp& op)
+{
+    std::map<CSerializeData, CSerializeData, CWalletLogKeyCompare>::iterator mi = mapRecords.find(op.vchKey);
+    if (mi != mapRecords.end())
+    {
+        nLiveSize -= RecordSize(mi->first, mi->second);
+        if (op.nOp == CWalletLogOp::ERASE)
+        {
+            mapRecords.erase(mi);
+            return;
+        }
+        mi->second = op.vchValue;
+    }
+    else if (op.nOp == CWalletLogOp::PUT)
+        mi = mapRecords.insert(make_pair(op.vchKey, op.vchValue)).first;
+    else
+        return;
+    nLiveSize += RecordSize(mi->first, mi->second);
+}
+
+bool CWalletLog::Replay(const unsigned char* pbegin, uint64 nSize, uint64& nGoodSize)
+{
+    nGoodSize = 0;
+    if (nSize < WALLETLOG_HEADER_SIZE)
+    {
+        // a header torn while creating the file is rewritten
+        if (memcmp(pbegin, pchWalletLogMagic, std::min(nSize, (uint64)sizeof(pchWalletLogMagic))) == 0)
+            return true;
+        return error("CWalletLog::Replay() : %s is not a wallet log", path.string().c_str());
+    }
+    if (memcmp(pbegin, pchWalletLogMagic, sizeof(pchWalletLogMagic)) != 0)
+        return error("CWalletLog::Replay() : %s is not a wallet log", path.string().c_str());
+    if (ReadLE32(pbegin + sizeof(pchWalletLogMagic)) > CURRENT_VERSION)
+        return error("CWalletLog::Replay() : %s was written by a newer version", path.string().c_str());
+
+    uint64 nPos = WALLETLOG_HEADER_SIZE;
+    nGoodSize = nPos;
+    while (nSize - nPos >= WALLETLOG_RECORD_OVERHEAD)
+    {
+        uint64 nPayload;
+        if (IsValidRecord(pbegin, nSize, nPos, nPayload))
+        {
+            const unsigned char* pPayload = pbegin + nPos + 4;
+            nPos += nPayload + WALLETLOG_RECORD_OVERHEAD;
+            nGoodSize = nPos;
+            vector<CWalletLogOp> vOps;
+            try {
+                CDataStream ssPayload((const char*)pPayload, (const char*)pPayload + nPayload, SER_DISK, CLIENT_VERSION);
+                ssPayload >> vOps;
+            }
+            catch (std::exception &e) {
+                printf("CWalletLog::Replay() : skipping unreadable record at offset %"PRI64u" of %s\n",
+                       nPos - nPayload - WALLETLOG_RECORD_OVERHEAD, path.string().c_str());
+                fDamaged = true;
+                continue;
+            }
+            BOOST_FOREACH(const CWalletLogOp& op, vOps)
+                Apply(op);
+            continue;
+        }
+
+        // Only an append cut short by a crash may end the file: if an intact record
+        // follows, or this one claims to fit in the file, it is damage in the middle.
+        bool fFits = (ReadLE32(pbegin + nPos) <= nSize - nPos - WALLETLOG_RECORD_OVERHEAD);
+        uint64 nNext = nPos + 1;
+        while (nNext < nSize && !IsValidRecord(pbegin, nSize, nNext, nPayload))
+            nNext++;
+        if (nNext >= nSize && !fFits)
+            break;
+        printf("CWalletLog::Replay() : skipping %"PRI64u" damaged bytes at offset %"PRI64u" of %s\n",
+               std::min(nNext, nSize) - nPos, nPos, path.string().c_str());
+        fDamaged = true;
+        nPos = std::min(nNext, nSize);
+        nGoodSize = nPos;
+    }
+    return true;
+}
+
+bool CWalletLog::Open(const filesystem::path& pathIn)
+{
+    LOCK(cs);
+    if (file)
+        return error("CWalletLog::Open() : %s is already open", path.string().c_str());
+    path = pathIn;
+    mapRecords.clear();
+    nFileSize = nLiveSize = nAppended = nSynced = 0;
+    fDamaged = false;
+
+    int64 nStart = GetTimeMillis();
+    uint64 nSize = 0;
+    uint64 nGoodSize = 0;
+    if (filesystem::exists(path))
+        nSize = filesystem::file_size(path);
+    if (nSize > 0)
+    {
+        bool fReplayed;
+#ifndef WIN32
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return error("CWalletLog::Open() : cannot open %s", path.string().c_str());
+        void* pmap = mmap(NULL, nSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (pmap == MAP_FAILED)
+            return error("CWalletLog::Open() : cannot map %s", path.string().c_str());
+        madvise(pmap, nSize, MADV_SEQUENTIAL);
+        fReplayed = Replay((const unsigned char*)pmap, nSize, nGoodSize);
+        munmap(pmap, nSize);
+#else
+        vector<unsigned char> vch(nSize);
+        FILE* filein = fopen(path.string().c_str(), "rb");
+        if (!filein)
+            return error("CWalletLog::Open() : cannot open %s", path.string().c_str());
+        bool fRead = (fread(&vch[0], 1, nSize, filein) == nSize);
+        fclose(filein);
+        if (!fRead)
+            return error("CWalletLog::Open() : cannot read %s", path.string().c_str());
+        fReplayed = Replay(&vch[0], nSize, nGoodSize);
+#endif
+        if (!fReplayed)
+        {
+            mapRecords.clear();
+            return false;
+        }
+    }
+
+    file = fopen(path.string().c_str(), "ab");
+    if (!file)
+        return error("CWalletLog::Open() : cannot open %s for writing", path.string().c_str());
+    // Keep a copy of the bytes skipped as damaged, which may hold the only copy of a key,
+    // and of a torn tail, in case it was more than one append cut short. A damaged file
+    // stays damaged until salvaged, so it is only copied aside the first time.
+    filesystem::path pathBak;
+    if (fDamaged)
+        pathBak = GetQuarantinePath();
+    else if (nGoodSize < nSize)
+        pathBak = path.string() + strprintf(".%"PRI64d".bak", GetTime());
+    if (!pathBak.empty() && !filesystem::exists(pathBak))
+    {
+        try {
+            filesystem::copy_file(path, pathBak);
+        } catch(const filesystem::filesystem_error &e) {
+            printf("CWalletLog::Open() : error copying %s to %s - %s\n", path.string().c_str(), pathBak.string().c_str(), e.what());
+        }
+    }
+    if (nGoodSize < nSize)
+    {
+        printf("CWalletLog::Open() : cutting %"PRI64u" bytes of an incomplete record off %s\n",
+               nSize - nGoodSize, path.string().c_str());
+        if (!TruncateFile(file, nGoodSize))
+        {
+            fclose(file);
+            file = NULL;
+            return error("CWalletLog::Open() : cannot truncate %s", path.string().c_str());
+        }
+    }
+    nFileSize = nGoodSize;
+    if (nFileSize == 0)
+    {
+        if (!WriteHeader(file) || fflush(file) != 0)
+        {
+            fclose(file);
+            file = NULL;
+            return error("CWalletLog::Open() : cannot write %s", path.string().c_str());
+        }
+        FileCommit(file);
+        nFileSize = WALLETLOG_HEADER_SIZE;
+    }
+    printf("Opened %s: %"PRIszu" records, %"PRI64u" bytes in %"PRI64d"ms\n",
+           path.string().c_str(), mapRecords.size(), nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+void CWalletLog::Close()
+{
+    Sync();
+    LOCK(cs_compact);
+    LOCK2(cs_sync, cs);
+    if (file)
+    {
+        fclose(file);
+        file = NULL;
+    }
+    mapRecords.clear();
+}
+
+bool CWalletLog::IsOpen() const
+{
+    LOCK(cs);
+    return file != NULL;
+}
+
+bool CWalletLog::IsDamaged() const
+{
+    LOCK(cs);
+    return fDamaged;
+}
+
+bool CWalletLog::Append(const vector<CWalletLogOp>& vOps)
+{
+    if (!file)
+        return false;
+    uint64 nBytes = 0;
+    if (!WriteRecord(file, vOps, nBytes) || fflush(file) != 0)
+    {
+        // don't leave part of a record for the next one to be appended after
+        fflush(file);
+        TruncateFile(file, nFileSize);
+        return error("CWalletLog::Append() : cannot write %s", path.string().c_str());
+    }
+    nFileSize += nBytes;
+    nAppended++;
+    BOOST_FOREACH(const CWalletLogOp& op, vOps)
+        Apply(op);
+    return true;
+}
+
+bool CWalletLog::Read(const CSerializeData& vchKey, CSerializeData& vchValue) const
+{
+    LOCK(cs);
+    std::map<CSerializeData, CSerializeData, CWalletLogKeyCompare>::const_iterator mi = mapRecords.find(vchKey);
+    if (mi == mapRecords.end())
+        return false;
+    vchValue = mi->second;
+    return true;
+}
+
+bool CWalletLog::Exists(const CSerializeData& vchKey) const
+{
+    LOCK(cs);
+    return mapRecords.count(vchKey) > 0;
+}
+
+bool CWalletLog::Write(const CSerializeData& vchKey, const CSerializeData& vchValue, bool fOverwrite)
+{
+    LOCK(cs);
+    if (!fOverwrite && mapRecords.count(vchKey))
+        return false;
+    return Append(vector<CWalletLogOp>(1, CWalletLogOp(vchKey, vchValue)));
+}
+
+bool CWalletLog::Erase(const CSerializeData& vchKey)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    if (!mapRecords.count(vchKey))
+        return true;
+    return Append(vector<CWalletLogOp>(1, CWalletLogOp(vchKey)));
+}
+
+bool CWalletLog::WriteBatch(const vector<CWalletLogOp>& vOps)
+{
+    LOCK(cs);
+    if (vOps.empty())
+        return file != NULL;
+    return Append(vOps);
+}
+
+bool CWalletLog::Seek(CSerializeData& vchKey, CSerializeData& vchValue, bool fInclusive) const
+{
+    LOCK(cs);
+    std::map<CSerializeData, CSerializeData, CWalletLogKeyCompare>::const_iterator mi =
+        fInclusive ? mapRecords.lower_bound(vchKey) : mapRecords.upper_bound(vchKey);
+    if (mi == mapRecords.end())
+        return false;
+    vchKey = mi->first;
+    vchValue = mi->second;
+    return true;
+}
+
+bool CWalletLog::Sync()
+{
+    LOCK(cs_sync);
+    uint64 nTarget;
+    {
+        LOCK(cs);
+        if (!file)
+            return false;
+        if (nSynced == nAppended)
+            return true;
+        if (fflush(file) != 0)
+            return error("CWalletLog::Sync() : cannot write %s", path.string().c_str());
+        nTarget = nAppended;
+    }
+
+    // Writers keep appending during the fsync; whoever waited on cs_sync meanwhile
+    // finds their records covered by it and returns without another one.
+    FileCommit(file);
+
+    {
+        LOCK(cs);
+        nSynced = nTarget;
+    }
+    return true;
+}
+
+bool CWalletLog::NeedsCompaction() const
+{
+    LOCK(cs);
+    if (!file || fDamaged || nFileSize < COMPACT_MIN_SIZE || nFileSize <= nLiveSize)
+        return false;
+    return (nFileSize - nLiveSize) * 100 > nFileSize * COMPACT_GARBAGE_PERCENT;
+}
+
+bool CWalletLog::Compact(bool fDropDamaged)
+{
+    LOCK(cs_compact);
+    int64 nStart = GetTimeMillis();
+
+    // Write the live records as of now to a new file without holding up writers...
+    std::map<CSerializeData, CSerializeData, CWalletLogKeyCompare> mapSnapshot;
+    uint64 nSnapshotSize;
+    {
+        LOCK(cs);
+        if (!file)
+            return false;
+        // the damaged records still count as garbage; never rewrite them away unasked
+        if (fDamaged && !fDropDamaged)
+            return error("CWalletLog::Compact() : %s has damaged records, not compacting it", path.string().c_str());
+        if (fflush(file) != 0)
+            return error("CWalletLog::Compact() : cannot write %s", path.string().c_str());
+        mapSnapshot = mapRecords;
+        nSnapshotSize = nFileSize;
+    }
+
+    filesystem::path pathTmp = path.string() + ".compact";
+    FILE* fileNew = fopen(pathTmp.string().c_str(), "wb");
+    if (!fileNew)
+        return error("CWalletLog::Compact() : cannot create %s", pathTmp.string().c_str());
+    bool fOk = WriteHeader(fileNew);
+    uint64 nNewSize = WALLETLOG_HEADER_SIZE;
+    vector<CWalletLogOp> vOps;
+    for (std::map<CSerializeData, CSerializeData, CWalletLogKeyCompare>::const_iterator mi = mapSnapshot.begin(); fOk && mi != mapSnapshot.end(); )
+    {
+        vOps.push_back(CWalletLogOp(mi->first, mi->second));
+        ++mi;
+        if (vOps.size() >= WALLETLOG_COMPACT_BATCH || mi == mapSnapshot.end())
+        {
+            fOk = WriteRecord(fileNew, vOps, nNewSize);
+            vOps.clear();
+        }
+    }
+    mapSnapshot.clear();
+
+    // ...then, with writers stopped, copy over what they appended meanwhile and swap the files
+    if (fOk)
+    {
+        LOCK2(cs_sync, cs);
+        if (nFileSize > nSnapshotSize)
+        {
+            fOk = (fflush(file) == 0);
+            FILE* fileOld = fopen(path.string().c_str(), "rb");
+            if (!fileOld || fseek(fileOld, nSnapshotSize, SEEK_SET) != 0)
+                fOk = false;
+            char buf[65536];
+            for (uint64 nLeft = nFileSize - nSnapshotSize; fOk && nLeft > 0; )
+            {
+                size_t n = std::min(nLeft, (uint64)sizeof(buf));
+                fOk = (fread(buf, 1, n, fileOld) == n && fwrite(buf, 1, n, fileNew) == n);
+                nLeft -= n;
+            }
+            if (fileOld)
+                fclose(fileOld);
+            nNewSize += nFileSize - nSnapshotSize;
+        }
+        if (fOk && fflush(fileNew) == 0)
+            FileCommit(fileNew);
+        else
+            fOk = false;
+        fclose(fileNew);
+        fileNew = NULL;
+
+        if (fOk)
+        {
+            fclose(file);
+            fOk = RenameOver(pathTmp, path);
+            file = fopen(path.string().c_str(), "ab");
+            if (!file)
+                return error("CWalletLog::Compact() : cannot reopen %s", path.string().c_str());
+            if (fOk)
+            {
+                nFileSize = nNewSize;
+                nSynced = nAppended;
+                fDamaged = false;
+            }
+        }
+    }
+    if (fileNew)
+        fclose(fileNew);
+    if (!fOk)
+    {
+        try {
+            filesystem::remove(pathTmp);
+        } catch(const filesystem::filesystem_error &e) {
+        }
+        return error("CWalletLog::Compact() : rewriting %s failed", path.string().c_str());
+    }
+    printf("Compacted %s to %"PRI64u" bytes in %"PRI64d"ms\n", path.string().c_str(), nNewSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CWalletLog::Backup(const filesystem::path& pathDest)
+{
+    LOCK2(cs_compact, cs);
+    if (!file || fflush(file) != 0)
+        return false;
+    try {
+#if BOOST_VERSION >= 104000
+        filesystem::copy_file(path, pathDest, filesystem::copy_option::overwrite_if_exists);
+#else
+        filesystem::copy_file(path, pathDest);
+#endif
+    } catch(const filesystem::filesystem_error &e) {
+        return error("CWalletLog::Backup() : error copying %s to %s - %s", path.string().c_str(), pathDest.string().c_str(), e.what());
+    }
+    return true;
+}
@@ -0,0 +1,116 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_WALLETLOG_H
+#define BITCOIN_WALLETLOG_H
+
+#include <map>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "serialize.h"
+#include "sync.h"
+
+/** One put or erase of a serialized key */
+class CWalletLogOp
+{
+public:
+    enum { PUT = 1, ERASE = 2 };
+
+    unsigned char nOp;
+    CSerializeData vchKey;
+    CSerializeData vchValue;
+
+    CWalletLogOp() : nOp(PUT) {}
+    CWalletLogOp(const CSerializeData& vchKeyIn, const CSerializeData& vchValueIn) : nOp(PUT), vchKey(vchKeyIn), vchValue(vchValueIn) {}
+    explicit CWalletLogOp(const CSerializeData& vchKeyIn) : nOp(ERASE), vchKey(vchKeyIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nOp);
+        READWRITE(vchKey);
+        if (nOp == PUT)
+            READWRITE(vchValue);
+    )
+};
+
+/** Orders keys bytewise as unsigned, like Berkeley DB's default btree comparison */
+struct CWalletLogKeyCompare
+{
+    bool operator()(const CSerializeData& a, const CSerializeData& b) const;
+};
+
+/** Append-only key/value file holding the records of a wallet.
+ *
+ * Every change is appended as one record: the size of its payload, the payload
+ * (a list of puts and erases) and a checksum over both, so a transaction reaches
+ * the file as a single record and replays all or nothing. Opening maps the file
+ * into memory and replays it into an in-memory index that serves all reads; a
+ * record torn by a crash at the end of the file is cut off, while damage before
+ * intact records is skipped and marks the log damaged.
+ *
+ * Appends are only flushed to the operating system. Sync() makes everything
+ * appended so far durable with one fsync, however many threads are waiting on
+ * it, and Compact() rewrites the live records into a new file while writers
+ * keep appending to the old one.
+ */
+class CWalletLog
+{
+private:
+    mutable CCriticalSection cs;
+    CCriticalSection cs_sync;    // one fsync at a time, taken before cs
+    CCriticalSection cs_compact; // one compaction at a time, taken before cs_sync
+    boost::filesystem::path path;
+    FILE* file;
+    std::map<CSerializeData, CSerializeData, CWalletLogKeyCompare> mapRecords;
+    uint64 nFileSize;  // bytes in the file
+    uint64 nLiveSize;  // bytes the records in mapRecords take in the file
+    uint64 nAppended;  // records appended since opening
+    uint64 nSynced;    // of those, how many are known to be on disk
+    bool fDamaged;     // records were skipped when replaying
+
+    bool Replay(const unsigned char* pbegin, uint64 nSize, uint64& nGoodSize);
+    void Apply(const CWalletLogOp& op);
+    bool Append(const std::vector<CWalletLogOp>& vOps);
+
+public:
+    static const unsigned int CURRENT_VERSION = 1;
+    // rewrite once more than this share of the file is overwritten or erased records
+    static const unsigned int COMPACT_GARBAGE_PERCENT = 50;
+    static const uint64 COMPACT_MIN_SIZE = 1024 * 1024;
+
+    CWalletLog();
+    ~CWalletLog();
+
+    /** Open the file, creating it if it does not exist, and replay it into the index */
+    bool Open(const boost::filesystem::path& pathIn);
+    /** Sync and close; any later access fails */
+    void Close();
+    bool IsOpen() const;
+    bool IsDamaged() const;
+    const boost::filesystem::path& GetPath() const { return path; }
+    /** Where Open keeps a copy of a damaged file; made once, until Compact(true) clears the damage */
+    boost::filesystem::path GetQuarantinePath() const { return path.string() + ".damaged"; }
+
+    bool Read(const CSerializeData& vchKey, CSerializeData& vchValue) const;
+    bool Exists(const CSerializeData& vchKey) const;
+    bool Write(const CSerializeData& vchKey, const CSerializeData& vchValue, bool fOverwrite=true);
+    bool Erase(const CSerializeData& vchKey);
+    /** Append all of vOps as a single record */
+    bool WriteBatch(const std::vector<CWalletLogOp>& vOps);
+    /** Find the first record with a key after vchKey (at or after it if fInclusive) and return it in vchKey and vchValue */
+    bool Seek(CSerializeData& vchKey, CSerializeData& vchValue, bool fInclusive) const;
+
+    /** Make every record appended so far durable */
+    bool Sync();
+    bool NeedsCompaction() const;
+    /** Rewrite the file with only the live records. Refused once records were found damaged,
+        unless fDropDamaged: then the damaged records are left behind and the log counts as
+        undamaged again */
+    bool Compact(bool fDropDamaged = false);
+    /** Copy a consistent image of the file to pathDest */
+    bool Backup(const boost::filesystem::path& pathDest);
+};
+
+#endif // BITCOIN_WALLETLOG_H